@@ -0,0 +1,320 @@
+// clock_gettime and the file descriptor calls used to silence output are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_WARMUP 1
+#define DEFAULT_THRESHOLD 10.0
+
+typedef struct {
+  char* name;
+  double operations;
+  int samples;
+  double median;
+  double p95;
+  double min;
+  double mean;
+} BenchResult;
+
+typedef struct {
+  char* name;
+  double median;
+} BaselineEntry;
+
+static const char* suiteName;
+static int warmup = DEFAULT_WARMUP;
+static int repetitions;
+static bool jsonOutput = false;
+static const char* filter = NULL;
+static const char* baselinePath = NULL;
+static double threshold = DEFAULT_THRESHOLD;
+
+static BenchResult* results = NULL;
+static int resultCount = 0;
+static int resultCapacity = 0;
+
+static int savedStdout = -1;
+
+static void* checkedRealloc(void* pointer, size_t size) {
+  void* result = realloc(pointer, size);
+  if (result == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  return result;
+}
+
+static char* copyText(const char* text, size_t length) {
+  char* copy = checkedRealloc(NULL, length + 1);
+  memcpy(copy, text, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: %s [--json] [--warmup N] [--repetitions N] [--filter TEXT]\n"
+          "       [--compare FILE [--threshold PERCENT]]\n",
+          suiteName);
+  exit(64);
+}
+
+void benchInit(const char* suite, int defaultRepetitions, int argc, const char* argv[]) {
+  suiteName = suite;
+  repetitions = defaultRepetitions;
+
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "--json") == 0) {
+      jsonOutput = true;
+    } else if (strcmp(argv[i], "--warmup") == 0 && hasValue) {
+      warmup = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--repetitions") == 0 && hasValue) {
+      repetitions = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--filter") == 0 && hasValue) {
+      filter = argv[++i];
+    } else if (strcmp(argv[i], "--compare") == 0 && hasValue) {
+      baselinePath = argv[++i];
+    } else if (strcmp(argv[i], "--threshold") == 0 && hasValue) {
+      threshold = atof(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+
+  if (warmup < 0 || repetitions < 1) usage();
+}
+
+bool benchSelected(const char* name) { return filter == NULL || strstr(name, filter) != NULL; }
+
+static int compareDoubles(const void* a, const void* b) {
+  double left = *(const double*)a;
+  double right = *(const double*)b;
+  return (left > right) - (left < right);
+}
+
+// Interpolates between the two nearest samples of a sorted array.
+static double percentile(const double* sorted, int count, double fraction) {
+  double position = fraction * (count - 1);
+  int lower = (int)position;
+  if (lower + 1 >= count) return sorted[count - 1];
+  double weight = position - lower;
+  return sorted[lower] * (1 - weight) + sorted[lower + 1] * weight;
+}
+
+void benchRun(const char* name, double operations, BenchFn fn, void* context) {
+  if (!benchSelected(name)) return;
+
+  for (int i = 0; i < warmup; i++) fn(context);
+
+  double* samples = checkedRealloc(NULL, sizeof(double) * repetitions);
+  double total = 0;
+  for (int i = 0; i < repetitions; i++) {
+    double start = now();
+    fn(context);
+    samples[i] = (now() - start) * 1e9 / operations;
+    total += samples[i];
+  }
+  qsort(samples, repetitions, sizeof(double), compareDoubles);
+
+  if (resultCapacity < resultCount + 1) {
+    resultCapacity = resultCapacity < 8 ? 8 : resultCapacity * 2;
+    results = checkedRealloc(results, sizeof(BenchResult) * resultCapacity);
+  }
+
+  BenchResult* result = &results[resultCount++];
+  result->name = copyText(name, strlen(name));
+  result->operations = operations;
+  result->samples = repetitions;
+  result->median = percentile(samples, repetitions, 0.5);
+  result->p95 = percentile(samples, repetitions, 0.95);
+  result->min = samples[0];
+  result->mean = total / repetitions;
+  free(samples);
+
+  // Progress goes to stderr so it never mixes with a JSON report.
+  if (jsonOutput) fprintf(stderr, "%s: %s done\n", suiteName, name);
+}
+
+// Picks a unit so that the table stays readable from nanoseconds up to seconds.
+static void formatDuration(char* buffer, size_t size, double nanoseconds) {
+  if (nanoseconds < 1e3) {
+    snprintf(buffer, size, "%.2f ns", nanoseconds);
+  } else if (nanoseconds < 1e6) {
+    snprintf(buffer, size, "%.2f us", nanoseconds / 1e3);
+  } else if (nanoseconds < 1e9) {
+    snprintf(buffer, size, "%.2f ms", nanoseconds / 1e6);
+  } else {
+    snprintf(buffer, size, "%.2f s", nanoseconds / 1e9);
+  }
+}
+
+static void printJsonString(const char* text) {
+  putchar('"');
+  for (const char* c = text; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') putchar('\\');
+    putchar(*c);
+  }
+  putchar('"');
+}
+
+// Every result is written on a line of its own, which is what `loadBaseline` relies on.
+static void printJson() {
+  printf("{\n  \"suite\": ");
+  printJsonString(suiteName);
+  printf(",\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"results\": [\n", warmup, repetitions);
+  for (int i = 0; i < resultCount; i++) {
+    BenchResult* result = &results[i];
+    printf("    {\"name\": ");
+    printJsonString(result->name);
+    printf(", \"unit\": \"ns/op\", \"operations\": %.0f, \"samples\": %d, \"median\": %.3f, "
+           "\"p95\": %.3f, \"min\": %.3f, \"mean\": %.3f}%s\n",
+           result->operations, result->samples, result->median, result->p95, result->min,
+           result->mean, i + 1 < resultCount ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+static void printTable() {
+  printf("%-40s %12s %12s %12s\n", suiteName, "median/op", "p95/op", "min/op");
+  for (int i = 0; i < resultCount; i++) {
+    char median[32], p95[32], min[32];
+    formatDuration(median, sizeof(median), results[i].median);
+    formatDuration(p95, sizeof(p95), results[i].p95);
+    formatDuration(min, sizeof(min), results[i].min);
+    printf("%-40s %12s %12s %12s\n", results[i].name, median, p95, min);
+  }
+}
+
+char* benchReadFile(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+
+  fseek(file, 0L, SEEK_END);
+  size_t fileSize = ftell(file);
+  rewind(file);
+
+  char* buffer = checkedRealloc(NULL, fileSize + 1);
+  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+  if (bytesRead < fileSize) {
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    exit(74);
+  }
+  buffer[bytesRead] = '\0';
+
+  fclose(file);
+  return buffer;
+}
+
+// Reads the name and median of every result in a report written by `printJson`.
+static BaselineEntry* loadBaseline(const char* path, int* count) {
+  char* source = benchReadFile(path);
+  BaselineEntry* entries = NULL;
+  int capacity = 0;
+  *count = 0;
+
+  for (char* line = strtok(source, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+    char* name = strstr(line, "{\"name\": \"");
+    char* median = strstr(line, "\"median\": ");
+    if (name == NULL || median == NULL) continue;
+
+    name += strlen("{\"name\": \"");
+    char* end = strchr(name, '"');
+    if (end == NULL) continue;
+
+    if (capacity < *count + 1) {
+      capacity = capacity < 8 ? 8 : capacity * 2;
+      entries = checkedRealloc(entries, sizeof(BaselineEntry) * capacity);
+    }
+    entries[*count].name = copyText(name, end - name);
+    entries[*count].median = atof(median + strlen("\"median\": "));
+    (*count)++;
+  }
+
+  free(source);
+  return entries;
+}
+
+// Reports each case's median against the baseline and counts those slower than the threshold.
+static int compareBaseline() {
+  int baselineCount;
+  BaselineEntry* baseline = loadBaseline(baselinePath, &baselineCount);
+  int regressions = 0;
+
+  fprintf(stderr, "%s compared with %s (threshold %.1f%%):\n", suiteName, baselinePath, threshold);
+  for (int i = 0; i < resultCount; i++) {
+    BaselineEntry* entry = NULL;
+    for (int j = 0; j < baselineCount; j++) {
+      if (strcmp(baseline[j].name, results[i].name) == 0) {
+        entry = &baseline[j];
+        break;
+      }
+    }
+
+    if (entry == NULL || entry->median <= 0) {
+      fprintf(stderr, "  %-40s (no baseline)\n", results[i].name);
+      continue;
+    }
+
+    double change = (results[i].median - entry->median) / entry->median * 100;
+    bool regressed = change > threshold;
+    if (regressed) regressions++;
+    fprintf(stderr, "  %-40s %+7.1f%%%s\n", results[i].name, change,
+            regressed ? "  REGRESSION" : "");
+  }
+
+  for (int i = 0; i < baselineCount; i++) free(baseline[i].name);
+  free(baseline);
+  return regressions;
+}
+
+int benchFinish() {
+  if (jsonOutput) {
+    printJson();
+  } else {
+    printTable();
+  }
+
+  int regressions = baselinePath != NULL ? compareBaseline() : 0;
+
+  for (int i = 0; i < resultCount; i++) free(results[i].name);
+  free(results);
+  results = NULL;
+  resultCount = resultCapacity = 0;
+  return regressions > 0 ? 1 : 0;
+}
+
+void benchSilence() {
+  fflush(stdout);
+  savedStdout = dup(fileno(stdout));
+  int null = open("/dev/null", O_WRONLY);
+  if (savedStdout < 0 || null < 0) {
+    fprintf(stderr, "Could not redirect standard output.\n");
+    exit(74);
+  }
+  dup2(null, fileno(stdout));
+  close(null);
+}
+
+void benchRestore() {
+  fflush(stdout);
+  dup2(savedStdout, fileno(stdout));
+  close(savedStdout);
+  savedStdout = -1;
+}
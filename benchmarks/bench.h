@@ -0,0 +1,97 @@
+#ifndef corelox_bench_h
+#define corelox_bench_h
+
+#include <stdbool.h>
+
+/**
+ * @file bench.h
+ * @brief Shared harness for the CoreLox benchmark binaries.
+ *
+ * Each benchmark binary registers its cases with `benchRun`, which runs a
+ * case a few times to warm up and then times a fixed number of repetitions.
+ * The harness reports the median, 95th percentile, minimum and mean cost per
+ * operation, either as a table or as JSON (`--json`). A JSON report from an
+ * earlier run can be passed with `--compare`, in which case any case whose
+ * median got slower by more than the threshold makes the binary exit with a
+ * non-zero status.
+ *
+ * Command-line options accepted by every benchmark binary:
+ *
+ * - `--json`: print the report as JSON instead of a table.
+ * - `--warmup N`: untimed runs before measuring (default 1).
+ * - `--repetitions N`: timed runs per case (default depends on the suite).
+ * - `--filter TEXT`: only run cases whose name contains `TEXT`.
+ * - `--compare FILE`: compare medians against a JSON report in `FILE`.
+ * - `--threshold PERCENT`: allowed median slowdown for `--compare` (default 10).
+ */
+
+/**
+ * @brief One timed repetition of a benchmark case.
+ *
+ * @param context The pointer passed to `benchRun`.
+ */
+typedef void (*BenchFn)(void* context);
+
+/**
+ * @brief Parses the command line and starts a report for a suite.
+ *
+ * Exits with status 64 on an unknown option.
+ *
+ * @param suite Name of the suite, used in the report.
+ * @param repetitions Default number of timed runs for each case.
+ * @param argc Argument count passed to `main`.
+ * @param argv Arguments passed to `main`.
+ */
+void benchInit(const char* suite, int repetitions, int argc, const char* argv[]);
+
+/**
+ * @brief Tells whether a case would be run under the current `--filter`.
+ *
+ * Lets a suite skip expensive setup for cases that were filtered out.
+ *
+ * @param name Name of the case.
+ * @return true if `benchRun` would run the case.
+ */
+bool benchSelected(const char* name);
+
+/**
+ * @brief Warms up, times and records one benchmark case.
+ *
+ * @param name Name of the case; must be unique within the suite.
+ * @param operations Operations performed by one call of `fn`, used to report cost per operation.
+ * @param fn Function performing one repetition.
+ * @param context Passed through to `fn`.
+ */
+void benchRun(const char* name, double operations, BenchFn fn, void* context);
+
+/**
+ * @brief Prints the report and compares it against the baseline, if any.
+ *
+ * @return The process exit status: 0, or 1 if a case regressed past the threshold.
+ */
+int benchFinish();
+
+/**
+ * @brief Redirects standard output to the null device.
+ *
+ * Used around code that prints, such as compiling with `DEBUG_PRINT_CODE`
+ * or running scripts, so that the report stays readable and parseable.
+ */
+void benchSilence();
+
+/**
+ * @brief Restores the standard output redirected by `benchSilence`.
+ */
+void benchRestore();
+
+/**
+ * @brief Reads a whole file into a newly allocated, NUL-terminated buffer.
+ *
+ * Exits with status 74 if the file cannot be read.
+ *
+ * @param path Path of the file.
+ * @return The contents, to be released with `free`.
+ */
+char* benchReadFile(const char* path);
+
+#endif
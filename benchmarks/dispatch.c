@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "compiler.h"
+#include "object.h"
+#include "vm.h"
+
+#define ITERATIONS 100000
+
+typedef struct {
+  const char* name;
+  const char* source;
+} DispatchCase;
+
+// Each loop runs ITERATIONS times, so the reported cost is per iteration of the loop body.
+static const DispatchCase cases[] = {
+    {"empty loop, local counter",
+     "fun f() { for (var i = 0; i < 100000; i = i + 1) {} } f();"},
+    {"empty loop, global counter", "for (var i = 0; i < 100000; i = i + 1) {}"},
+    {"local arithmetic",
+     "fun f() { var x = 0; for (var i = 0; i < 100000; i = i + 1) { x = (x + i * 3 - 1) / 2; } }"
+     " f();"},
+    {"function call",
+     "fun id(x) { return x; }"
+     "fun f() { for (var i = 0; i < 100000; i = i + 1) id(i); } f();"},
+    {"closure upvalue",
+     "fun make() { var n = 0; fun inc() { n = n + 1; } return inc; }"
+     "fun f() { var inc = make(); for (var i = 0; i < 100000; i = i + 1) inc(); } f();"},
+    {"closure creation",
+     "fun f() { var a = 0; var b = 0; for (var i = 0; i < 100000; i = i + 1) {"
+     " var n = i; fun g() { return a + b + n; } } } f();"},
+    {"field get and set",
+     "class P {} fun f() { var p = P(); p.x = 0;"
+     " for (var i = 0; i < 100000; i = i + 1) p.x = p.x + 1; } f();"},
+    {"method invoke",
+     "class C { m(x) { return x; } }"
+     "fun f() { var c = C(); for (var i = 0; i < 100000; i = i + 1) c.m(i); } f();"},
+    {"list index",
+     "fun f() { var l = [0, 1, 2, 3];"
+     " for (var i = 0; i < 100000; i = i + 1) l[i % 4] = l[3 - i % 4]; } f();"},
+};
+
+static void runScript(void* context) {
+  if (interpretFunction(context) != INTERPRET_OK) {
+    fprintf(stderr, "Dispatch benchmark failed at runtime.\n");
+    exit(70);
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  benchInit("dispatch", 15, argc, argv);
+  initVM();
+
+  // Every case runs once as stack code and once through the register pass.
+  for (int registers = 0; registers <= 1; registers++) {
+    vm->registers = registers;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+      char name[96];
+      snprintf(name, sizeof(name), registers ? "%s, registers" : "%s", cases[i].name);
+      if (!benchSelected(name)) continue;
+
+      // Compiling prints the disassembly when DEBUG_PRINT_CODE is defined.
+      benchSilence();
+      ObjFunction* function = compile(cases[i].source);
+      benchRestore();
+      if (function == NULL) {
+        fprintf(stderr, "Dispatch benchmark \"%s\" does not compile.\n", name);
+        return 65;
+      }
+
+      push(OBJ_VAL(function));
+      benchRun(name, ITERATIONS, runScript, function);
+      pop();
+    }
+  }
+
+  freeVM();
+  return benchFinish();
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+
+#include "bench.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Marking threads asked for by the parallel cases. Small heaps and single-processor machines still
+// mark on one thread.
+#define PARALLEL_THREADS 4
+
+typedef struct {
+  int objects;
+} HeapCase;
+
+// Builds a list of `count` small lists, each holding a number, and leaves it on the VM stack.
+static void buildLiveHeap(int count) {
+  ObjList* root = newList();
+  push(OBJ_VAL(root));
+  for (int i = 0; i < count; i++) {
+    ObjList* item = newList();
+    push(OBJ_VAL(item));
+    writeValueArray(&item->items, NUMBER_VAL(i));
+    writeValueArray(&root->items, OBJ_VAL(item));
+    pop();
+  }
+}
+
+static void runFullCycle(void* context) {
+  (void)context;
+  vm->gcMode = GC_MODE_STOP_THE_WORLD;
+  collectGarbage();
+}
+
+static void runParallelCycle(void* context) {
+  (void)context;
+  vm->gcMode = GC_MODE_STOP_THE_WORLD;
+  vm->gcThreads = PARALLEL_THREADS;
+  collectGarbage();
+  vm->gcThreads = 1;
+}
+
+static void runIncrementalCycle(void* context) {
+  (void)context;
+  vm->gcMode = GC_MODE_INCREMENTAL;
+  uint64_t cycles = vm->stats.gcCycles;
+  while (vm->stats.gcCycles == cycles) collectGarbage();
+}
+
+// Allocates short-lived lists and lets the collector reclaim them as the program would.
+static void runGarbage(void* context) {
+  HeapCase* test = context;
+  vm->gcMode = GC_MODE_INCREMENTAL;
+  for (int i = 0; i < test->objects; i++) {
+    ObjList* item = newList();
+    push(OBJ_VAL(item));
+    writeValueArray(&item->items, NUMBER_VAL(i));
+    pop();
+  }
+}
+
+static void benchLiveHeap(int objects) {
+  char full[64];
+  char parallel[64];
+  char incremental[64];
+  snprintf(full, sizeof(full), "full cycle, %d live objects", objects);
+  snprintf(parallel, sizeof(parallel), "parallel cycle, %d live objects", objects);
+  snprintf(incremental, sizeof(incremental), "incremental cycle, %d live objects", objects);
+  if (!benchSelected(full) && !benchSelected(parallel) && !benchSelected(incremental)) return;
+
+  vm->gcMode = GC_MODE_STOP_THE_WORLD;
+  buildLiveHeap(objects);
+  collectGarbage();
+
+  benchRun(full, objects, runFullCycle, NULL);
+  benchRun(parallel, objects, runParallelCycle, NULL);
+  benchRun(incremental, objects, runIncrementalCycle, NULL);
+
+  pop();
+  vm->gcMode = GC_MODE_STOP_THE_WORLD;
+  collectGarbage();
+}
+
+static void benchGarbage(int objects) {
+  char name[64];
+  snprintf(name, sizeof(name), "allocate garbage, %d objects", objects);
+
+  HeapCase test = {objects};
+  benchRun(name, objects, runGarbage, &test);
+}
+
+int main(int argc, const char* argv[]) {
+  benchInit("gc", 11, argc, argv);
+  initVM();
+
+  benchLiveHeap(1000);
+  benchLiveHeap(10000);
+  benchLiveHeap(100000);
+  benchLiveHeap(1000000);
+  benchGarbage(10000);
+  benchGarbage(100000);
+
+  freeVM();
+  return benchFinish();
+}
@@ -1,35 +1,133 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 
+#include "bench.h"
 #include "memory.h"
+#include "object.h"
 #include "table.h"
+#include "vm.h"
 
-double run_benchmark() {
-  clock_t start = clock();
+#define KEY_COUNT 4096
+#define LOOKUPS 65536
+#define CHURN_ROUNDS 64
 
+static ObjString* keys[KEY_COUNT];
+static ObjString* missingKeys[KEY_COUNT];
+
+typedef struct {
   Table table;
-  initTable(&table);
+  int size;
+  ObjString* probes[KEY_COUNT];
+  Value sink;
+} TableCase;
 
-  ObjString* key = copyString("key", 3);
-  Value value = BOOL_VAL(true);
+// Keys are kept on the VM stack so the collector leaves them alone.
+static void makeKeys(ObjString** out, const char* prefix) {
+  char buffer[32];
+  for (int i = 0; i < KEY_COUNT; i++) {
+    int length = snprintf(buffer, sizeof(buffer), "%s%d", prefix, i);
+    out[i] = copyString(buffer, length);
+    push(OBJ_VAL(out[i]));
+  }
+}
 
-  tableSet(&table, key, value);
+static void fillTable(TableCase* test, int size) {
+  initTable(&test->table);
+  test->size = size;
+  for (int i = 0; i < size; i++) tableSet(&test->table, keys[i], NUMBER_VAL(i));
+}
 
-  Value result;
-  tableGet(&table, key, &result);
+static void runLookups(void* context) {
+  TableCase* test = context;
+  for (int i = 0; i < LOOKUPS; i++) {
+    tableGet(&test->table, test->probes[i % KEY_COUNT], &test->sink);
+  }
+}
 
+static void runInserts(void* context) {
+  TableCase* test = context;
+  Table table;
+  initTable(&table);
+  for (int i = 0; i < test->size; i++) tableSet(&table, keys[i], NUMBER_VAL(i));
   freeTable(&table);
+}
+
+// Alternating inserts and deletes on a table that stays half full. A tombstoning table degrades
+// on this pattern.
+static void runChurn(void* context) {
+  TableCase* test = context;
+  int half = test->size / 2;
+  for (int round = 0; round < CHURN_ROUNDS; round++) {
+    for (int i = 0; i < half; i++) {
+      int in = (i + round * 7) % test->size;
+      int out = (in + half) % test->size;
+      tableSet(&test->table, keys[in], NUMBER_VAL(i));
+      tableDelete(&test->table, keys[out]);
+    }
+  }
+}
+
+// Looks up keys present in the table `hitPercent` percent of the time, spread evenly.
+static void benchLookups(int size, int hitPercent) {
+  char name[64];
+  snprintf(name, sizeof(name), "get %d keys, %d%% hits", size, hitPercent);
+  if (!benchSelected(name)) return;
 
-  freeObject(&key->obj);
+  TableCase* test = malloc(sizeof(TableCase));
+  fillTable(test, size);
+  for (int i = 0; i < KEY_COUNT; i++) {
+    bool hit = (i * hitPercent) % 100 + hitPercent >= 100;
+    test->probes[i] = hit ? keys[i % size] : missingKeys[i];
+  }
 
-  clock_t end = clock();
-  double time_spent = (double)(end - start) / CLOCKS_PER_SEC;
-  return time_spent;
+  benchRun(name, LOOKUPS, runLookups, test);
+  freeTable(&test->table);
+  free(test);
 }
 
-int main() {
-  double time = run_benchmark();
-  printf("Total time: %f\n", time);
-  return 0;
-}
\ No newline at end of file
+static void benchInserts(int size) {
+  char name[64];
+  snprintf(name, sizeof(name), "set %d keys into empty table", size);
+
+  TableCase test;
+  test.size = size;
+  benchRun(name, size, runInserts, &test);
+}
+
+static void benchChurn(int size) {
+  char name[64];
+  snprintf(name, sizeof(name), "set + delete churn, %d keys", size);
+  if (!benchSelected(name)) return;
+
+  TableCase* test = malloc(sizeof(TableCase));
+  fillTable(test, size / 2);
+  test->size = size;
+  benchRun(name, (double)CHURN_ROUNDS * size, runChurn, test);
+
+  // Lookups that miss walk the longest probe runs, so they show what the churn left behind.
+  for (int i = 0; i < KEY_COUNT; i++) test->probes[i] = missingKeys[i];
+  snprintf(name, sizeof(name), "get miss after churn, %d keys", size);
+  benchRun(name, LOOKUPS, runLookups, test);
+
+  freeTable(&test->table);
+  free(test);
+}
+
+int main(int argc, const char* argv[]) {
+  benchInit("hash_table", 15, argc, argv);
+  initVM();
+  makeKeys(keys, "key");
+  makeKeys(missingKeys, "missing");
+
+  int sizes[] = {8, 64, 512, KEY_COUNT};
+  int hitRates[] = {100, 50, 0};
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 3; j++) benchLookups(sizes[i], hitRates[j]);
+  }
+  for (int i = 0; i < 4; i++) benchInserts(sizes[i]);
+  benchChurn(64);
+  benchChurn(1024);
+
+  freeVM();
+  return benchFinish();
+}
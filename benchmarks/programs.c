@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "vm.h"
+
+// Paths are relative to the repository root, where `make bench` is run from.
+static const char* programs[] = {
+    "examples/bench_hash_table.lox",   "examples/bench_method_calls.lox",
+    "examples/bench_string_concat.lox", "benchmarks/lox/fib.lox",
+    "benchmarks/lox/binary_trees.lox", "benchmarks/lox/nbody.lox",
+    "benchmarks/lox/method_dispatch.lox",
+};
+
+// Each repetition runs the script in a fresh VM, as `corelox script.lox` would.
+static void runProgram(void* context) {
+  initVM();
+  benchSilence();
+  InterpretResult result = interpret(context);
+  benchRestore();
+  freeVM();
+
+  if (result != INTERPRET_OK) {
+    fprintf(stderr, "Benchmark program failed.\n");
+    exit(70);
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  benchInit("programs", 5, argc, argv);
+
+  for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+    if (!benchSelected(programs[i])) continue;
+
+    char* source = benchReadFile(programs[i]);
+    benchRun(programs[i], 1, runProgram, source);
+    free(source);
+  }
+
+  return benchFinish();
+}
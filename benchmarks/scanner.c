@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "scanner.h"
+
+// Each source is its snippet repeated until it is about this large, like a generated script.
+#define SOURCE_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+  const char* name;
+  const char* snippet;
+} ScannerCase;
+
+typedef struct {
+  char* source;
+  size_t length;
+  int tokens;
+} Source;
+
+static const ScannerCase cases[] = {
+    {"mixed code",
+     "class Node < Base {\n"
+     "  init(value, next) {\n"
+     "    this.value = value; // The payload.\n"
+     "    this.next = next;\n"
+     "  }\n"
+     "\n"
+     "  sum() {\n"
+     "    var total = 0;\n"
+     "    for (var node = this; node != nil; node = node.next) {\n"
+     "      if (node.value >= 10.5 and !false) total = total + node.value;\n"
+     "      elif (node.value < 0) continue;\n"
+     "    }\n"
+     "    return total;\n"
+     "  }\n"
+     "}\n"
+     "print \"sum: \" + Node(1, nil).sum();\n"},
+    {"keywords",
+     "if x then y else z; while true and false or nil { break; continue; }\n"
+     "switch (v) { case 1: fall; default: return this; }\n"
+     "fun f() { var a = super.m; print a; }\n"},
+    {"long identifiers",
+     "var accumulatedTotalForEveryElement = firstCollectionOfValues[currentIndexIntoIt];\n"
+     "resolveUpvalueIndexForTheEnclosingFunction(compilerStateBeingPassedAround);\n"},
+    {"comments and indentation",
+     "        // Explains what the statement below does in some detail, as comments do.\n"
+     "        /* A block comment\n"
+     "         * spanning a few lines.\n"
+     "         */\n"
+     "        x = 1;\n"},
+};
+
+static int scanAll(const Source* source) {
+  initScanner(source->source, source->length);
+  int tokens = 0;
+  for (;;) {
+    Token token = scanToken();
+    if (token.type == TOKEN_ERROR) {
+      fprintf(stderr, "Scanner benchmark source has a lexical error on line %d.\n", token.line);
+      exit(65);
+    }
+    if (token.type == TOKEN_EOF) return tokens;
+    tokens++;
+  }
+}
+
+static void runScan(void* context) { scanAll(context); }
+
+static void makeSource(Source* source, const char* snippet) {
+  size_t snippetLength = strlen(snippet);
+  size_t copies = SOURCE_SIZE / snippetLength + 1;
+  source->length = copies * snippetLength;
+  source->source = malloc(source->length + 1);
+  for (size_t i = 0; i < copies; i++) {
+    memcpy(source->source + i * snippetLength, snippet, snippetLength);
+  }
+  source->source[source->length] = '\0';
+  source->tokens = scanAll(source);
+}
+
+int main(int argc, const char* argv[]) {
+  benchInit("scanner", 15, argc, argv);
+
+  // The reported cost is per token, including the whitespace and comments before it.
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if (!benchSelected(cases[i].name)) continue;
+
+    Source source;
+    makeSource(&source, cases[i].snippet);
+    benchRun(cases[i].name, source.tokens, runScan, &source);
+    free(source.source);
+  }
+
+  return benchFinish();
+}
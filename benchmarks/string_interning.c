@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "object.h"
+#include "vm.h"
+
+// Names as they show up in scripts: mostly short, a few long descriptive ones.
+static const char* identifiers[] = {
+    "i", "j", "n", "x", "y", "id", "fn", "ok", "key", "len", "map", "sum", "tmp", "init", "left",
+    "name", "node", "self", "size", "this", "count", "index", "print", "right", "value", "buffer",
+    "length", "parent", "result", "string", "element", "handler", "visitor", "callback", "children",
+    "iterator", "instance", "accumulate", "startIndex", "superclass", "currentNode", "errorMessage",
+    "bytesAllocated", "compileFunction", "resolveUpvalueIndex",
+};
+
+// Object keys as found in typical JSON payloads.
+static const char* jsonKeys[] = {
+    "id", "url", "name", "type", "email", "title", "status", "user_id", "country", "is_active",
+    "last_name", "first_name", "created_at", "updated_at", "description", "phone_number",
+    "postal_code", "display_name", "profile_image", "billing_address", "shipping_address_line_1",
+    "shipping_address_line_2", "subscription_tier", "notification_preferences",
+    "external_reference_id",
+};
+
+#define ROUNDS 2000
+#define INSERT_ROUNDS 400
+
+typedef struct {
+  const char** names;
+  int count;
+  int lengths[64];
+} HitCase;
+
+typedef struct {
+  int inserts;
+  char* keys;
+  int* lengths;
+  int generation;
+} InsertCase;
+
+static void runHits(void* context) {
+  HitCase* test = context;
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < test->count; i++) copyString(test->names[i], test->lengths[i]);
+  }
+}
+
+// Every key ends in two generation characters, rewritten before each repetition so that the
+// interning in one repetition never turns the next one's misses into hits.
+static void runInserts(void* context) {
+  static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  InsertCase* test = context;
+  int generation = test->generation++;
+  char high = digits[generation / 62 % 62];
+  char low = digits[generation % 62];
+
+  for (int key = 0; key < test->inserts; key++) {
+    char* chars = test->keys + key * 64;
+    int length = test->lengths[key];
+    chars[length - 2] = high;
+    chars[length - 1] = low;
+    copyString(chars, length);
+  }
+}
+
+// Interns each name once and keeps it on the VM stack, then measures repeated lookups.
+static void benchHits(const char* label, const char** names, int count) {
+  HitCase test;
+  test.names = names;
+  test.count = count;
+  for (int i = 0; i < count; i++) {
+    test.lengths[i] = (int)strlen(names[i]);
+    push(OBJ_VAL(copyString(names[i], test.lengths[i])));
+  }
+
+  benchRun(label, (double)ROUNDS * count, runHits, &test);
+  for (int i = 0; i < count; i++) pop();
+}
+
+// Interns fresh strings derived from each name, so every call misses and inserts. The strings
+// are formatted up front so that only interning is timed.
+static void benchMisses(const char* label, const char** names, int count) {
+  InsertCase test;
+  test.inserts = INSERT_ROUNDS * count;
+  test.keys = malloc((size_t)test.inserts * 64);
+  test.lengths = malloc(sizeof(int) * test.inserts);
+  test.generation = 0;
+
+  for (int round = 0; round < INSERT_ROUNDS; round++) {
+    for (int i = 0; i < count; i++) {
+      int key = round * count + i;
+      test.lengths[key] = snprintf(test.keys + key * 64, 64, "%s_%d_00", names[i], round);
+    }
+  }
+
+  benchRun(label, test.inserts, runInserts, &test);
+  free(test.keys);
+  free(test.lengths);
+}
+
+int main(int argc, const char* argv[]) {
+  benchInit("string_interning", 15, argc, argv);
+  initVM();
+
+  int identifierCount = sizeof(identifiers) / sizeof(identifiers[0]);
+  int jsonKeyCount = sizeof(jsonKeys) / sizeof(jsonKeys[0]);
+
+  benchHits("identifiers (hit)", identifiers, identifierCount);
+  benchHits("json keys (hit)", jsonKeys, jsonKeyCount);
+  benchMisses("identifiers (insert)", identifiers, identifierCount);
+  benchMisses("json keys (insert)", jsonKeys, jsonKeyCount);
+
+  freeVM();
+  return benchFinish();
+}
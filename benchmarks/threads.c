@@ -0,0 +1,78 @@
+// pthreads are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "vm.h"
+
+#define MAX_THREADS 8
+
+// Allocates as well as computes, so the collector runs in every VM while the others do too.
+static const char* source =
+    "fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); }"
+    "var list = [];"
+    "for (var i = 0; i < 2000; i = i + 1) push(list, \"item \" + \"number\");"
+    "print fib(22);";
+
+typedef struct {
+  int threadCount;
+  InterpretResult results[MAX_THREADS];
+} ThreadRun;
+
+typedef struct {
+  ThreadRun* run;
+  int index;
+} ThreadSlot;
+
+// Each thread creates, uses and destroys a VM of its own, as an embedder serving requests would.
+static void* runScript(void* context) {
+  ThreadSlot* slot = context;
+  VM* instance = createVM();
+  slot->run->results[slot->index] = interpretVM(instance, source);
+  destroyVM(instance);
+  return NULL;
+}
+
+static void runThreads(void* context) {
+  ThreadRun* run = context;
+  pthread_t threads[MAX_THREADS];
+  ThreadSlot slots[MAX_THREADS];
+
+  for (int i = 0; i < run->threadCount; i++) {
+    slots[i].run = run;
+    slots[i].index = i;
+    if (pthread_create(&threads[i], NULL, runScript, &slots[i]) != 0) {
+      fprintf(stderr, "Could not start a thread.\n");
+      exit(71);
+    }
+  }
+  for (int i = 0; i < run->threadCount; i++) pthread_join(threads[i], NULL);
+
+  for (int i = 0; i < run->threadCount; i++) {
+    if (run->results[i] != INTERPRET_OK) {
+      fprintf(stderr, "Threaded benchmark script failed.\n");
+      exit(70);
+    }
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  benchInit("threads", 10, argc, argv);
+
+  // Reported per script: with independent VMs the time should fall in proportion to the threads
+  // until they outnumber the cores.
+  for (int threadCount = 1; threadCount <= MAX_THREADS; threadCount *= 2) {
+    char name[32];
+    snprintf(name, sizeof(name), "%d VM%s in parallel", threadCount, threadCount == 1 ? "" : "s");
+    ThreadRun run = {.threadCount = threadCount};
+
+    benchSilence();
+    benchRun(name, threadCount, runThreads, &run);
+    benchRestore();
+  }
+
+  return benchFinish();
+}
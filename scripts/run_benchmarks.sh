@@ -0,0 +1,50 @@
+#!/bin/bash
+#
+# Runs every benchmark binary built by `make bench`.
+#
+# Usage: scripts/run_benchmarks.sh [--save DIR] [--compare DIR] [--threshold PERCENT] [-- ARGS...]
+#
+#   --save DIR       write each suite's JSON report to DIR/<suite>.json
+#   --compare DIR    compare against reports saved earlier with --save; exits non-zero if any
+#                    benchmark's median regressed by more than the threshold (default 10%)
+#   ARGS             passed to every benchmark, e.g. -- --repetitions 30
+
+save=""
+compare=""
+threshold=10
+extra=()
+
+while [ $# -gt 0 ]; do
+  case "$1" in
+    --save) save="$2"; shift 2 ;;
+    --compare) compare="$2"; shift 2 ;;
+    --threshold) threshold="$2"; shift 2 ;;
+    --) shift; extra=("$@"); break ;;
+    *) echo "Unknown option: $1" >&2; exit 64 ;;
+  esac
+done
+
+cd "$(dirname "$0")/.." || exit 1
+[ -n "$save" ] && mkdir -p "$save"
+
+status=0
+for binary in benchmarks/*.out; do
+  suite=$(basename "$binary" .out)
+  args=("${extra[@]}")
+  if [ -n "$compare" ]; then
+    if [ -f "$compare/$suite.json" ]; then
+      args+=(--compare "$compare/$suite.json" --threshold "$threshold")
+    else
+      echo "$suite: no baseline in $compare" >&2
+    fi
+  fi
+
+  if [ -n "$save" ]; then
+    "$binary" --json "${args[@]}" > "$save/$suite.json" || status=1
+  else
+    "$binary" "${args[@]}" || status=1
+    echo
+  fi
+done
+
+exit $status
@@ -0,0 +1,569 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "bytecode.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+
+// Tags identifying the type of each constant pool entry.
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_FALSE,
+  CONSTANT_TRUE,
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+} ConstantTag;
+
+// Compiler options that change the bytecode, recorded in the header.
+#define FLAG_PEEPHOLE 0x1
+#define FLAG_REGISTERS 0x2
+
+static uint32_t compilerFlags() {
+  return (vm->peephole ? FLAG_PEEPHOLE : 0) | (vm->registers ? FLAG_REGISTERS : 0);
+}
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+
+// Continues a 64-bit FNV-1a hash over `size` more bytes.
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+  const uint8_t* bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t hashSource(const char* source, size_t length) {
+  return hashBytes(FNV_OFFSET_BASIS, source, length);
+}
+
+bool isBytecodeFile(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return false;
+
+  char magic[4];
+  bool matches = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                 memcmp(magic, BYTECODE_MAGIC, sizeof(magic)) == 0;
+  fclose(file);
+  return matches;
+}
+
+//> Writing
+
+// Strings already written, so each is stored once per file however many chunks use it. Interned
+// strings are unique, so they are keyed by pointer. It is allocated with plain malloc(): the
+// script being written is not rooted, and nothing here may trigger a collection. `checksum`
+// covers every byte written after the header.
+typedef struct {
+  FILE* file;
+  uint64_t checksum;
+  ObjString** strings;
+  int* indices;
+  int capacity;
+  int count;
+} Writer;
+
+static void writeRaw(Writer* writer, const void* data, size_t size) {
+  fwrite(data, 1, size, writer->file);
+  writer->checksum = hashBytes(writer->checksum, data, size);
+}
+
+static void writeInt(Writer* writer, int32_t value) { writeRaw(writer, &value, sizeof(value)); }
+
+static void writeByte(Writer* writer, uint8_t byte) { writeRaw(writer, &byte, 1); }
+
+static uint32_t hashPointer(ObjString* string, int capacity) {
+  return (uint32_t)(((uintptr_t)string >> 3) * 2654435761u) & (uint32_t)(capacity - 1);
+}
+
+static void growWriter(Writer* writer) {
+  int capacity = writer->capacity < 64 ? 64 : writer->capacity * 2;
+  ObjString** strings = calloc(capacity, sizeof(ObjString*));
+  int* indices = malloc(sizeof(int) * capacity);
+  for (int i = 0; i < writer->capacity; i++) {
+    if (writer->strings[i] == NULL) continue;
+    uint32_t slot = hashPointer(writer->strings[i], capacity);
+    while (strings[slot] != NULL) slot = (slot + 1) & (capacity - 1);
+    strings[slot] = writer->strings[i];
+    indices[slot] = writer->indices[i];
+  }
+  free(writer->strings);
+  free(writer->indices);
+  writer->strings = strings;
+  writer->indices = indices;
+  writer->capacity = capacity;
+}
+
+// Writes a reference to `string`: -1 for NULL, the index of a string written earlier, or the next
+// index followed by the length and characters the first time a string is seen.
+static void writeString(Writer* writer, ObjString* string) {
+  if (string == NULL) {
+    writeInt(writer, -1);
+    return;
+  }
+
+  if ((writer->count + 1) * 4 > writer->capacity * 3) growWriter(writer);
+  uint32_t slot = hashPointer(string, writer->capacity);
+  while (writer->strings[slot] != NULL) {
+    if (writer->strings[slot] == string) {
+      writeInt(writer, writer->indices[slot]);
+      return;
+    }
+    slot = (slot + 1) & (writer->capacity - 1);
+  }
+
+  writer->strings[slot] = string;
+  writer->indices[slot] = writer->count;
+  writeInt(writer, writer->count++);
+  writeInt(writer, string->length);
+  writeRaw(writer, string->chars, string->length);
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+
+  writeString(writer, function->name);
+  writeInt(writer, function->arity);
+  writeInt(writer, function->upvalueCount);
+  writeInt(writer, function->capturesLocals);
+
+  writeInt(writer, chunk->count);
+  writeRaw(writer, chunk->code, chunk->count);
+
+  writeInt(writer, chunk->lines.count);
+  writeRaw(writer, chunk->lines.lines, sizeof(LineInfo) * chunk->lines.count);
+
+  writeInt(writer, chunk->caches.count);
+  for (int i = 0; i < chunk->caches.count; i++) {
+    writeInt(writer, chunk->caches.caches[i].offset);
+  }
+
+  writeInt(writer, chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    if (IS_NIL(value)) {
+      writeByte(writer, CONSTANT_NIL);
+    } else if (IS_BOOL(value)) {
+      writeByte(writer, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+    } else if (IS_NUMBER(value)) {
+      double number = AS_NUMBER(value);
+      writeByte(writer, CONSTANT_NUMBER);
+      writeRaw(writer, &number, sizeof(number));
+    } else if (IS_STRING(value)) {
+      writeByte(writer, CONSTANT_STRING);
+      writeString(writer, AS_STRING(value));
+    } else {
+      writeByte(writer, CONSTANT_FUNCTION);
+      writeFunction(writer, AS_FUNCTION(value));
+    }
+  }
+}
+
+bool writeBytecode(ObjFunction* script, uint64_t sourceHash, const char* path) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) return false;
+
+  // The checksum covers only what follows it, so it is written as zero and filled in at the end.
+  Writer writer = {file, 0, NULL, NULL, 0, 0};
+  uint64_t checksum = 0;
+  writeRaw(&writer, BYTECODE_MAGIC, 4);
+  writeInt(&writer, BYTECODE_VERSION);
+  writeInt(&writer, OPCODE_COUNT);
+  writeInt(&writer, compilerFlags());
+  writeRaw(&writer, &sourceHash, sizeof(sourceHash));
+  long checksumOffset = ftell(file);
+  writeRaw(&writer, &checksum, sizeof(checksum));
+
+  writer.checksum = FNV_OFFSET_BASIS;
+  writeInt(&writer, vm->globalNames.count);
+  for (int i = 0; i < vm->globalNames.count; i++) {
+    writeString(&writer, AS_STRING(vm->globalNames.values[i]));
+  }
+
+  writeFunction(&writer, script);
+  free(writer.strings);
+  free(writer.indices);
+
+  checksum = writer.checksum;
+  bool ok = checksumOffset >= 0 && fseek(file, checksumOffset, SEEK_SET) == 0 &&
+            fwrite(&checksum, sizeof(checksum), 1, file) == 1 && !ferror(file);
+  if (fclose(file) != 0) ok = false;
+  return ok;
+}
+
+//< Writing
+//> Reading
+
+// Cursor over a mapped cache file. Any out-of-bounds read clears `ok` and yields zeroes.
+//
+// `strings` holds the strings read so far, by index. Each is stored in a function, a constant pool
+// or the global names as soon as it is read, so none needs rooting here.
+typedef struct {
+  const uint8_t* current;
+  const uint8_t* end;
+  bool ok;
+  ObjString** strings;
+  int stringCapacity;
+  int stringCount;
+} Reader;
+
+static const uint8_t* readRaw(Reader* reader, size_t size) {
+  if (!reader->ok || (size_t)(reader->end - reader->current) < size) {
+    reader->ok = false;
+    return NULL;
+  }
+  const uint8_t* data = reader->current;
+  reader->current += size;
+  return data;
+}
+
+static int32_t readInt(Reader* reader) {
+  int32_t value = 0;
+  const uint8_t* data = readRaw(reader, sizeof(value));
+  if (data != NULL) memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+// Reads a length that must be non-negative, failing the whole read otherwise.
+static int readCount(Reader* reader) {
+  int32_t count = readInt(reader);
+  if (count < 0) reader->ok = false;
+  return reader->ok ? count : 0;
+}
+
+// Reads a string reference written by writeString(). NULL means either a missing name or a failed
+// read.
+static ObjString* readString(Reader* reader) {
+  int32_t index = readInt(reader);
+  if (index == -1) return NULL;
+  if (index >= 0 && index < reader->stringCount) return reader->strings[index];
+  if (index != reader->stringCount) {
+    reader->ok = false;
+    return NULL;
+  }
+
+  int32_t length = readCount(reader);
+  const uint8_t* chars = readRaw(reader, length);
+  if (chars == NULL) return NULL;
+  ObjString* string = copyString((const char*)chars, length);
+
+  if (reader->stringCount == reader->stringCapacity) {
+    push(OBJ_VAL(string));
+    int oldCapacity = reader->stringCapacity;
+    reader->stringCapacity = GROW_CAPACITY(oldCapacity);
+    reader->strings = GROW_ARRAY(ObjString*, reader->strings, oldCapacity, reader->stringCapacity);
+    pop();
+  }
+  reader->strings[reader->stringCount++] = string;
+  return string;
+}
+
+static int readOperandShort(const uint8_t* operand) { return (operand[0] << 8) | operand[1]; }
+
+static bool isConstant(Chunk* chunk, int index) { return index < chunk->constants.count; }
+
+static bool isName(Chunk* chunk, int index) {
+  return isConstant(chunk, index) && IS_STRING(chunk->constants.values[index]);
+}
+
+// Records a local slot operand; slots are checked against the stack depth once that is known.
+static bool isLocal(int slot, int* slotCount) {
+  if (slot >= *slotCount) *slotCount = slot + 1;
+  return true;
+}
+
+// Checks the operands of the instruction at `offset` against what the chunk, the function and the
+// globals actually hold, so running the code can never index past any of them.
+static bool validOperands(ObjFunction* function, int offset, int* slotCount) {
+  Chunk* chunk = &function->chunk;
+  uint8_t instruction = chunk->code[offset];
+  const uint8_t* operands = chunk->code + offset + 1;
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_ADD_CONST:
+      return isConstant(chunk, operands[0]);
+    case OP_CONSTANT_LONG:
+      return isConstant(chunk, (operands[0] << 16) | readOperandShort(operands + 1));
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_SUPER_INVOKE:
+      return isName(chunk, operands[0]);
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      return isName(chunk, operands[0]) && readOperandShort(operands + 1) < chunk->caches.count;
+    case OP_INVOKE:
+      return isName(chunk, operands[0]) && readOperandShort(operands + 2) < chunk->caches.count;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+      return readOperandShort(operands) < vm->globalValues.count;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+      return operands[0] < function->upvalueCount;
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+      return isLocal(operands[0], slotCount);
+    case OP_GET_LOCAL_GET_LOCAL:
+    case OP_MOVE:
+      return isLocal(operands[0], slotCount) && isLocal(operands[1], slotCount);
+    case OP_INC_LOCAL:
+      return isLocal(operands[0], slotCount) && isConstant(chunk, operands[1]) &&
+             IS_NUMBER(chunk->constants.values[operands[1]]);
+    case OP_LOAD_CONSTANT:
+      return isLocal(operands[0], slotCount) && isConstant(chunk, operands[1]);
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+      return isLocal(operands[0], slotCount) && isLocal(operands[1], slotCount) &&
+             isLocal(operands[2], slotCount);
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+      return isLocal(operands[0], slotCount) && isLocal(operands[1], slotCount) &&
+             isConstant(chunk, operands[2]);
+    case OP_LESS_RR_JUMP:
+    case OP_LESS_EQUAL_RR_JUMP:
+    case OP_GREATER_RR_JUMP:
+    case OP_GREATER_EQUAL_RR_JUMP:
+      return isLocal(operands[0], slotCount) && isLocal(operands[1], slotCount);
+    case OP_LESS_RK_JUMP:
+    case OP_LESS_EQUAL_RK_JUMP:
+    case OP_GREATER_RK_JUMP:
+    case OP_GREATER_EQUAL_RK_JUMP:
+      return isLocal(operands[0], slotCount) && isConstant(chunk, operands[1]);
+    case OP_CLOSURE: {
+      // Each captured variable is a local of this function or one of its own upvalues.
+      int upvalueCount = AS_FUNCTION(chunk->constants.values[operands[0]])->upvalueCount;
+      for (int i = 0; i < upvalueCount; i++) {
+        uint8_t capturesLocal = operands[1 + 2 * i];
+        uint8_t index = operands[2 + 2 * i];
+        if (capturesLocal > 1) return false;
+        if (capturesLocal ? !isLocal(index, slotCount) : index >= function->upvalueCount) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default:
+      return instruction < OPCODE_COUNT;
+  }
+}
+
+// Walks the code instruction by instruction, so that each one is read from where it starts and
+// every jump lands on the start of an instruction. The interpreter trusts the compiler for all of
+// this, and a corrupt cache must not reach it. `slotCount` is set to the local slots the code uses.
+static bool validCode(ObjFunction* function, int* slotCount) {
+  Chunk* chunk = &function->chunk;
+  *slotCount = 0;
+  if (chunk->count == 0) return false;
+
+  bool* starts = ALLOCATE(bool, chunk->count);
+  memset(starts, 0, chunk->count);
+  bool valid = true;
+  int offset = 0;
+  uint8_t last = OP_RETURN;
+  while (valid && offset < chunk->count) {
+    last = chunk->code[offset];
+    // The length of a closure comes from the function it creates.
+    if (last == OP_CLOSURE) {
+      int constant = offset + 1 < chunk->count ? chunk->code[offset + 1] : chunk->constants.count;
+      if (!isConstant(chunk, constant) || !IS_FUNCTION(chunk->constants.values[constant])) {
+        valid = false;
+        break;
+      }
+    }
+
+    int length = instructionLength(chunk, offset);
+    valid = offset + length <= chunk->count && validOperands(function, offset, slotCount);
+    starts[offset] = true;
+    offset += length;
+  }
+  // Execution must never run off the end of the code.
+  valid = valid && offset == chunk->count &&
+          (last == OP_RETURN || last == OP_JUMP || last == OP_LOOP);
+
+  for (offset = 0; valid && offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    int target = jumpTarget(chunk, offset);
+    if (target == -1 && chunk->code[offset] != OP_LOOP) continue;
+    valid = target >= 0 && target < chunk->count && starts[target];
+  }
+
+  FREE_ARRAY(bool, starts, chunk->count);
+  return valid;
+}
+
+static ObjFunction* readFunction(Reader* reader) {
+  ObjFunction* function = newFunction();
+  push(OBJ_VAL(function));
+  Chunk* chunk = &function->chunk;
+
+  function->name = readString(reader);
+  WRITE_BARRIER_OBJ(function->name);
+  function->arity = readInt(reader);
+  function->upvalueCount = readInt(reader);
+  function->capturesLocals = readInt(reader) != 0;
+  if (function->arity < 0 || function->arity > UINT8_MAX || function->upvalueCount < 0 ||
+      function->upvalueCount > UINT8_COUNT) {
+    reader->ok = false;
+  }
+
+  int codeCount = readCount(reader);
+  const uint8_t* code = readRaw(reader, codeCount);
+  if (code != NULL && codeCount > 0) {
+    chunk->code = ALLOCATE(uint8_t, codeCount);
+    memcpy(chunk->code, code, codeCount);
+    chunk->capacity = codeCount;
+    chunk->count = codeCount;
+  }
+
+  int lineCount = readCount(reader);
+  const uint8_t* lines = readRaw(reader, sizeof(LineInfo) * lineCount);
+  if (lines != NULL && lineCount > 0) {
+    chunk->lines.lines = ALLOCATE(LineInfo, lineCount);
+    memcpy(chunk->lines.lines, lines, sizeof(LineInfo) * lineCount);
+    chunk->lines.capacity = lineCount;
+    chunk->lines.count = lineCount;
+  }
+
+  // Line lookups binary-search the runs, so they must start at 0 and increase within the code.
+  for (int i = 0; i < chunk->lines.count; i++) {
+    int start = chunk->lines.lines[i].start;
+    int previous = i == 0 ? -1 : chunk->lines.lines[i - 1].start;
+    if (start <= previous || start >= chunk->count || (i == 0 && start != 0)) reader->ok = false;
+  }
+
+  int cacheCount = readCount(reader);
+  for (int i = 0; i < cacheCount && reader->ok; i++) {
+    int offset = readInt(reader);
+    if (offset < 0 || offset >= chunk->count) reader->ok = false;
+    addInlineCache(&chunk->caches, offset);
+  }
+
+  int constantCount = readCount(reader);
+  for (int i = 0; i < constantCount && reader->ok; i++) {
+    const uint8_t* tag = readRaw(reader, 1);
+    if (tag == NULL) break;
+
+    switch (*tag) {
+      case CONSTANT_NIL:
+        addConstant(chunk, NIL_VAL);
+        break;
+      case CONSTANT_FALSE:
+        addConstant(chunk, FALSE_VAL);
+        break;
+      case CONSTANT_TRUE:
+        addConstant(chunk, TRUE_VAL);
+        break;
+      case CONSTANT_NUMBER: {
+        double number = 0;
+        const uint8_t* data = readRaw(reader, sizeof(number));
+        if (data != NULL) memcpy(&number, data, sizeof(number));
+        addConstant(chunk, COMPACT_NUMBER_VAL(number));
+        break;
+      }
+      case CONSTANT_STRING: {
+        ObjString* string = readString(reader);
+        if (string == NULL) {
+          reader->ok = false;
+          break;
+        }
+        addConstant(chunk, OBJ_VAL(string));
+        break;
+      }
+      case CONSTANT_FUNCTION: {
+        ObjFunction* nested = readFunction(reader);
+        if (nested != NULL) addConstant(chunk, OBJ_VAL(nested));
+        break;
+      }
+      default:
+        reader->ok = false;
+        break;
+    }
+  }
+
+  // The depth is derived rather than stored, so a cache can never claim less than the code needs.
+  int slotCount;
+  if (reader->ok && !validCode(function, &slotCount)) reader->ok = false;
+  if (reader->ok) function->maxSlots = maxStackDepth(chunk, function->arity + 1);
+  if (reader->ok && (function->maxSlots < 0 || slotCount > function->maxSlots)) reader->ok = false;
+
+  pop();
+  return reader->ok ? function : NULL;
+}
+
+// Binds every global name to the slot the cached bytecode refers to it by.
+static void readGlobals(Reader* reader) {
+  int count = readCount(reader);
+  for (int i = 0; i < count && reader->ok; i++) {
+    ObjString* name = readString(reader);
+    if (name == NULL) {
+      reader->ok = false;
+      break;
+    }
+
+    push(OBJ_VAL(name));
+    if (globalSlot(name) != i) reader->ok = false;
+    pop();
+  }
+}
+
+ObjFunction* readBytecode(const char* path, const uint64_t* sourceHash) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = (size_t)info.st_size;
+  void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return NULL;
+
+  Reader reader = {mapping, (const uint8_t*)mapping + size, true, NULL, 0, 0};
+  ObjFunction* script = NULL;
+
+  const uint8_t* magic = readRaw(&reader, 4);
+  int32_t version = readInt(&reader);
+  int32_t opcodeCount = readInt(&reader);
+  int32_t flags = readInt(&reader);
+  uint64_t hash = 0;
+  uint64_t checksum = 0;
+  const uint8_t* hashData = readRaw(&reader, sizeof(hash));
+  if (hashData != NULL) memcpy(&hash, hashData, sizeof(hash));
+  const uint8_t* checksumData = readRaw(&reader, sizeof(checksum));
+  if (checksumData != NULL) memcpy(&checksum, checksumData, sizeof(checksum));
+
+  if (reader.ok && memcmp(magic, BYTECODE_MAGIC, 4) == 0 && version == BYTECODE_VERSION &&
+      opcodeCount == OPCODE_COUNT && (uint32_t)flags == compilerFlags() &&
+      (sourceHash == NULL || hash == *sourceHash) &&
+      hashBytes(FNV_OFFSET_BASIS, reader.current, reader.end - reader.current) == checksum) {
+    readGlobals(&reader);
+    if (reader.ok) script = readFunction(&reader);
+    // The script is called with no arguments and closes over nothing.
+    if (script != NULL && (script->arity != 0 || script->upvalueCount != 0)) script = NULL;
+    if (reader.current != reader.end) script = NULL;
+  }
+
+  FREE_ARRAY(ObjString*, reader.strings, reader.stringCapacity);
+  munmap(mapping, size);
+  return script;
+}
+
+//< Reading
@@ -1,6 +1,7 @@
 #include "chunk.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "memory.h"
 #include "vm.h"
@@ -11,12 +12,14 @@ void initChunk(Chunk* chunk) {
   chunk->code = NULL;
   initLineInfoArray(&chunk->lines);
   initValueArray(&chunk->constants);
+  initInlineCacheArray(&chunk->caches);
 }
 
 void freeChunk(Chunk* chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   freeLineInfoArray(&chunk->lines);
   freeValueArray(&chunk->constants);
+  freeInlineCacheArray(&chunk->caches);
   initChunk(chunk);
 }
 
@@ -31,7 +34,8 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
   chunk->code[chunk->count] = byte;
   chunk->count++;
 
-  // Handle the LineInfoArray for RLE encoding
+  // Handle the LineInfoArray for RLE encoding. A byte on the same line as the previous one just
+  // extends the last run, which ends wherever the chunk does.
   if (chunk->lines.count == 0 || chunk->lines.lines[chunk->lines.count - 1].line != line) {
     if (chunk->lines.capacity < chunk->lines.count + 1) {
       int oldCapacity = chunk->lines.capacity;
@@ -41,15 +45,301 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     }
 
     chunk->lines.lines[chunk->lines.count].line = line;
-    chunk->lines.lines[chunk->lines.count].run_length = 1;
+    chunk->lines.lines[chunk->lines.count].start = chunk->count - 1;
     chunk->lines.count++;
+  }
+}
+
+void truncateChunk(Chunk* chunk, int count) {
+  chunk->count = count;
+
+  while (chunk->lines.count > 0 && chunk->lines.lines[chunk->lines.count - 1].start >= count) {
+    chunk->lines.count--;
+  }
+
+  while (chunk->caches.count > 0 &&
+         chunk->caches.caches[chunk->caches.count - 1].offset >= count) {
+    chunk->caches.count--;
+  }
+}
+
+int instructionLength(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_ADD_CONST:
+      return 2;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SUPER_INVOKE:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+    case OP_GET_LOCAL_GET_LOCAL:
+    case OP_INC_LOCAL:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_NOT_JUMP_IF_FALSE:
+    case OP_MOVE:
+    case OP_LOAD_CONSTANT:
+      return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+      return 4;
+    case OP_INVOKE:
+    case OP_LESS_RR_JUMP:
+    case OP_LESS_RK_JUMP:
+    case OP_LESS_EQUAL_RR_JUMP:
+    case OP_LESS_EQUAL_RK_JUMP:
+    case OP_GREATER_RR_JUMP:
+    case OP_GREATER_RK_JUMP:
+    case OP_GREATER_EQUAL_RR_JUMP:
+    case OP_GREATER_EQUAL_RK_JUMP:
+      return 5;
+    case OP_CLOSURE: {
+      ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+      return 2 + 2 * function->upvalueCount;
+    }
+    default:
+      return 1;
+  }
+}
+
+// Values an instruction leaves on the stack minus those it consumes. `peak` is set to how far above
+// the starting depth the stack gets while the instruction runs.
+static int stackEffect(Chunk* chunk, int offset, int* peak) {
+  uint8_t* code = chunk->code + offset;
+  int effect;
+  switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_DUP:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_GLOBAL:
+    case OP_LIST:
+      effect = 1;
+      break;
+    case OP_GET_LOCAL_GET_LOCAL:
+      effect = 2;
+      break;
+    case OP_CLOSE_UPVALUE:
+    case OP_METHOD:
+    case OP_INHERIT:
+    case OP_POP:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_DEFINE_GLOBAL:
+    case OP_LIST_APPEND:
+    case OP_INDEX_GET:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_PRINT:
+    case OP_LESS_JUMP_IF_FALSE:
+      effect = -1;
+      break;
+    case OP_INDEX_SET:
+      effect = -2;
+      break;
+    case OP_CALL:
+    case OP_INVOKE:
+      effect = -code[code[0] == OP_CALL ? 1 : 2];
+      break;
+    case OP_SUPER_INVOKE:
+      effect = -code[2] - 1;
+      break;
+    case OP_RETURN:
+      effect = -1;
+      break;
+    default:
+      effect = 0;
+      break;
+  }
+
+  // Concatenating onto a string constant pushes the constant before adding it, and concatenating
+  // into a register pushes both operands.
+  if (code[0] == OP_ADD_CONST) {
+    *peak = 1;
+  } else if (code[0] == OP_ADD_RR || code[0] == OP_ADD_RK) {
+    *peak = 2;
   } else {
-    chunk->lines.lines[chunk->lines.count - 1].run_length++;
+    *peak = effect > 0 ? effect : 0;
+  }
+  return effect;
+}
+
+int jumpTarget(Chunk* chunk, int offset) {
+  uint8_t* code = chunk->code + offset;
+  switch (code[0]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_NOT_JUMP_IF_FALSE:
+    case OP_LESS_RR_JUMP:
+    case OP_LESS_RK_JUMP:
+    case OP_LESS_EQUAL_RR_JUMP:
+    case OP_LESS_EQUAL_RK_JUMP:
+    case OP_GREATER_RR_JUMP:
+    case OP_GREATER_RK_JUMP:
+    case OP_GREATER_EQUAL_RR_JUMP:
+    case OP_GREATER_EQUAL_RK_JUMP: {
+      int end = offset + instructionLength(chunk, offset);
+      return end + ((chunk->code[end - 2] << 8) | chunk->code[end - 1]);
+    }
+    case OP_LOOP:
+      return offset + 3 - ((code[1] << 8) | code[2]);
+    default:
+      return -1;
+  }
+}
+
+void writeJumpOperand(uint8_t* code, int offset, int jump) {
+  code[offset] = (jump >> 8) & 0xff;
+  code[offset + 1] = jump & 0xff;
+}
+
+bool relocateChunk(Chunk* chunk, const int* newOffset, RelocateFn rewrite, void* context) {
+  int count = chunk->count;
+  int* lines = malloc(count * sizeof(int));
+  if (lines == NULL) return false;
+
+  // Expand the run-length encoded lines so each old byte can be looked up directly.
+  for (int i = 0; i < chunk->lines.count; i++) {
+    int end = i + 1 < chunk->lines.count ? chunk->lines.lines[i + 1].start : count;
+    for (int byte = chunk->lines.lines[i].start; byte < end; byte++) {
+      lines[byte] = chunk->lines.lines[i].line;
+    }
+  }
+
+  uint8_t* code = chunk->code;
+  LineInfoArray* array = &chunk->lines;
+  array->count = 0;
+  int write = 0;
+  for (int offset = 0; offset < count;) {
+    int start = write;
+    int length = rewrite(chunk, offset, &write, newOffset, context);
+    if (length == 0) {
+      // Jumps keep their operands; only the offset they end in changes.
+      uint8_t instruction = code[offset];
+      int target = jumpTarget(chunk, offset);
+      length = instructionLength(chunk, offset);
+      memmove(&code[write], &code[offset], length);
+      write += length;
+      if (target >= 0) {
+        int jump = instruction == OP_LOOP ? write - newOffset[target] : newOffset[target] - write;
+        writeJumpOperand(code, write - 2, jump);
+      }
+    }
+
+    // Re-encode the lines run by run; there are never more runs than before.
+    bool sameLine = array->count > 0 && array->lines[array->count - 1].line == lines[offset];
+    if (write > start && !sameLine) {
+      array->lines[array->count].line = lines[offset];
+      array->lines[array->count].start = start;
+      array->count++;
+    }
+
+    offset += length;
+  }
+  chunk->count = write;
+
+  for (int i = 0; i < chunk->caches.count; i++) {
+    chunk->caches.caches[i].offset = newOffset[chunk->caches.caches[i].offset];
+  }
+
+  free(lines);
+  return true;
+}
+
+int maxStackDepth(Chunk* chunk, int entryDepth) {
+  if (chunk->count == 0) return entryDepth;
+
+  // Depth on entry to each instruction, or -1 until a path reaches it. The compiler keeps the
+  // stack balanced, so every path into an instruction arrives with the same depth and each one
+  // only has to be walked once.
+  int* depths = ALLOCATE(int, chunk->count);
+  int* pending = ALLOCATE(int, chunk->count);
+  for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+
+  int pendingCount = 0;
+  int maxDepth = entryDepth;
+  bool balanced = true;
+  depths[0] = entryDepth;
+  pending[pendingCount++] = 0;
+
+  while (pendingCount > 0 && balanced) {
+    int offset = pending[--pendingCount];
+    int depth = depths[offset];
+
+    for (;;) {
+      int peak;
+      int effect = stackEffect(chunk, offset, &peak);
+      if (depth + peak > maxDepth) maxDepth = depth + peak;
+      depth += effect;
+      if (depth < 0) {
+        balanced = false;
+        break;
+      }
+
+      uint8_t instruction = chunk->code[offset];
+      int target = jumpTarget(chunk, offset);
+      if (target >= 0 && target < chunk->count) {
+        if (depths[target] == -1) {
+          depths[target] = depth;
+          pending[pendingCount++] = target;
+        } else if (depths[target] != depth) {
+          balanced = false;
+          break;
+        }
+      }
+      if (instruction == OP_JUMP || instruction == OP_LOOP || instruction == OP_RETURN) break;
+
+      offset += instructionLength(chunk, offset);
+      if (offset >= chunk->count) break;
+      if (depths[offset] != -1) {
+        balanced = depths[offset] == depth;
+        break;
+      }
+      depths[offset] = depth;
+    }
   }
+
+  FREE_ARRAY(int, depths, chunk->count);
+  FREE_ARRAY(int, pending, chunk->count);
+  return balanced ? maxDepth : -1;
 }
 
-int writeConstant(Chunk* chunk, Value value, int line) {
-  int index = addConstant(chunk, value);
+int writeConstant(Chunk* chunk, ConstantIndex* constants, Value value, int line) {
+  int index = constants != NULL ? internConstant(chunk, constants, value) : addConstant(chunk, value);
 
   if (index <= UINT8_MAX) {
     writeChunk(chunk, OP_CONSTANT, line);
@@ -69,19 +359,143 @@ int writeConstant(Chunk* chunk, Value value, int line) {
 int addConstant(Chunk* chunk, Value value) {
   push(value);
   writeValueArray(&chunk->constants, value);
+  WRITE_BARRIER(value);
   pop();
   return chunk->constants.count - 1;
 }
 
-int getLine(Chunk* chunk, int instructionIndex) {
-  int offset = 0;
+void initConstantIndex(ConstantIndex* index) {
+  index->slots = NULL;
+  index->capacity = 0;
+  index->count = 0;
+}
 
-  for (int i = 0; i < chunk->lines.count; i++) {
-    offset += chunk->lines.lines[i].run_length;
-    if (instructionIndex < offset) {
-      return chunk->lines.lines[i].line;
+void freeConstantIndex(ConstantIndex* index) {
+  FREE_ARRAY(int, index->slots, index->capacity);
+  initConstantIndex(index);
+}
+
+// Constants are told apart by their encoding rather than by valuesEqual(), under which 0 and -0
+// are equal but still are two different constants.
+static bool sameConstant(Value a, Value b) {
+#ifdef NAN_BOXING
+  return a == b;
+#else
+  if (a.type != b.type) return false;
+  if (IS_NUMBER(a)) return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+  return AS_OBJ(a) == AS_OBJ(b);
+#endif
+}
+
+static uint32_t hashConstant(Value value) {
+  uint64_t bits;
+#ifdef NAN_BOXING
+  bits = value;
+#else
+  if (IS_NUMBER(value)) {
+    memcpy(&bits, &value.as.number, sizeof(bits));
+  } else {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  }
+#endif
+  // Fibonacci hashing spreads pointers and small integers, whose low bits barely vary.
+  return (uint32_t)((bits * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+// The slot holding `value`, or the empty slot ending its probe run. Slots left behind by constants
+// taken back out of the pool point past its end; they never match, but do not end the run either.
+static int findConstantSlot(Chunk* chunk, ConstantIndex* index, Value value) {
+  uint32_t mask = (uint32_t)index->capacity - 1;
+  for (uint32_t slot = hashConstant(value) & mask;; slot = (slot + 1) & mask) {
+    int entry = index->slots[slot] - 1;
+    if (entry < 0) return (int)slot;
+    if (entry < chunk->constants.count && sameConstant(chunk->constants.values[entry], value)) {
+      return (int)slot;
+    }
+  }
+}
+
+// Rebuilds the index from the pool itself at twice the size, which also drops the stale slots.
+static void growConstantIndex(Chunk* chunk, ConstantIndex* index) {
+  int capacity = 8;
+  while (capacity < chunk->constants.count * 2) capacity *= 2;
+  freeConstantIndex(index);
+  index->slots = ALLOCATE(int, capacity);
+  memset(index->slots, 0, sizeof(int) * capacity);
+  index->capacity = capacity;
+
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    if (!IS_NUMBER(value) && !IS_STRING(value)) continue;
+    int slot = findConstantSlot(chunk, index, value);
+    if (index->slots[slot] == 0) {
+      index->slots[slot] = i + 1;
+      index->count++;
     }
   }
+}
+
+int internConstant(Chunk* chunk, ConstantIndex* index, Value value) {
+  if (!IS_NUMBER(value) && !IS_STRING(value)) return addConstant(chunk, value);
+
+  if (index->capacity != 0) {
+    int entry = index->slots[findConstantSlot(chunk, index, value)] - 1;
+    if (entry >= 0) return entry;
+  }
 
-  return -1;
+  int constant = addConstant(chunk, value);
+  if ((index->count + 1) * 4 > index->capacity * 3) {
+    // Rebuilt from the pool, which already holds the new constant.
+    growConstantIndex(chunk, index);
+  } else {
+    index->slots[findConstantSlot(chunk, index, value)] = constant + 1;
+    index->count++;
+  }
+  return constant;
+}
+
+// Binary-searches for the last run starting at or before `offset`, which must be in the chunk.
+static int findLineRun(Chunk* chunk, int offset) {
+  int low = 0;
+  int high = chunk->lines.count - 1;
+  while (low < high) {
+    int middle = low + (high - low + 1) / 2;
+    if (chunk->lines.lines[middle].start <= offset) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return low;
+}
+
+int getLine(Chunk* chunk, int instructionIndex) {
+  if (instructionIndex < 0 || instructionIndex >= chunk->count || chunk->lines.count == 0) {
+    return -1;
+  }
+  return chunk->lines.lines[findLineRun(chunk, instructionIndex)].line;
+}
+
+void getLines(Chunk* chunk, const int* instructionIndices, int* lines, int count) {
+  LineInfo* runs = chunk->lines.lines;
+  int runCount = chunk->lines.count;
+  int run = 0;
+
+  for (int i = 0; i < count; i++) {
+    int offset = instructionIndices[i];
+    if (offset < 0 || offset >= chunk->count || runCount == 0) {
+      lines[i] = -1;
+      continue;
+    }
+
+    // Offsets close to the previous one are usually in the same run or the next; only a jump
+    // elsewhere needs the binary search.
+    bool inRun = runs[run].start <= offset && (run + 1 == runCount || runs[run + 1].start > offset);
+    if (!inRun) {
+      bool inNext = run + 1 < runCount && runs[run + 1].start <= offset &&
+                    (run + 2 == runCount || runs[run + 2].start > offset);
+      run = inNext ? run + 1 : findLineRun(chunk, offset);
+    }
+    lines[i] = runs[run].line;
+  }
 }
\ No newline at end of file
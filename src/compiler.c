@@ -1,20 +1,24 @@
 #include "compiler.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "memory.h"
+#include "peephole.h"
+#include "registers.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-// Global parser state.
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
+// Parser state, kept per thread so that VMs on different threads can compile at the same time.
+THREAD_LOCAL Parser parser;
+THREAD_LOCAL Compiler* current = NULL;
+THREAD_LOCAL ClassCompiler* currentClass = NULL;
 
 // Retrieves the current chunk being compiled.
 static Chunk* currentChunk() { return &current->function->chunk; }
@@ -95,8 +99,90 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
+static void emitInlineCache(int instructionOffset) {
+  int cache = addInlineCache(&currentChunk()->caches, instructionOffset);
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+  }
+
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+static void emitPropertyOp(uint8_t instruction, uint8_t name) {
+  int offset = currentChunk()->count;
+  emitBytes(instruction, name);
+  emitInlineCache(offset);
+}
+
+static void emitInvoke(uint8_t name, uint8_t argCount) {
+  int offset = currentChunk()->count;
+  emitBytes(OP_INVOKE, name);
+  emitByte(argCount);
+  emitInlineCache(offset);
+}
+
+static void recordTrailingGet(int start, uint8_t instruction, uint8_t name) {
+  current->trailingGetStart = start;
+  current->trailingGetEnd = currentChunk()->count;
+  current->trailingGetOp = instruction;
+  current->trailingGetName = name;
+}
+
+static void recordConstant(int start, int index, Value value) {
+  current->trailingConstant.start = start;
+  current->trailingConstant.end = currentChunk()->count;
+  current->trailingConstant.index = index;
+  current->trailingConstant.value = value;
+}
+
 static void emitConstant(Value value) {
-  writeConstant(currentChunk(), value, parser.previous.line);
+  Chunk* chunk = currentChunk();
+  int start = chunk->count;
+  int count = chunk->constants.count;
+  int index = writeConstant(chunk, &current->constants, value, parser.previous.line);
+  // A reused constant may have other users, so folding must leave it in the pool.
+  recordConstant(start, chunk->constants.count > count ? index : -1, value);
+}
+
+// Emits any literal value, using the dedicated opcodes for nil and the booleans.
+static void emitLiteral(Value value) {
+  int start = currentChunk()->count;
+  if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(value);
+    return;
+  }
+  recordConstant(start, -1, value);
+}
+
+static bool endsWithConstant() { return current->trailingConstant.end == currentChunk()->count; }
+
+// Takes back the literal that ends the code, along with the constant pool entry it added, if any.
+static void dropConstant() {
+  Chunk* chunk = currentChunk();
+  TrailingConstant* constant = &current->trailingConstant;
+  if (constant->index != -1 && constant->index == chunk->constants.count - 1) {
+    chunk->constants.count--;
+  }
+  truncateChunk(chunk, constant->start);
+  constant->end = -1;
+}
+
+// Throws away code compiled for a branch that can never run, including its pending breaks.
+static void discardCode(int start) {
+  if (endsWithConstant() && current->trailingConstant.start >= start) dropConstant();
+  truncateChunk(currentChunk(), start);
+
+  JumpList* breaks = currentBreakJumps();
+  while (breaks->count > 0 && breaks->jumps[breaks->count - 1].offset >= start) {
+    breaks->count--;
+  }
+
+  current->trailingGetEnd = -1;
+  current->trailingConstant.end = -1;
 }
 
 static void emitReturn() {
@@ -113,12 +199,16 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  initConstantIndex(&compiler->constants);
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
   compiler->currentLoopStart = -1;
   compiler->currentLoopEnd = -1;
   compiler->currentLoopDepth = 0;
   initJumpList(&compiler->breakJumps);
+  compiler->trailingGetStart = -1;
+  compiler->trailingGetEnd = -1;
+  compiler->trailingConstant.end = -1;
   compiler->localCapacity = UINT8_COUNT;
   compiler->locals = GROW_ARRAY(Local, NULL, 0, compiler->localCapacity);
   compiler->upvalueCapacity = UINT8_COUNT;
@@ -127,6 +217,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   current = compiler;
   if (type != TYPE_SCRIPT) {
     current->function->name = copyString(parser.previous.start, parser.previous.length);
+    WRITE_BARRIER_OBJ(current->function->name);
   }
 
   Local* local = &current->locals[current->localCount++];
@@ -142,11 +233,22 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   }
 }
 
+// Releases the compiler's own arrays once its function and upvalue list have been emitted.
+static void freeCompiler(Compiler* compiler) {
+  freeConstantIndex(&compiler->constants);
+  FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+  FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+}
+
 static ObjFunction* endCompiler() {
   emitReturn();
   freeJumpList(currentBreakJumps());
   ObjFunction* function = current->function;
 
+  if (vm->registers && !parser.hadError) translateToRegisters(currentChunk());
+  if (vm->peephole && !parser.hadError) optimizeChunk(currentChunk());
+  if (!parser.hadError) function->maxSlots = maxStackDepth(currentChunk(), function->arity + 1);
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
@@ -179,7 +281,15 @@ static void endScope() {
 //< Scope Management Functions
 //> Constants Table Functions
 
-static uint8_t makeConstant(Value value) { return (uint8_t)addConstant(currentChunk(), value); }
+// Adds a constant for an instruction with a one-byte operand, reusing an equal one if there is.
+static uint8_t makeConstant(Value value) {
+  int constant = internConstant(currentChunk(), &current->constants, value);
+  if (constant > UINT8_MAX) {
+    error("Too many constants in one chunk.");
+    return 0;
+  }
+  return (uint8_t)constant;
+}
 
 //< Constants Table Functions
 
@@ -195,6 +305,11 @@ static void patchJump(int offset) {
 
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
+
+  // A jump now lands on the end of the code, so whatever ends there is no longer a single get or
+  // literal.
+  current->trailingGetEnd = -1;
+  current->trailingConstant.end = -1;
 }
 
 void patchJumps(JumpList* list, int depth, int target) {
@@ -211,6 +326,8 @@ void patchJumps(JumpList* list, int depth, int target) {
     currentChunk()->code[list->jumps[i].offset] = (jumpOffset >> 8) & 0xff;
     currentChunk()->code[list->jumps[i].offset + 1] = jumpOffset & 0xff;
   }
+  current->trailingGetEnd = -1;
+  current->trailingConstant.end = -1;
 }
 
 static int emitJump(uint8_t instruction) {
@@ -268,7 +385,17 @@ static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
 
 static void block() {
   while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    bool terminates = check(TOKEN_RETURN) || check(TOKEN_BREAK) || check(TOKEN_CONTINUE);
     declaration();
+
+    if (terminates) {
+      // Nothing after a return, break or continue in the same block can run.
+      int dead = currentChunk()->count;
+      while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        declaration();
+      }
+      discardCode(dead);
+    }
   }
 
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
@@ -281,6 +408,16 @@ static uint8_t identifierConstant(Token* name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+static uint16_t identifierGlobal(Token* name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+
+  return (uint16_t)slot;
+}
+
 static bool identifiersEqual(Token* a, Token* b) {
   if (a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
@@ -345,6 +482,7 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
+    compiler->enclosing->function->capturesLocals = true;
     return addUpvalue(compiler, (uint8_t)local, true);
   }
 
@@ -375,13 +513,13 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static uint16_t parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable();
   if (current->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return identifierGlobal(&parser.previous);
 }
 
 static void markInitialized() {
@@ -389,13 +527,14 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitByte(OP_DEFINE_GLOBAL);
+  emitBytes((global >> 8) & 0xff, global & 0xff);
 }
 
 //< Variable Parsing Functions
@@ -414,7 +553,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      uint16_t constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -430,6 +569,7 @@ static void function(FunctionType type) {
     emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
     emitByte(compiler.upvalues[i].index);
   }
+  freeCompiler(&compiler);
 }
 
 static void method() {
@@ -446,7 +586,7 @@ static void method() {
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  uint16_t global = parseVariable("Expect function name.");
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
@@ -496,8 +636,10 @@ static void super_(bool canAssign __attribute__((unused))) {
     emitBytes(OP_SUPER_INVOKE, name);
     emitByte(argCount);
   } else {
+    int start = currentChunk()->count;
     namedVariable(syntheticToken("super"), false);
     emitBytes(OP_GET_SUPER, name);
+    recordTrailingGet(start, OP_GET_SUPER, name);
   }
 }
 
@@ -508,7 +650,7 @@ static void classDeclaration() {
   declareVariable();
 
   emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  defineVariable(current->scopeDepth > 0 ? 0 : identifierGlobal(&className));
 
   ClassCompiler classCompiler;
   classCompiler.enclosing = currentClass;
@@ -568,9 +710,10 @@ static void or_(bool canAssign __attribute__((unused))) {
   patchJump(endJump);
 }
 
-static void elifStatement();
+static bool isFalsey(Value value) { return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)); }
 
-static void elifStatement() {
+// Compiles an `if` or `elif` statement, starting at its condition.
+static void ifStatement() {
   if (!tryConsume(TOKEN_LEFT_PAREN)) {
     expression();
     consume(TOKEN_THEN, "Expect 'then' after expression without parantheses.");
@@ -579,31 +722,23 @@ static void elifStatement() {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
   }
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
-
-  int elseJump = emitJump(OP_JUMP);
-
-  patchJump(thenJump);
-  emitByte(OP_POP);
+  if (endsWithConstant()) {
+    // The condition is a literal, so only one arm can ever run.
+    bool taken = !isFalsey(current->trailingConstant.value);
+    dropConstant();
 
-  if (match(TOKEN_ELIF)) {
-    elifStatement();
-  } else if (match(TOKEN_ELSE)) {
+    int dead = currentChunk()->count;
     statement();
-  }
+    if (!taken) discardCode(dead);
 
-  patchJump(elseJump);
-}
-
-static void ifStatement() {
-  if (!tryConsume(TOKEN_LEFT_PAREN)) {
-    expression();
-    consume(TOKEN_THEN, "Expect 'then' after expression without parantheses.");
-  } else {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    dead = currentChunk()->count;
+    if (match(TOKEN_ELIF)) {
+      ifStatement();
+    } else if (match(TOKEN_ELSE)) {
+      statement();
+    }
+    if (taken) discardCode(dead);
+    return;
   }
 
   int thenJump = emitJump(OP_JUMP_IF_FALSE);
@@ -616,7 +751,7 @@ static void ifStatement() {
   emitByte(OP_POP);
 
   if (match(TOKEN_ELIF)) {
-    elifStatement();
+    ifStatement();
   } else if (match(TOKEN_ELSE)) {
     statement();
   }
@@ -628,7 +763,7 @@ static void ifStatement() {
 //> Parsing function for statements and declarations
 
 static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+  uint16_t global = parseVariable("Expect variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -743,16 +878,47 @@ static void forStatement() {
   endScope();
 }
 
-bool fallthroughMode = false;
-int fallJump = -1;
+THREAD_LOCAL bool fallthroughMode = false;
+THREAD_LOCAL int fallJump = -1;
 
 // switchCase → "case" expression ":" statement* ;
-static int switchCase() {
+//
+// `subject` is the switch value when it is a literal, and `decided` is set once an arm is known to
+// match it; arms that can then never be entered are compiled and discarded.
+static int switchCase(const Value* subject, bool* decided) {
   consume(TOKEN_CASE, "Expected 'case' here.");
+  int caseStart = currentChunk()->count;
   emitByte(OP_DUP);
   expression();
   consume(TOKEN_COLON, "Expect ':' after case expression.");
 
+  bool literalCase = subject != NULL && endsWithConstant() &&
+                     current->trailingConstant.start == caseStart + 1;
+  if (!fallthroughMode && (*decided || literalCase)) {
+    bool matches = !*decided && valuesEqual(*subject, current->trailingConstant.value);
+    discardCode(caseStart);
+
+    int bodyStart = currentChunk()->count;
+    while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) && !check(TOKEN_RIGHT_BRACE) &&
+           !check(TOKEN_FALLTHROUGH)) {
+      statement();
+    }
+
+    if (!matches) {
+      discardCode(bodyStart);
+      tryConsume(TOKEN_FALLTHROUGH);  // An arm that never runs never falls through either.
+      return -1;
+    }
+
+    *decided = true;
+    if (tryConsume(TOKEN_FALLTHROUGH)) {
+      fallthroughMode = true;
+      fallJump = emitJump(OP_JUMP);
+      return -1;
+    }
+    return emitJump(OP_JUMP);
+  }
+
   emitByte(OP_EQUAL);
   int caseFalseJump = emitJump(OP_JUMP_IF_FALSE);
   emitByte(OP_POP);
@@ -785,9 +951,13 @@ static int switchCase() {
 }
 
 // defaultCase → "default" ":" statement* ;
-static void defaultCase() {
+static void defaultCase(bool decided) {
   consume(TOKEN_COLON, "Expect ':' after 'default'.");
 
+  // Once an arm is known to match, the default is only reachable by falling through into it.
+  bool dead = decided && !fallthroughMode;
+  int bodyStart = currentChunk()->count;
+
   if (fallthroughMode) {
     patchJump(fallJump);
     fallthroughMode = false;
@@ -796,6 +966,8 @@ static void defaultCase() {
   while (!check(TOKEN_RIGHT_BRACE)) {
     statement();
   }
+
+  if (dead) discardCode(bodyStart);
 }
 
 // switchStmt → "switch" "(" expression ")" "{" switchCase* defaultCase? "}" ;
@@ -803,6 +975,9 @@ static void switchStatement() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after switch value.");
+  Value subject = current->trailingConstant.value;
+  bool literalSubject = endsWithConstant();
+  bool decided = false;
 
   consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
 
@@ -810,12 +985,12 @@ static void switchStatement() {
   initJumpList(&caseJumps);
 
   while (check(TOKEN_CASE)) {
-    int caseEndJump = switchCase();
+    int caseEndJump = switchCase(literalSubject ? &subject : NULL, &decided);
     if (caseEndJump != -1) addJump(&caseJumps, *currentLoopDepth(), caseEndJump);
   }
 
   if (match(TOKEN_DEFAULT)) {
-    defaultCase();
+    defaultCase(decided);
   }
 
   patchJumps(&caseJumps, *currentLoopDepth(), currentChunk()->count);
@@ -909,11 +1084,96 @@ static void statement() {
 //< Parsing function for statements and declarations
 //> Parsing primitives
 
+// Computes `a <operator> b` at compile time. Returns false, leaving the work to the VM, whenever
+// the operation would fail or behave differently at runtime.
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result) {
+  switch (operatorType) {
+    case TOKEN_BANG_EQUAL:
+      *result = BOOL_VAL(!valuesEqual(a, b));
+      return true;
+    case TOKEN_EQUAL_EQUAL:
+      *result = BOOL_VAL(valuesEqual(a, b));
+      return true;
+    case TOKEN_PLUS:
+      if (IS_STRING(a) && IS_STRING(b)) {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        int length = left->length + right->length;
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(takeString(chars, length));
+        return true;
+      }
+      break;
+    default:
+      break;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+
+  switch (operatorType) {
+    case TOKEN_GREATER:
+      *result = BOOL_VAL(x > y);
+      return true;
+    case TOKEN_GREATER_EQUAL:
+      *result = BOOL_VAL(!(x < y));
+      return true;
+    case TOKEN_LESS:
+      *result = BOOL_VAL(x < y);
+      return true;
+    case TOKEN_LESS_EQUAL:
+      *result = BOOL_VAL(!(x > y));
+      return true;
+    case TOKEN_PLUS:
+      *result = COMPACT_NUMBER_VAL(x + y);
+      return true;
+    case TOKEN_MINUS:
+      *result = COMPACT_NUMBER_VAL(x - y);
+      return true;
+    case TOKEN_STAR:
+      *result = COMPACT_NUMBER_VAL(x * y);
+      return true;
+    case TOKEN_SLASH:
+      *result = COMPACT_NUMBER_VAL(x / y);
+      return true;
+    case TOKEN_PERCENT: {
+      // Mirrors the VM's rounding to int; a zero divisor is left to fail at runtime.
+      if (x <= INT_MIN || x >= INT_MAX || y <= INT_MIN || y >= INT_MAX) return false;
+      int divisor = (int)(y + 0.5);
+      if (divisor == 0) return false;
+      *result = INT_VAL((int)(x + 0.5) % divisor);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
 static void binary(bool canAssign __attribute__((unused))) {
   TokenType operatorType = parser.previous.type;
   ParseRule* rule = getRule(operatorType);
+
+  bool literalLeft = endsWithConstant();
+  TrailingConstant left = current->trailingConstant;
+
   parsePrecedence((Precedence)(rule->precedence + 1));  // Parse the RHS with higher precedence.
 
+  Value folded;
+  if (literalLeft && endsWithConstant() && current->trailingConstant.start == left.end &&
+      foldBinary(operatorType, left.value, current->trailingConstant.value, &folded)) {
+    push(folded);
+    dropConstant();
+    current->trailingConstant = left;
+    dropConstant();
+    emitLiteral(folded);
+    pop();
+    return;
+  }
+
   switch (operatorType) {
     case TOKEN_BANG_EQUAL:
       emitBytes(OP_EQUAL, OP_NOT);
@@ -953,7 +1213,26 @@ static void binary(bool canAssign __attribute__((unused))) {
   }
 }
 
+// A call whose callee turns out to be a plain property read, as in `(a.b)(x)` or `(super.m)(x)`,
+// would otherwise allocate a bound method only to call it. Take the get back and invoke instead.
 static void call(bool canAssign __attribute__((unused))) {
+  if (current->trailingGetEnd == currentChunk()->count) {
+    uint8_t instruction = current->trailingGetOp;
+    uint8_t name = current->trailingGetName;
+    truncateChunk(currentChunk(), current->trailingGetStart);
+    current->trailingGetEnd = -1;
+
+    uint8_t argCount = argumentList();
+    if (instruction == OP_GET_PROPERTY) {
+      emitInvoke(name, argCount);
+    } else {
+      namedVariable(syntheticToken("super"), false);
+      emitBytes(OP_SUPER_INVOKE, name);
+      emitByte(argCount);
+    }
+    return;
+  }
+
   uint8_t argCount = argumentList();
   emitBytes(OP_CALL, argCount);
 }
@@ -964,17 +1243,64 @@ static void dot(bool canAssign) {
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
+    emitPropertyOp(OP_SET_PROPERTY, name);
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
-    emitByte(argCount);
+    emitInvoke(name, argCount);
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    int start = currentChunk()->count;
+    emitPropertyOp(OP_GET_PROPERTY, name);
+    recordTrailingGet(start, OP_GET_PROPERTY, name);
+  }
+}
+
+static void listLiteral(bool canAssign __attribute__((unused))) {
+  // Elements are appended one at a time so the list never needs more than one stack slot.
+  emitByte(OP_LIST);
+  if (!check(TOKEN_RIGHT_BRACKET)) {
+    do {
+      if (check(TOKEN_RIGHT_BRACKET)) break;  // Allow a trailing comma.
+      expression();
+      emitByte(OP_LIST_APPEND);
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+}
+
+static void subscript(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_INDEX_SET);
+  } else {
+    emitByte(OP_INDEX_GET);
   }
 }
 
 static void ternary(bool canAssign __attribute__((unused))) {
+  if (endsWithConstant()) {
+    // A literal condition picks its branch at compile time; the other one is parsed and dropped.
+    bool taken = !isFalsey(current->trailingConstant.value);
+    dropConstant();
+
+    int dead = currentChunk()->count;
+    parsePrecedence(PREC_TERNARY);
+    if (!taken) discardCode(dead);
+
+    consume(TOKEN_COLON, "Expect ':' after true branch of ternary operator.");
+
+    TrailingConstant live = current->trailingConstant;
+    dead = currentChunk()->count;
+    parsePrecedence(PREC_ASSIGNMENT);
+    if (taken) {
+      discardCode(dead);
+      if (live.end == dead) current->trailingConstant = live;
+    }
+    return;
+  }
+
   int thenJump = emitJump(OP_JUMP_IF_FALSE);
   emitByte(OP_POP);
 
@@ -995,13 +1321,13 @@ static void ternary(bool canAssign __attribute__((unused))) {
 static void literal(bool canAssign __attribute__((unused))) {
   switch (parser.previous.type) {
     case TOKEN_FALSE:
-      emitByte(OP_FALSE);
+      emitLiteral(FALSE_VAL);
       break;
     case TOKEN_NIL:
-      emitByte(OP_NIL);
+      emitLiteral(NIL_VAL);
       break;
     case TOKEN_TRUE:
-      emitByte(OP_TRUE);
+      emitLiteral(TRUE_VAL);
       break;
     default:
       return;  // Unreachable.
@@ -1014,8 +1340,20 @@ static void grouping(bool canAssign __attribute__((unused))) {
 }
 
 static void number(bool canAssign __attribute__((unused))) {
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+  // The source need not be NUL-terminated, so strtod gets a terminated copy of the literal.
+  char buffer[64];
+  int length = parser.previous.length;
+  char* text = length < (int)sizeof(buffer) ? buffer : (char*)malloc(length + 1);
+  if (text == NULL) {
+    fprintf(stderr, "Not enough memory to read a number literal.\n");
+    exit(74);
+  }
+  memcpy(text, parser.previous.start, length);
+  text[length] = '\0';
+  double value = strtod(text, NULL);
+  if (text != buffer) free(text);
+  // Integral literals become small integers, so loop counters start out on the VM's int paths.
+  emitConstant(COMPACT_NUMBER_VAL(value));
 }
 
 static void string(bool canAssign __attribute__((unused))) {
@@ -1032,16 +1370,22 @@ static void namedVariable(Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = identifierGlobal(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
+  uint8_t op = getOp;
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    op = setOp;
+  }
+
+  if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL) {
+    emitByte(op);
+    emitBytes((arg >> 8) & 0xff, arg & 0xff);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitBytes(op, (uint8_t)arg);
   }
 }
 
@@ -1051,6 +1395,20 @@ static void unary(bool canAssign __attribute__((unused))) {
   TokenType operatorType = parser.previous.type;
   parsePrecedence(PREC_UNARY);
 
+  if (endsWithConstant()) {
+    Value operand = current->trailingConstant.value;
+    if (operatorType == TOKEN_BANG) {
+      dropConstant();
+      emitLiteral(BOOL_VAL(isFalsey(operand)));
+      return;
+    }
+    if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+      dropConstant();
+      emitLiteral(COMPACT_NUMBER_VAL(-AS_NUMBER(operand)));
+      return;
+    }
+  }
+
   switch (operatorType) {
     case TOKEN_BANG:
       emitByte(OP_NOT);
@@ -1130,6 +1488,7 @@ ParseRule rules[] = {
     [TOKEN_IDENTIFIER]    = {variable, NULL,    PREC_NONE},
     [TOKEN_IF]            = {NULL,     NULL,    PREC_NONE},
     [TOKEN_LEFT_BRACE]    = {NULL,     NULL,    PREC_NONE},
+    [TOKEN_LEFT_BRACKET]  = {listLiteral, subscript, PREC_CALL},
     [TOKEN_LEFT_PAREN]    = {grouping, call,    PREC_CALL},
     [TOKEN_LESS]          = {NULL,     binary,  PREC_COMPARISON},
     [TOKEN_LESS_EQUAL]    = {NULL,     binary,  PREC_COMPARISON},
@@ -1143,6 +1502,7 @@ ParseRule rules[] = {
     [TOKEN_QUESTION]      = {NULL,     ternary, PREC_TERNARY},
     [TOKEN_RETURN]        = {NULL,     NULL,    PREC_NONE},
     [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,    PREC_NONE},
+    [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,    PREC_NONE},
     [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,    PREC_NONE},
     [TOKEN_SEMICOLON]     = {NULL,     NULL,    PREC_NONE},
     [TOKEN_SLASH]         = {NULL,     binary,  PREC_FACTOR},
@@ -1162,8 +1522,8 @@ static ParseRule* getRule(TokenType type) { return &rules[type]; }
 //< Parse Rules and Operator Precedence Table
 //> Main Compiler Function
 
-ObjFunction* compile(const char* source) {
-  initScanner(source);
+// Compiles the script the scanner has been set up with.
+static ObjFunction* compileScript() {
   Compiler compiler;
   initCompiler(&compiler, TYPE_SCRIPT);
 
@@ -1174,12 +1534,29 @@ ObjFunction* compile(const char* source) {
 
   while (!match(TOKEN_EOF)) {
     declaration();
+    // Nothing refers to the source of a finished top-level declaration any more.
+    parser.current.start = discardSource(parser.current.start);
   }
 
   ObjFunction* function = endCompiler();
+  freeCompiler(&compiler);
   return parser.hadError ? NULL : function;
 }
 
+ObjFunction* compile(const char* source) { return compileBuffer(source, strlen(source)); }
+
+ObjFunction* compileBuffer(const char* source, size_t length) {
+  initScanner(source, length);
+  return compileScript();
+}
+
+ObjFunction* compileStream(FILE* file) {
+  initStreamScanner(file);
+  ObjFunction* function = compileScript();
+  freeScanner();
+  return function;
+}
+
 //< Main Compiler Functions
 //> Garbage Collection
 
@@ -1,9 +1,12 @@
 #include "debug.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 
+#include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
@@ -19,6 +22,13 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t first = chunk->code[offset + 1];
+  uint8_t second = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, first, second);
+  return offset + 3;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   uint8_t argCount = chunk->code[offset + 2];
@@ -28,6 +38,25 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 3;
 }
 
+static int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 5;
+}
+
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 4;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
   jump |= chunk->code[offset + 2];
@@ -55,6 +84,43 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+  uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+  printf("%-16s %4d '", name, slot);
+  if (slot < vm->globalNames.count) printValue(vm->globalNames.values[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
+// Register arithmetic: destination and left slots, then a slot or, for the _RK forms, a constant.
+static int registerInstruction(const char* name, bool constant, Chunk* chunk, int offset) {
+  uint8_t destination = chunk->code[offset + 1];
+  uint8_t left = chunk->code[offset + 2];
+  uint8_t right = chunk->code[offset + 3];
+  printf("%-16s %4d %4d %4d", name, destination, left, right);
+  if (constant) {
+    printf(" '");
+    printValue(chunk->constants.values[right]);
+    printf("'");
+  }
+  printf("\n");
+  return offset + 4;
+}
+
+static int registerJumpInstruction(const char* name, bool constant, Chunk* chunk, int offset) {
+  uint8_t left = chunk->code[offset + 1];
+  uint8_t right = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+  printf("%-16s %4d %4d", name, left, right);
+  if (constant) {
+    printf(" '");
+    printValue(chunk->constants.values[right]);
+    printf("'");
+  }
+  printf(" %4d -> %d\n", offset, offset + 5 + jump);
+  return offset + 5;
+}
+
 static int simpleInstruction(const char* name, int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -89,9 +155,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_SET_LOCAL:
       return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_GET_UPVALUE:
       return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
@@ -99,11 +165,19 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_GET_SUPER:
       return constantInstruction("OP_GET_SUPER", chunk, offset);
     case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+      return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_LIST:
+      return simpleInstruction("OP_LIST", offset);
+    case OP_LIST_APPEND:
+      return simpleInstruction("OP_LIST_APPEND", offset);
+    case OP_INDEX_GET:
+      return simpleInstruction("OP_INDEX_GET", offset);
+    case OP_INDEX_SET:
+      return simpleInstruction("OP_INDEX_SET", offset);
     case OP_EQUAL:
       return simpleInstruction("OP_EQUAL", offset);
     case OP_GREATER:
@@ -160,15 +234,246 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_METHOD:
       return constantInstruction("OP_METHOD", chunk, offset);
     case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
     case OP_INHERIT:
       return simpleInstruction("OP_INHERIT", offset);
     case OP_RETURN:
       return simpleInstruction("OP_RETURN", offset);
+    case OP_GET_LOCAL_GET_LOCAL:
+      return twoByteInstruction("OP_GET_LOCAL_GET_LOCAL", chunk, offset);
+    case OP_INC_LOCAL: {
+      uint8_t slot = chunk->code[offset + 1];
+      uint8_t constant = chunk->code[offset + 2];
+      printf("%-16s %4d %4d '", "OP_INC_LOCAL", slot, constant);
+      printValue(chunk->constants.values[constant]);
+      printf("'\n");
+      return offset + 3;
+    }
+    case OP_ADD_CONST:
+      return constantInstruction("OP_ADD_CONST", chunk, offset);
+    case OP_LESS_JUMP_IF_FALSE:
+      return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_NOT_JUMP_IF_FALSE:
+      return jumpInstruction("OP_NOT_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_MOVE:
+      return twoByteInstruction("OP_MOVE", chunk, offset);
+    case OP_LOAD_CONSTANT: {
+      uint8_t slot = chunk->code[offset + 1];
+      uint8_t constant = chunk->code[offset + 2];
+      printf("%-16s %4d %4d '", "OP_LOAD_CONSTANT", slot, constant);
+      printValue(chunk->constants.values[constant]);
+      printf("'\n");
+      return offset + 3;
+    }
+    case OP_ADD_RR:
+      return registerInstruction("OP_ADD_RR", false, chunk, offset);
+    case OP_ADD_RK:
+      return registerInstruction("OP_ADD_RK", true, chunk, offset);
+    case OP_SUBTRACT_RR:
+      return registerInstruction("OP_SUBTRACT_RR", false, chunk, offset);
+    case OP_SUBTRACT_RK:
+      return registerInstruction("OP_SUBTRACT_RK", true, chunk, offset);
+    case OP_MULTIPLY_RR:
+      return registerInstruction("OP_MULTIPLY_RR", false, chunk, offset);
+    case OP_MULTIPLY_RK:
+      return registerInstruction("OP_MULTIPLY_RK", true, chunk, offset);
+    case OP_DIVIDE_RR:
+      return registerInstruction("OP_DIVIDE_RR", false, chunk, offset);
+    case OP_DIVIDE_RK:
+      return registerInstruction("OP_DIVIDE_RK", true, chunk, offset);
+    case OP_LESS_RR_JUMP:
+      return registerJumpInstruction("OP_LESS_RR_JUMP", false, chunk, offset);
+    case OP_LESS_RK_JUMP:
+      return registerJumpInstruction("OP_LESS_RK_JUMP", true, chunk, offset);
+    case OP_LESS_EQUAL_RR_JUMP:
+      return registerJumpInstruction("OP_LESS_EQUAL_RR_JUMP", false, chunk, offset);
+    case OP_LESS_EQUAL_RK_JUMP:
+      return registerJumpInstruction("OP_LESS_EQUAL_RK_JUMP", true, chunk, offset);
+    case OP_GREATER_RR_JUMP:
+      return registerJumpInstruction("OP_GREATER_RR_JUMP", false, chunk, offset);
+    case OP_GREATER_RK_JUMP:
+      return registerJumpInstruction("OP_GREATER_RK_JUMP", true, chunk, offset);
+    case OP_GREATER_EQUAL_RR_JUMP:
+      return registerJumpInstruction("OP_GREATER_EQUAL_RR_JUMP", false, chunk, offset);
+    case OP_GREATER_EQUAL_RK_JUMP:
+      return registerJumpInstruction("OP_GREATER_EQUAL_RK_JUMP", true, chunk, offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
   }
-}
\ No newline at end of file
+}
+
+const char* opcodeName(uint8_t instruction) {
+  static const char* names[OPCODE_COUNT] = {
+#define OPCODE_NAME(name) [name] = #name
+      OPCODE_NAME(OP_CONSTANT),            OPCODE_NAME(OP_CONSTANT_LONG),
+      OPCODE_NAME(OP_CLOSURE),             OPCODE_NAME(OP_CLOSE_UPVALUE),
+      OPCODE_NAME(OP_CLASS),               OPCODE_NAME(OP_METHOD),
+      OPCODE_NAME(OP_INVOKE),              OPCODE_NAME(OP_SUPER_INVOKE),
+      OPCODE_NAME(OP_INHERIT),             OPCODE_NAME(OP_DUP),
+      OPCODE_NAME(OP_NIL),                 OPCODE_NAME(OP_TRUE),
+      OPCODE_NAME(OP_FALSE),               OPCODE_NAME(OP_POP),
+      OPCODE_NAME(OP_GET_LOCAL),           OPCODE_NAME(OP_SET_LOCAL),
+      OPCODE_NAME(OP_GET_PROPERTY),        OPCODE_NAME(OP_SET_PROPERTY),
+      OPCODE_NAME(OP_GET_UPVALUE),         OPCODE_NAME(OP_SET_UPVALUE),
+      OPCODE_NAME(OP_GET_SUPER),           OPCODE_NAME(OP_GET_GLOBAL),
+      OPCODE_NAME(OP_SET_GLOBAL),          OPCODE_NAME(OP_DEFINE_GLOBAL),
+      OPCODE_NAME(OP_LIST),                OPCODE_NAME(OP_LIST_APPEND),
+      OPCODE_NAME(OP_INDEX_GET),           OPCODE_NAME(OP_INDEX_SET),
+      OPCODE_NAME(OP_EQUAL),               OPCODE_NAME(OP_GREATER),
+      OPCODE_NAME(OP_LESS),                OPCODE_NAME(OP_ADD),
+      OPCODE_NAME(OP_SUBTRACT),            OPCODE_NAME(OP_MULTIPLY),
+      OPCODE_NAME(OP_DIVIDE),              OPCODE_NAME(OP_MODULO),
+      OPCODE_NAME(OP_NOT),                 OPCODE_NAME(OP_NEGATE),
+      OPCODE_NAME(OP_PRINT),               OPCODE_NAME(OP_JUMP),
+      OPCODE_NAME(OP_JUMP_IF_FALSE),       OPCODE_NAME(OP_JUMP_IF_TRUE),
+      OPCODE_NAME(OP_LOOP),                OPCODE_NAME(OP_CALL),
+      OPCODE_NAME(OP_RETURN),              OPCODE_NAME(OP_GET_LOCAL_GET_LOCAL),
+      OPCODE_NAME(OP_INC_LOCAL),           OPCODE_NAME(OP_ADD_CONST),
+      OPCODE_NAME(OP_LESS_JUMP_IF_FALSE),  OPCODE_NAME(OP_NOT_JUMP_IF_FALSE),
+      OPCODE_NAME(OP_MOVE),                OPCODE_NAME(OP_LOAD_CONSTANT),
+      OPCODE_NAME(OP_ADD_RR),              OPCODE_NAME(OP_ADD_RK),
+      OPCODE_NAME(OP_SUBTRACT_RR),         OPCODE_NAME(OP_SUBTRACT_RK),
+      OPCODE_NAME(OP_MULTIPLY_RR),         OPCODE_NAME(OP_MULTIPLY_RK),
+      OPCODE_NAME(OP_DIVIDE_RR),           OPCODE_NAME(OP_DIVIDE_RK),
+      OPCODE_NAME(OP_LESS_RR_JUMP),        OPCODE_NAME(OP_LESS_RK_JUMP),
+      OPCODE_NAME(OP_LESS_EQUAL_RR_JUMP),  OPCODE_NAME(OP_LESS_EQUAL_RK_JUMP),
+      OPCODE_NAME(OP_GREATER_RR_JUMP),     OPCODE_NAME(OP_GREATER_RK_JUMP),
+      OPCODE_NAME(OP_GREATER_EQUAL_RR_JUMP), OPCODE_NAME(OP_GREATER_EQUAL_RK_JUMP),
+#undef OPCODE_NAME
+  };
+
+  return instruction < OPCODE_COUNT ? names[instruction] : "?";
+}
+
+const char* objTypeName(ObjType type) {
+  static const char* names[OBJ_TYPE_COUNT] = {
+      [OBJ_FUNCTION] = "function",      [OBJ_NATIVE] = "native",
+      [OBJ_CLOSURE] = "closure",        [OBJ_CLASS] = "class",
+      [OBJ_INSTANCE] = "instance",      [OBJ_BOUND_METHOD] = "bound_method",
+      [OBJ_UPVALUE] = "upvalue",        [OBJ_STRING] = "string",
+      [OBJ_SHAPE] = "shape",            [OBJ_LIST] = "list",
+      [OBJ_ROPE] = "rope",              [OBJ_STRING_BUILDER] = "string_builder",
+  };
+  return type < OBJ_TYPE_COUNT ? names[type] : "?";
+}
+
+static void printFunctionCaches(Obj* object) {
+  if (object->type != OBJ_FUNCTION) return;
+
+  ObjFunction* function = (ObjFunction*)object;
+  Chunk* chunk = &function->chunk;
+  for (int i = 0; i < chunk->caches.count; i++) {
+    InlineCache* cache = &chunk->caches.caches[i];
+    uint64_t total = cache->hits + cache->misses;
+    if (total == 0) continue;
+
+    ObjString* name = AS_STRING(chunk->constants.values[chunk->code[cache->offset + 1]]);
+    fprintf(stderr, "%-20s %5d %-16s %-16s %10llu %10llu %10llu %7d %6.2f%%\n",
+            function->name != NULL ? function->name->chars : "<script>",
+            getLine(chunk, cache->offset), opcodeName(chunk->code[cache->offset]), name->chars,
+            (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+            (unsigned long long)cache->megamorphic, cache->count, 100.0 * cache->hits / total);
+  }
+}
+
+void printInlineCacheStats() {
+  fprintf(stderr, "== inline caches ==\n");
+  fprintf(stderr, "%-20s %5s %-16s %-16s %10s %10s %10s %7s %7s\n", "function", "line", "opcode",
+          "name", "hits", "misses", "megamorph", "shapes", "hit%");
+
+  forEachObject(printFunctionCaches);
+}
+
+void printAllocStats() {
+  fprintf(stderr, "== allocations ==\n");
+  fprintf(stderr, "%-20s %12s %14s\n", "opcode", "objects", "bytes");
+
+  for (int i = 0; i <= OPCODE_COUNT; i++) {
+    AllocCount* count = &vm->allocCounts[i];
+    if (count->objects == 0) continue;
+
+    fprintf(stderr, "%-20s %12llu %14llu\n", i == OPCODE_COUNT ? "(outside run)" : opcodeName(i),
+            (unsigned long long)count->objects, (unsigned long long)count->bytes);
+  }
+}
+
+static int compareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+void printGCStats() {
+  fprintf(stderr, "== garbage collector ==\n");
+  static const char* modes[] = {"stop-the-world", "incremental", "lazy sweep"};
+  fprintf(stderr, "mode: %s, marking threads: %d, cycles: %llu, pauses: %d\n", modes[vm->gcMode],
+          vm->gcThreads, (unsigned long long)vm->stats.gcCycles, vm->gcPauseCount);
+  if (vm->gcPauseCount == 0) return;
+
+  double* durations = (double*)malloc(sizeof(double) * vm->gcPauseCount);
+  if (durations == NULL) return;
+
+  double total = 0;
+  size_t reclaimed = 0;
+  for (int i = 0; i < vm->gcPauseCount; i++) {
+    durations[i] = vm->gcPauses[i].seconds;
+    total += durations[i];
+    reclaimed += vm->gcPauses[i].bytesReclaimed;
+  }
+  qsort(durations, vm->gcPauseCount, sizeof(double), compareDoubles);
+
+  int last = vm->gcPauseCount - 1;
+  fprintf(stderr, "%12s %12s %12s %12s %12s %14s\n", "total ms", "p50 us", "p90 us", "p99 us",
+          "max us", "reclaimed");
+  fprintf(stderr, "%12.3f %12.1f %12.1f %12.1f %12.1f %14zu\n", total * 1e3,
+          durations[last * 50 / 100] * 1e6, durations[last * 90 / 100] * 1e6,
+          durations[last * 99 / 100] * 1e6, durations[last] * 1e6, reclaimed);
+  free(durations);
+}
+
+static int compareCounts(const void* a, const void* b) {
+  uint64_t x = vm->stats.instructions[*(const int*)a];
+  uint64_t y = vm->stats.instructions[*(const int*)b];
+  return (x < y) - (x > y);
+}
+
+void printStats() {
+  VMStats* stats = &vm->stats;
+  fprintf(stderr, "== stats ==\n");
+  fprintf(stderr, "%-20s %12s %14s\n", "object type", "objects", "bytes");
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    if (stats->objectsAllocated[i] == 0) continue;
+    fprintf(stderr, "%-20s %12llu %14llu\n", objTypeName((ObjType)i),
+            (unsigned long long)stats->objectsAllocated[i],
+            (unsigned long long)stats->bytesAllocated[i]);
+  }
+
+  fprintf(stderr, "gc: %llu cycles, %llu pauses, %.3f ms total, %.1f us max, %llu bytes freed\n",
+          (unsigned long long)stats->gcCycles, (unsigned long long)stats->gcPauses,
+          stats->gcPauseSeconds * 1e3, stats->gcMaxPauseSeconds * 1e6,
+          (unsigned long long)stats->gcBytesFreed);
+  fprintf(stderr, "tables: %llu lookups, %.2f probes per lookup, %llu resizes\n",
+          (unsigned long long)stats->tableLookups,
+          stats->tableLookups == 0 ? 0.0 : 1.0 + (double)stats->tableProbes / stats->tableLookups,
+          (unsigned long long)stats->tableResizes);
+  fprintf(stderr, "frames pushed: %llu\n", (unsigned long long)stats->framesPushed);
+
+  int opcodes[OPCODE_COUNT];
+  uint64_t total = 0;
+  for (int i = 0; i < OPCODE_COUNT; i++) {
+    opcodes[i] = i;
+    total += stats->instructions[i];
+  }
+  if (total == 0) return;
+
+  qsort(opcodes, OPCODE_COUNT, sizeof(int), compareCounts);
+  fprintf(stderr, "%-24s %14s %8s\n", "opcode", "executed", "share");
+  for (int i = 0; i < OPCODE_COUNT && stats->instructions[opcodes[i]] > 0; i++) {
+    uint64_t count = stats->instructions[opcodes[i]];
+    fprintf(stderr, "%-24s %14llu %7.1f%%\n", opcodeName((uint8_t)opcodes[i]),
+            (unsigned long long)count, 100.0 * count / total);
+  }
+}
@@ -0,0 +1,82 @@
+#ifndef corelox_bytecode_h
+#define corelox_bytecode_h
+
+#include "object.h"
+
+/**
+ * @file bytecode.h
+ * @brief Binary cache files holding a compiled script.
+ *
+ * A cache file stores the top-level `ObjFunction` of a script together with
+ * everything reachable from its chunk: the bytecode (including the upvalue
+ * descriptors that follow each `OP_CLOSURE`), the run-length encoded line
+ * table, the inline cache layout and the constant pool, with nested functions
+ * written recursively. Because global variables are compiled to slot indices,
+ * the file also lists the global names in slot order. Strings form one pool
+ * shared by the whole file: each is written the first time a global name,
+ * function name or constant uses it, and referred to by index after that.
+ *
+ * The header records the format version, the number of opcodes and the
+ * compiler options the file was produced with, plus a hash of the source
+ * and a checksum of everything after the header. A file whose header does
+ * not match the running interpreter is rejected, so a stale or foreign
+ * cache silently falls back to compiling the source. A damaged body fails
+ * the checksum; should one pass it anyway, every operand in the code is
+ * still checked against the function it belongs to before anything runs.
+ * Numbers and sizes are stored in host byte order; the files are a cache,
+ * not an interchange format.
+ */
+
+/**
+ * @brief Leading bytes of every cache file.
+ *
+ * The first byte is not printable, so a cache file can never be mistaken for
+ * Lox source.
+ */
+#define BYTECODE_MAGIC "\x7f" "LXC"
+
+/**
+ * @brief Version of the file layout. Bump it whenever the encoding changes.
+ */
+#define BYTECODE_VERSION 5
+
+/**
+ * @brief Hashes script source text (64-bit FNV-1a).
+ *
+ * @param source The source text.
+ * @param length Number of characters in `source`.
+ * @return The hash stored in, and checked against, cache file headers.
+ */
+uint64_t hashSource(const char* source, size_t length);
+
+/**
+ * @brief Returns true if the file at `path` starts with `BYTECODE_MAGIC`.
+ *
+ * @param path Path of the file to inspect.
+ */
+bool isBytecodeFile(const char* path);
+
+/**
+ * @brief Writes a compiled script to a cache file.
+ *
+ * @param script The top-level function returned by `compile()`.
+ * @param sourceHash The `hashSource()` of the script's source.
+ * @param path Path of the file to create or overwrite.
+ * @return True on success, false if the file could not be written.
+ */
+bool writeBytecode(ObjFunction* script, uint64_t sourceHash, const char* path);
+
+/**
+ * @brief Loads a compiled script from a cache file.
+ *
+ * The file is mapped into memory and decoded in place: bytecode and line
+ * tables are copied straight out of the mapping, and only strings go through
+ * the intern table. Global names are bound to the slots the file expects.
+ *
+ * @param path Path of the cache file.
+ * @param sourceHash The hash the file must have been produced from, or NULL to accept any source.
+ * @return The script function, or NULL if the file is missing, malformed or does not match.
+ */
+ObjFunction* readBytecode(const char* path, const uint64_t* sourceHash);
+
+#endif
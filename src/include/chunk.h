@@ -2,6 +2,7 @@
 #define corelox_chunk_h
 
 #include "common.h"
+#include "inline_cache.h"
 #include "line_info.h"
 #include "value.h"
 
@@ -19,7 +20,7 @@ typedef enum {
   OP_CLOSE_UPVALUE,  ///< Close an upvalue over local and copy its value to the heap.
   OP_CLASS,          ///< Define a new class.
   OP_METHOD,         ///< Define a new method for a class.
-  OP_INVOKE,         ///< Invoke a method on an object.
+  OP_INVOKE,         ///< Invoke a method on an object (name, argument count, cache index).
   OP_SUPER_INVOKE,   ///< Invoke a method on a superclass.
   OP_INHERIT,        ///< Inherit methods from a superclass.
   OP_DUP,            ///< Duplicate the top value on the stack.
@@ -29,14 +30,18 @@ typedef enum {
   OP_POP,            ///< Pop the top value from the stack.
   OP_GET_LOCAL,      ///< Get a local variable.
   OP_SET_LOCAL,      ///< Set a local variable.
-  OP_GET_PROPERTY,   ///< Get a property of an object.
-  OP_SET_PROPERTY,   ///< Set a property of an object.
+  OP_GET_PROPERTY,   ///< Get a property of an object (name, 16-bit cache index).
+  OP_SET_PROPERTY,   ///< Set a property of an object (name, 16-bit cache index).
   OP_GET_UPVALUE,    ///< Get a variable based on upvalue
   OP_SET_UPVALUE,    ///< Set a variable based on upvalue
   OP_GET_SUPER,      ///< Get a property from a superclass.
-  OP_GET_GLOBAL,     ///< Get a global variable.
-  OP_SET_GLOBAL,     ///< Set a global variable.
-  OP_DEFINE_GLOBAL,  ///< Define a global variable.
+  OP_GET_GLOBAL,     ///< Get a global variable by its 16-bit slot index.
+  OP_SET_GLOBAL,     ///< Set a global variable by its 16-bit slot index.
+  OP_DEFINE_GLOBAL,  ///< Define a global variable by its 16-bit slot index.
+  OP_LIST,           ///< Push a new, empty list.
+  OP_LIST_APPEND,    ///< Append the top value to the list beneath it.
+  OP_INDEX_GET,      ///< Read a list element (list, index).
+  OP_INDEX_SET,      ///< Store into a list element (list, index, value).
   OP_EQUAL,          ///< Check if two values are equal.
   OP_GREATER,        ///< Check if one value is greater than another.
   OP_LESS,           ///< Check if one value is less than another.
@@ -54,8 +59,41 @@ typedef enum {
   OP_LOOP,           ///< Loop back to a previous location in the bytecode.
   OP_CALL,           ///< Call a function.s
   OP_RETURN,         ///< Return from the current function or program.
+
+  // Superinstructions, only ever produced by the peephole pass.
+  OP_GET_LOCAL_GET_LOCAL,  ///< Push two locals (two slot operands).
+  OP_INC_LOCAL,            ///< Add a numeric constant to a local in place (slot, constant).
+  OP_ADD_CONST,            ///< Add a constant to the top of the stack (constant).
+  OP_LESS_JUMP_IF_FALSE,   ///< `OP_LESS` followed by `OP_JUMP_IF_FALSE` (16-bit offset).
+  OP_NOT_JUMP_IF_FALSE,    ///< `OP_NOT` followed by `OP_JUMP_IF_FALSE` (16-bit offset).
+
+  // Register instructions, only ever produced by the register pass. `R` operands are local slots
+  // and `K` operands constants; the first operand of the arithmetic ones is the destination slot.
+  OP_MOVE,                   ///< Copy a local into another (destination, source).
+  OP_LOAD_CONSTANT,          ///< Store a constant into a local (destination, constant).
+  OP_ADD_RR,                 ///< Add two locals into a third.
+  OP_ADD_RK,                 ///< Add a local and a constant into a local.
+  OP_SUBTRACT_RR,            ///< Subtract two locals into a third.
+  OP_SUBTRACT_RK,            ///< Subtract a constant from a local into a local.
+  OP_MULTIPLY_RR,            ///< Multiply two locals into a third.
+  OP_MULTIPLY_RK,            ///< Multiply a local by a constant into a local.
+  OP_DIVIDE_RR,              ///< Divide two locals into a third.
+  OP_DIVIDE_RK,              ///< Divide a local by a constant into a local.
+  OP_LESS_RR_JUMP,           ///< Jump unless `R < R` (two operands, 16-bit offset).
+  OP_LESS_RK_JUMP,           ///< Jump unless `R < K` (two operands, 16-bit offset).
+  OP_LESS_EQUAL_RR_JUMP,     ///< Jump unless `R <= R` (two operands, 16-bit offset).
+  OP_LESS_EQUAL_RK_JUMP,     ///< Jump unless `R <= K` (two operands, 16-bit offset).
+  OP_GREATER_RR_JUMP,        ///< Jump unless `R > R` (two operands, 16-bit offset).
+  OP_GREATER_RK_JUMP,        ///< Jump unless `R > K` (two operands, 16-bit offset).
+  OP_GREATER_EQUAL_RR_JUMP,  ///< Jump unless `R >= R` (two operands, 16-bit offset).
+  OP_GREATER_EQUAL_RK_JUMP,  ///< Jump unless `R >= K` (two operands, 16-bit offset).
 } OpCode;
 
+/**
+ * @brief Number of opcodes, for tables indexed by opcode.
+ */
+#define OPCODE_COUNT (OP_GREATER_EQUAL_RK_JUMP + 1)
+
 /**
  * @brief Represents a chunk of bytecode and its associated metadata.
  *
@@ -64,13 +102,28 @@ typedef enum {
  * used in the bytecode. It dynamically grows as more instructions are added.
  */
 typedef struct {
-  int count;             ///< Number of instructions (bytes) in the chunk.
-  int capacity;          ///< Allocated capacity for the bytecode (in bytes).
-  uint8_t* code;         ///< Pointer to the array of bytecode instructions.
-  LineInfoArray lines;   ///< Array mapping instructions to their source lines.
-  ValueArray constants;  ///< Array of constants used in the chunk.
+  int count;                ///< Number of instructions (bytes) in the chunk.
+  int capacity;             ///< Allocated capacity for the bytecode (in bytes).
+  uint8_t* code;            ///< Pointer to the array of bytecode instructions.
+  LineInfoArray lines;      ///< Array mapping instructions to their source lines.
+  ValueArray constants;     ///< Array of constants used in the chunk.
+  InlineCacheArray caches;  ///< Inline caches owned by property and invoke instructions.
 } Chunk;
 
+/**
+ * @brief Hash index over a chunk's constant pool, used while it is compiled.
+ *
+ * Maps each number and string constant to its index in the pool, so that a
+ * function mentioning the same name or literal many times stores it once and
+ * keeps more of its constants within reach of the one-byte operands. Strings
+ * are interned, so identical ones are the same object.
+ */
+typedef struct {
+  int* slots;    ///< Pool index + 1 of each slot, or 0 for an empty slot.
+  int capacity;  ///< Number of slots, a power of two, or 0 before the first constant.
+  int count;     ///< Occupied slots.
+} ConstantIndex;
+
 /**
  * @brief Initializes a chunk.
  *
@@ -105,6 +158,93 @@ void freeChunk(Chunk* chunk);
  */
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 
+/**
+ * @brief Discards every instruction at or after `count`.
+ *
+ * Used by the compiler to take back the tail of the code it just emitted
+ * when a better encoding becomes apparent. Line information and inline
+ * caches owned by the discarded instructions are dropped along with them.
+ *
+ * @param chunk Pointer to the chunk to shorten.
+ * @param count The number of bytes to keep.
+ */
+void truncateChunk(Chunk* chunk, int count);
+
+/**
+ * @brief Returns the size in bytes of the instruction at `offset`.
+ *
+ * @param chunk Pointer to the chunk holding the instruction.
+ * @param offset Bytecode offset of the instruction's opcode.
+ * @return The opcode byte plus all of its operands.
+ */
+int instructionLength(Chunk* chunk, int offset);
+
+/**
+ * @brief Returns where the jump instruction at `offset` lands.
+ *
+ * Every jump instruction ends in its 16-bit offset, which counts from the
+ * end of the instruction: backwards for `OP_LOOP`, forwards for the others.
+ *
+ * @param chunk Pointer to the chunk holding the instruction.
+ * @param offset Bytecode offset of the instruction's opcode.
+ * @return The offset of the instruction jumped to, or -1 if the instruction is not a jump.
+ */
+int jumpTarget(Chunk* chunk, int offset);
+
+/**
+ * @brief Stores a 16-bit jump offset at `offset`, high byte first.
+ *
+ * @param code The bytecode to write into.
+ * @param offset Where the two bytes go.
+ * @param jump The distance to encode, as `jumpTarget` reads it back.
+ */
+void writeJumpOperand(uint8_t* code, int offset, int jump);
+
+/**
+ * @brief Writes what a rewriting pass puts in place of the old instruction at `offset`.
+ *
+ * @param chunk The chunk being rewritten; everything before `*write` is already final.
+ * @param offset Old offset of the instruction.
+ * @param write New offset to write at, to be advanced past the bytes written.
+ * @param newOffset New offset of each old instruction start, and of the old end.
+ * @param context The pass's own state.
+ * @return The number of old bytes replaced, or 0 to keep the instruction unchanged.
+ */
+typedef int (*RelocateFn)(Chunk* chunk, int offset, int* write, const int* newOffset,
+                          void* context);
+
+/**
+ * @brief Moves a chunk's code to the offsets a pass has planned for it, in place.
+ *
+ * Walks the old code once, letting `rewrite` replace instructions and moving
+ * the ones it keeps, with their jumps rebased onto `newOffset`. The line
+ * table and inline cache offsets follow the code. Because the rewrite is in
+ * place, no instruction may move later than it was, and `rewrite` must read
+ * any old operands it needs before writing over them.
+ *
+ * @param chunk Pointer to the chunk to rewrite.
+ * @param newOffset New offset of each old instruction start, and `newOffset[count]` the new size.
+ * @param rewrite Function writing the pass's replacements.
+ * @param context Passed through to `rewrite`.
+ * @return False, with the chunk untouched, if there was no memory to work in.
+ */
+bool relocateChunk(Chunk* chunk, const int* newOffset, RelocateFn rewrite, void* context);
+
+/**
+ * @brief Computes the deepest the value stack gets while the chunk runs.
+ *
+ * Follows every path through the bytecode, jumps included, adding up the
+ * stack effect of each instruction. Calls are counted by their effect on the
+ * caller's stack only; the callee's frame needs its own depth.
+ *
+ * @param chunk Pointer to the chunk to analyze.
+ * @param entryDepth Slots in use when the chunk starts: the callee and its arguments.
+ * @return The maximum number of stack slots used above the frame's base, or -1 if some path
+ *         pops below the base or two paths reach an instruction with different depths. The
+ *         compiler never emits either, so only a corrupt bytecode cache can.
+ */
+int maxStackDepth(Chunk* chunk, int entryDepth);
+
 /**
  * @brief Writes a constant value into the chunk.
  *
@@ -113,11 +253,13 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line);
  * constant onto the stack.
  *
  * @param chunk Pointer to the chunk where the constant is written.
+ * @param index Index of the chunk's constants, so that an equal constant is reused; or NULL to
+ *              always add it.
  * @param value The constant value to write.
  * @param line The source line where this constant was used.
  * @return The index of the constant in the constant array.
  */
-int writeConstant(Chunk* chunk, Value value, int line);
+int writeConstant(Chunk* chunk, ConstantIndex* index, Value value, int line);
 
 /**
  * @brief Adds a constant to the chunk's constant pool.
@@ -132,6 +274,35 @@ int writeConstant(Chunk* chunk, Value value, int line);
  */
 int addConstant(Chunk* chunk, Value value);
 
+/**
+ * @brief Initializes an empty constant index.
+ *
+ * @param index The index to initialize.
+ */
+void initConstantIndex(ConstantIndex* index);
+
+/**
+ * @brief Frees the memory used by a constant index.
+ *
+ * @param index The index to free.
+ */
+void freeConstantIndex(ConstantIndex* index);
+
+/**
+ * @brief Returns the pool index of `value`, adding it to the pool only if it is not there yet.
+ *
+ * Numbers and strings are looked up in `index`; any other value is always
+ * added, as is a number or string that was taken back out of the pool (by
+ * shrinking `constants.count`) since it was indexed. Numbers match only when
+ * their encoding is identical, so `0` and `-0` stay apart.
+ *
+ * @param chunk Pointer to the chunk that owns the pool.
+ * @param index Index of the chunk's constants.
+ * @param value The constant value.
+ * @return The index of the constant in the constant array.
+ */
+int internConstant(Chunk* chunk, ConstantIndex* index, Value value);
+
 /**
  * @brief Retrieves the source line for a given bytecode instruction.
  *
@@ -139,10 +310,29 @@ int addConstant(Chunk* chunk, Value value);
  * function returns the source line where the instruction originated.
  * It is primarily used for debugging and error reporting.
  *
+ * The runs are binary-searched, so a lookup takes O(log n) in the number of
+ * runs.
+ *
  * @param chunk Pointer to the chunk containing the instruction.
  * @param instructionIndex The index of the instruction in the bytecode.
- * @return The source line number for the instruction.
+ * @return The source line number for the instruction, or -1 if the index is
+ *         outside the chunk.
  */
 int getLine(Chunk* chunk, int instructionIndex);
 
+/**
+ * @brief Retrieves the source lines of many instructions at once.
+ *
+ * Equivalent to calling `getLine` for each index, but an index in the same
+ * or the next run as the one before it is resolved without a search, so
+ * resolving indices in increasing order costs O(1) each. Meant for the
+ * profiler and for stack traces, which resolve many offsets together.
+ *
+ * @param chunk Pointer to the chunk containing the instructions.
+ * @param instructionIndices The indices of the instructions in the bytecode.
+ * @param lines Receives the line of each instruction, or -1 for an index outside the chunk.
+ * @param count Number of indices to resolve.
+ */
+void getLines(Chunk* chunk, const int* instructionIndices, int* lines, int count);
+
 #endif
\ No newline at end of file
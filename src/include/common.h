@@ -68,6 +68,67 @@
  */
 #define NAN_BOXING
 
+/**
+ * @brief Enables direct-threaded dispatch in the interpreter loop.
+ *
+ * When the compiler supports the GNU "labels as values" extension, the
+ * `run()` loop jumps straight from one opcode handler to the next through
+ * a table of label addresses instead of funnelling every instruction
+ * through a single `switch`. Define `NO_COMPUTED_GOTO` to force the
+ * portable `switch` dispatch (e.g. for A/B comparisons).
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+/**
+ * @brief Serves small objects from size-class slabs instead of `malloc`.
+ *
+ * Objects up to `POOL_MAX_SIZE` bytes are carved out of fixed-size slabs,
+ * and the sweep walks those slabs linearly instead of chasing the object
+ * list. Define `NO_POOL_ALLOCATOR` (or build with `make POOL=0`) to allocate
+ * every object with plain `malloc` for comparison.
+ */
+#ifndef NO_POOL_ALLOCATOR
+#define POOL_ALLOCATOR
+#endif
+
+/**
+ * @brief Lets the garbage collector mark on several threads.
+ *
+ * The number of threads is set per VM with `gcThreads`. Marking needs
+ * pthreads; define `NO_PARALLEL_MARK` (or build with `make PARALLEL_MARK=0`)
+ * to always mark on the collecting thread.
+ */
+#ifndef NO_PARALLEL_MARK
+#define PARALLEL_MARK
+#endif
+
+/**
+ * @brief Lets hot functions be compiled to machine code.
+ *
+ * The baseline JIT emits x86-64 code for the System V calling convention
+ * and works on NaN-boxed values, so other targets always interpret. It runs
+ * only for VMs with `jit` set (`--jit`); define `NO_JIT` (or build with
+ * `make JIT=0`) to leave it out.
+ */
+#if defined(NAN_BOXING) && defined(__x86_64__) && defined(__unix__) && !defined(NO_JIT)
+#define JIT
+#endif
+
+/**
+ * @brief Storage class for interpreter state that belongs to one thread.
+ *
+ * The current VM, the compiler and the scanner keep their state in
+ * thread-local variables, so independent VMs can run on several threads at
+ * once. GCC and Clang spell it `__thread`; anything else gets the C11 keyword.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 // hard limit on the number of local variables in a function
 #define UINT8_COUNT (UINT8_MAX + 1)
 
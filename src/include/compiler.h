@@ -104,6 +104,19 @@ typedef struct {
  */
 typedef enum { TYPE_INITIALIZER, TYPE_METHOD, TYPE_FUNCTION, TYPE_SCRIPT } FunctionType;
 
+/**
+ * @brief The literal push that currently ends the code, if any.
+ *
+ * Lets the compiler fold operators whose operands turn out to be literals
+ * after they have already been emitted.
+ */
+typedef struct {
+  int start;    ///< Offset of the push instruction.
+  int end;      ///< Chunk length right after it; the record is stale once this differs.
+  int index;    ///< Pool index of a constant this push added, or -1 if it added none.
+  Value value;  ///< The value pushed.
+} TrailingConstant;
+
 /**
  * @brief Struct for storing compiler state during compilation.
  *
@@ -115,6 +128,7 @@ typedef enum { TYPE_INITIALIZER, TYPE_METHOD, TYPE_FUNCTION, TYPE_SCRIPT } Funct
  * @tparam enclosing The enclosing compiler, if any.
  * @tparam function The function being compiled.
  * @tparam type The type of function being compiled.
+ * @tparam constants Index of the function's constant pool, so each constant is stored once.
  *
  * @tparam locals Array of local variables in the current scope.
  * @tparam localCapacity The allocated capacity for local variables.
@@ -129,11 +143,18 @@ typedef enum { TYPE_INITIALIZER, TYPE_METHOD, TYPE_FUNCTION, TYPE_SCRIPT } Funct
  * @tparam currentLoopEnd The ending offset of the current loop.
  * @tparam currentLoopDepth The current depth of the loop stack.
  * @tparam breakJumps List of break jump offsets for the current loop.
+ *
+ * @tparam trailingGetStart Offset of the plain property or `super` get that ends the code, or -1.
+ * @tparam trailingGetEnd Chunk length right after that get; stale once more code is emitted.
+ * @tparam trailingGetOp `OP_GET_PROPERTY` or `OP_GET_SUPER`.
+ * @tparam trailingGetName Constant index of the property name.
+ * @tparam trailingConstant The literal that ends the code, for constant folding.
  */
 typedef struct Compiler {
   struct Compiler* enclosing;
   ObjFunction* function;
   FunctionType type;
+  ConstantIndex constants;
 
   Local* locals;
   int localCapacity;
@@ -148,6 +169,13 @@ typedef struct Compiler {
   int currentLoopEnd;
   int currentLoopDepth;
   JumpList breakJumps;
+
+  int trailingGetStart;
+  int trailingGetEnd;
+  uint8_t trailingGetOp;
+  uint8_t trailingGetName;
+
+  TrailingConstant trailingConstant;
 } Compiler;
 
 /**
@@ -172,11 +200,34 @@ typedef struct ClassCompiler {
  * that can be executed by the virtual machine. It initializes the
  * parser and compiler state, and returns the compiled function.
  *
- * @param source The source code to compile.
+ * @param source The NUL-terminated source code to compile.
  * @return The compiled function as `ObjFunction`.
  */
 ObjFunction* compile(const char* source);
 
+/**
+ * @brief Compiles `length` characters of source code, which need not be NUL-terminated.
+ *
+ * Lets a memory-mapped file be compiled in place.
+ *
+ * @param source The source code to compile.
+ * @param length Number of characters in `source`.
+ * @return The compiled function, or NULL if there were compile errors.
+ */
+ObjFunction* compileBuffer(const char* source, size_t length);
+
+/**
+ * @brief Compiles source code read from `file` as the compiler goes.
+ *
+ * The file is read in chunks, one top-level declaration at a time, and the
+ * source of each declaration is freed once it has been compiled, so little more
+ * than the declaration being compiled is in memory at once.
+ *
+ * @param file The open file to read. It is read to the end but not closed.
+ * @return The compiled function, or NULL if there were compile errors.
+ */
+ObjFunction* compileStream(FILE* file);
+
 /**
  * @brief Marks all objects used during compilation as reachable by garbage collection
  *
@@ -2,6 +2,7 @@
 #define corelox_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 /**
  * @file debug.h
@@ -40,4 +41,57 @@ void disassembleChunk(Chunk* chunk, const char* name);
  */
 int disassembleInstruction(Chunk* chunk, int offset);
 
-#endif
\ No newline at end of file
+/**
+ * @brief Returns the printable name of an opcode, such as `"OP_ADD"`.
+ *
+ * @param instruction The opcode.
+ * @return A static string, or `"?"` for an unknown opcode.
+ */
+const char* opcodeName(uint8_t instruction);
+
+/**
+ * @brief Returns the name of an object type in lower case, such as `"string"`.
+ *
+ * @param type The object type.
+ * @return A static string, or `"?"` for an unknown type.
+ */
+const char* objTypeName(ObjType type);
+
+/**
+ * @brief Prints per-site inline cache counters for every live function.
+ *
+ * This function walks all functions still known to the virtual machine and
+ * prints, for each property access or invoke site that executed at least
+ * once, the number of cache hits, misses and megamorphic misses along with
+ * the resulting hit rate. The report is written to `stderr`.
+ */
+void printInlineCacheStats();
+
+/**
+ * @brief Prints a summary of every garbage collector pause recorded so far.
+ *
+ * The report gives the collector mode, the number of completed cycles and
+ * pauses, the total and tail (median, 90th, 99th percentile and maximum)
+ * pause durations, and the total number of bytes reclaimed. It is written
+ * to `stderr`.
+ */
+void printGCStats();
+
+/**
+ * @brief Prints how many objects each opcode allocated to stderr.
+ *
+ * Allocations made outside the interpreter loop, by the compiler or while
+ * setting up natives, are reported on a separate line.
+ */
+void printAllocStats();
+
+/**
+ * @brief Prints the VM's always-on counters (`VMStats`) to stderr.
+ *
+ * Allocations are given per object type, followed by the collector, hash
+ * table and call counters, and, when they were counted, the instructions
+ * executed per opcode, most frequent first.
+ */
+void printStats();
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef corelox_inline_cache_h
+#define corelox_inline_cache_h
+
+#include "common.h"
+#include "value.h"
+
+/**
+ * @file inline_cache.h
+ * @brief Per-call-site inline caches for property access and method invocation.
+ *
+ * Every `OP_GET_PROPERTY`, `OP_SET_PROPERTY` and `OP_INVOKE` instruction owns
+ * one `InlineCache`, addressed by a 16-bit operand emitted by the compiler.
+ * A cache remembers, per receiver shape, either which slot holds the field
+ * or which method closure the name resolved to, so that the common
+ * monomorphic case is a single shape compare plus an indexed load.
+ */
+
+/**
+ * @brief Maximum number of receiver shapes remembered by a single call site.
+ *
+ * A site that sees more distinct shapes than this is considered
+ * megamorphic: misses beyond this point are served by the slow path and are
+ * not recorded.
+ */
+#define INLINE_CACHE_ENTRIES 4
+
+/**
+ * @brief One (receiver shape -> resolution) pair recorded at a call site.
+ *
+ * A shape fixes both the receiver's class and its field layout. When `method`
+ * is NULL the entry describes a field stored at `slot`. For stores that add a
+ * field, `transition` is the shape the instance moves to. Method entries are
+ * only valid while `version` matches the class's current version.
+ */
+typedef struct {
+  ObjShape* shape;       ///< Receiver shape this entry was recorded for.
+  uint32_t version;      ///< Class version at the time the method was resolved.
+  ObjClosure* method;    ///< Resolved method, or NULL for a field entry.
+  ObjShape* transition;  ///< Shape after an adding store, or NULL.
+  int slot;              ///< Slot index for field entries.
+} InlineCacheEntry;
+
+/**
+ * @brief Inline cache state and counters for one call site.
+ */
+typedef struct {
+  int offset;                                      ///< Bytecode offset of the owning instruction.
+  int count;                                       ///< Number of entries in use.
+  InlineCacheEntry entries[INLINE_CACHE_ENTRIES];  ///< Recorded receiver shapes.
+  uint64_t hits;                                   ///< Lookups served from the cache.
+  uint64_t misses;                                 ///< Lookups served by the slow path.
+  uint64_t megamorphic;                            ///< Misses not recorded (cache full).
+} InlineCache;
+
+/**
+ * @brief Dynamic array of inline caches owned by a chunk.
+ */
+typedef struct {
+  int count;            ///< Number of caches in use.
+  int capacity;         ///< Allocated capacity for the array.
+  InlineCache* caches;  ///< Pointer to the array of caches.
+} InlineCacheArray;
+
+/**
+ * @brief Initializes an `InlineCacheArray` to an empty state.
+ *
+ * @param array Pointer to the array to initialize.
+ */
+void initInlineCacheArray(InlineCacheArray* array);
+
+/**
+ * @brief Frees the memory used by an `InlineCacheArray`.
+ *
+ * @param array Pointer to the array to free.
+ */
+void freeInlineCacheArray(InlineCacheArray* array);
+
+/**
+ * @brief Appends a fresh, empty cache for the instruction at `offset`.
+ *
+ * @param array Pointer to the array to append to.
+ * @param offset Bytecode offset of the instruction owning the cache.
+ * @return The index of the new cache.
+ */
+int addInlineCache(InlineCacheArray* array, int offset);
+
+/**
+ * @brief Records a resolution for `shape` in the cache.
+ *
+ * An existing entry for the same shape is overwritten. If the cache is full
+ * the site is counted as megamorphic and nothing is recorded.
+ *
+ * @param cache The call site's cache.
+ * @param shape The receiver shape.
+ * @param method The resolved method, or NULL for a field.
+ * @param transition The shape reached by an adding store, or NULL.
+ * @param slot The slot index for field entries.
+ */
+void recordInlineCache(InlineCache* cache, ObjShape* shape, ObjClosure* method,
+                       ObjShape* transition, int slot);
+
+/**
+ * @brief Marks all shapes and closures referenced by the caches as reachable.
+ *
+ * @param array Pointer to the array to mark.
+ */
+void markInlineCaches(InlineCacheArray* array);
+
+#endif
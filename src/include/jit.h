@@ -0,0 +1,114 @@
+#ifndef corelox_jit_h
+#define corelox_jit_h
+
+#include "common.h"
+#include "object.h"
+
+/**
+ * @file jit.h
+ * @brief Baseline compiler from the bytecode of hot functions to x86-64 machine code.
+ *
+ * Every function counts its calls and loop back edges. Once the count
+ * reaches `JIT_THRESHOLD`, its chunk is translated instruction by
+ * instruction: stack shuffling, constants and jumps become inline machine
+ * code, and the other supported instructions call their body in `jitHelpers`.
+ * An instruction without a template becomes an exit that hands the frame
+ * back to the interpreter at that instruction.
+ *
+ * The machine code works on the interpreter's own `CallFrame` and value
+ * stack and never allocates, so garbage collection and stack traces see
+ * exactly what they would in the interpreter. It is entered from `OP_LOOP`,
+ * at the head of a loop whose whole body it can run, and keeps control until
+ * it reaches an exit. A helper that meets operands it does not handle, or that
+ * would raise a runtime error, *bails*: it changes nothing and leaves the
+ * instruction for the interpreter to redo. A function that bails more than
+ * `JIT_MAX_BAILS` times is deoptimized for good.
+ */
+
+#ifdef JIT
+
+/**
+ * @brief Calls plus loop back edges after which a function is compiled.
+ */
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+/**
+ * @brief Bails after which a function's machine code is thrown away.
+ *
+ * Each bail leaves and re-enters the machine code, which costs more than
+ * interpreting the instruction in the first place.
+ */
+#define JIT_MAX_BAILS 64
+
+/**
+ * @brief The machine code compiled for one function.
+ */
+typedef struct JitCode JitCode;
+
+/**
+ * @brief Body of one instruction, called from machine code.
+ *
+ * @param stackTop The frame's stack top.
+ * @param local The local slot the instruction names, or the frame's first slot.
+ * @param operand The instruction's constant or global slot, if it has one.
+ * @return The stack top after the instruction, or NULL to bail.
+ */
+typedef Value* (*JitHelper)(Value* stackTop, Value* local, uint64_t operand);
+
+/**
+ * @brief Instruction bodies by opcode, NULL where the machine code has none.
+ *
+ * They are defined next to the interpreter loop in vm.c, so both tiers share
+ * one implementation of each instruction's semantics.
+ */
+extern const JitHelper jitHelpers[OPCODE_COUNT];
+
+/**
+ * @brief Compiles `function` to machine code.
+ *
+ * Leaves `function->jitCode` NULL when none of its loops could run as
+ * machine code, and the function stays interpreted.
+ *
+ * @param function The function to compile.
+ */
+void jitCompile(ObjFunction* function);
+
+/**
+ * @brief Counts a call of or a back edge in `function`, compiling it at `JIT_THRESHOLD`.
+ *
+ * The count stops at the threshold, so each function is compiled at most
+ * once, and one that was deoptimized stays interpreted.
+ *
+ * @param function The function being run.
+ */
+static inline void jitCount(ObjFunction* function) {
+  if (function->hotness < JIT_THRESHOLD && ++function->hotness == JIT_THRESHOLD) {
+    jitCompile(function);
+  }
+}
+
+/**
+ * @brief Runs `function`'s machine code from `ip`, if it has an entry there.
+ *
+ * Reads and updates the stack top through `vm->stackTop`.
+ *
+ * @param function The compiled function of the current frame.
+ * @param ip The instruction to start at.
+ * @param slots The current frame's first stack slot.
+ * @return The instruction the interpreter continues at, which is `ip` itself when there is no
+ *         entry.
+ */
+uint8_t* jitRun(ObjFunction* function, uint8_t* ip, Value* slots);
+
+/**
+ * @brief Releases `function`'s machine code, if it has any.
+ *
+ * @param function The function to free the machine code of.
+ */
+void jitFree(ObjFunction* function);
+
+#endif
+
+#endif
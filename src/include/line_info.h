@@ -13,20 +13,24 @@
  * This header defines data structures and functions for managing
  * line information in a chunk of bytecode. The line information
  * is stored using run-length encoding (RLE) to efficiently map
- * bytecode instructions to their corresponding source lines.
+ * bytecode instructions to their corresponding source lines. Each run
+ * records the offset it starts at, so runs are sorted by offset and a
+ * lookup can binary-search them.
  */
 
 /**
  * @brief Represents a run-length encoded entry for line information.
  *
- * The `LineInfo` struct stores the line number and the run length
- * (i.e., how many consecutive bytecode instructions correspond to
- * that line). This helps efficiently encode line information without
- * storing the line number for every single bytecode instruction.
+ * The `LineInfo` struct stores the line number and the offset of the
+ * first bytecode byte of the run. A run extends up to the start of the
+ * next one, or to the end of the chunk for the last run, so appending a
+ * byte on the same line does not touch the array at all. This encodes
+ * line information without storing the line number for every single
+ * bytecode instruction.
  */
 typedef struct {
-  int line;        ///< The source line number.
-  int run_length;  ///< Number of consecutive instructions from this line.
+  int line;   ///< The source line number.
+  int start;  ///< Offset of the first bytecode byte from this line.
 } LineInfo;
 
 /**
@@ -67,7 +71,7 @@ void freeLineInfoArray(LineInfoArray* array);
 /**
  * @brief Prints a single `LineInfo` entry.
  *
- * This function prints the line number and run length of a `LineInfo`
+ * This function prints the line number and start offset of a `LineInfo`
  * entry in a human-readable format. It is mainly used for debugging
  * and verifying the correctness of line information.
  *
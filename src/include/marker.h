@@ -0,0 +1,88 @@
+#ifndef corelox_marker_h
+#define corelox_marker_h
+
+#include "common.h"
+#include "object.h"
+
+/**
+ * @file marker.h
+ * @brief Parallel tracing of the gray objects on several threads.
+ *
+ * Each marking thread traces from a private gray stack. A thread that runs
+ * out of work goes idle; a busy thread that notices idle ones hands half of
+ * its stack over as a packet on a shared list, which the idle threads take
+ * from. Marking ends once every thread is idle and no packet is left.
+ * Objects are claimed with an atomic exchange of `isMarked`, so each one is
+ * blackened exactly once whichever thread reaches it first.
+ *
+ * Marking must not run alongside the program: the collector calls
+ * `parallelMark` inside a pause, with every root already shaded.
+ */
+
+#ifdef PARALLEL_MARK
+
+/**
+ * @brief Largest number of threads a collection may mark with.
+ */
+#define GC_MAX_THREADS 64
+
+/**
+ * @brief Heap size, in bytes, below which marking stays on one thread.
+ *
+ * Starting the helper threads costs more than tracing a small heap.
+ */
+#ifdef DEBUG_STRESS_GC
+#define GC_PARALLEL_MIN_BYTES 0
+#else
+#define GC_PARALLEL_MIN_BYTES (4 * 1024 * 1024)
+#endif
+
+/**
+ * @brief One marking thread.
+ */
+typedef struct MarkWorker MarkWorker;
+
+/**
+ * @brief The marking thread the calling thread acts as, or NULL outside `parallelMark`.
+ *
+ * `markObject` hands objects to `markerShade` while this is set.
+ */
+extern THREAD_LOCAL MarkWorker* markWorker;
+
+/**
+ * @brief Number of threads a parallel mark asked for `requested` threads would use.
+ *
+ * Threads beyond the number of online processors would only take turns, so
+ * the count is capped there and at `GC_MAX_THREADS`.
+ *
+ * @param requested The number of threads asked for.
+ * @return The number of threads to mark with, at least 1.
+ */
+int markerThreads(int requested);
+
+/**
+ * @brief Blackens every object reachable from `gray`, using up to `threads` threads.
+ *
+ * The calling thread takes part in marking. If some helper threads cannot be
+ * started, marking goes on with the ones that could.
+ *
+ * @param gray The gray objects to start from. They must already be marked.
+ * @param grayCount Number of objects in `gray`.
+ * @param threads Number of threads to mark with, including the caller, before `markerThreads`
+ *                caps it.
+ * @param blacken Marks the references of one object, through `markObject`.
+ */
+void parallelMark(Obj** gray, int grayCount, int threads, void (*blacken)(Obj* object));
+
+/**
+ * @brief Marks `object` and queues it on the calling marking thread's gray stack.
+ *
+ * Does nothing if another thread has already marked the object.
+ *
+ * @param object The object to shade.
+ */
+void markerShade(Obj* object);
+
+#endif
+
+#endif
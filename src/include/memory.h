@@ -22,6 +22,89 @@
  */
 #define GC_HEAP_GROW_FACTOR 2
 
+/**
+ * @brief Bytes allocated between two increments of an incremental collection.
+ *
+ * While a cycle is in progress the next increment runs once this many more
+ * bytes have been allocated, so marking and sweeping advance with the mutator.
+ */
+#define GC_STEP_BYTES (64 * 1024)
+
+/**
+ * @brief Number of objects traced or swept by one increment, on top of the objects allocated since
+ * the previous increment.
+ *
+ * Objects allocated while marking start out gray, so each increment also traces
+ * as many objects as were allocated since the last one. This keeps marking
+ * ahead of allocation; the base budget bounds the length of one pause.
+ */
+#ifdef DEBUG_STRESS_GC
+#define GC_STEP_WORK 8
+#else
+#define GC_STEP_WORK 2048
+#endif
+
+/**
+ * @brief Selects how the garbage collector runs a cycle.
+ */
+typedef enum {
+  GC_MODE_STOP_THE_WORLD,  ///< Mark and sweep the whole heap in a single pause.
+  GC_MODE_INCREMENTAL,     ///< Interleave tri-color marking and sweeping with allocation.
+  GC_MODE_LAZY_SWEEP       ///< Mark the whole heap in one pause, then sweep with allocation.
+} GCMode;
+
+/**
+ * @brief The phase of the current garbage collection cycle.
+ */
+typedef enum {
+  GC_PHASE_IDLE,  ///< No cycle in progress.
+  GC_PHASE_MARK,  ///< Tracing gray objects; the write barrier is active.
+  GC_PHASE_SWEEP  ///< Freeing unmarked objects behind `vm->sweepLink`.
+} GCPhase;
+
+/**
+ * @brief One recorded garbage collector pause.
+ */
+typedef struct {
+  double seconds;         ///< Wall-clock time spent in the pause.
+  size_t bytesReclaimed;  ///< Bytes freed during the pause.
+} GCPause;
+
+/**
+ * @brief Objects and bytes allocated while executing one opcode.
+ */
+typedef struct {
+  uint64_t objects;  ///< Number of objects allocated.
+  uint64_t bytes;    ///< Total size of those objects.
+} AllocCount;
+
+/**
+ * @brief Write barrier for storing `value` into an existing heap object.
+ *
+ * While an incremental cycle is marking, the object written to may already be
+ * black. Shading the stored value gray keeps the tri-color invariant, so the
+ * collector never misses it (Dijkstra's insertion barrier). Stores into roots
+ * (the stack and the global slots) need no barrier, since the roots are scanned
+ * again before marking finishes. Users must include `vm.h`.
+ *
+ * @param value The value being stored.
+ */
+#define WRITE_BARRIER(value)                           \
+  do {                                                 \
+    if (vm->gcPhase == GC_PHASE_MARK) markValue(value); \
+  } while (false)
+
+/**
+ * @brief Write barrier for storing an object pointer into an existing heap object.
+ *
+ * @param object The object being stored, or NULL.
+ * @see WRITE_BARRIER
+ */
+#define WRITE_BARRIER_OBJ(object)                                \
+  do {                                                           \
+    if (vm->gcPhase == GC_PHASE_MARK) markObject((Obj*)(object)); \
+  } while (false)
+
 /**
  * @brief Allocates a block of memory for a given type.
  *
@@ -35,6 +118,17 @@
  */
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
+/**
+ * @brief Frees the memory of a fixed-size heap object.
+ *
+ * This macro returns the storage of an object allocated with
+ * `allocateObjectMemory` and updates the allocation accounting.
+ *
+ * @param type The object's struct type.
+ * @param pointer A pointer to the object.
+ */
+#define FREE_OBJECT(type, pointer) freeObjectMemory((Obj*)(pointer), sizeof(type))
+
 /**
  * @brief Frees a block of memory.
  *
@@ -73,7 +167,7 @@
  * @param newCount The new number of elements the array should hold.
  * @return A pointer to the newly reallocated array with the increased capacity.
  */
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
+#define GROW_ARRAY(type, pointer, oldCount, newCount)                              \
   (type*)reallocate(pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
 
 /**
@@ -116,10 +210,48 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 void freeObject(Obj* object);
 
 /**
- * @brief Initializes the garbage collector.
+ * @brief Allocates storage for a new heap object.
+ *
+ * Small objects are served from the size-class pools when `POOL_ALLOCATOR`
+ * is enabled; larger ones come from `malloc` and are linked into
+ * `vm->objects`. The allocation counts towards `vm->bytesAllocated` and may
+ * trigger a collection before the storage is handed out. The returned header
+ * has `isMarked` and `next` initialized; the caller sets the type.
+ *
+ * @param size The size of the object in bytes.
+ * @return A pointer to the new object.
+ */
+Obj* allocateObjectMemory(size_t size);
+
+/**
+ * @brief Releases the storage of a heap object.
+ *
+ * Only the garbage collector's sweep and `freeObjects` free objects. For
+ * pooled objects the slot is returned by the sweep itself, so this function
+ * just updates the allocation accounting.
+ *
+ * @param object A pointer to the object.
+ * @param size The size the object was allocated with, in bytes.
+ */
+void freeObjectMemory(Obj* object, size_t size);
+
+/**
+ * @brief Calls `visit` for every object currently owned by the virtual machine.
+ *
+ * @param visit The function to call with each object.
+ */
+void forEachObject(void (*visit)(Obj* object));
+
+/**
+ * @brief Runs the garbage collector.
  *
- * This function initializes the garbage collector by setting the initial
- * garbage collection threshold and allocating memory for the object list.
+ * In `GC_MODE_STOP_THE_WORLD` this performs a full mark-sweep cycle. In
+ * `GC_MODE_INCREMENTAL` it performs one bounded increment of the current
+ * cycle, starting a new cycle if none is in progress. In `GC_MODE_LAZY_SWEEP`
+ * a new cycle marks the whole heap at once and each later call sweeps one
+ * increment. Marking the whole heap at once, here and when an incremental
+ * cycle completes its mark, uses `vm->gcThreads` threads on large heaps.
+ * Every call is recorded as a pause in `vm->gcPauses`.
  */
 void collectGarbage();
 
@@ -0,0 +1,30 @@
+#ifndef corelox_natives_h
+#define corelox_natives_h
+
+/**
+ * @file natives.h
+ * @brief Standard library of native functions for math, strings, conversion and lists.
+ *
+ * Every function is a global bound with `defineNative()`, so scripts can
+ * shadow any of them with their own definition:
+ *
+ * | Group      | Functions                                                              |
+ * | ---------- | ---------------------------------------------------------------------- |
+ * | Math       | `abs`, `floor`, `ceil`, `round`, `sqrt`, `exp`, `log`, `sin`, `cos`,   |
+ * |            | `tan`, `pow(x, y)`, `min(a, b)`, `max(a, b)`                           |
+ * | Strings    | `substring(s, start, end)`, `indexOf(s, part)`, `split(s, separator)`, |
+ * |            | `toUpper(s)`, `toLower(s)`, `charCode(s, index)`, `fromCharCode(code)` |
+ * | Conversion | `toNumber(s)`, `toString(value)`                                       |
+ * | Lists      | `sort(list)`, `indexOf(list, value)`                                   |
+ *
+ * Arguments of the wrong type, and indexes that are not integers inside
+ * the string, raise runtime errors through `nativeError()`. Ropes are
+ * accepted wherever a string is.
+ */
+
+/**
+ * @brief Binds every function of the standard library in the current VM.
+ */
+void defineStandardLibrary();
+
+#endif
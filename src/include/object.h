@@ -88,6 +88,58 @@
  */
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
+/**
+ * @brief Macro to check if a value is a shape object.
+ *
+ * This macro checks if a value is a shape object by comparing the object type
+ * to `OBJ_SHAPE`. Shapes never escape to Lox code; they only appear inside
+ * instances, classes and transition tables.
+ */
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
+
+/**
+ * @brief Macro to check if a value is a list object.
+ *
+ * This macro checks if a value is a list object by comparing the object type
+ * to `OBJ_LIST`. It is used by the indexing opcodes and the list natives to
+ * validate their operands.
+ */
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+
+/**
+ * @brief Macro to check if a value is an unflattened concatenation.
+ *
+ * Ropes are produced by `+` on long strings and behave like strings in Lox
+ * code. Use `IS_ANY_STRING` to accept both representations.
+ */
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+
+/**
+ * @brief Macro to check if a value is a flat string or a rope.
+ */
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
+
+/**
+ * @brief Macro to check if a value is a string builder object.
+ */
+#define IS_STRING_BUILDER(value) isObjType(value, OBJ_STRING_BUILDER)
+
+/**
+ * @brief Concatenations shorter than this are flattened and interned eagerly.
+ *
+ * Short results are cheap to copy and are often compared or used as keys
+ * right away, so only longer ones are deferred into a rope.
+ */
+#define ROPE_MIN_LENGTH 64
+
+/**
+ * @brief Maximum number of fields an instance keeps in shape-described slots.
+ *
+ * An instance that grows past this many fields leaves the shape tree and
+ * switches to dictionary mode, storing all of its fields in a `Table`.
+ */
+#define SHAPE_MAX_FIELDS 32
+
 /**
  * @brief Macro to cast a value to a function object.
  *
@@ -160,6 +212,34 @@
  */
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 
+/**
+ * @brief Macro to cast a value to a shape object.
+ *
+ * This macro casts a value to a shape object by extracting the object pointer
+ * from the `Value` struct and casting it to an `ObjShape` pointer. It is used
+ * when reading shapes back out of a transition table.
+ */
+#define AS_SHAPE(value) ((ObjShape*)AS_OBJ(value))
+
+/**
+ * @brief Macro to cast a value to a list object.
+ *
+ * This macro casts a value to a list object by extracting the object pointer
+ * from the `Value` struct and casting it to an `ObjList` pointer. It is used
+ * to reach the list's element storage.
+ */
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+
+/**
+ * @brief Macro to cast a value to a rope object.
+ */
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
+
+/**
+ * @brief Macro to cast a value to a string builder object.
+ */
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder*)AS_OBJ(value))
+
 /**
  * @brief Macro to access the character data of a string object.
  *
@@ -185,8 +265,17 @@ typedef enum {
   OBJ_BOUND_METHOD,
   OBJ_UPVALUE,
   OBJ_STRING,
+  OBJ_SHAPE,
+  OBJ_LIST,
+  OBJ_ROPE,
+  OBJ_STRING_BUILDER,
 } ObjType;
 
+/**
+ * @brief Number of object types, for arrays indexed by `ObjType`.
+ */
+#define OBJ_TYPE_COUNT (OBJ_STRING_BUILDER + 1)
+
 /**
  * @brief Represents the base object type in the virtual machine.
  *
@@ -212,15 +301,25 @@ struct Obj {
  *
  * - `obj`: The base object struct containing the object type and a pointer to the next object.
  * - `arity`: The number of arguments the function takes.
+ * - `maxSlots`: The most stack slots a call uses above its frame base, from `maxStackDepth`.
+ * - `capturesLocals`: Whether a closure inside the function captures one of its locals. Returns
+ *   from functions that never do have no upvalues to close.
  * - `chunk`: The chunk of bytecode instructions for the function.
  * - `name`: The name of the function as a string object.
+ * - `hotness`: Calls and loop back edges counted towards compiling the function, up to
+ *   `JIT_THRESHOLD`.
+ * - `jitCode`: The function's machine code, or NULL while it is interpreted.
  */
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  int maxSlots;
+  bool capturesLocals;
   Chunk chunk;
   ObjString* name;
+  int hotness;
+  struct JitCode* jitCode;
 } ObjFunction;
 
 /**
@@ -228,7 +327,8 @@ typedef struct {
  *
  * The `NativeFn` type represents a pointer to a native function that can be called from the
  * virtual machine. It is used to define the signature of native functions that can be registered
- * with the virtual machine and called from Lox code.
+ * with the virtual machine and called from Lox code. A native that cannot
+ * handle its arguments returns `nativeError()`, which raises a runtime error.
  */
 typedef Value (*NativeFn)(int argCount, Value* args);
 
@@ -281,12 +381,12 @@ typedef struct ObjUpvalue {
  * - `obj`: The base object struct containing the object type and a pointer to the next object.
  * - `function`: The function object that the closure is created from.
  */
-typedef struct {
+struct ObjClosure {
   Obj obj;
   ObjFunction* function;
   ObjUpvalue** upvalues;
   int upvalueCount;
-} ObjClosure;
+};
 
 /**
  * @brief Represents a class object in the virtual machine.
@@ -299,13 +399,47 @@ typedef struct {
  *
  * - `obj`: The base object struct containing the object type and a pointer to the next object.
  * - `name`: The name of the class as a string
+ * - `version`: Bumped whenever a cached method lookup on this class may have become stale.
+ * - `rootShape`: The empty shape every new instance of the class starts from.
+ * - `fieldCountHint`: Largest field count seen on an instance, used to size inline slots.
  **/
-typedef struct {
+struct ObjClass {
   Obj obj;
   ObjString* name;
   Table methods;
   ObjClosure* cachedInit;
-} ObjClass;
+  uint32_t version;
+  ObjShape* rootShape;
+  int fieldCountHint;
+};
+
+/**
+ * @brief Represents a shape (hidden class) describing an instance's field layout.
+ *
+ * The `ObjShape` struct maps field names to slot indices for every instance that
+ * acquired the same fields in the same order. Shapes form a transition tree rooted
+ * at the class's empty shape: adding a field to an instance moves it to the child
+ * shape reached through that field's name.
+ *
+ * Fields:
+ *
+ * - `obj`: The base object struct containing the object type and a pointer to the next object.
+ * - `klass`: The class whose instances use this shape.
+ * - `parent`: The shape this one was derived from, or NULL for the root shape.
+ * - `name`: The field added by the transition into this shape, or NULL for the root shape.
+ * - `fieldCount`: The number of fields (and slots) described by this shape.
+ * - `slots`: Table mapping each field name to its slot index as a number.
+ * - `transitions`: Table mapping a field name to the child shape that adds it.
+ */
+struct ObjShape {
+  Obj obj;
+  ObjClass* klass;
+  ObjShape* parent;
+  ObjString* name;
+  int fieldCount;
+  Table slots;
+  Table transitions;
+};
 
 /**
  * @brief Represents an instance object in the virtual machine.
@@ -317,12 +451,23 @@ typedef struct {
  * Fields:
  *
  * - `obj`: The base object struct containing the object type and a pointer to the next object.
- * - `fields`: The table of fields for the instance.
+ * - `klass`: The class of the instance.
+ * - `shape`: The shape describing `slots`, or NULL once the instance is in dictionary mode.
+ * - `slots`: Field values indexed by shape slot; points at `inlineSlots` until it outgrows them.
+ * - `slotCapacity`: The number of values `slots` can hold.
+ * - `inlineCapacity`: The number of values allocated inline after the instance header.
+ * - `fields`: The table of fields for the instance, used only in dictionary mode.
+ * - `inlineSlots`: Slot storage allocated together with the instance.
  */
 typedef struct {
   Obj obj;
   ObjClass* klass;
+  ObjShape* shape;
+  Value* slots;
+  int slotCapacity;
+  int inlineCapacity;
   Table fields;
+  Value inlineSlots[];
 } ObjInstance;
 
 /**
@@ -344,6 +489,23 @@ typedef struct {
   ObjClosure* method;
 } ObjBoundMethod;
 
+/**
+ * @brief Represents a list object in the virtual machine.
+ *
+ * The `ObjList` struct represents a growable array of values, inheriting from base object. The
+ * elements live contiguously in a `ValueArray`, so indexing is a bounds check plus a load and
+ * appending grows the storage with `GROW_CAPACITY`.
+ *
+ * Fields:
+ *
+ * - `obj`: The base object struct containing the object type and a pointer to the next object.
+ * - `items`: The elements of the list, in order.
+ */
+typedef struct {
+  Obj obj;
+  ValueArray items;
+} ObjList;
+
 /**
  * @brief Represents a string object in the virtual machine.
  *
@@ -356,8 +518,8 @@ typedef struct {
  *
  * - `obj`: The base object struct containing the object type and a pointer to the next object.
  * - `length`: The length of the string.
- * - `hash`: The cache of hash value of the string for quick comparison, using FNV-1a hash
- * algorithm.
+ * - `hash`: The cache of hash value of the string for quick comparison (FNV-1a for short strings,
+ * word-at-a-time mixing for longer ones).
  * - `chars`: A flexible array to store the characters of the string.
  */
 struct ObjString {
@@ -367,6 +529,46 @@ struct ObjString {
   char chars[];
 };
 
+/**
+ * @brief Represents a deferred string concatenation.
+ *
+ * A rope records the two operands of a `+` instead of copying them, so building a string piece
+ * by piece costs one small allocation per piece. The characters are copied, hashed and interned
+ * only once, by `flattenRope`, when the string is printed or compared.
+ *
+ * Fields:
+ *
+ * - `obj`: The base object struct containing the object type and a pointer to the next object.
+ * - `length`: The total length of the concatenated string.
+ * - `left`: The left operand, an `ObjString` or another rope; NULL once flattened.
+ * - `right`: The right operand, an `ObjString` or another rope; NULL once flattened.
+ * - `flat`: The interned result, or NULL until the rope is flattened.
+ */
+typedef struct {
+  Obj obj;
+  int length;
+  Obj* left;
+  Obj* right;
+  ObjString* flat;
+} ObjRope;
+
+/**
+ * @brief Represents a mutable buffer for explicit string accumulation.
+ *
+ * Fields:
+ *
+ * - `obj`: The base object struct containing the object type and a pointer to the next object.
+ * - `length`: The number of characters appended so far.
+ * - `capacity`: The allocated size of `chars`.
+ * - `chars`: The accumulated characters, not NUL-terminated.
+ */
+typedef struct {
+  Obj obj;
+  int length;
+  int capacity;
+  char* chars;
+} ObjStringBuilder;
+
 /**
  * @brief Creates a new function object.
  *
@@ -442,6 +644,85 @@ ObjInstance* newInstance(ObjClass* klass);
  */
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 
+/**
+ * @brief Creates a new, empty list object.
+ *
+ * The list starts without any element storage; elements are added with
+ * `writeValueArray` on its `items` array.
+ *
+ * @return The newly created list object as ObjList.
+ */
+ObjList* newList();
+
+/**
+ * @brief Creates a new shape object.
+ *
+ * This function creates the shape reached from `parent` by adding the field `name`,
+ * or the root shape of `klass` when `parent` is NULL. The new shape inherits all of
+ * the parent's slots and assigns the next slot index to `name`.
+ *
+ * @param klass The class whose instances use the shape.
+ * @param parent The shape being extended, or NULL for a root shape.
+ * @param name The field being added, or NULL for a root shape.
+ * @return The newly created shape object as ObjShape.
+ */
+ObjShape* newShape(ObjClass* klass, ObjShape* parent, ObjString* name);
+
+/**
+ * @brief Returns the slot index of a field in a shape.
+ *
+ * @param shape The shape to search.
+ * @param name The field name.
+ * @return The slot index of the field, or -1 if the shape has no such field.
+ */
+int shapeFindSlot(ObjShape* shape, ObjString* name);
+
+/**
+ * @brief Returns the shape reached by adding a field to an existing shape.
+ *
+ * The transition is looked up in the shape's transition table and created on first
+ * use, so every instance that adds the same fields in the same order shares shapes.
+ *
+ * @param shape The shape being extended.
+ * @param name The field being added.
+ * @return The child shape, or NULL if it would exceed `SHAPE_MAX_FIELDS`.
+ */
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name);
+
+/**
+ * @brief Moves an instance onto a child shape and stores the new field's value.
+ *
+ * The slot storage is grown out of line if the instance's current capacity is
+ * exhausted. `shape` must be a direct transition from the instance's current shape.
+ *
+ * @param instance The instance gaining a field.
+ * @param shape The shape that describes the instance after the field is added.
+ * @param value The value of the new field.
+ */
+void instanceAddField(ObjInstance* instance, ObjShape* shape, Value value);
+
+/**
+ * @brief Reads a field of an instance.
+ *
+ * @param instance The instance to read from.
+ * @param name The field name.
+ * @param value Receives the field value if it exists.
+ * @return `true` if the instance has the field, `false` otherwise.
+ */
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+
+/**
+ * @brief Writes a field of an instance, adding it if necessary.
+ *
+ * New fields follow the shape transition tree; instances that grow past
+ * `SHAPE_MAX_FIELDS` fields are switched to dictionary mode.
+ *
+ * @param instance The instance to write to.
+ * @param name The field name.
+ * @param value The value to store.
+ */
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+
 /**
  * @brief Creates a new upvalue object.
  *
@@ -480,6 +761,56 @@ ObjString* copyString(const char* chars, int length);
  */
 ObjString* takeString(char* chars, int length);
 
+/**
+ * @brief Creates a rope for the concatenation of two strings.
+ *
+ * Both operands must be reachable by the collector while the rope is allocated.
+ *
+ * @param left The left operand, an `ObjString` or `ObjRope`.
+ * @param right The right operand, an `ObjString` or `ObjRope`.
+ * @return The newly created rope object as ObjRope.
+ */
+ObjRope* newRope(Obj* left, Obj* right);
+
+/**
+ * @brief Returns the interned string a rope stands for, building it on first use.
+ *
+ * The result is cached in the rope and the operands are released. The rope must be reachable by
+ * the collector during the call, since interning allocates.
+ *
+ * @param rope The rope to flatten.
+ * @return The flattened string.
+ */
+ObjString* flattenRope(ObjRope* rope);
+
+/**
+ * @brief Copies the characters of a rope into a buffer without flattening it.
+ *
+ * Never allocates on the managed heap, so it is safe to call from anywhere.
+ *
+ * @param rope The rope to copy.
+ * @param dest A buffer with room for at least `rope->length` characters.
+ */
+void copyRopeChars(ObjRope* rope, char* dest);
+
+/**
+ * @brief Creates a new, empty string builder.
+ *
+ * @return The newly created builder as ObjStringBuilder.
+ */
+ObjStringBuilder* newStringBuilder();
+
+/**
+ * @brief Appends a flat string or rope to a builder.
+ *
+ * Both the builder and `text` must be reachable by the collector, since growing the buffer can
+ * trigger a collection.
+ *
+ * @param builder The builder to append to.
+ * @param text A value for which `IS_ANY_STRING` holds.
+ */
+void builderAppend(ObjStringBuilder* builder, Value text);
+
 /**
  * @brief Prints an object to the standard output.
  *
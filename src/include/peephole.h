@@ -0,0 +1,35 @@
+#ifndef corelox_peephole_h
+#define corelox_peephole_h
+
+#include "chunk.h"
+
+/**
+ * @file peephole.h
+ * @brief Peephole pass that fuses common instruction sequences.
+ *
+ * The compiler emits bytecode in a single pass, so frequent idioms such as
+ * the `i = i + 1` at the end of every `for` loop cost one dispatch per
+ * instruction. Once a function is complete, the peephole pass rewrites those
+ * sequences into superinstructions:
+ *
+ * | Sequence                                                   | Superinstruction         |
+ * | ---------------------------------------------------------- | ------------------------ |
+ * | `GET_LOCAL s`, `CONSTANT k`, `ADD`, `SET_LOCAL s`, `POP`   | `OP_INC_LOCAL s k`       |
+ * | `GET_LOCAL a`, `GET_LOCAL b`                               | `OP_GET_LOCAL_GET_LOCAL` |
+ * | `CONSTANT k`, `ADD`                                        | `OP_ADD_CONST k`         |
+ * | `LESS`, `JUMP_IF_FALSE`                                    | `OP_LESS_JUMP_IF_FALSE`  |
+ * | `NOT`, `JUMP_IF_FALSE`                                     | `OP_NOT_JUMP_IF_FALSE`   |
+ *
+ * A sequence is only fused when no jump lands inside it. Jump offsets, line
+ * information and inline cache offsets are rewritten to match the shorter
+ * code.
+ */
+
+/**
+ * @brief Rewrites a finished chunk in place, fusing instruction sequences.
+ *
+ * @param chunk Pointer to the chunk to optimize. It must end in a return.
+ */
+void optimizeChunk(Chunk* chunk);
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef corelox_pool_h
+#define corelox_pool_h
+
+#include "common.h"
+
+/**
+ * @file pool.h
+ * @brief Size-class slab pools for small heap objects.
+ *
+ * Every object of at most `POOL_MAX_SIZE` bytes is rounded up to a multiple of
+ * `POOL_GRANULARITY` and served from the free list of its size class. Each
+ * class owns a list of slabs, contiguous blocks of equally sized slots with a
+ * byte per slot recording whether it holds a live object. The garbage
+ * collector sweeps the slabs slot by slot, so the sweep walks memory linearly
+ * and freeing a small object never reaches the C allocator.
+ */
+
+#ifdef POOL_ALLOCATOR
+
+/**
+ * @brief Size-class step, in bytes. Slot sizes are multiples of this value.
+ */
+#define POOL_GRANULARITY 16
+
+/**
+ * @brief Largest object size, in bytes, that is served from a pool.
+ */
+#define POOL_MAX_SIZE 256
+
+/**
+ * @brief Number of size classes.
+ */
+#define POOL_CLASS_COUNT (POOL_MAX_SIZE / POOL_GRANULARITY)
+
+/**
+ * @brief Bytes of object storage in one slab.
+ */
+#define POOL_SLAB_SIZE (64 * 1024)
+
+/**
+ * @brief Rounds an allocation size up to the slot size of its class.
+ */
+#define POOL_ROUND(size) (((size) + POOL_GRANULARITY - 1) & ~(size_t)(POOL_GRANULARITY - 1))
+
+/**
+ * @brief A contiguous block of equally sized slots.
+ */
+typedef struct Slab {
+  struct Slab* next;  ///< Next slab of the same size class.
+  int slotSize;       ///< Size of one slot, in bytes.
+  int slotCount;      ///< Number of slots in the slab.
+  bool swept;         ///< Whether the sweep in progress has already passed this slab.
+  uint8_t* slots;     ///< Slot storage, `slotSize * slotCount` bytes.
+  uint8_t live[];     ///< One byte per slot, non-zero while the slot holds an object.
+} Slab;
+
+/**
+ * @brief The slabs and free slots of one size class.
+ */
+typedef struct {
+  Slab* slabs;     ///< All slabs of this class, newest first.
+  void* freeList;  ///< Free slots, linked through their first word.
+} SizeClass;
+
+/**
+ * @brief Callback deciding the fate of a live slot during a sweep.
+ *
+ * @param object The object stored in the slot.
+ * @return `true` to keep the object, `false` once it has been released and the slot may be reused.
+ */
+typedef bool (*PoolSweepFn)(void* object);
+
+/**
+ * @brief All size classes plus the position of an incremental sweep.
+ */
+typedef struct {
+  SizeClass classes[POOL_CLASS_COUNT];  ///< Size classes, indexed by `size / POOL_GRANULARITY`.
+  bool sweeping;                        ///< Whether a sweep is in progress.
+  int sweepClass;                       ///< Size class being swept.
+  Slab* sweepSlab;                      ///< Slab being swept.
+  int sweepSlot;                        ///< Next slot to visit in `sweepSlab`.
+} ObjectPool;
+
+/**
+ * @brief Initializes an empty pool.
+ *
+ * @param pool Pointer to the pool to initialize.
+ */
+void initPool(ObjectPool* pool);
+
+/**
+ * @brief Releases every slab owned by the pool.
+ *
+ * Objects still stored in the slabs are not visited; use `poolForEach` first
+ * to release their resources.
+ *
+ * @param pool Pointer to the pool to free.
+ */
+void freePool(ObjectPool* pool);
+
+/**
+ * @brief Takes a free slot large enough for `size` bytes.
+ *
+ * @param pool The pool to allocate from.
+ * @param size Requested size, at most `POOL_MAX_SIZE`.
+ * @param pending Set to `true` when the slot lies ahead of the sweep in progress, in which case the
+ * sweep will still visit it.
+ * @return The slot.
+ */
+void* poolAllocate(ObjectPool* pool, size_t size, bool* pending);
+
+/**
+ * @brief Starts sweeping every slab that exists now.
+ *
+ * @param pool The pool to sweep.
+ */
+void poolBeginSweep(ObjectPool* pool);
+
+/**
+ * @brief Visits up to `budget` live slots of the sweep in progress.
+ *
+ * Slots for which `sweepObject` returns `false` are returned to their free
+ * list. Slabs created after `poolBeginSweep` are skipped.
+ *
+ * @param pool The pool to sweep.
+ * @param budget Maximum number of slots to visit.
+ * @param sweepObject Decides whether each live object survives.
+ * @return The unused part of `budget`. The sweep is finished once `pool->sweeping` is `false`.
+ */
+int poolSweep(ObjectPool* pool, int budget, PoolSweepFn sweepObject);
+
+/**
+ * @brief Calls `visit` for every live object in the pool.
+ *
+ * @param pool The pool to walk.
+ * @param visit Function called with each object.
+ */
+void poolForEach(ObjectPool* pool, void (*visit)(void* object));
+
+#endif
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef corelox_profiler_h
+#define corelox_profiler_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+
+/**
+ * @file profiler.h
+ * @brief Sampling profiler for Lox code.
+ *
+ * While the profiler is running, the interpreter loop reports every
+ * instruction to `profileInstruction`, which only increments counters: per
+ * opcode, per bytecode offset of the running function, and a call count
+ * whenever a new frame starts executing. Time is measured by sampling: a
+ * `SIGPROF` timer flags that a sample is due and the next instruction
+ * charges the CPU time used since the previous sample to the whole call
+ * stack, walked as `runtimeError` walks it. When the profiler is stopped
+ * the interpreter runs with none of this.
+ *
+ * Everything the profiler gathers lives in its VM, but the `SIGPROF` timer,
+ * its handler and the count of ticks it leaves for the interpreter loop are
+ * per process. Only one VM in a process may be profiled at a time; other VMs
+ * can keep running alongside it unprofiled.
+ *
+ * Results can be printed as top-N tables (`printProfile`) and written as
+ * collapsed stacks for `flamegraph.pl` (`writeProfileStacks`).
+ */
+
+/**
+ * @brief Default interval between two samples, in microseconds of CPU time.
+ */
+#define PROFILE_INTERVAL_US 1000
+
+/**
+ * @brief Number of rows in each table printed by `printProfile`.
+ */
+#define PROFILE_TOP 10
+
+/**
+ * @brief Counters gathered for one function.
+ *
+ * The per-offset arrays are indexed by bytecode offset and sized after the
+ * function's chunk; they are folded into source lines when reporting.
+ */
+typedef struct {
+  ObjFunction* function;        ///< The profiled function, kept alive by `markProfiler`.
+  uint64_t calls;               ///< Frames started for this function.
+  uint64_t selfMicros;          ///< Sampled CPU time spent running this function.
+  uint64_t totalMicros;         ///< Sampled CPU time with this function anywhere on the stack.
+  uint64_t* instructionCounts;  ///< Instructions executed, per bytecode offset.
+  uint64_t* sampleMicros;       ///< Sampled CPU time, per bytecode offset.
+  uint64_t lastSample;          ///< Last sample counted in `totalMicros`, to skip recursion.
+} FunctionProfile;
+
+/**
+ * @brief One distinct call stack seen by the sampler.
+ *
+ * The stack is stored as `depth` function indices, outermost first, starting
+ * at `start` in `Profiler.stackFrames`.
+ */
+typedef struct {
+  uint32_t hash;    ///< Hash of the function indices.
+  int start;        ///< Index of the outermost frame in `Profiler.stackFrames`.
+  int depth;        ///< Number of frames.
+  uint64_t micros;  ///< Sampled CPU time spent with exactly this stack.
+} ProfileStack;
+
+/**
+ * @brief Everything the profiler has gathered since it was initialized.
+ */
+typedef struct {
+  bool running;             ///< Whether the interpreter reports instructions to the profiler.
+  int intervalMicros;       ///< CPU time between two timer ticks.
+  uint64_t lastSampleTime;  ///< Process CPU time of the previous sample, in microseconds.
+
+  FunctionProfile* functions;  ///< One entry per profiled function.
+  int functionCount;           ///< Number of profiled functions.
+  int functionCapacity;        ///< Allocated capacity of `functions`.
+  int* functionSlots;          ///< Open-addressing map from function pointer to index + 1.
+  int functionSlotCapacity;    ///< Capacity of `functionSlots`, a power of two.
+  ObjFunction* lastFunction;   ///< Function of the previous instruction.
+  int lastIndex;               ///< Index of `lastFunction` in `functions`.
+  int lastFrameCount;          ///< Frame count at the previous instruction.
+
+  ProfileStack* stacks;    ///< Distinct sampled stacks.
+  int stackCount;          ///< Number of distinct stacks.
+  int stackCapacity;       ///< Allocated capacity of `stacks`.
+  int* stackSlots;         ///< Open-addressing map from stack hash to index + 1.
+  int stackSlotCapacity;   ///< Capacity of `stackSlots`, a power of two.
+  int* stackFrames;        ///< Function indices of every distinct stack.
+  int stackFrameCount;     ///< Number of entries used in `stackFrames`.
+  int stackFrameCapacity;  ///< Allocated capacity of `stackFrames`.
+
+  uint64_t opcodeCounts[OPCODE_COUNT];  ///< Instructions executed, per opcode.
+  uint64_t instructions;                ///< Instructions executed in total.
+  uint64_t samples;                     ///< Samples taken in total.
+} Profiler;
+
+/**
+ * @brief Initializes the VM's profiler to an empty, stopped state.
+ */
+void initProfiler();
+
+/**
+ * @brief Releases everything the VM's profiler has gathered.
+ */
+void freeProfiler();
+
+/**
+ * @brief Starts counting instructions and sampling the call stack.
+ *
+ * Installs a `SIGPROF` handler and a CPU-time interval timer. Both are per
+ * process, so no other VM may be profiled until `stopProfiler` is called.
+ *
+ * @param intervalMicros Time between samples, in microseconds.
+ */
+void startProfiler(int intervalMicros);
+
+/**
+ * @brief Stops the interval timer. The gathered data is kept.
+ */
+void stopProfiler();
+
+/**
+ * @brief Records one instruction about to be executed.
+ *
+ * Called by the interpreter loop only while the profiler is running.
+ *
+ * @param function The function whose code is running.
+ * @param ip The instruction's address in the function's chunk.
+ */
+void profileInstruction(ObjFunction* function, uint8_t* ip);
+
+/**
+ * @brief Marks every profiled function so that the report can still name it.
+ */
+void markProfiler();
+
+/**
+ * @brief Prints the hottest functions, lines and opcodes to stderr.
+ */
+void printProfile();
+
+/**
+ * @brief Writes the sampled stacks in the collapsed format read by `flamegraph.pl`.
+ *
+ * Each line holds the function names from the outermost frame inwards,
+ * separated by semicolons, followed by the sampled CPU time in microseconds.
+ *
+ * @param path The file to write.
+ * @return true if the file was written.
+ */
+bool writeProfileStacks(const char* path);
+
+#endif
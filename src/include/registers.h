@@ -0,0 +1,46 @@
+#ifndef corelox_registers_h
+#define corelox_registers_h
+
+#include "chunk.h"
+
+/**
+ * @file registers.h
+ * @brief Register pass that turns stack bytecode into three-address instructions.
+ *
+ * The compiler always emits stack code, so `a = b + c` between locals is
+ * five dispatches that copy every operand through the value stack. With
+ * `--registers`, each finished function goes through this pass first, which
+ * rewrites the sequences whose operands are all locals or constants into
+ * instructions reading and writing `frame->slots` directly (`R` is a local
+ * slot, `K` a constant and `op` one of `ADD`, `SUBTRACT`, `MULTIPLY` or
+ * `DIVIDE`):
+ *
+ * | Sequence                                                     | Register instruction      |
+ * | ------------------------------------------------------------ | ------------------------- |
+ * | `GET_LOCAL s`, `SET_LOCAL d`, `POP`                          | `OP_MOVE d s`             |
+ * | `CONSTANT k`, `SET_LOCAL d`, `POP`                           | `OP_LOAD_CONSTANT d k`    |
+ * | `GET_LOCAL a`, `GET_LOCAL b`, `op`, `SET_LOCAL d`, `POP`     | `OP_op_RR d a b`          |
+ * | `GET_LOCAL a`, `CONSTANT k`, `op`, `SET_LOCAL d`, `POP`      | `OP_op_RK d a k`          |
+ * | `GET_LOCAL a`, `GET_LOCAL b`, `LESS`, `JUMP_IF_FALSE`, `POP` | `OP_LESS_RR_JUMP a b`     |
+ * | `GET_LOCAL a`, `CONSTANT k`, `LESS`, `JUMP_IF_FALSE`, `POP`  | `OP_LESS_RK_JUMP a k`     |
+ *
+ * The comparisons `>`, `<=` and `>=` have the same two forms. A
+ * compare-and-branch never puts its condition on the stack, so it also
+ * drops the `POP` at its target. It is only formed when that `POP` is
+ * reached by this jump alone, which holds for every `if` and loop
+ * condition the compiler emits.
+ *
+ * Everything else stays stack code, and the interpreter runs both kinds
+ * of instruction in the same loop. Jumps, lines and inline cache offsets
+ * are rewritten the same way the peephole pass rewrites them, and the
+ * peephole pass then runs over the result as usual.
+ */
+
+/**
+ * @brief Rewrites a finished chunk in place into register instructions where it can.
+ *
+ * @param chunk Pointer to the chunk to translate. It must end in a return.
+ */
+void translateToRegisters(Chunk* chunk);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef corelox_scanner_h
 #define corelox_scanner_h
 
+#include <stdio.h>
+
 /**
  * @file scanner.h
  * @brief Lexical scanner for tokenizing source code.
@@ -21,20 +23,22 @@
  */
 typedef enum {
   // Single-character tokens.
-  TOKEN_LEFT_PAREN,   ///< '('
-  TOKEN_RIGHT_PAREN,  ///< ')'
-  TOKEN_LEFT_BRACE,   ///< '{'
-  TOKEN_RIGHT_BRACE,  ///< '}'
-  TOKEN_COMMA,        ///< ','
-  TOKEN_DOT,          ///< '.'
-  TOKEN_MINUS,        ///< '-'
-  TOKEN_PLUS,         ///< '+'
-  TOKEN_SEMICOLON,    ///< ';'
-  TOKEN_SLASH,        ///< '/'
-  TOKEN_STAR,         ///< '*'
-  TOKEN_QUESTION,     ///< '?'
-  TOKEN_COLON,        ///< ':'
-  TOKEN_PERCENT,      ///< '%'
+  TOKEN_LEFT_PAREN,     ///< '('
+  TOKEN_RIGHT_PAREN,    ///< ')'
+  TOKEN_LEFT_BRACE,     ///< '{'
+  TOKEN_RIGHT_BRACE,    ///< '}'
+  TOKEN_LEFT_BRACKET,   ///< '['
+  TOKEN_RIGHT_BRACKET,  ///< ']'
+  TOKEN_COMMA,          ///< ','
+  TOKEN_DOT,            ///< '.'
+  TOKEN_MINUS,          ///< '-'
+  TOKEN_PLUS,           ///< '+'
+  TOKEN_SEMICOLON,      ///< ';'
+  TOKEN_SLASH,          ///< '/'
+  TOKEN_STAR,           ///< '*'
+  TOKEN_QUESTION,       ///< '?'
+  TOKEN_COLON,          ///< ':'
+  TOKEN_PERCENT,        ///< '%'
 
   // One or two character tokens.
   TOKEN_BANG,           ///< '!'
@@ -82,18 +86,31 @@ typedef enum {
   TOKEN_EOF     ///< End of file token.
 } TokenType;
 
+/**
+ * @brief A buffer that streamed source is read into.
+ */
+typedef struct SourceBuffer SourceBuffer;
+
 /**
  * @brief Represents the state of the scanner during tokenization.
  *
  * The `Scanner` struct keeps track of the current position in the source
  * code during scanning. It holds pointers to the start of the current
- * token being scanned, the current position in the source, and the
- * current line number.
+ * token being scanned, the current position in the source, the end of the
+ * source read so far, and the current line number.
+ *
+ * The source need not be NUL-terminated. When it is streamed from a file,
+ * the scanner reads another chunk whenever it runs out, and keeps every
+ * earlier buffer a token may still point into until `discardSource` says
+ * those tokens are dead.
  */
 typedef struct {
-  const char* start;    ///< Pointer to the start of the current token.
-  const char* current;  ///< Pointer to the current character being scanned.
-  int line;             ///< The current line number in the source code.
+  const char* start;     ///< Pointer to the start of the current token.
+  const char* current;   ///< Pointer to the current character being scanned.
+  const char* end;       ///< One past the last character of the source available so far.
+  int line;              ///< The current line number in the source code.
+  FILE* stream;          ///< File the rest of the source is read from, or NULL once it is all in.
+  SourceBuffer* buffer;  ///< Buffer holding the streamed source at `current`, or NULL.
 } Scanner;
 
 /**
@@ -115,12 +132,40 @@ typedef struct {
  * @brief Initializes the scanner with the source code.
  *
  * This function sets up the scanner to start reading from the given
- * source code string. It initializes the scanner's internal state,
- * setting the current position to the beginning of the source.
+ * source code. It initializes the scanner's internal state, setting the
+ * current position to the beginning of the source.
+ *
+ * @param source Pointer to the source code to be scanned. It need not be NUL-terminated.
+ * @param length Number of characters in `source`.
+ */
+void initScanner(const char* source, size_t length);
+
+/**
+ * @brief Initializes the scanner to read the source code from `file` as it goes.
  *
- * @param source Pointer to the source code string to be scanned.
+ * Only the source from the oldest live token onwards is kept in memory, so
+ * call `discardSource` whenever earlier tokens are no longer needed, and
+ * `freeScanner` when done.
+ *
+ * @param file The open file to read the source from. The scanner does not close it.
+ */
+void initStreamScanner(FILE* file);
+
+/**
+ * @brief Lets a streaming scanner free the source before `keep`.
+ *
+ * Every token that starts before `keep` becomes invalid. Does nothing when
+ * the scanner is not streaming.
+ *
+ * @param keep Start of the oldest token still needed.
+ * @return Where that token's text is afterwards.
+ */
+const char* discardSource(const char* keep);
+
+/**
+ * @brief Frees the buffers of a streaming scanner.
  */
-void initScanner(const char* source);
+void freeScanner();
 
 /**
  * @brief Scans the next token from the source code.
@@ -10,37 +10,83 @@
  *
  * Details of the implementation are as follows:
  *
- * - Hash Function: FNV-1a (Fowler-Noll-Vo alternate)
- * - Collision Resolution: Open Addressing (Linear Probing)
+ * - Hash Function: FNV-1a for short strings, 64-bit word-at-a-time mixing for longer ones
+ * - Layout: Struct of arrays; a control byte per slot, then the keys, then the values
+ * - Collision Resolution: Open Addressing (Linear Probing), scanned `TABLE_GROUP_WIDTH` control
+ *   bytes at a time, with SSE2 compares where available
  * - Load Factor: 0.75 (change TABLE_MAX_LOAD to adjust)
- * - Growth Policy: Double the capacity when load factor is reached
- * - Deletion strategy: Tombstones (marking deleted entries)
+ * - Growth Policy: Double the capacity when load factor is reached, halve it when a delete leaves
+ *   the table below TABLE_MIN_LOAD
+ * - Deletion strategy: Backward shift, so there are no tombstones
+ *
+ * The string intern table is a separate `StringTable`: its entries carry each
+ * string's hash and length (and the bytes of short strings) so probes rarely
+ * dereference the strings, and it deletes by shifting entries back instead of
+ * leaving tombstones.
  */
 
 /**
- * @brief Represents a key-value pair in the hash table.
+ * @brief Number of leading string bytes stored inline in a `StringEntry`.
+ */
+#define STRING_ENTRY_PREFIX 8
+
+/**
+ * @brief Number of control bytes examined by one probe step.
+ */
+#define TABLE_GROUP_WIDTH 16
+
+/**
+ * @brief Control byte of an empty slot.
  *
- * The `Entry` struct represents a single key-value pair in the hash table.
- * Each entry contains a key (an `ObjString` pointer) and a value (a `Value`).
+ * A full slot's control byte holds the top seven bits of its key's hash, so
+ * only empty slots have the high bit set.
  */
-typedef struct {
-  ObjString* key;
-  Value value;
-} Entry;
+#define TABLE_EMPTY 0x80
 
 /**
  * @brief Represents a hash table for storing key-value pairs.
  *
- * The `Table` struct represents a hash table that stores key-value pairs.
- * The table is implemented as an array of `Entry` structs, with each entry
- * containing a key (an `ObjString` pointer) and a value (a `Value`).
+ * The `Table` struct maps `ObjString` keys to values. A probe first compares
+ * a whole group of one-byte hash fragments in `control`, and only touches
+ * `keys` for the slots whose fragment matches, so a miss usually reads
+ * nothing but the control bytes.
+ *
+ * All three arrays live in one allocation. `control` has `TABLE_GROUP_WIDTH`
+ * extra bytes that mirror the first slots, so a group starting near the end
+ * of the table can be loaded without wrapping.
  */
 typedef struct {
-  int count;
-  int capacity;
-  Entry* entries;
+  int count;         ///< Number of keys in the table.
+  int capacity;      ///< Number of slots, always zero or a power of two.
+  uint8_t* control;  ///< One `TABLE_EMPTY` or hash-fragment byte per slot, plus the mirror.
+  ObjString** keys;  ///< Key of each full slot.
+  Value* values;     ///< Value of each full slot.
 } Table;
 
+/**
+ * @brief One slot of the string intern table.
+ *
+ * The hash and length are copied out of the string so that a probe can reject
+ * a non-matching entry without dereferencing `key`. Strings of up to
+ * `STRING_ENTRY_PREFIX` bytes also keep their bytes in `prefix`, so matching
+ * them never touches the string either. A slot is empty when `key` is NULL.
+ */
+typedef struct {
+  ObjString* key;   ///< The interned string, or NULL for an empty slot.
+  uint32_t hash;    ///< Cached hash of the string.
+  int length;       ///< Length of the string.
+  uint64_t prefix;  ///< The bytes of a short string, zero padded; unused for longer strings.
+} StringEntry;
+
+/**
+ * @brief Open-addressed set of interned strings.
+ */
+typedef struct {
+  int count;             ///< Number of strings in the table.
+  int capacity;          ///< Number of slots, always zero or a power of two.
+  StringEntry* entries;  ///< Pointer to the slot array.
+} StringTable;
+
 /**
  * @brief Initializes a new hash table.
  *
@@ -75,22 +121,6 @@ void freeTable(Table* table);
  */
 bool tableGet(Table* table, ObjString* key, Value* value);
 
-/**
- * @brief Finds a string in the hash table by its characters.
- *
- * This function searches for a string in the hash table by its characters.
- * It computes the hash value of the string and looks for a matching key
- * in the table. If a matching key is found, the corresponding `ObjString`
- * pointer is returned.
- *
- * @param table A pointer to the hash table to search.
- * @param chars The characters of the string to search for.
- * @param length The length of the string.
- * @param hash The hash value of the string.
- * @return The `ObjString` pointer if the string is found, NULL otherwise.
- */
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
-
 /**
  * @brief Sets a key-value pair in the hash table.
  *
@@ -111,7 +141,8 @@ bool tableSet(Table* table, ObjString* key, Value value);
  *
  * This function removes a key-value pair from the hash table by key. It
  * searches for the key in the table and, if found, removes the corresponding
- * entry (by replacing it with a tombstone).
+ * entry and shifts the later entries of its probe run back into the hole, so
+ * no tombstone is left behind. A table left sparse by the delete is shrunk.
  * The function returns true if the key was found and removed successfully.
  *
  * @param table A pointer to the hash table to update.
@@ -133,17 +164,6 @@ bool tableDelete(Table* table, ObjString* key);
  */
 void tableAddAll(Table* from, Table* to);
 
-/**
- * @brief Removes all white (non-reachable) objects from a table.
- *
- * This function removes all white (non-reachable) objects from a table.
- * It iterates over the entries in the table and removes any key-value pairs
- * where the key is a white object (not reachable during garbage collection).
- *
- * @param table A pointer to the table to remove white objects from.
- */
-void tableRemoveWhite(Table* table);
-
 /**
  * @brief Marks all objects in a table as reachable during garbage collection.
  *
@@ -155,4 +175,51 @@ void tableRemoveWhite(Table* table);
  */
 void markTable(Table* table);
 
+/**
+ * @brief Initializes an empty string intern table.
+ *
+ * @param table A pointer to the table to initialize.
+ */
+void initStringTable(StringTable* table);
+
+/**
+ * @brief Frees the slot array of a string intern table.
+ *
+ * The strings themselves are owned by the garbage collector and are not freed.
+ *
+ * @param table A pointer to the table to free.
+ */
+void freeStringTable(StringTable* table);
+
+/**
+ * @brief Finds an interned string by its characters.
+ *
+ * @param table A pointer to the table to search.
+ * @param chars The characters of the string to search for.
+ * @param length The length of the string.
+ * @param hash The hash value of the string.
+ * @return The interned `ObjString`, or NULL if the table holds no such string.
+ */
+ObjString* stringTableFind(StringTable* table, const char* chars, int length, uint32_t hash);
+
+/**
+ * @brief Adds a string that is not yet in the table.
+ *
+ * Growing the table can trigger a collection, so `string` must be reachable.
+ *
+ * @param table A pointer to the table to add to.
+ * @param string The string to intern.
+ */
+void stringTableAdd(StringTable* table, ObjString* string);
+
+/**
+ * @brief Removes every string that was not marked by the last trace.
+ *
+ * The intern table holds its strings weakly; this runs between marking and
+ * sweeping so that the table never points at freed strings.
+ *
+ * @param table A pointer to the table to prune.
+ */
+void stringTableRemoveWhite(StringTable* table);
+
 #endif
\ No newline at end of file
@@ -22,6 +22,9 @@
  */
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjClass ObjClass;
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjShape ObjShape;
 
 #ifdef NAN_BOXING
 
@@ -35,6 +38,7 @@ typedef struct ObjString ObjString;
  * values and optimize memory usage.
  */
 
+#include <math.h>
 #include <string.h>
 
 /**
@@ -62,6 +66,19 @@ typedef struct ObjString ObjString;
  */
 #define TAG_TRUE 3  // 11.
 
+/**
+ * @brief Represents the tagged value for an unassigned global slot in the VM
+ */
+#define TAG_UNDEFINED 4  // 100.
+
+/**
+ * @brief Represents the bit that marks a quiet NaN as a small integer, held in the low 32 bits
+ *
+ * The singleton tags above leave this bit clear and object pointers set the sign bit, so a value
+ * with both `QNAN` and this bit set, but not the sign bit, is always an integer.
+ */
+#define INT_TAG ((uint64_t)0x0002000000000000)
+
 /**
  * @brief Bitwise representation of a tagged value in the VM, to be used in NaN-boxing
  */
@@ -72,6 +89,22 @@ typedef uint64_t Value;
  */
 #define NUMBER_VAL(num) numToValue(num)
 
+/**
+ * @brief Encodes a 32-bit integer to a Value tagged as a small integer (quiet NaN tagged with
+ * `INT_TAG`)
+ *
+ * Small integers are numbers like any other: every number operation accepts them, and they compare,
+ * print and convert exactly as the double of the same value would. They only let the interpreter
+ * skip the conversions on integer operands.
+ */
+#define INT_VAL(i) ((Value)(QNAN | INT_TAG | (uint32_t)(int32_t)(i)))
+
+/**
+ * @brief Encodes a number as a small integer when that represents it exactly, and as a double
+ * otherwise.
+ */
+#define COMPACT_NUMBER_VAL(num) compactNumberToValue(num)
+
 /**
  * @brief Encodes an object pointer to a Value tagged as an object (quiet NaN tagged with a sign bit
  * set to 1)
@@ -96,19 +129,44 @@ typedef uint64_t Value;
  */
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 
+/**
+ * @brief Represents the sentinel stored in global slots that have no definition yet (quiet NaN
+ * tagged with the `TAG_UNDEFINED` value). It never escapes to user code.
+ */
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+
 /**
  * @brief Represents the tagged value for a boolean value in the VM (either tagged 'true' or
  * 'false')
  */
 #define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
 
+/**
+ * @brief Checks if a `Value` is a number stored as a double.
+ */
+#define IS_DOUBLE(value) (((value) & QNAN) != QNAN)
+
+/**
+ * @brief Checks if a `Value` is a number stored as a small integer.
+ */
+#define IS_INT(value) (((value) & (SIGN_BIT | QNAN | INT_TAG)) == (QNAN | INT_TAG))
+
+/**
+ * @brief Checks if two `Value`s are both small integers, with a single test.
+ *
+ * Both values need `QNAN` and `INT_TAG` set for their conjunction to have them. An object could
+ * only get past the sign bit test with `INT_TAG` set in its address, which no pointer has.
+ */
+#define ARE_INTS(a, b) IS_INT((a) & (b))
+
 /**
  * @brief Checks if a `Value` is a number value.
  *
- * This macro checks if a `Value` struct represents a number value. It is used
- * to determine if a value is a number when working with values in the interpreter.
+ * This macro checks if a `Value` struct represents a number value, stored
+ * either as a double or as a small integer. It is used to determine if a value
+ * is a number when working with values in the interpreter.
  */
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_NUMBER(value) (IS_DOUBLE(value) || IS_INT(value))
 
 /**
  * @brief Checks if a `Value` is an object value.
@@ -134,6 +192,14 @@ typedef uint64_t Value;
  */
 #define IS_NIL(value) ((value) == NIL_VAL)
 
+/**
+ * @brief Checks if a `Value` is the undefined global sentinel.
+ *
+ * This macro checks if a `Value` is the sentinel stored in a global slot that
+ * has been reserved by the compiler but not yet defined at runtime.
+ */
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
 /**
  * @brief Accesses the number value of a `Value`.
  *
@@ -143,6 +209,16 @@ typedef uint64_t Value;
  */
 #define AS_NUMBER(value) valueToNum(value)
 
+/**
+ * @brief Accesses the number held by a `Value` known to be a double, skipping the integer check.
+ */
+#define AS_DOUBLE(value) doubleBitsToNum(value)
+
+/**
+ * @brief Accesses the integer held by a small-integer `Value`.
+ */
+#define AS_INT(value) ((int32_t)(uint32_t)(value))
+
 /**
  * @brief Accesses the object value of a `Value`.
  *
@@ -175,18 +251,40 @@ static inline Value numToValue(double num) {
 }
 
 /**
- * @brief Helper function to convert a Value to a double
+ * @brief Helper function to convert a Value holding a double to that double
  *
- * This function converts a Value tagged as a number to a double. It works by using
+ * This function converts a Value tagged as a double to a double. It works by using
  * compiler optimizations to generify the memcpy call and ecourage the compiler to
  * treat the 64-bit floating-point number as a double.
  */
-static inline double valueToNum(Value value) {
+static inline double doubleBitsToNum(Value value) {
   double num;
   memcpy(&num, &value, sizeof(Value));
   return num;
 }
 
+/**
+ * @brief Helper function to convert a Value tagged as a number, double or small integer, to a
+ * double
+ */
+static inline double valueToNum(Value value) {
+  if (IS_INT(value)) return (double)AS_INT(value);
+  return doubleBitsToNum(value);
+}
+
+/**
+ * @brief Helper function to convert a double to a Value, as a small integer where possible
+ *
+ * Integral values in the 32-bit range become small integers. Negative zero,
+ * which no integer can represent, stays a double.
+ */
+static inline Value compactNumberToValue(double num) {
+  if (num >= INT32_MIN && num <= INT32_MAX && num == (int32_t)num && !(num == 0 && signbit(num))) {
+    return INT_VAL((int32_t)num);
+  }
+  return numToValue(num);
+}
+
 #else
 
 /**
@@ -196,7 +294,7 @@ static inline double valueToNum(Value value) {
  * stored in the virtual machine. This is used to distinguish between different
  * types of values (e.g., numbers, strings) when working with the interpreter.
  */
-typedef enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ } ValueType;
+typedef enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ, VAL_UNDEFINED } ValueType;
 
 /**
  * @brief Represents a value in the virtual machine via a tagged union.
@@ -230,6 +328,14 @@ typedef struct {
  */
 #define IS_NIL(value) ((value).type == VAL_NIL)
 
+/**
+ * @brief Checks if a `Value` is the undefined global sentinel.
+ *
+ * This macro checks if a `Value` is the sentinel stored in a global slot that
+ * has been reserved by the compiler but not yet defined at runtime.
+ */
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+
 /**
  * @brief Checks if a `Value` is a number value.
  *
@@ -291,6 +397,14 @@ typedef struct {
  */
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 
+/**
+ * @brief Creates the sentinel stored in global slots that have no definition yet.
+ *
+ * This value is only ever stored in the VM's global slot array and never
+ * escapes to user code.
+ */
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
+
 /**
  * @brief Creates a `Value` struct with a number value.
  *
@@ -309,6 +423,41 @@ typedef struct {
  */
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+/**
+ * @brief Small integers exist only with NaN-boxing; here every number is a double.
+ */
+#define IS_INT(value) false
+
+/**
+ * @brief Small integers exist only with NaN-boxing, so no pair of values is ever two of them.
+ */
+#define ARE_INTS(a, b) false
+
+/**
+ * @brief Every number is a double without NaN-boxing.
+ */
+#define IS_DOUBLE(value) IS_NUMBER(value)
+
+/**
+ * @brief Accesses the number value of a `Value`. Without NaN-boxing this is `AS_NUMBER`.
+ */
+#define AS_DOUBLE(value) AS_NUMBER(value)
+
+/**
+ * @brief Accesses the integer value of a number known to be integral.
+ */
+#define AS_INT(value) ((int32_t)(value).as.number)
+
+/**
+ * @brief Creates a `Value` struct with a number value given as an integer.
+ */
+#define INT_VAL(i) NUMBER_VAL((double)(i))
+
+/**
+ * @brief Creates a `Value` struct with a number value. Without NaN-boxing this is `NUMBER_VAL`.
+ */
+#define COMPACT_NUMBER_VAL(num) NUMBER_VAL(num)
+
 #endif
 
 /**
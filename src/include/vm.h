@@ -2,7 +2,10 @@
 #define corelox_vm_h
 
 #include "chunk.h"
+#include "memory.h"
 #include "object.h"
+#include "pool.h"
+#include "profiler.h"
 #include "table.h"
 #include "value.h"
 
@@ -16,8 +19,20 @@
  * and provides the main execution loop, memory management, and stack operations.
  */
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+/**
+ * @brief Number of call frames allocated up front; the frame array doubles from there.
+ */
+#define FRAMES_INITIAL 64
+
+/**
+ * @brief Default recursion limit, the deepest call stack before "Stack overflow." is reported.
+ */
+#define FRAMES_MAX 10000
+
+/**
+ * @brief Number of value stack slots allocated up front; the stack doubles from there.
+ */
+#define STACK_INITIAL (FRAMES_INITIAL * UINT8_COUNT)
 
 /**
  * @brief Represents a call frame in the virtual machine.
@@ -32,6 +47,40 @@ typedef struct {
   Value* slots;         ///< Array of slots for local variables and arguments.
 } CallFrame;
 
+/**
+ * @brief Counters describing what a VM has done since it was created.
+ *
+ * They are always kept: each one is a single increment on a path that does
+ * far more work than that anyway, so leaving them on costs next to nothing.
+ * The exception is `instructions`, which would cost an increment on every
+ * instruction; it is only filled in while `VM.countInstructions` is set, and
+ * the interpreter loop costs nothing extra while it is not. Embedders read
+ * the counters with `getStatsVM()`, Lox code with the `stats()` native, and
+ * `--stats` prints them when the interpreter exits.
+ */
+typedef struct {
+  uint64_t objectsAllocated[OBJ_TYPE_COUNT];  ///< Objects allocated, per type.
+  uint64_t bytesAllocated[OBJ_TYPE_COUNT];    ///< Bytes of those objects, per type.
+
+  uint64_t gcCycles;         ///< Completed collection cycles.
+  uint64_t gcPauses;         ///< Times the collector ran, a cycle taking one or more.
+  double gcPauseSeconds;     ///< Wall-clock time of all the pauses together.
+  double gcMaxPauseSeconds;  ///< Wall-clock time of the longest pause.
+  uint64_t gcBytesFreed;     ///< Bytes the collector reclaimed.
+
+  uint64_t tableLookups;  ///< Hash table and intern table lookups.
+  uint64_t tableProbes;   ///< Probes a lookup made past the first, summed over all lookups.
+  uint64_t tableResizes;  ///< Times a hash table or the intern table was resized.
+
+  uint64_t instructions[OPCODE_COUNT];  ///< Instructions run, per opcode, if counted at all.
+  uint64_t framesPushed;                ///< Calls of Lox functions, each pushing a frame.
+} VMStats;
+
+/**
+ * @brief Longest runtime error message a native function can raise, including the terminator.
+ */
+#define NATIVE_ERROR_MAX 256
+
 /**
  * @brief Represents the virtual machine's execution state.
  *
@@ -39,12 +88,17 @@ typedef struct {
  * current chunk of bytecode being executed, the instruction pointer,
  * the value stack, and the stack's current capacity.
  *
- * @tparam frames Array of call frames for function calls.
+ * @tparam frames Dynamic array of call frames for function calls.
  * @tparam frameCount The number of active call frames.
+ * @tparam frameCapacity The current allocated capacity of `frames`.
+ * @tparam maxFrames Recursion limit: the most frames `frames` may grow to.
  * @tparam stack Dynamic array used for the value stack.
  * @tparam stackTop Points to the top of the stack.
  * @tparam stackCapacity The current allocated capacity of the stack.
- * @tparam globals Table of global variables.
+ * @tparam stackUpvalues Open upvalue of each stack slot, or NULL; sized like `stack`.
+ * @tparam globalSlots Table mapping each global name to its slot index.
+ * @tparam globalValues Flat array of global values, indexed by slot.
+ * @tparam globalNames Name of each global slot, used for error messages.
  * @tparam strings Table of interned string objects.
  * @tparam initString The string "init" used for class initialization.
  * @tparam openUpvalues Linked list of open upvalues for closure capture.
@@ -53,18 +107,42 @@ typedef struct {
  * @tparam objects Linked list of all objects managed by the VM.
  * @tparam grayCount Number of gray objects in the object list
  * @tparam grayCapacity Number of gray objects in the stack
+ * @tparam gcMode Whether collections run stop-the-world or incrementally.
+ * @tparam gcThreads Number of threads a collection marks the whole heap with.
+ * @tparam gcPhase Phase of the collection cycle in progress.
+ * @tparam sweepLink Link to the next object to sweep during `GC_PHASE_SWEEP`.
+ * @tparam gcObjectsAllocated Objects allocated since the last increment while marking.
+ * @tparam gcPauses Every recorded collector pause, in order.
+ * @tparam peephole Whether the compiler fuses instruction sequences into superinstructions.
+ * @tparam registers Whether the compiler turns local arithmetic and conditions into register
+ *         instructions.
+ * @tparam jit Whether hot functions are compiled to machine code, when `JIT` is enabled.
+ * @tparam countInstructions Whether the interpreter loop fills in `stats.instructions`.
+ * @tparam countAllocations Whether allocations are attributed to the opcode that made them.
+ * @tparam currentOpcode Opcode being executed while `countAllocations` is set, or `OPCODE_COUNT`.
+ * @tparam allocCounts Objects allocated per opcode; the last entry covers everything else.
+ * @tparam profiler Counters and samples gathered by `--profile`.
+ * @tparam stats Counters describing what the VM has done, always kept.
+ * @tparam nativeErrorMessage Message of the runtime error the last failing native raised.
+ * @tparam pool Size-class slabs holding the small objects, when `POOL_ALLOCATOR` is enabled.
  */
 typedef struct {
-  CallFrame frames[FRAMES_MAX];  ///< Array of call frames for function calls.
-  int frameCount;                ///< The number of active call frames.
+  CallFrame* frames;  ///< Dynamic array of call frames for function calls.
+  int frameCount;     ///< The number of active call frames.
+  int frameCapacity;  ///< The current allocated capacity of `frames`.
+  int maxFrames;      ///< Recursion limit: the most frames `frames` may grow to.
 
   Value* stack;       ///< Dynamic array used for the value stack.
   Value* stackTop;    ///< Points to the top of the stack.
   int stackCapacity;  ///< The current allocated capacity of the stack.
 
-  Table globals;  ///< Table of global variables.
+  ObjUpvalue** stackUpvalues;  ///< Open upvalue of each stack slot, or NULL; sized like `stack`.
+
+  Table globalSlots;        ///< Maps each global name to its slot index.
+  ValueArray globalValues;  ///< Flat array of global values, indexed by slot.
+  ValueArray globalNames;   ///< Name of each global slot, used for error messages.
 
-  Table strings;          ///< Table of interned string objects.
+  StringTable strings;    ///< Table of interned string objects.
   ObjString* initString;  ///< The string "init" used for class initialization.
 
   ObjUpvalue* openUpvalues;  ///< Linked list of open upvalues for closure capture.
@@ -75,6 +153,33 @@ typedef struct {
   int grayCount;          ///< Number of gray objects in the object list
   int grayCapacity;       ///< Number of gray objects in the stack
   Obj** grayStack;        ///< Stack of objects with marked roots to traverse during GC loop
+
+  GCMode gcMode;           ///< Whether collections run stop-the-world or incrementally.
+  int gcThreads;           ///< Number of threads a collection marks the whole heap with.
+  GCPhase gcPhase;         ///< Phase of the collection cycle in progress.
+  Obj** sweepLink;         ///< Link to the next object to sweep during `GC_PHASE_SWEEP`.
+  int gcObjectsAllocated;  ///< Objects allocated since the last increment while marking.
+  GCPause* gcPauses;       ///< Every recorded collector pause, in order.
+  int gcPauseCount;        ///< Number of recorded pauses.
+  int gcPauseCapacity;     ///< Allocated capacity of `gcPauses`.
+
+  bool peephole;           ///< Whether the compiler runs the peephole pass.
+  bool registers;          ///< Whether the compiler runs the register pass.
+  bool jit;                ///< Whether hot functions are compiled to machine code.
+  bool countInstructions;  ///< Whether the interpreter loop fills in `stats.instructions`.
+  bool countAllocations;   ///< Whether allocations are attributed to the opcode that made them.
+
+  int currentOpcode;                         ///< Opcode being executed, or `OPCODE_COUNT`.
+  AllocCount allocCounts[OPCODE_COUNT + 1];  ///< Objects allocated per opcode.
+
+  Profiler profiler;  ///< Counters and samples gathered by `--profile`.
+  VMStats stats;      ///< Counters describing what the VM has done, always kept.
+
+  char nativeErrorMessage[NATIVE_ERROR_MAX];  ///< Error the last failing native raised.
+
+#ifdef POOL_ALLOCATOR
+  ObjectPool pool;  ///< Size-class slabs holding the small objects.
+#endif
 } VM;
 
 /**
@@ -91,32 +196,85 @@ typedef enum {
 } InterpretResult;
 
 /**
- * @brief Global static instance of the virtual machine.
+ * @brief The virtual machine the calling thread is currently running.
  *
- * The `vm` variable is a global static instance of the virtual machine
- * that is used throughout the interpreter to execute bytecode and manage
- * the VM's state. It is defined in `vm.c` and initialized in `main.c`.
+ * Everything in the interpreter, from the allocator to the compiler's GC
+ * roots, works on this VM. Each thread has its own pointer, which starts out
+ * NULL: `initVM()` sets it to a fresh VM, and `useVM()` switches it between
+ * VMs created with `createVM()`. Two threads must never use the same VM at
+ * the same time, but VMs share no state with each other, so separate scripts
+ * can run in parallel on separate threads.
  */
-extern VM vm;
+extern THREAD_LOCAL VM* vm;
 
 /**
- * @brief Initializes the virtual machine.
+ * @brief Creates a virtual machine and makes it the calling thread's current VM.
  *
  * This function sets up the virtual machine's internal state, preparing it
  * for bytecode execution. It initializes the stack and other execution-related
- * structures, and must be called before any bytecode is executed.
+ * structures, and must be called before any bytecode is executed. A VM that
+ * was current before is left as it was; only the thread's pointer moves.
  */
 void initVM();
 
 /**
- * @brief Frees the virtual machine's memory.
+ * @brief Frees the calling thread's current VM.
  *
  * This function deallocates memory used by the virtual machine, including
- * its stack and other execution-related structures. It should be called
- * when the virtual machine is no longer needed.
+ * its stack, every object it allocated, and the VM itself. The thread has no
+ * current VM afterwards.
  */
 void freeVM();
 
+/**
+ * @brief Makes `instance` the calling thread's current VM.
+ *
+ * @param instance A VM from `createVM()`, or NULL.
+ * @return The VM that was current before, so the caller can switch back.
+ */
+VM* useVM(VM* instance);
+
+/**
+ * @brief Creates an independent virtual machine for embedding.
+ *
+ * The new VM has its own heap, globals and interned strings. The calling
+ * thread's current VM is left unchanged.
+ *
+ * @return The new VM, to pass to `interpretVM()` and `destroyVM()`.
+ */
+VM* createVM();
+
+/**
+ * @brief Compiles and runs `source` in the given VM.
+ *
+ * Globals persist between calls on the same VM, as they do between REPL
+ * lines. The calling thread's current VM is restored before returning.
+ *
+ * @param instance A VM from `createVM()`.
+ * @param source The source code to compile and execute.
+ * @return An `InterpretResult` representing the outcome of the execution.
+ */
+InterpretResult interpretVM(VM* instance, const char* source);
+
+/**
+ * @brief Frees a VM created with `createVM()` and everything it allocated.
+ *
+ * @param instance The VM to free. If it is the calling thread's current VM,
+ *                 the thread is left without one.
+ */
+void destroyVM(VM* instance);
+
+/**
+ * @brief Returns the counters of the given VM.
+ *
+ * The counters keep running, so the result describes the VM at the time it
+ * is read. Instructions run as machine code by the JIT are not counted.
+ *
+ * @param instance A VM from `createVM()` or `initVM()`.
+ * @return The VM's counters, valid until the VM is destroyed.
+ */
+const VMStats* getStatsVM(VM* instance);
+
 /**
  * @brief Interprets and executes a chunk of bytecode from source code.
  *
@@ -130,12 +288,58 @@ void freeVM();
  */
 InterpretResult interpret(const char* source);
 
+/**
+ * @brief Executes an already compiled top-level function.
+ *
+ * Used to run a script loaded from a bytecode cache instead of compiling it.
+ *
+ * @param function The script function, as returned by `compile()` or `readBytecode()`.
+ * @return An `InterpretResult` representing the outcome of the execution.
+ */
+InterpretResult interpretFunction(ObjFunction* function);
+
+/**
+ * @brief Resolves a global variable name to its slot index.
+ *
+ * The compiler calls this for every global it references, so each name is
+ * bound to one stable slot for the lifetime of the VM. A newly reserved slot
+ * holds `UNDEFINED_VAL` until `OP_DEFINE_GLOBAL` runs, which preserves late
+ * binding. Slots persist across `interpret()` calls, so REPL lines share them.
+ *
+ * @param name The name of the global variable.
+ * @return The slot index of the global in `vm->globalValues`.
+ */
+int globalSlot(ObjString* name);
+
+/**
+ * @brief Binds a native function to a global variable of the current VM.
+ *
+ * @param name The global's name.
+ * @param function The C implementation.
+ * @param arity The exact number of arguments calls must pass.
+ */
+void defineNative(const char* name, NativeFn function, int arity);
+
+/**
+ * @brief Raises a runtime error from inside a native function.
+ *
+ * A native fails by returning the result of this call. The VM then reports
+ * the formatted message with a stack trace, exactly like the errors it raises
+ * itself, and the call never produces a value.
+ *
+ * @param format A printf-style format string for the message.
+ * @return `UNDEFINED_VAL`, which user code can never see, meaning "this native failed".
+ */
+Value nativeError(const char* format, ...);
+
 /**
  * @brief Pushes a value onto the virtual machine's stack.
  *
  * This function pushes a `Value` onto the top of the stack, advancing
- * the `stackTop` pointer. If the stack exceeds its current capacity,
- * it dynamically grows to accommodate more values.
+ * the `stackTop` pointer. When that fills the stack, it dynamically grows
+ * to accommodate more values, moving the frame slots and open upvalues that
+ * point into it along with the values. The value is already on the stack
+ * by then, so a collection triggered by the growth keeps it.
  *
  * @param value The value to push onto the stack.
  */
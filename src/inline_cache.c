@@ -0,0 +1,71 @@
+#include "inline_cache.h"
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+void initInlineCacheArray(InlineCacheArray* array) {
+  array->count = 0;
+  array->capacity = 0;
+  array->caches = NULL;
+}
+
+void freeInlineCacheArray(InlineCacheArray* array) {
+  FREE_ARRAY(InlineCache, array->caches, array->capacity);
+  initInlineCacheArray(array);
+}
+
+int addInlineCache(InlineCacheArray* array, int offset) {
+  if (array->capacity < array->count + 1) {
+    int oldCapacity = array->capacity;
+    array->capacity = GROW_CAPACITY(oldCapacity);
+    array->caches = GROW_ARRAY(InlineCache, array->caches, oldCapacity, array->capacity);
+  }
+
+  InlineCache* cache = &array->caches[array->count];
+  cache->offset = offset;
+  cache->count = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->megamorphic = 0;
+  return array->count++;
+}
+
+void recordInlineCache(InlineCache* cache, ObjShape* shape, ObjClosure* method,
+                       ObjShape* transition, int slot) {
+  InlineCacheEntry* entry = NULL;
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].shape == shape) {
+      entry = &cache->entries[i];
+      break;
+    }
+  }
+
+  if (entry == NULL) {
+    if (cache->count == INLINE_CACHE_ENTRIES) {
+      cache->megamorphic++;
+      return;
+    }
+    entry = &cache->entries[cache->count++];
+  }
+
+  entry->shape = shape;
+  entry->version = shape->klass->version;
+  entry->method = method;
+  entry->transition = transition;
+  entry->slot = slot;
+  WRITE_BARRIER_OBJ(shape);
+  WRITE_BARRIER_OBJ(method);
+  WRITE_BARRIER_OBJ(transition);
+}
+
+void markInlineCaches(InlineCacheArray* array) {
+  for (int i = 0; i < array->count; i++) {
+    InlineCache* cache = &array->caches[i];
+    for (int j = 0; j < cache->count; j++) {
+      markObject((Obj*)cache->entries[j].shape);
+      markObject((Obj*)cache->entries[j].method);
+      markObject((Obj*)cache->entries[j].transition);
+    }
+  }
+}
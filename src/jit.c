@@ -0,0 +1,370 @@
+// mmap and MAP_ANONYMOUS are not C99.
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+// Machine code entry: runs from `target` and returns the instruction to continue interpreting at.
+// The stack top is read from and written back to `*stackTop`.
+typedef uint8_t* (*JitEntry)(Value* slots, Value** stackTop, void* target);
+
+struct JitCode {
+  uint8_t* memory;
+  size_t size;
+  void** entries;  // Machine code address of each bytecode offset that starts a compiled loop.
+  int bails;       // Incremented by the machine code itself on every bail.
+};
+
+// Machine code under construction.
+typedef struct {
+  uint8_t* bytes;
+  int count;
+  int capacity;
+} Assembly;
+
+// A rel32 field to fill in once the bytecode offset it jumps to has been emitted.
+typedef struct {
+  int position;
+  int target;
+} Fixup;
+
+// Bytes of the prologue; the shared epilogue follows it.
+#define PROLOGUE_SIZE 16
+
+// The machine code keeps the interpreter's state in callee-saved registers: r12 is the stack top,
+// r13 the frame's first slot and rbx where the stack top is written back on exit.
+
+static void emitBytes(Assembly* assembly, const uint8_t* bytes, int length) {
+  if (assembly->capacity < assembly->count + length) {
+    while (assembly->capacity < assembly->count + length) {
+      assembly->capacity = assembly->capacity < 256 ? 256 : assembly->capacity * 2;
+    }
+    // Plain malloc: compiling must not start a collection while the interpreter holds the stack
+    // top in a register.
+    assembly->bytes = (uint8_t*)realloc(assembly->bytes, assembly->capacity);
+    if (assembly->bytes == NULL) exit(1);
+  }
+  memcpy(assembly->bytes + assembly->count, bytes, length);
+  assembly->count += length;
+}
+
+#define EMIT(assembly, ...) \
+  emitBytes(assembly, (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(Assembly* assembly, int32_t value) {
+  emitBytes(assembly, (const uint8_t*)&value, sizeof(value));
+}
+
+static void emit64(Assembly* assembly, uint64_t value) {
+  emitBytes(assembly, (const uint8_t*)&value, sizeof(value));
+}
+
+// jmp to the epilogue, which has already been emitted.
+static void emitJumpToEpilogue(Assembly* assembly) {
+  EMIT(assembly, 0xE9);
+  emit32(assembly, PROLOGUE_SIZE - (assembly->count + 4));
+}
+
+// Leaves the machine code, continuing the interpreter at `ip`.
+static void emitExit(Assembly* assembly, uint8_t* ip) {
+  EMIT(assembly, 0x4C, 0x89, 0x23);  // mov [rbx], r12
+  EMIT(assembly, 0x48, 0xB8);        // mov rax, ip
+  emit64(assembly, (uint64_t)(uintptr_t)ip);
+  emitJumpToEpilogue(assembly);
+}
+
+// Counts a bail on `code`, then exits to the interpreter at `ip`.
+#define BAIL_SIZE 31
+static void emitBail(Assembly* assembly, JitCode* code, uint8_t* ip) {
+  EMIT(assembly, 0x48, 0xB9);  // mov rcx, &code->bails
+  emit64(assembly, (uint64_t)(uintptr_t)&code->bails);
+  EMIT(assembly, 0x83, 0x01, 0x01);  // add dword [rcx], 1
+  emitExit(assembly, ip);
+}
+
+static void emitPushRax(Assembly* assembly) {
+  EMIT(assembly, 0x49, 0x89, 0x04, 0x24);  // mov [r12], rax
+  EMIT(assembly, 0x49, 0x83, 0xC4, 0x08);  // add r12, 8
+}
+
+static void emitPushImmediate(Assembly* assembly, Value value) {
+  EMIT(assembly, 0x48, 0xB8);  // mov rax, value
+  emit64(assembly, value);
+  emitPushRax(assembly);
+}
+
+static void emitLoadTop(Assembly* assembly) {
+  EMIT(assembly, 0x49, 0x8B, 0x44, 0x24, 0xF8);  // mov rax, [r12 - 8]
+}
+
+// Calls `helper`, bailing at `ip` if it returns NULL.
+static void emitHelper(Assembly* assembly, JitCode* code, JitHelper helper, int slot,
+                       uint64_t operand, uint8_t* ip) {
+  EMIT(assembly, 0x4C, 0x89, 0xE7);  // mov rdi, r12
+  EMIT(assembly, 0x49, 0x8D, 0xB5);  // lea rsi, [r13 + slot * 8]
+  emit32(assembly, slot * (int)sizeof(Value));
+  EMIT(assembly, 0x48, 0xBA);  // mov rdx, operand
+  emit64(assembly, operand);
+  EMIT(assembly, 0x48, 0xB8);  // mov rax, helper
+  emit64(assembly, (uint64_t)(uintptr_t)helper);
+  EMIT(assembly, 0xFF, 0xD0);              // call rax
+  EMIT(assembly, 0x48, 0x85, 0xC0);        // test rax, rax
+  EMIT(assembly, 0x75, BAIL_SIZE);         // jnz over the bail
+  emitBail(assembly, code, ip);
+  EMIT(assembly, 0x49, 0x89, 0xC4);  // mov r12, rax
+}
+
+// Emits the rel32 of a jump to bytecode offset `target`, filled in once every instruction has
+// been emitted.
+static void emitJumpTarget(Assembly* assembly, Fixup** fixups, int* fixupCount, int* fixupCapacity,
+                           int target) {
+  if (*fixupCapacity < *fixupCount + 1) {
+    *fixupCapacity = *fixupCapacity < 8 ? 8 : *fixupCapacity * 2;
+    *fixups = (Fixup*)realloc(*fixups, sizeof(Fixup) * *fixupCapacity);
+    if (*fixups == NULL) exit(1);
+  }
+  (*fixups)[(*fixupCount)++] = (Fixup){assembly->count, target};
+  emit32(assembly, 0);
+}
+
+// Jumps to `target` when the top of the stack is `value`.
+static void emitJumpIfTop(Assembly* assembly, Value value) {
+  EMIT(assembly, 0x48, 0xB9);  // mov rcx, value
+  emit64(assembly, value);
+  EMIT(assembly, 0x48, 0x39, 0xC8);  // cmp rax, rcx
+  EMIT(assembly, 0x0F, 0x84);        // je target
+}
+
+// Whether the machine code can run `instruction` without leaving.
+static bool isCompiled(uint8_t instruction) {
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_DUP:
+    case OP_POP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_LOCAL_GET_LOCAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_NOT_JUMP_IF_FALSE:
+    case OP_LOOP:
+      return true;
+    default:
+      return jitHelpers[instruction] != NULL;
+  }
+}
+
+static uint16_t readShort(uint8_t* ip) { return (uint16_t)((ip[0] << 8) | ip[1]); }
+
+void jitCompile(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  Value* constants = chunk->constants.values;
+  int count = chunk->count;
+  if (count <= 0) return;
+
+  JitCode* code = (JitCode*)malloc(sizeof(JitCode));
+  int* nativeOffsets = (int*)malloc(sizeof(int) * (size_t)count);
+  if (code == NULL || nativeOffsets == NULL) exit(1);
+  code->bails = 0;
+
+  Assembly assembly = {NULL, 0, 0};
+  Fixup* fixups = NULL;
+  int fixupCount = 0;
+  int fixupCapacity = 0;
+
+  // Prologue: save the registers the machine code keeps its state in and jump to the entry.
+  EMIT(&assembly, 0x53, 0x41, 0x54, 0x41, 0x55);  // push rbx; push r12; push r13
+  EMIT(&assembly, 0x49, 0x89, 0xFD);              // mov r13, rdi
+  EMIT(&assembly, 0x48, 0x89, 0xF3);              // mov rbx, rsi
+  EMIT(&assembly, 0x4C, 0x8B, 0x26);              // mov r12, [rsi]
+  EMIT(&assembly, 0xFF, 0xE2);                    // jmp rdx
+  // Epilogue, which every exit jumps to with the instruction to continue at in rax.
+  EMIT(&assembly, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3);  // pop r13; pop r12; pop rbx; ret
+
+  for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+    uint8_t* ip = chunk->code + offset;
+    int next = offset + instructionLength(chunk, offset);
+    nativeOffsets[offset] = assembly.count;
+
+    switch (*ip) {
+      case OP_CONSTANT:
+        emitPushImmediate(&assembly, constants[ip[1]]);
+        break;
+      case OP_CONSTANT_LONG:
+        emitPushImmediate(&assembly, constants[(ip[1] << 16) | (ip[2] << 8) | ip[3]]);
+        break;
+      case OP_NIL:
+        emitPushImmediate(&assembly, NIL_VAL);
+        break;
+      case OP_TRUE:
+        emitPushImmediate(&assembly, TRUE_VAL);
+        break;
+      case OP_FALSE:
+        emitPushImmediate(&assembly, FALSE_VAL);
+        break;
+      case OP_DUP:
+        emitLoadTop(&assembly);
+        emitPushRax(&assembly);
+        break;
+      case OP_POP:
+        EMIT(&assembly, 0x49, 0x83, 0xEC, 0x08);  // sub r12, 8
+        break;
+      case OP_GET_LOCAL_GET_LOCAL:
+        EMIT(&assembly, 0x49, 0x8B, 0x85);  // mov rax, [r13 + slot * 8]
+        emit32(&assembly, ip[1] * (int)sizeof(Value));
+        emitPushRax(&assembly);
+        EMIT(&assembly, 0x49, 0x8B, 0x85);
+        emit32(&assembly, ip[2] * (int)sizeof(Value));
+        emitPushRax(&assembly);
+        break;
+      case OP_GET_LOCAL:
+        EMIT(&assembly, 0x49, 0x8B, 0x85);  // mov rax, [r13 + slot * 8]
+        emit32(&assembly, ip[1] * (int)sizeof(Value));
+        emitPushRax(&assembly);
+        break;
+      case OP_SET_LOCAL:
+        emitLoadTop(&assembly);
+        EMIT(&assembly, 0x49, 0x89, 0x85);  // mov [r13 + slot * 8], rax
+        emit32(&assembly, ip[1] * (int)sizeof(Value));
+        break;
+      case OP_JUMP:
+        EMIT(&assembly, 0xE9);
+        emitJumpTarget(&assembly, &fixups, &fixupCount, &fixupCapacity, next + readShort(ip + 1));
+        break;
+      case OP_LOOP:
+        EMIT(&assembly, 0xE9);
+        emitJumpTarget(&assembly, &fixups, &fixupCount, &fixupCapacity, next - readShort(ip + 1));
+        break;
+      case OP_JUMP_IF_FALSE:
+        emitLoadTop(&assembly);
+        emitJumpIfTop(&assembly, NIL_VAL);
+        emitJumpTarget(&assembly, &fixups, &fixupCount, &fixupCapacity, next + readShort(ip + 1));
+        emitJumpIfTop(&assembly, FALSE_VAL);
+        emitJumpTarget(&assembly, &fixups, &fixupCount, &fixupCapacity, next + readShort(ip + 1));
+        break;
+      case OP_JUMP_IF_TRUE:
+        emitLoadTop(&assembly);
+        EMIT(&assembly, 0x48, 0xB9);  // mov rcx, nil
+        emit64(&assembly, NIL_VAL);
+        EMIT(&assembly, 0x48, 0x39, 0xC8, 0x74, 0x14);  // cmp rax, rcx; je over the jump
+        EMIT(&assembly, 0x48, 0xB9);                    // mov rcx, false
+        emit64(&assembly, FALSE_VAL);
+        EMIT(&assembly, 0x48, 0x39, 0xC8, 0x74, 0x05);  // cmp rax, rcx; je over the jump
+        EMIT(&assembly, 0xE9);
+        emitJumpTarget(&assembly, &fixups, &fixupCount, &fixupCapacity, next + readShort(ip + 1));
+        break;
+      case OP_LESS_JUMP_IF_FALSE:
+      case OP_NOT_JUMP_IF_FALSE:
+        // The first half leaves a boolean on the stack, so only false needs testing.
+        emitHelper(&assembly, code, jitHelpers[*ip == OP_LESS_JUMP_IF_FALSE ? OP_LESS : OP_NOT],
+                   0, 0, ip);
+        emitLoadTop(&assembly);
+        emitJumpIfTop(&assembly, FALSE_VAL);
+        emitJumpTarget(&assembly, &fixups, &fixupCount, &fixupCapacity, next + readShort(ip + 1));
+        break;
+      case OP_INC_LOCAL:
+        emitHelper(&assembly, code, jitHelpers[OP_INC_LOCAL], ip[1], constants[ip[2]], ip);
+        break;
+      case OP_ADD_CONST:
+        emitHelper(&assembly, code, jitHelpers[OP_ADD_CONST], 0, constants[ip[1]], ip);
+        break;
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+        emitHelper(&assembly, code, jitHelpers[*ip], 0, readShort(ip + 1), ip);
+        break;
+      default:
+        if (jitHelpers[*ip] != NULL) {
+          emitHelper(&assembly, code, jitHelpers[*ip], 0, 0, ip);
+        } else {
+          emitExit(&assembly, ip);
+        }
+        break;
+    }
+  }
+
+  for (int i = 0; i < fixupCount; i++) {
+    int32_t distance = nativeOffsets[fixups[i].target] - (fixups[i].position + 4);
+    memcpy(assembly.bytes + fixups[i].position, &distance, sizeof(distance));
+  }
+
+  // A loop is entered at its head, and only when the machine code runs all of its body, so it
+  // never leaves mid-loop other than to bail.
+  code->entries = (void**)calloc((size_t)count, sizeof(void*));
+  if (code->entries == NULL) exit(1);
+  bool anyEntry = false;
+  for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+    if (chunk->code[offset] != OP_LOOP) continue;
+    int head = offset + 3 - readShort(chunk->code + offset + 1);
+    bool compiled = true;
+    for (int body = head; body < offset && compiled; body += instructionLength(chunk, body)) {
+      compiled = isCompiled(chunk->code[body]);
+    }
+    if (compiled) {
+      code->entries[head] = (void*)(uintptr_t)nativeOffsets[head];
+      anyEntry = true;
+    }
+  }
+
+  long page = sysconf(_SC_PAGESIZE);
+  code->size = ((size_t)assembly.count + page - 1) / page * page;
+  code->memory = anyEntry ? (uint8_t*)mmap(NULL, code->size, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                          : MAP_FAILED;
+  if (code->memory != MAP_FAILED) {
+    memcpy(code->memory, assembly.bytes, assembly.count);
+    if (mprotect(code->memory, code->size, PROT_READ | PROT_EXEC) == 0) {
+      for (int offset = 0; offset < count; offset++) {
+        if (code->entries[offset] != NULL) {
+          code->entries[offset] = code->memory + (uintptr_t)code->entries[offset];
+        }
+      }
+      function->jitCode = code;
+    } else {
+      munmap(code->memory, code->size);
+    }
+  }
+
+  if (function->jitCode == NULL) {
+    free(code->entries);
+    free(code);
+  }
+  free(assembly.bytes);
+  free(fixups);
+  free(nativeOffsets);
+}
+
+uint8_t* jitRun(ObjFunction* function, uint8_t* ip, Value* slots) {
+  JitCode* code = function->jitCode;
+  void* entry = code->entries[ip - function->chunk.code];
+  if (entry == NULL) return ip;
+
+  ip = ((JitEntry)code->memory)(slots, &vm->stackTop, entry);
+  if (code->bails > JIT_MAX_BAILS) jitFree(function);
+  return ip;
+}
+
+void jitFree(ObjFunction* function) {
+  JitCode* code = function->jitCode;
+  if (code == NULL) return;
+
+  munmap(code->memory, code->size);
+  free(code->entries);
+  free(code);
+  function->jitCode = NULL;
+}
+
+#endif
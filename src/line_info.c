@@ -16,5 +16,5 @@ void freeLineInfoArray(LineInfoArray* array) {
 }
 
 void printLineInfo(LineInfo value) {
-  printf("Line: %d, Run Length: %d\n", value.line, value.run_length);
+  printf("Line: %d, Start: %d\n", value.line, value.start);
 }
\ No newline at end of file
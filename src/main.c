@@ -1,11 +1,21 @@
+// mmap, open and fstat are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "bytecode.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "profiler.h"
 #include "vm.h"
 
 // ANSI color codes
@@ -92,53 +102,247 @@ void repl() {
   goodbyeMessage();
 }
 
-static char* readFile(const char* path) {
+// A script's source, mapped into memory instead of copied
+typedef struct {
+  const char* chars;
+  size_t length;
+} SourceFile;
+
+// Map a script into memory. Returns false for a file that cannot be mapped, such as a pipe, which
+// has to be streamed instead.
+static bool mapFile(const char* path, SourceFile* source) {
+  int file = open(path, O_RDONLY);
+  if (file < 0) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+
+  struct stat info;
+  if (fstat(file, &info) != 0 || !S_ISREG(info.st_mode)) {
+    close(file);
+    return false;
+  }
+
+  source->chars = "";
+  source->length = (size_t)info.st_size;
+  if (source->length > 0) {
+    void* chars = mmap(NULL, source->length, PROT_READ, MAP_PRIVATE, file, 0);
+    if (chars == MAP_FAILED) {
+      fprintf(stderr, "Could not read file \"%s\".\n", path);
+      exit(74);
+    }
+    source->chars = chars;
+  }
+  close(file);
+  return true;
+}
+
+static void unmapFile(SourceFile source) {
+  if (source.length > 0) munmap((void*)source.chars, source.length);
+}
+
+// Compile a script as it is read, one top-level declaration at a time
+static ObjFunction* streamFile(const char* path) {
   FILE* file = fopen(path, "rb");
   if (file == NULL) {
     fprintf(stderr, "Could not open file \"%s\".\n", path);
     exit(74);
   }
+  ObjFunction* function = compileStream(file);
+  if (ferror(file)) {
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    exit(74);
+  }
+  fclose(file);
+  return function;
+}
 
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
+// Command-line switches
+static bool showCacheStats = false;    // --ic-stats: dump inline cache counters on exit
+static bool showGCStats = false;       // --gc-stats: summarize garbage collector pauses on exit
+static bool stopTheWorldGC = false;    // --gc-full: collect the whole heap in one pause
+static bool lazySweepGC = false;       // --gc-lazy-sweep: mark in one pause, sweep with allocation
+static int gcThreads = 1;              // --gc-threads: threads that mark the whole heap at once
+static bool showAllocStats = false;    // --alloc-stats: count object allocations per opcode
+static bool showStats = false;         // --stats: dump the VM's counters and opcode counts on exit
+static bool noPeephole = false;        // --no-peephole: keep the bytecode exactly as emitted
+static bool useRegisters = false;      // --registers: run locals through register instructions
+static bool useJIT = false;            // --jit: compile hot functions to machine code
+static bool streamSource = false;      // --stream: compile while reading, skipping the cache
+static bool compileOnly = false;       // --compile-only: write a bytecode cache instead of running
+static const char* outputPath = NULL;  // -o: where --compile-only writes the cache
+static bool profile = false;           // --profile: sample the running script and report hot spots
+static const char* stacksPath = NULL;  // --profile-output: collapsed stacks, default corelox.folded
+static int maxFrames = FRAMES_MAX;     // --max-frames: recursion limit before "Stack overflow."
 
-  char* buffer = (char*)malloc(fileSize + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+// Print the reports requested on the command line
+static void printExitReports() {
+  if (showCacheStats) printInlineCacheStats();
+  if (showGCStats) printGCStats();
+  if (showAllocStats) printAllocStats();
+  if (showStats) printStats();
+  if (profile) {
+    const char* stacks = stacksPath != NULL ? stacksPath : "corelox.folded";
+    stopProfiler();
+    printProfile();
+    if (writeProfileStacks(stacks)) {
+      fprintf(stderr, "collapsed stacks written to %s\n", stacks);
+    } else {
+      fprintf(stderr, "Could not write profile stacks \"%s\".\n", stacks);
+    }
+  }
+}
+
+// The cache consulted for a script: "script.lox" uses "script.loxc"
+static char* cachePath(const char* path) {
+  size_t length = strlen(path);
+  bool isLox = length >= 4 && strcmp(path + length - 4, ".lox") == 0;
+  char* cache = malloc(length + (isLox ? 2 : 6));
+  if (cache == NULL) {
+    fprintf(stderr, "Not enough memory to name the cache of \"%s\".\n", path);
     exit(74);
   }
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
+  strcpy(cache, path);
+  strcat(cache, isLox ? "c" : ".loxc");
+  return cache;
+}
+
+// Compile a file to a bytecode cache without running it
+static void compileFile(const char* path) {
+  SourceFile source;
+  if (!mapFile(path, &source)) {
+    fprintf(stderr, "Can only cache the bytecode of a regular file, not \"%s\".\n", path);
     exit(74);
   }
-  buffer[bytesRead] = '\0';
+  ObjFunction* function = compileBuffer(source.chars, source.length);
+  if (function == NULL) exit(65);
 
-  fclose(file);
-  return buffer;
+  char* cache = outputPath != NULL ? NULL : cachePath(path);
+  const char* target = outputPath != NULL ? outputPath : cache;
+  if (!writeBytecode(function, hashSource(source.chars, source.length), target)) {
+    fprintf(stderr, "Could not write bytecode file \"%s\".\n", target);
+    exit(74);
+  }
+  free(cache);
+  unmapFile(source);
+}
+
+// Load a script from a bytecode file, or from its source falling back to a valid cache
+static ObjFunction* loadFile(const char* path) {
+  SourceFile source;
+  // A pipe can only be read once, so it is compiled as it streams in and never taken for bytecode.
+  if (!mapFile(path, &source)) return streamFile(path);
+
+  if (isBytecodeFile(path)) {
+    unmapFile(source);
+    ObjFunction* function = readBytecode(path, NULL);
+    if (function == NULL) {
+      fprintf(stderr, "Invalid or incompatible bytecode file \"%s\".\n", path);
+      exit(65);
+    }
+    return function;
+  }
+
+  if (streamSource) {
+    unmapFile(source);
+    return streamFile(path);
+  }
+
+  uint64_t hash = hashSource(source.chars, source.length);
+  char* cache = cachePath(path);
+  ObjFunction* function = readBytecode(cache, &hash);
+  free(cache);
+
+  if (function == NULL) function = compileBuffer(source.chars, source.length);
+  unmapFile(source);
+  return function;
 }
 
 // Run a file
 void runFile(const char* path) {
-  char* source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
+  ObjFunction* function = loadFile(path);
+  if (profile) startProfiler(PROFILE_INTERVAL_US);
+  InterpretResult result = function == NULL ? INTERPRET_COMPILE_ERROR : interpretFunction(function);
+  printExitReports();
 
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void usage() {
+  fprintf(stderr,
+          COLOR_RED
+          "Usage: carbonlox [--ic-stats] [--gc-stats] [--gc-full | --gc-lazy-sweep]\n"
+          "                 [--gc-threads N] [--alloc-stats] [--stats] [--no-peephole] [--registers]\n"
+          "                 [--jit] [--max-frames N] [--profile [--profile-output file.folded]]\n"
+          "                 [--stream] [--compile-only [-o file.loxc]] [path]\n" COLOR_RESET);
+  exit(64);
+}
+
 int main(int argc, const char* argv[]) {
+  const char* path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--ic-stats") == 0) {
+      showCacheStats = true;
+    } else if (strcmp(argv[i], "--gc-stats") == 0) {
+      showGCStats = true;
+    } else if (strcmp(argv[i], "--gc-full") == 0) {
+      stopTheWorldGC = true;
+    } else if (strcmp(argv[i], "--gc-lazy-sweep") == 0) {
+      lazySweepGC = true;
+    } else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc) {
+      gcThreads = atoi(argv[++i]);
+      if (gcThreads < 1) usage();
+    } else if (strcmp(argv[i], "--alloc-stats") == 0) {
+      showAllocStats = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      showStats = true;
+    } else if (strcmp(argv[i], "--no-peephole") == 0) {
+      noPeephole = true;
+    } else if (strcmp(argv[i], "--registers") == 0) {
+      useRegisters = true;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      useJIT = true;
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      streamSource = true;
+    } else if (strcmp(argv[i], "--compile-only") == 0) {
+      compileOnly = true;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile = true;
+    } else if (strcmp(argv[i], "--profile-output") == 0 && i + 1 < argc) {
+      stacksPath = argv[++i];
+    } else if (strcmp(argv[i], "--max-frames") == 0 && i + 1 < argc) {
+      maxFrames = atoi(argv[++i]);
+      if (maxFrames < 1) usage();
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else if (argv[i][0] == '-' || path != NULL) {
+      usage();
+    } else {
+      path = argv[i];
+    }
+  }
+
   initVM();
+  if (stopTheWorldGC) vm->gcMode = GC_MODE_STOP_THE_WORLD;
+  if (lazySweepGC) vm->gcMode = GC_MODE_LAZY_SWEEP;
+  vm->gcThreads = gcThreads;
+  if (noPeephole) vm->peephole = false;
+  vm->registers = useRegisters;
+  vm->jit = useJIT;
+  vm->countInstructions = showStats;
+  vm->countAllocations = showAllocStats;
+  vm->maxFrames = maxFrames;
 
-  if (argc == 1) {
+  if (compileOnly) {
+    if (path == NULL) usage();
+    compileFile(path);
+  } else if (path == NULL) {
+    if (profile) startProfiler(PROFILE_INTERVAL_US);
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+    printExitReports();
   } else {
-    fprintf(stderr, COLOR_RED "Usage: carbonlox [path]\n" COLOR_RESET);
-    exit(64);
+    runFile(path);
   }
 
   freeVM();
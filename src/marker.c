@@ -0,0 +1,188 @@
+// pthreads are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include "marker.h"
+
+#ifdef PARALLEL_MARK
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Gray objects handed from a busy thread to an idle one.
+typedef struct GrayPacket {
+  struct GrayPacket* next;
+  int count;
+  Obj* objects[];
+} GrayPacket;
+
+// State shared by the threads of one parallel mark. `idle` and `packetCount` only change under
+// `lock`, but busy threads read them without it to decide whether to share.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t workReady;
+  GrayPacket* packets;
+  int packetCount;
+  int idle;
+  int workers;
+  void (*blacken)(Obj* object);
+} Marker;
+
+struct MarkWorker {
+  Marker* marker;
+  Obj** gray;
+  int grayCount;
+  int grayCapacity;
+};
+
+THREAD_LOCAL MarkWorker* markWorker = NULL;
+
+static pthread_once_t processorsOnce = PTHREAD_ONCE_INIT;
+static int processors = 1;
+
+static void countProcessors() {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  if (online > 1) processors = online < GC_MAX_THREADS ? (int)online : GC_MAX_THREADS;
+}
+
+int markerThreads(int requested) {
+  pthread_once(&processorsOnce, countProcessors);
+  return requested < processors ? requested : processors;
+}
+
+static void pushGray(MarkWorker* worker, Obj* object) {
+  if (worker->grayCapacity < worker->grayCount + 1) {
+    worker->grayCapacity = worker->grayCapacity < 8 ? 8 : worker->grayCapacity * 2;
+    worker->gray = (Obj**)realloc(worker->gray, sizeof(Obj*) * worker->grayCapacity);
+    if (worker->gray == NULL) exit(1);
+  }
+  worker->gray[worker->grayCount++] = object;
+}
+
+void markerShade(Obj* object) {
+  if (__atomic_load_n(&object->isMarked, __ATOMIC_RELAXED)) return;
+  if (__atomic_exchange_n(&object->isMarked, true, __ATOMIC_RELAXED)) return;
+  pushGray(markWorker, object);
+}
+
+// Queues `count` objects for any thread to take. Called with `marker->lock` held.
+static void addPacket(Marker* marker, Obj** objects, int count) {
+  GrayPacket* packet = (GrayPacket*)malloc(sizeof(GrayPacket) + sizeof(Obj*) * count);
+  if (packet == NULL) exit(1);
+  packet->count = count;
+  memcpy(packet->objects, objects, sizeof(Obj*) * count);
+
+  packet->next = marker->packets;
+  marker->packets = packet;
+  __atomic_store_n(&marker->packetCount, marker->packetCount + 1, __ATOMIC_RELAXED);
+}
+
+// Hands the top half of the worker's stack to the idle threads.
+static void shareWork(MarkWorker* worker) {
+  Marker* marker = worker->marker;
+  int count = worker->grayCount / 2;
+  worker->grayCount -= count;
+
+  pthread_mutex_lock(&marker->lock);
+  addPacket(marker, worker->gray + worker->grayCount, count);
+  pthread_cond_signal(&marker->workReady);
+  pthread_mutex_unlock(&marker->lock);
+}
+
+// Waits for a packet and moves it onto the worker's stack. Returns false once every thread is idle
+// with nothing left to share, which ends the mark.
+static bool takeWork(MarkWorker* worker) {
+  Marker* marker = worker->marker;
+  pthread_mutex_lock(&marker->lock);
+  __atomic_store_n(&marker->idle, marker->idle + 1, __ATOMIC_RELAXED);
+
+  while (marker->packets == NULL && marker->idle < marker->workers) {
+    pthread_cond_wait(&marker->workReady, &marker->lock);
+  }
+
+  GrayPacket* packet = marker->packets;
+  if (packet == NULL) {
+    pthread_cond_broadcast(&marker->workReady);
+    pthread_mutex_unlock(&marker->lock);
+    return false;
+  }
+
+  marker->packets = packet->next;
+  __atomic_store_n(&marker->packetCount, marker->packetCount - 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&marker->idle, marker->idle - 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&marker->lock);
+
+  for (int i = 0; i < packet->count; i++) pushGray(worker, packet->objects[i]);
+  free(packet);
+  return true;
+}
+
+static void* runWorker(void* argument) {
+  MarkWorker* worker = (MarkWorker*)argument;
+  Marker* marker = worker->marker;
+  markWorker = worker;
+
+  while (takeWork(worker)) {
+    while (worker->grayCount > 0) {
+      Obj* object = worker->gray[--worker->grayCount];
+      marker->blacken(object);
+
+      // Share only while more threads are idle than there are packets waiting for them.
+      if (worker->grayCount >= 2 && __atomic_load_n(&marker->idle, __ATOMIC_RELAXED) >
+                                        __atomic_load_n(&marker->packetCount, __ATOMIC_RELAXED)) {
+        shareWork(worker);
+      }
+    }
+  }
+
+  markWorker = NULL;
+  return NULL;
+}
+
+void parallelMark(Obj** gray, int grayCount, int threads, void (*blacken)(Obj* object)) {
+  threads = markerThreads(threads);
+
+  Marker marker;
+  pthread_mutex_init(&marker.lock, NULL);
+  pthread_cond_init(&marker.workReady, NULL);
+  marker.packets = NULL;
+  marker.packetCount = 0;
+  marker.idle = 0;
+  marker.workers = 1;
+  marker.blacken = blacken;
+
+  MarkWorker workers[GC_MAX_THREADS];
+  pthread_t helpers[GC_MAX_THREADS];
+  for (int i = 0; i < threads; i++) {
+    workers[i].marker = &marker;
+    workers[i].gray = NULL;
+    workers[i].grayCount = 0;
+    workers[i].grayCapacity = 0;
+  }
+
+  // The roots are split into one packet per thread. The lock is held until every helper has been
+  // started, so none can see fewer workers than there are and stop early.
+  pthread_mutex_lock(&marker.lock);
+  for (int i = 0; i < threads; i++) {
+    int start = (int)((long)grayCount * i / threads);
+    int end = (int)((long)grayCount * (i + 1) / threads);
+    if (end > start) addPacket(&marker, gray + start, end - start);
+  }
+  for (int i = 1; i < threads; i++) {
+    if (pthread_create(&helpers[marker.workers], NULL, runWorker, &workers[marker.workers]) != 0) {
+      break;
+    }
+    marker.workers++;
+  }
+  pthread_mutex_unlock(&marker.lock);
+
+  runWorker(&workers[0]);
+  for (int i = 1; i < marker.workers; i++) pthread_join(helpers[i], NULL);
+
+  for (int i = 0; i < threads; i++) free(workers[i].gray);
+  pthread_cond_destroy(&marker.workReady);
+  pthread_mutex_destroy(&marker.lock);
+}
+
+#endif
@@ -1,8 +1,15 @@
+// clock_gettime, used to time the collector's pauses, is POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
 #include "memory.h"
 
+#include <limits.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "jit.h"
+#include "marker.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -11,20 +18,22 @@
 #include "debug.h"
 #endif
 
-void* reallocate(void* pointer, size_t oldSize __attribute__((unused)), size_t newSize) {
-  vm.bytesAllocated += newSize - oldSize;
-
-  if (newSize > oldSize) {
+static void collectIfNeeded() {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
+  collectGarbage();
 #endif
 
 #ifndef DEBUG_STRESS_GC
-    if (vm.bytesAllocated > vm.nextGC) {
-      collectGarbage();
-    }
-#endif
+  if (vm->bytesAllocated > vm->nextGC) {
+    collectGarbage();
   }
+#endif
+}
+
+void* reallocate(void* pointer, size_t oldSize __attribute__((unused)), size_t newSize) {
+  vm->bytesAllocated += newSize - oldSize;
+
+  if (newSize > oldSize) collectIfNeeded();
 
   if (newSize == 0) {
     free(pointer);
@@ -36,8 +45,53 @@ void* reallocate(void* pointer, size_t oldSize __attribute__((unused)), size_t n
   return result;
 }
 
+Obj* allocateObjectMemory(size_t size) {
+#ifdef POOL_ALLOCATOR
+  if (size <= POOL_MAX_SIZE) {
+    vm->bytesAllocated += POOL_ROUND(size);
+    collectIfNeeded();
+
+    // A slot the sweep in progress has yet to visit starts marked, so the sweep keeps it.
+    bool pending;
+    Obj* object = (Obj*)poolAllocate(&vm->pool, size, &pending);
+    object->isMarked = pending;
+    object->next = NULL;
+    return object;
+  }
+#endif
+
+  vm->bytesAllocated += size;
+  collectIfNeeded();
+
+  Obj* object = (Obj*)malloc(size);
+  if (object == NULL) exit(1);
+  object->isMarked = false;
+  object->next = vm->objects;
+  vm->objects = object;
+  return object;
+}
+
+void freeObjectMemory(Obj* object, size_t size) {
+#ifdef POOL_ALLOCATOR
+  if (size <= POOL_MAX_SIZE) {
+    // The slot itself is handed back by the sweep that freed the object.
+    vm->bytesAllocated -= POOL_ROUND(size);
+    return;
+  }
+#endif
+
+  vm->bytesAllocated -= size;
+  free(object);
+}
+
 void markObject(Obj* object) {
   if (object == NULL) return;
+#ifdef PARALLEL_MARK
+  if (markWorker != NULL) {
+    markerShade(object);
+    return;
+  }
+#endif
   if (object->isMarked) return;
 
 #ifdef DEBUG_LOG_GC
@@ -48,13 +102,13 @@ void markObject(Obj* object) {
 
   object->isMarked = true;
 
-  if (vm.grayCapacity < vm.grayCount + 1) {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+  if (vm->grayCapacity < vm->grayCount + 1) {
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
   }
 
-  vm.grayStack[vm.grayCount++] = object;
-  if (vm.grayStack == NULL) exit(1);
+  vm->grayStack[vm->grayCount++] = object;
+  if (vm->grayStack == NULL) exit(1);
 }
 
 void markValue(Value value) {
@@ -79,6 +133,7 @@ static void blackenObject(Obj* object) {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
       markArray(&function->chunk.constants);
+      markInlineCaches(&function->chunk.caches);
       break;
     }
     case OBJ_CLOSURE: {
@@ -93,25 +148,52 @@ static void blackenObject(Obj* object) {
       ObjClass* klass = (ObjClass*)object;
       markTable(&klass->methods);
       markObject((Obj*)klass->name);
+      markObject((Obj*)klass->rootShape);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       markObject((Obj*)instance->klass);
+      markObject((Obj*)instance->shape);
+      if (instance->shape != NULL) {
+        for (int i = 0; i < instance->shape->fieldCount; i++) {
+          markValue(instance->slots[i]);
+        }
+      }
       markTable(&instance->fields);
       break;
     }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markObject((Obj*)shape->klass);
+      markObject((Obj*)shape->parent);
+      markObject((Obj*)shape->name);
+      markTable(&shape->slots);
+      markTable(&shape->transitions);
+      break;
+    }
     case OBJ_BOUND_METHOD: {
       ObjBoundMethod* bound = (ObjBoundMethod*)object;
       markValue(bound->receiver);
       markObject((Obj*)bound->method);
       break;
     }
+    case OBJ_LIST:
+      markArray(&((ObjList*)object)->items);
+      break;
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)object;
+      markObject(rope->left);
+      markObject(rope->right);
+      markObject((Obj*)rope->flat);
+      break;
+    }
     case OBJ_UPVALUE:
       markValue(((ObjUpvalue*)object)->closed);
       break;
     case OBJ_NATIVE:
     case OBJ_STRING:
+    case OBJ_STRING_BUILDER:
       break;
   }
 }
@@ -124,38 +206,66 @@ void freeObject(Obj* object) {
   switch (object->type) {
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
+#ifdef JIT
+      jitFree(function);
+#endif
       freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
+      FREE_OBJECT(ObjFunction, object);
       break;
     }
     case OBJ_NATIVE:
-      FREE(ObjNative, object);
+      FREE_OBJECT(ObjNative, object);
       break;
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
       FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-      FREE(ObjClosure, object);
+      FREE_OBJECT(ObjClosure, object);
       break;
     }
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
       freeTable(&klass->methods);
+      FREE_OBJECT(ObjClass, object);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
+      if (instance->slots != instance->inlineSlots) {
+        FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+      }
       freeTable(&instance->fields);
-      FREE(ObjInstance, object);
+      freeObjectMemory(object, sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity);
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      freeTable(&shape->slots);
+      freeTable(&shape->transitions);
+      FREE_OBJECT(ObjShape, object);
       break;
     }
     case OBJ_BOUND_METHOD:
-      FREE(ObjBoundMethod, object);
+      FREE_OBJECT(ObjBoundMethod, object);
+      break;
+    case OBJ_LIST:
+      freeValueArray(&((ObjList*)object)->items);
+      FREE_OBJECT(ObjList, object);
+      break;
+    case OBJ_ROPE:
+      FREE_OBJECT(ObjRope, object);
+      break;
+    case OBJ_STRING_BUILDER: {
+      ObjStringBuilder* builder = (ObjStringBuilder*)object;
+      FREE_ARRAY(char, builder->chars, builder->capacity);
+      FREE_OBJECT(ObjStringBuilder, object);
       break;
+    }
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
+      FREE_OBJECT(ObjUpvalue, object);
       break;
     case OBJ_STRING: {
-      FREE(ObjString, object);
+      ObjString* string = (ObjString*)object;
+      freeObjectMemory(object, sizeof(ObjString) + string->length + 1);
       break;
     }
   }
@@ -163,82 +273,266 @@ void freeObject(Obj* object) {
 
 static void markRoots() {
   // Mark the stack values
-  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+  for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
     markValue(*slot);
   }
 
   // Mark the closures
-  for (int i = 0; i < vm.frameCount; i++) {
-    markObject((Obj*)vm.frames[i].closure);
+  for (int i = 0; i < vm->frameCount; i++) {
+    markObject((Obj*)vm->frames[i].closure);
   }
 
   // Mark the open upvalues
-  for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+  for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
     markObject((Obj*)upvalue);
   }
 
-  // Mark the globals table
-  markTable(&vm.globals);
+  // Mark the global slots and their names
+  markTable(&vm->globalSlots);
+  markArray(&vm->globalValues);
+  markArray(&vm->globalNames);
 
   // Mark the compiler roots
   markCompilerRoots();
 
   // Mark the interned init string
-  markObject((Obj*)vm.initString);
+  markObject((Obj*)vm->initString);
+
+  // Mark the functions named in the profile
+  markProfiler();
 }
 
-static void traceReferences() {
-  while (vm.grayCount > 0) {
-    Obj* object = vm.grayStack[--vm.grayCount];
+// Blackens gray objects until none are left or `budget` objects have been traced.
+static int traceReferences(int budget) {
+  while (vm->grayCount > 0 && budget > 0) {
+    Obj* object = vm->grayStack[--vm->grayCount];
     blackenObject(object);
+    budget--;
   }
+  return budget;
 }
 
-static void sweep() {
-  Obj* previous = NULL;
-  Obj* object = vm.objects;
-  while (object != NULL) {
+// Visits up to `budget` objects after `vm->sweepLink`, freeing unmarked ones and clearing the mark
+// on survivors for the next cycle.
+static int sweepList(int budget) {
+  while (*vm->sweepLink != NULL && budget > 0) {
+    Obj* object = *vm->sweepLink;
+    budget--;
+
     if (object->isMarked) {
-      if (!(object->type == OBJ_STRING || object->type == OBJ_NATIVE)) object->isMarked = false;
-      previous = object;
-      object = object->next;
 #ifdef DEBUG_LOG_GC
       printf("-- gc %p retain\n", (void*)object);
 #endif
+      object->isMarked = false;
+      vm->sweepLink = &object->next;
     } else {
 #ifdef DEBUG_LOG_GC
       printf("-- gc %p sweep\n", (void*)object);
 #endif
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
-      }
-
-      freeObject(unreached);
+      *vm->sweepLink = object->next;
+      freeObject(object);
     }
   }
+  return budget;
+}
+
+#ifdef POOL_ALLOCATOR
+static bool sweepPooled(void* slot) {
+  Obj* object = (Obj*)slot;
+  if (object->isMarked) {
+    object->isMarked = false;
+    return true;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc %p sweep\n", (void*)object);
+#endif
+  freeObject(object);
+  return false;
+}
+#endif
+
+// Sweeps the pooled objects slab by slab, then the objects on the list.
+static int sweep(int budget) {
+#ifdef POOL_ALLOCATOR
+  budget = poolSweep(&vm->pool, budget, sweepPooled);
+  if (vm->pool.sweeping) return budget;
+#endif
+  return sweepList(budget);
+}
+
+static bool sweepFinished() {
+#ifdef POOL_ALLOCATOR
+  if (vm->pool.sweeping) return false;
+#endif
+  return *vm->sweepLink == NULL;
+}
+
+#ifdef PARALLEL_MARK
+// Whether the heap is large enough to repay starting the marking threads. Stress builds share
+// every heap, so there the threshold is not compared at all.
+static bool worthMarkingInParallel() {
+#if GC_PARALLEL_MIN_BYTES > 0
+  return vm->bytesAllocated >= GC_PARALLEL_MIN_BYTES;
+#else
+  return true;
+#endif
+}
+#endif
+
+// Blackens every gray object, on `vm->gcThreads` threads once the heap is large enough to repay
+// starting them.
+static void traceAll() {
+#ifdef PARALLEL_MARK
+  if (vm->grayCount > 0 && worthMarkingInParallel() &&
+      markerThreads(vm->gcThreads) > 1) {
+    int count = vm->grayCount;
+    vm->grayCount = 0;
+    parallelMark(vm->grayStack, count, vm->gcThreads, blackenObject);
+    return;
+  }
+#endif
+  traceReferences(INT_MAX);
+}
+
+// Stands in for the rest of the list when a sweep has nothing left to visit.
+static Obj* sweptList = NULL;
+
+static void beginMark() {
+  vm->gcPhase = GC_PHASE_MARK;
+  vm->gcObjectsAllocated = 0;
+  markRoots();
+}
+
+// Atomically completes marking: the roots are scanned again to pick up anything stored into them
+// while marking was interleaved with the program, then the remaining gray objects are traced.
+static void finishMark() {
+  markRoots();
+  traceAll();
+  stringTableRemoveWhite(&vm->strings);
+
+  // New objects are pushed onto the head of the list. Sweeping from the first survivor on means
+  // the objects allocated during the sweep are never visited.
+  vm->sweepLink = &vm->objects;
+  while (*vm->sweepLink != NULL && !(*vm->sweepLink)->isMarked) {
+    sweepList(1);
+  }
+  if (*vm->sweepLink == NULL) {
+    // Nothing on the list survived. Left at the head, the sweep would reach the objects allocated
+    // from here on, so it is pointed at an empty list instead.
+    vm->sweepLink = &sweptList;
+  } else {
+    sweepList(1);
+  }
+
+#ifdef POOL_ALLOCATOR
+  poolBeginSweep(&vm->pool);
+#endif
+  vm->gcPhase = GC_PHASE_SWEEP;
+}
+
+static void finishSweep() {
+  vm->gcPhase = GC_PHASE_IDLE;
+  vm->sweepLink = NULL;
+  vm->stats.gcCycles++;
+  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+}
+
+// Sweeps up to `budget` objects and ends the cycle once none are left.
+static void sweepIncrement(int budget) {
+  sweep(budget);
+  if (sweepFinished()) {
+    finishSweep();
+    return;
+  }
+  vm->nextGC = vm->bytesAllocated + GC_STEP_BYTES;
+}
+
+static void collectFull() {
+  if (vm->gcPhase == GC_PHASE_IDLE) beginMark();
+  if (vm->gcPhase == GC_PHASE_MARK) finishMark();
+
+  sweep(INT_MAX);
+  finishSweep();
+}
+
+static void collectIncrement() {
+  int budget = GC_STEP_WORK + vm->gcObjectsAllocated;
+  vm->gcObjectsAllocated = 0;
+
+  if (vm->gcPhase == GC_PHASE_IDLE) beginMark();
+
+  if (vm->gcPhase == GC_PHASE_MARK) {
+    budget = traceReferences(budget);
+    if (vm->grayCount == 0) finishMark();
+  }
+
+  if (vm->gcPhase == GC_PHASE_SWEEP) {
+    sweepIncrement(budget);
+    return;
+  }
+
+  vm->nextGC = vm->bytesAllocated + GC_STEP_BYTES;
+}
+
+// The pause that starts a cycle marks the whole heap; the sweep then advances with allocation.
+static void collectLazily() {
+  if (vm->gcPhase == GC_PHASE_IDLE) beginMark();
+  if (vm->gcPhase == GC_PHASE_MARK) finishMark();
+  sweepIncrement(GC_STEP_WORK);
+}
+
+static void recordPause(double seconds, size_t bytesReclaimed) {
+  if (vm->gcPauseCapacity < vm->gcPauseCount + 1) {
+    vm->gcPauseCapacity = GROW_CAPACITY(vm->gcPauseCapacity);
+    vm->gcPauses = (GCPause*)realloc(vm->gcPauses, sizeof(GCPause) * vm->gcPauseCapacity);
+    if (vm->gcPauses == NULL) exit(1);
+  }
+
+  GCPause* pause = &vm->gcPauses[vm->gcPauseCount++];
+  pause->seconds = seconds;
+  pause->bytesReclaimed = bytesReclaimed;
+
+  VMStats* stats = &vm->stats;
+  stats->gcPauses++;
+  stats->gcPauseSeconds += seconds;
+  if (seconds > stats->gcMaxPauseSeconds) stats->gcMaxPauseSeconds = seconds;
+  stats->gcBytesFreed += bytesReclaimed;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
 }
 
 void collectGarbage() {
+  size_t before = vm->bytesAllocated;
+  // Wall-clock time, since a parallel mark spends processor time on several threads at once.
+  double start = now();
+
 #ifdef DEBUG_LOG_GC
-  size_t before = vm.bytesAllocated;
   printf("-- gc begin\n");
 #endif
 
-  markRoots();
-  traceReferences();
-  tableRemoveWhite(&vm.strings);
-  sweep();
+  switch (vm->gcMode) {
+    case GC_MODE_STOP_THE_WORLD:
+      collectFull();
+      break;
+    case GC_MODE_INCREMENTAL:
+      collectIncrement();
+      break;
+    case GC_MODE_LAZY_SWEEP:
+      collectLazily();
+      break;
+  }
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  recordPause(now() - start, before - vm->bytesAllocated);
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
-  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated,
-         before, vm.bytesAllocated, vm.nextGC);
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm->bytesAllocated,
+         before, vm->bytesAllocated, vm->nextGC);
 #endif
 }
 
@@ -250,11 +544,38 @@ void freeObjectList(Obj* object) {
   }
 }
 
+#ifdef POOL_ALLOCATOR
+static void freePooled(void* slot) { freeObject((Obj*)slot); }
+#endif
+
 void freeObjects() {
-  Obj* object = vm.objects;
+#ifdef POOL_ALLOCATOR
+  poolForEach(&vm->pool, freePooled);
+  freePool(&vm->pool);
+#endif
+
+  Obj* object = vm->objects;
   while (object != NULL) {
     Obj* next = object->next;
     freeObject(object);
     object = next;
   }
+}
+
+#ifdef POOL_ALLOCATOR
+// Per thread like `vm`, so VMs on different threads can walk their heaps at the same time.
+static THREAD_LOCAL void (*objectVisitor)(Obj* object);
+
+static void visitPooled(void* slot) { objectVisitor((Obj*)slot); }
+#endif
+
+void forEachObject(void (*visit)(Obj* object)) {
+#ifdef POOL_ALLOCATOR
+  objectVisitor = visit;
+  poolForEach(&vm->pool, visitPooled);
+#endif
+
+  for (Obj* object = vm->objects; object != NULL; object = object->next) {
+    visit(object);
+  }
 }
\ No newline at end of file
@@ -0,0 +1,332 @@
+#include "natives.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+//> Arguments
+
+// The flat string behind a string argument. Flattening a rope allocates, which is safe because the
+// arguments are still on the stack. That allocation can move the stack, though, so a native copies
+// its arguments out of `args` before it flattens or allocates anything.
+static ObjString* stringArg(Value value) {
+  return IS_ROPE(value) ? flattenRope(AS_ROPE(value)) : AS_STRING(value);
+}
+
+// Reads a whole-number argument, failing for anything else.
+static bool integerArg(Value value, int* integer) {
+  if (!IS_NUMBER(value)) return false;
+
+  double number = AS_NUMBER(value);
+  if (number != floor(number) || number < INT32_MIN || number > INT32_MAX) return false;
+  *integer = (int)number;
+  return true;
+}
+
+// Appends to a list that is reachable by the collector.
+static void listAppend(ObjList* list, Value value) {
+  push(value);
+  writeValueArray(&list->items, value);
+  WRITE_BARRIER(value);
+  pop();
+}
+
+//< Arguments
+//> Math
+
+// Defines a native applying a C math function to its one number argument.
+#define MATH_NATIVE(name, function)                                              \
+  static Value name##Native(int argCount __attribute__((unused)), Value* args) { \
+    if (!IS_NUMBER(args[0])) return nativeError(#name "() expects a number.");   \
+    return COMPACT_NUMBER_VAL(function(AS_NUMBER(args[0])));                     \
+  }
+
+MATH_NATIVE(abs, fabs)
+MATH_NATIVE(floor, floor)
+MATH_NATIVE(ceil, ceil)
+MATH_NATIVE(round, round)
+MATH_NATIVE(sqrt, sqrt)
+MATH_NATIVE(exp, exp)
+MATH_NATIVE(log, log)
+MATH_NATIVE(sin, sin)
+MATH_NATIVE(cos, cos)
+MATH_NATIVE(tan, tan)
+
+#undef MATH_NATIVE
+
+static Value powNative(int argCount __attribute__((unused)), Value* args) {
+  if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) return nativeError("pow() expects two numbers.");
+  return COMPACT_NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+}
+
+// Returns the argument itself, so an integer stays an integer.
+static Value minNative(int argCount __attribute__((unused)), Value* args) {
+  if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) return nativeError("min() expects two numbers.");
+  return AS_NUMBER(args[1]) < AS_NUMBER(args[0]) ? args[1] : args[0];
+}
+
+static Value maxNative(int argCount __attribute__((unused)), Value* args) {
+  if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) return nativeError("max() expects two numbers.");
+  return AS_NUMBER(args[1]) > AS_NUMBER(args[0]) ? args[1] : args[0];
+}
+
+//< Math
+//> Strings
+
+static Value substringNative(int argCount __attribute__((unused)), Value* args) {
+  Value text = args[0];
+  Value first = args[1];
+  Value last = args[2];
+  if (!IS_ANY_STRING(text)) return nativeError("substring() expects a string.");
+
+  ObjString* string = stringArg(text);
+  int start, end;
+  if (!integerArg(first, &start) || !integerArg(last, &end) || start < 0 || end < start ||
+      end > string->length) {
+    return nativeError("substring() indexes must be integers with 0 <= start <= end <= %d.",
+                       string->length);
+  }
+  return OBJ_VAL(copyString(string->chars + start, end - start));
+}
+
+static int findSubstring(ObjString* string, ObjString* part) {
+  if (part->length == 0) return 0;
+  if (part->length > string->length) return -1;
+
+  const char* last = string->chars + string->length - part->length;
+  for (const char* candidate = string->chars; candidate <= last; candidate++) {
+    candidate = memchr(candidate, part->chars[0], last - candidate + 1);
+    if (candidate == NULL) break;
+    if (memcmp(candidate, part->chars, part->length) == 0) return candidate - string->chars;
+  }
+  return -1;
+}
+
+// Equality as `==` sees it, where a rope equals the string it flattens to.
+static bool sameValue(Value a, Value b) {
+  if (IS_ROPE(a)) a = OBJ_VAL(flattenRope(AS_ROPE(a)));
+  if (IS_ROPE(b)) b = OBJ_VAL(flattenRope(AS_ROPE(b)));
+  return valuesEqual(a, b);
+}
+
+// Finds a part of a string, or an element of a list. Returns -1 when there is none.
+static Value indexOfNative(int argCount __attribute__((unused)), Value* args) {
+  Value container = args[0];
+  Value target = args[1];
+  if (IS_LIST(container)) {
+    ObjList* list = AS_LIST(container);
+    for (int i = 0; i < list->items.count; i++) {
+      if (sameValue(list->items.values[i], target)) return INT_VAL(i);
+    }
+    return INT_VAL(-1);
+  }
+
+  if (!IS_ANY_STRING(container) || !IS_ANY_STRING(target)) {
+    return nativeError("indexOf() expects a string and a string, or a list and a value.");
+  }
+  ObjString* string = stringArg(container);
+  return INT_VAL(findSubstring(string, stringArg(target)));
+}
+
+// Splits at every occurrence of the separator, or into characters when it is empty.
+static Value splitNative(int argCount __attribute__((unused)), Value* args) {
+  Value text = args[0];
+  Value delimiter = args[1];
+  if (!IS_ANY_STRING(text) || !IS_ANY_STRING(delimiter)) {
+    return nativeError("split() expects a string and a separator.");
+  }
+
+  ObjString* string = stringArg(text);
+  ObjString* separator = stringArg(delimiter);
+  ObjList* list = newList();
+  push(OBJ_VAL(list));
+
+  if (separator->length == 0) {
+    for (int i = 0; i < string->length; i++) {
+      listAppend(list, OBJ_VAL(copyString(string->chars + i, 1)));
+    }
+    return pop();
+  }
+
+  const char* start = string->chars;
+  const char* end = string->chars + string->length;
+  for (;;) {
+    const char* found = start;
+    while (found + separator->length <= end &&
+           memcmp(found, separator->chars, separator->length) != 0) {
+      found++;
+    }
+    if (found + separator->length > end) found = end;
+
+    listAppend(list, OBJ_VAL(copyString(start, found - start)));
+    if (found == end) break;
+    start = found + separator->length;
+  }
+  return pop();
+}
+
+static Value changeCase(Value text, const char* name, int (*convert)(int)) {
+  if (!IS_ANY_STRING(text)) return nativeError("%s() expects a string.", name);
+
+  ObjString* string = stringArg(text);
+  char* chars = ALLOCATE(char, string->length + 1);
+  for (int i = 0; i < string->length; i++) {
+    chars[i] = (char)convert((unsigned char)string->chars[i]);
+  }
+  chars[string->length] = '\0';
+  return OBJ_VAL(takeString(chars, string->length));
+}
+
+// ASCII only, like the scanner: bytes outside it are left as they are.
+static int upper(int c) { return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c; }
+
+static int lower(int c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+
+static Value toUpperNative(int argCount __attribute__((unused)), Value* args) {
+  return changeCase(args[0], "toUpper", upper);
+}
+
+static Value toLowerNative(int argCount __attribute__((unused)), Value* args) {
+  return changeCase(args[0], "toLower", lower);
+}
+
+// The byte at an index, from 0 to 255.
+static Value charCodeNative(int argCount __attribute__((unused)), Value* args) {
+  Value text = args[0];
+  Value position = args[1];
+  if (!IS_ANY_STRING(text)) return nativeError("charCode() expects a string.");
+
+  ObjString* string = stringArg(text);
+  int index;
+  if (!integerArg(position, &index) || index < 0 || index >= string->length) {
+    return nativeError("charCode() index must be an integer inside the string.");
+  }
+  return INT_VAL((unsigned char)string->chars[index]);
+}
+
+static Value fromCharCodeNative(int argCount __attribute__((unused)), Value* args) {
+  int code;
+  if (!integerArg(args[0], &code) || code < 0 || code > UINT8_MAX) {
+    return nativeError("fromCharCode() expects an integer from 0 to 255.");
+  }
+  char c = (char)code;
+  return OBJ_VAL(copyString(&c, 1));
+}
+
+//< Strings
+//> Conversion
+
+// Parses a whole string as a decimal number, or returns nil if it is not one.
+static Value toNumberNative(int argCount __attribute__((unused)), Value* args) {
+  Value value = args[0];
+  if (IS_NUMBER(value)) return value;
+  if (!IS_ANY_STRING(value)) return nativeError("toNumber() expects a string or a number.");
+
+  // strtod() also takes leading spaces, "inf", "nan" and hexadecimal, which Lox never writes.
+  ObjString* string = stringArg(value);
+  const char* first = string->chars[0] == '-' ? string->chars + 1 : string->chars;
+  if (*first < '0' || *first > '9') return NIL_VAL;
+  if (strpbrk(string->chars, "xX") != NULL) return NIL_VAL;
+
+  char* end;
+  double number = strtod(string->chars, &end);
+  if (end != string->chars + string->length) return NIL_VAL;
+  return COMPACT_NUMBER_VAL(number);
+}
+
+// The text `print` shows for a number, boolean, nil or string.
+static Value toStringNative(int argCount __attribute__((unused)), Value* args) {
+  Value value = args[0];
+  if (IS_ANY_STRING(value)) return OBJ_VAL(stringArg(value));
+  if (IS_NIL(value)) return OBJ_VAL(copyString("nil", 3));
+  if (IS_BOOL(value)) {
+    return AS_BOOL(value) ? OBJ_VAL(copyString("true", 4)) : OBJ_VAL(copyString("false", 5));
+  }
+  if (!IS_NUMBER(value)) return nativeError("toString() expects a number, boolean, nil or string.");
+
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(value));
+  return OBJ_VAL(copyString(buffer, length));
+}
+
+//< Conversion
+//> Lists
+
+static int compareNumbers(const void* a, const void* b) {
+  double x = AS_NUMBER(*(const Value*)a);
+  double y = AS_NUMBER(*(const Value*)b);
+  return (x > y) - (x < y);
+}
+
+static int compareStrings(const void* a, const void* b) {
+  ObjString* x = AS_STRING(*(const Value*)a);
+  ObjString* y = AS_STRING(*(const Value*)b);
+  int shorter = x->length < y->length ? x->length : y->length;
+  int order = memcmp(x->chars, y->chars, shorter);
+  return order != 0 ? order : (x->length > y->length) - (x->length < y->length);
+}
+
+// Sorts a list of numbers, or of strings by their bytes, in place and returns it.
+static Value sortNative(int argCount __attribute__((unused)), Value* args) {
+  Value items = args[0];
+  if (!IS_LIST(items)) return nativeError("sort() expects a list.");
+
+  ObjList* list = AS_LIST(items);
+  bool numbers = true, strings = true;
+  for (int i = 0; i < list->items.count; i++) {
+    numbers = numbers && IS_NUMBER(list->items.values[i]);
+    strings = strings && IS_ANY_STRING(list->items.values[i]);
+  }
+  if (!numbers && !strings) return nativeError("sort() expects a list of numbers or of strings.");
+
+  if (numbers) {
+    qsort(list->items.values, list->items.count, sizeof(Value), compareNumbers);
+    return items;
+  }
+
+  // The comparison needs flat characters, and a rope is interchangeable with its string.
+  for (int i = 0; i < list->items.count; i++) {
+    if (!IS_ROPE(list->items.values[i])) continue;
+    ObjString* string = flattenRope(AS_ROPE(list->items.values[i]));
+    list->items.values[i] = OBJ_VAL(string);
+    WRITE_BARRIER_OBJ(string);
+  }
+  qsort(list->items.values, list->items.count, sizeof(Value), compareStrings);
+  return items;
+}
+
+//< Lists
+
+void defineStandardLibrary() {
+  defineNative("abs", absNative, 1);
+  defineNative("floor", floorNative, 1);
+  defineNative("ceil", ceilNative, 1);
+  defineNative("round", roundNative, 1);
+  defineNative("sqrt", sqrtNative, 1);
+  defineNative("exp", expNative, 1);
+  defineNative("log", logNative, 1);
+  defineNative("sin", sinNative, 1);
+  defineNative("cos", cosNative, 1);
+  defineNative("tan", tanNative, 1);
+  defineNative("pow", powNative, 2);
+  defineNative("min", minNative, 2);
+  defineNative("max", maxNative, 2);
+
+  defineNative("substring", substringNative, 3);
+  defineNative("indexOf", indexOfNative, 2);
+  defineNative("split", splitNative, 2);
+  defineNative("toUpper", toUpperNative, 1);
+  defineNative("toLower", toLowerNative, 1);
+  defineNative("charCode", charCodeNative, 2);
+  defineNative("fromCharCode", fromCharCodeNative, 1);
+
+  defineNative("toNumber", toNumberNative, 1);
+  defineNative("toString", toStringNative, 1);
+
+  defineNative("sort", sortNative, 1);
+}
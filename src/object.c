@@ -1,6 +1,7 @@
 #include "object.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -12,12 +13,20 @@
 #define ALLOCATE_OBJ_CST_SIZE(type, objectType, size) (type*)allocateObject(size, objectType)
 
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  Obj* object = allocateObjectMemory(size);
   object->type = type;
-  object->isMarked = false;
 
-  object->next = vm.objects;
-  vm.objects = object;
+  AllocCount* count = &vm->allocCounts[vm->currentOpcode];
+  count->objects++;
+  count->bytes += size;
+  vm->stats.objectsAllocated[type]++;
+  vm->stats.bytesAllocated[type] += size;
+
+  // Objects born during marking start gray so the cycle traces them once they are initialized.
+  if (vm->gcPhase == GC_PHASE_MARK) {
+    markObject(object);
+    vm->gcObjectsAllocated++;
+  }
 
 #ifdef DEBUG_LOG_GC
   printf("[MEM] %p allocate %zu for %d\n", (void*)object, size, type);
@@ -30,7 +39,11 @@ ObjFunction* newFunction() {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
+  function->capturesLocals = false;
   function->name = NULL;
+  function->hotness = 0;
+  function->jitCode = NULL;
   initChunk(&function->chunk);
   return function;
 }
@@ -60,16 +73,139 @@ ObjClass* newClass(ObjString* name) {
   initTable(&klass->methods);
   klass->name = name;
   klass->cachedInit = NULL;
+  klass->version = 0;
+  klass->rootShape = NULL;
+  klass->fieldCountHint = 0;
+
+  push(OBJ_VAL(klass));
+  klass->rootShape = newShape(klass, NULL, NULL);
+  pop();
+
   return klass;
 }
 
+ObjShape* newShape(ObjClass* klass, ObjShape* parent, ObjString* name) {
+  ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->klass = klass;
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = 0;
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+
+  if (parent != NULL) {
+    push(OBJ_VAL(shape));
+    tableAddAll(&parent->slots, &shape->slots);
+    tableSet(&shape->slots, name, NUMBER_VAL(parent->fieldCount));
+    shape->fieldCount = parent->fieldCount + 1;
+    pop();
+  }
+
+  return shape;
+}
+
+int shapeFindSlot(ObjShape* shape, ObjString* name) {
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot)) return -1;
+  return (int)AS_NUMBER(slot);
+}
+
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+  if (shape->fieldCount == SHAPE_MAX_FIELDS) return NULL;
+
+  ObjShape* child = newShape(shape->klass, shape, name);
+  push(OBJ_VAL(child));
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  pop();
+  return child;
+}
+
 ObjInstance* newInstance(ObjClass* klass) {
-  ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  // Size the inline slots after the largest instance of this class seen so far.
+  int inlineCapacity = klass->fieldCountHint;
+  ObjInstance* instance = ALLOCATE_OBJ_CST_SIZE(ObjInstance, OBJ_INSTANCE,
+                                                sizeof(ObjInstance) + sizeof(Value) * inlineCapacity);
   instance->klass = klass;
+  instance->shape = klass->rootShape;
+  instance->slots = instance->inlineSlots;
+  instance->slotCapacity = inlineCapacity;
+  instance->inlineCapacity = inlineCapacity;
   initTable(&instance->fields);
   return instance;
 }
 
+void instanceAddField(ObjInstance* instance, ObjShape* shape, Value value) {
+  int slot = shape->fieldCount - 1;
+
+  if (slot >= instance->slotCapacity) {
+    int oldCapacity = instance->slotCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    if (instance->slots == instance->inlineSlots) {
+      Value* slots = ALLOCATE(Value, capacity);
+      memcpy(slots, instance->inlineSlots, sizeof(Value) * slot);
+      instance->slots = slots;
+    } else {
+      instance->slots = GROW_ARRAY(Value, instance->slots, oldCapacity, capacity);
+    }
+    instance->slotCapacity = capacity;
+  }
+
+  instance->slots[slot] = value;
+  instance->shape = shape;
+  WRITE_BARRIER(value);
+
+  if (shape->fieldCount > instance->klass->fieldCountHint) {
+    instance->klass->fieldCountHint = shape->fieldCount;
+  }
+}
+
+// Moves every slot into the instance's field table and detaches it from the shape tree.
+static void instanceToDictionary(ObjInstance* instance) {
+  for (ObjShape* shape = instance->shape; shape->parent != NULL; shape = shape->parent) {
+    tableSet(&instance->fields, shape->name, instance->slots[shape->fieldCount - 1]);
+  }
+
+  if (instance->slots != instance->inlineSlots) {
+    FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+  }
+  instance->slots = instance->inlineSlots;
+  instance->slotCapacity = instance->inlineCapacity;
+  instance->shape = NULL;
+}
+
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value) {
+  if (instance->shape == NULL) return tableGet(&instance->fields, name, value);
+
+  int slot = shapeFindSlot(instance->shape, name);
+  if (slot == -1) return false;
+
+  *value = instance->slots[slot];
+  return true;
+}
+
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value) {
+  if (instance->shape != NULL) {
+    int slot = shapeFindSlot(instance->shape, name);
+    if (slot != -1) {
+      instance->slots[slot] = value;
+      WRITE_BARRIER(value);
+      return;
+    }
+
+    ObjShape* next = shapeTransition(instance->shape, name);
+    if (next != NULL) {
+      instanceAddField(instance, next, value);
+      return;
+    }
+
+    instanceToDictionary(instance);
+  }
+
+  tableSet(&instance->fields, name, value);
+}
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
   ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
   bound->receiver = receiver;
@@ -77,6 +213,12 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
   return bound;
 }
 
+ObjList* newList() {
+  ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  initValueArray(&list->items);
+  return list;
+}
+
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->location = slot;
@@ -85,7 +227,7 @@ ObjUpvalue* newUpvalue(Value* slot) {
   return upvalue;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
+static ObjString* allocateString(const char* chars, int length, uint32_t hash) {
   ObjString* string = ALLOCATE_OBJ_CST_SIZE(ObjString, OBJ_STRING, sizeof(ObjString) + length + 1);
   string->length = length;
   string->hash = hash;
@@ -93,50 +235,187 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
   string->chars[length] = '\0';
 
   push(OBJ_VAL(string));
-  tableSet(&vm.strings, string, NIL_VAL);
+  stringTableAdd(&vm->strings, string);
   pop();
 
   return string;
 }
 
+// Strings at least this long are hashed a word at a time.
+#define HASH_WORD_MIN 8
+
+#define HASH_PRIME_1 0x9E3779B185EBCA87ull
+#define HASH_PRIME_2 0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME_3 0x165667B19E3779F9ull
+#define HASH_PRIME_4 0x85EBCA77C2B2AE63ull
+
+static inline uint64_t rotateLeft(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t hashRound(uint64_t hash, uint64_t word) {
+  word *= HASH_PRIME_2;
+  word = rotateLeft(word, 31);
+  word *= HASH_PRIME_1;
+  hash ^= word;
+  return rotateLeft(hash, 27) * HASH_PRIME_1 + HASH_PRIME_4;
+}
+
 /**
- * @brief Hashes a string using the FNV-1a algorithm.
+ * @brief Hashes a string.
  *
- * This function computes the hash value of a string using the FNV-1a algorithm.
- * It iterates over each character in the string, XORing the hash with the character
- * and multiplying by a prime number to create a unique hash value.
+ * Short strings, which are mostly identifiers, use byte-at-a-time FNV-1a. Longer ones are read
+ * eight bytes at a time and mixed with xxHash64-style multiply-rotate rounds, then folded to
+ * 32 bits after a final avalanche so the low bits used for table indexing are well mixed.
  *
  * @param key The character array to hash.
  * @param length The length of the character array.
  * @return The hash value of the string.
  */
 static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+  if (length < HASH_WORD_MIN) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+      hash ^= (uint8_t)key[i];
+      hash *= 16777619;
+    }
+    return hash;
   }
-  return hash;
+
+  uint64_t hash = HASH_PRIME_3 ^ ((uint64_t)length * HASH_PRIME_1);
+  int i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, key + i, sizeof(word));
+    hash = hashRound(hash, word);
+  }
+  if (i < length) {
+    // Re-read the last full word, overlapping the previous one, instead of a byte-wise tail.
+    uint64_t word;
+    memcpy(&word, key + length - 8, sizeof(word));
+    hash = hashRound(hash, word);
+  }
+
+  hash ^= hash >> 33;
+  hash *= HASH_PRIME_2;
+  hash ^= hash >> 29;
+  hash *= HASH_PRIME_3;
+  hash ^= hash >> 32;
+  return (uint32_t)hash;
 }
 
 ObjString* copyString(const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString* interned = stringTableFind(&vm->strings, chars, length, hash);
   if (interned != NULL) return interned;
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  // The characters are copied into the string object itself.
+  return allocateString(chars, length, hash);
 }
 
 ObjString* takeString(char* chars, int length) {
   uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString* interned = stringTableFind(&vm->strings, chars, length, hash);
   if (interned != NULL) {
     FREE_ARRAY(char, chars, length + 1);
     return interned;
   }
-  return allocateString(chars, length, hash);
+  ObjString* string = allocateString(chars, length, hash);
+  FREE_ARRAY(char, chars, length + 1);
+  return string;
+}
+
+static int textLength(Obj* text) {
+  return text->type == OBJ_STRING ? ((ObjString*)text)->length : ((ObjRope*)text)->length;
+}
+
+ObjRope* newRope(Obj* left, Obj* right) {
+  ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  rope->length = textLength(left) + textLength(right);
+  return rope;
+}
+
+typedef struct {
+  Obj* node;
+  int offset;
+} RopePiece;
+
+void copyRopeChars(ObjRope* rope, char* dest) {
+  // An explicit work list keeps long left- or right-leaning chains off the C stack. Scratch
+  // memory comes from malloc so that walking a rope can never start a collection.
+  int capacity = 8;
+  int count = 0;
+  RopePiece* pieces = malloc(sizeof(RopePiece) * capacity);
+  if (pieces == NULL) exit(1);
+  pieces[count++] = (RopePiece){(Obj*)rope, 0};
+
+  while (count > 0) {
+    RopePiece piece = pieces[--count];
+    if (piece.node->type == OBJ_STRING) {
+      ObjString* string = (ObjString*)piece.node;
+      memcpy(dest + piece.offset, string->chars, string->length);
+      continue;
+    }
+
+    ObjRope* node = (ObjRope*)piece.node;
+    if (node->flat != NULL) {
+      memcpy(dest + piece.offset, node->flat->chars, node->length);
+      continue;
+    }
+
+    if (count + 2 > capacity) {
+      capacity *= 2;
+      pieces = realloc(pieces, sizeof(RopePiece) * capacity);
+      if (pieces == NULL) exit(1);
+    }
+    pieces[count++] = (RopePiece){node->left, piece.offset};
+    pieces[count++] = (RopePiece){node->right, piece.offset + textLength(node->left)};
+  }
+
+  free(pieces);
+}
+
+ObjString* flattenRope(ObjRope* rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  char* chars = ALLOCATE(char, rope->length + 1);
+  copyRopeChars(rope, chars);
+  chars[rope->length] = '\0';
+  rope->flat = takeString(chars, rope->length);
+  WRITE_BARRIER_OBJ(rope->flat);
+
+  // The operands are no longer needed and may be collected.
+  rope->left = NULL;
+  rope->right = NULL;
+  return rope->flat;
+}
+
+ObjStringBuilder* newStringBuilder() {
+  ObjStringBuilder* builder = ALLOCATE_OBJ(ObjStringBuilder, OBJ_STRING_BUILDER);
+  builder->length = 0;
+  builder->capacity = 0;
+  builder->chars = NULL;
+  return builder;
+}
+
+void builderAppend(ObjStringBuilder* builder, Value text) {
+  int length = textLength(AS_OBJ(text));
+  if (builder->length + length > builder->capacity) {
+    int oldCapacity = builder->capacity;
+    while (builder->capacity < builder->length + length) {
+      builder->capacity = GROW_CAPACITY(builder->capacity);
+    }
+    builder->chars = GROW_ARRAY(char, builder->chars, oldCapacity, builder->capacity);
+  }
+
+  if (IS_STRING(text)) {
+    memcpy(builder->chars + builder->length, AS_CSTRING(text), length);
+  } else {
+    copyRopeChars(AS_ROPE(text), builder->chars + builder->length);
+  }
+  builder->length += length;
 }
 
 static void printFunction(ObjFunction* function) {
@@ -148,6 +427,44 @@ static void printFunction(ObjFunction* function) {
   printf("<fn %s>", function->name->chars);
 }
 
+// Lists being printed, outermost first. A list that contains itself, directly or through others,
+// is printed as `[...]` the second time round, as is any list nested deeper than this.
+#define PRINT_DEPTH_MAX 64
+static THREAD_LOCAL ObjList* printingLists[PRINT_DEPTH_MAX];
+static THREAD_LOCAL int printingListCount = 0;
+
+static void printList(ObjList* list) {
+  bool printing = printingListCount == PRINT_DEPTH_MAX;
+  for (int i = 0; i < printingListCount && !printing; i++) printing = printingLists[i] == list;
+  if (printing) {
+    printf("[...]");
+    return;
+  }
+
+  printingLists[printingListCount++] = list;
+  printf("[");
+  for (int i = 0; i < list->items.count; i++) {
+    if (i > 0) printf(", ");
+    printValue(list->items.values[i]);
+  }
+  printf("]");
+  printingListCount--;
+}
+
+static void printRope(ObjRope* rope) {
+  if (rope->flat != NULL) {
+    printf("%s", rope->flat->chars);
+    return;
+  }
+
+  // Printing must not allocate on the managed heap, so copy into scratch memory instead.
+  char* chars = malloc(rope->length);
+  if (chars == NULL) exit(1);
+  copyRopeChars(rope, chars);
+  fwrite(chars, 1, rope->length, stdout);
+  free(chars);
+}
+
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
     case OBJ_FUNCTION:
@@ -174,5 +491,19 @@ void printObject(Value value) {
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
+    case OBJ_LIST:
+      printList(AS_LIST(value));
+      break;
+    case OBJ_ROPE:
+      printRope(AS_ROPE(value));
+      break;
+    case OBJ_STRING_BUILDER: {
+      ObjStringBuilder* builder = AS_STRING_BUILDER(value);
+      if (builder->length > 0) fwrite(builder->chars, 1, builder->length, stdout);
+      break;
+    }
   }
 }
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include "peephole.h"
+
+#include <stdlib.h>
+
+#include "vm.h"
+
+// Marks old offsets that are not the start of a fused sequence.
+#define NOT_FUSED 0xff
+
+// True if an instruction `instruction` starts at `offset` and no jump lands on it.
+static bool follows(Chunk* chunk, const bool* isTarget, int offset, uint8_t instruction) {
+  return offset < chunk->count && chunk->code[offset] == instruction && !isTarget[offset];
+}
+
+// Returns the superinstruction the code at `offset` fuses into, storing the number of original
+// bytes it replaces in `length`, or NOT_FUSED.
+static uint8_t matchSequence(Chunk* chunk, const bool* isTarget, int offset, int* length) {
+  uint8_t* code = chunk->code;
+
+  switch (code[offset]) {
+    case OP_GET_LOCAL:
+      if (follows(chunk, isTarget, offset + 2, OP_CONSTANT) &&
+          IS_NUMBER(chunk->constants.values[code[offset + 3]]) &&
+          follows(chunk, isTarget, offset + 4, OP_ADD) &&
+          follows(chunk, isTarget, offset + 5, OP_SET_LOCAL) && code[offset + 6] == code[offset + 1] &&
+          follows(chunk, isTarget, offset + 7, OP_POP)) {
+        *length = 8;
+        return OP_INC_LOCAL;
+      }
+      if (follows(chunk, isTarget, offset + 2, OP_GET_LOCAL)) {
+        *length = 4;
+        return OP_GET_LOCAL_GET_LOCAL;
+      }
+      break;
+    case OP_CONSTANT:
+      if (follows(chunk, isTarget, offset + 2, OP_ADD)) {
+        *length = 3;
+        return OP_ADD_CONST;
+      }
+      break;
+    case OP_LESS:
+      if (follows(chunk, isTarget, offset + 1, OP_JUMP_IF_FALSE)) {
+        *length = 4;
+        return OP_LESS_JUMP_IF_FALSE;
+      }
+      break;
+    case OP_NOT:
+      if (follows(chunk, isTarget, offset + 1, OP_JUMP_IF_FALSE)) {
+        *length = 4;
+        return OP_NOT_JUMP_IF_FALSE;
+      }
+      break;
+  }
+
+  return NOT_FUSED;
+}
+
+// Every superinstruction is its opcode plus two operand bytes, except OP_ADD_CONST.
+static int fusedLength(uint8_t instruction) { return instruction == OP_ADD_CONST ? 2 : 3; }
+
+// Writes the superinstruction planned for `offset`, if any.
+static int writeFused(Chunk* chunk, int offset, int* write, const int* newOffset, void* context) {
+  const uint8_t* fused = context;
+  uint8_t* code = chunk->code;
+  int start = *write;
+
+  switch (fused[offset]) {
+    case OP_INC_LOCAL: {
+      uint8_t slot = code[offset + 1];
+      uint8_t constant = code[offset + 3];
+      code[(*write)++] = OP_INC_LOCAL;
+      code[(*write)++] = slot;
+      code[(*write)++] = constant;
+      return 8;
+    }
+    case OP_GET_LOCAL_GET_LOCAL: {
+      uint8_t first = code[offset + 1];
+      uint8_t second = code[offset + 3];
+      code[(*write)++] = OP_GET_LOCAL_GET_LOCAL;
+      code[(*write)++] = first;
+      code[(*write)++] = second;
+      return 4;
+    }
+    case OP_ADD_CONST: {
+      uint8_t constant = code[offset + 1];
+      code[(*write)++] = OP_ADD_CONST;
+      code[(*write)++] = constant;
+      return 3;
+    }
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_NOT_JUMP_IF_FALSE: {
+      int target = jumpTarget(chunk, offset + 1);
+      code[(*write)++] = fused[offset];
+      writeJumpOperand(code, *write, newOffset[target] - (start + 3));
+      *write += 2;
+      return 4;
+    }
+    default:
+      return 0;
+  }
+}
+
+void optimizeChunk(Chunk* chunk) {
+  int count = chunk->count;
+  bool* isTarget = calloc(count + 1, sizeof(bool));
+  uint8_t* fused = malloc(count);
+  int* newOffset = malloc((count + 1) * sizeof(int));
+  if (isTarget == NULL || fused == NULL || newOffset == NULL) {
+    free(isTarget);
+    free(fused);
+    free(newOffset);
+    return;
+  }
+
+  // Find every offset a jump lands on; no sequence may be fused across one.
+  for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+    int target = jumpTarget(chunk, offset);
+    if (target >= 0) isTarget[target] = true;
+  }
+
+  // Decide what each instruction becomes and where it will live.
+  int size = 0;
+  for (int offset = 0; offset < count;) {
+    int length = instructionLength(chunk, offset);
+    fused[offset] = matchSequence(chunk, isTarget, offset, &length);
+    newOffset[offset] = size;
+    size += fused[offset] == NOT_FUSED ? length : fusedLength(fused[offset]);
+    offset += length;
+  }
+  newOffset[count] = size;
+
+  relocateChunk(chunk, newOffset, writeFused, fused);
+
+  free(isTarget);
+  free(fused);
+  free(newOffset);
+}
@@ -0,0 +1,153 @@
+#include "pool.h"
+
+#ifdef POOL_ALLOCATOR
+
+#include <stdlib.h>
+#include <string.h>
+
+// A free slot, linked into its size class. `slab` lets allocation find the slot's live byte.
+typedef struct FreeSlot {
+  struct FreeSlot* next;
+  Slab* slab;
+} FreeSlot;
+
+static int classIndex(size_t size) { return (int)(POOL_ROUND(size) / POOL_GRANULARITY) - 1; }
+
+static int slotIndex(Slab* slab, void* slot) {
+  return (int)(((uint8_t*)slot - slab->slots) / slab->slotSize);
+}
+
+static void releaseSlot(SizeClass* sizeClass, Slab* slab, int index) {
+  FreeSlot* slot = (FreeSlot*)(slab->slots + (size_t)index * slab->slotSize);
+  slab->live[index] = 0;
+  slot->slab = slab;
+  slot->next = (FreeSlot*)sizeClass->freeList;
+  sizeClass->freeList = slot;
+}
+
+static void addSlab(ObjectPool* pool, SizeClass* sizeClass, int slotSize) {
+  int slotCount = POOL_SLAB_SIZE / slotSize;
+  size_t header = POOL_ROUND(sizeof(Slab) + slotCount);
+
+  Slab* slab = (Slab*)malloc(header + (size_t)slotSize * slotCount);
+  if (slab == NULL) exit(1);
+
+  slab->slotSize = slotSize;
+  slab->slotCount = slotCount;
+  slab->slots = (uint8_t*)slab + header;
+  memset(slab->live, 0, slotCount);
+
+  // A slab created mid-sweep holds nothing the sweep needs to look at.
+  slab->swept = pool->sweeping;
+
+  slab->next = sizeClass->slabs;
+  sizeClass->slabs = slab;
+
+  // Thread the slots back to front so they are handed out in address order.
+  for (int i = slotCount - 1; i >= 0; i--) {
+    releaseSlot(sizeClass, slab, i);
+  }
+}
+
+void initPool(ObjectPool* pool) {
+  for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+    pool->classes[i].slabs = NULL;
+    pool->classes[i].freeList = NULL;
+  }
+  pool->sweeping = false;
+  pool->sweepClass = 0;
+  pool->sweepSlab = NULL;
+  pool->sweepSlot = 0;
+}
+
+void freePool(ObjectPool* pool) {
+  for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+    Slab* slab = pool->classes[i].slabs;
+    while (slab != NULL) {
+      Slab* next = slab->next;
+      free(slab);
+      slab = next;
+    }
+  }
+  initPool(pool);
+}
+
+void* poolAllocate(ObjectPool* pool, size_t size, bool* pending) {
+  int index = classIndex(size);
+  SizeClass* sizeClass = &pool->classes[index];
+  if (sizeClass->freeList == NULL) {
+    addSlab(pool, sizeClass, (index + 1) * POOL_GRANULARITY);
+  }
+
+  FreeSlot* slot = (FreeSlot*)sizeClass->freeList;
+  sizeClass->freeList = slot->next;
+
+  Slab* slab = slot->slab;
+  int position = slotIndex(slab, slot);
+  slab->live[position] = 1;
+
+  *pending = pool->sweeping && !slab->swept &&
+             !(slab == pool->sweepSlab && position < pool->sweepSlot);
+  return slot;
+}
+
+// Moves the sweep cursor to the next slab that existed when the sweep began.
+static void advanceSweep(ObjectPool* pool, Slab* slab) {
+  while (slab != NULL && slab->swept) slab = slab->next;
+
+  while (slab == NULL && ++pool->sweepClass < POOL_CLASS_COUNT) {
+    slab = pool->classes[pool->sweepClass].slabs;
+    while (slab != NULL && slab->swept) slab = slab->next;
+  }
+
+  pool->sweepSlab = slab;
+  pool->sweepSlot = 0;
+  if (slab == NULL) pool->sweeping = false;
+}
+
+void poolBeginSweep(ObjectPool* pool) {
+  for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+    for (Slab* slab = pool->classes[i].slabs; slab != NULL; slab = slab->next) {
+      slab->swept = false;
+    }
+  }
+
+  pool->sweeping = true;
+  pool->sweepClass = 0;
+  advanceSweep(pool, pool->classes[0].slabs);
+}
+
+int poolSweep(ObjectPool* pool, int budget, PoolSweepFn sweepObject) {
+  while (pool->sweeping && budget > 0) {
+    Slab* slab = pool->sweepSlab;
+    SizeClass* sizeClass = &pool->classes[pool->sweepClass];
+
+    while (pool->sweepSlot < slab->slotCount && budget > 0) {
+      int index = pool->sweepSlot++;
+      if (!slab->live[index]) continue;
+
+      budget--;
+      if (!sweepObject(slab->slots + (size_t)index * slab->slotSize)) {
+        releaseSlot(sizeClass, slab, index);
+      }
+    }
+
+    if (pool->sweepSlot == slab->slotCount) {
+      slab->swept = true;
+      advanceSweep(pool, slab->next);
+    }
+  }
+  return budget;
+}
+
+void poolForEach(ObjectPool* pool, void (*visit)(void* object)) {
+  for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+    for (Slab* slab = pool->classes[i].slabs; slab != NULL; slab = slab->next) {
+      for (int j = 0; j < slab->slotCount; j++) {
+        if (slab->live[j]) visit(slab->slots + (size_t)j * slab->slotSize);
+      }
+    }
+  }
+}
+
+#endif
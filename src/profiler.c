@@ -0,0 +1,475 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "profiler.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "vm.h"
+
+// Set by the timer. Several ticks can pass during a long native call or collection; the next
+// instruction then records a single sample covering all of them.
+//
+// Unlike the rest of the profiler's state this is shared by the whole process: the timer is per
+// process and its signal may be handled on any thread, so it could not find a per-VM count.
+static volatile sig_atomic_t pendingTicks = 0;
+
+static uint64_t cpuMicros() {
+  struct timespec time;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+  return (uint64_t)time.tv_sec * 1000000 + (uint64_t)time.tv_nsec / 1000;
+}
+
+static void onProfileTick(int signal) {
+  (void)signal;
+  pendingTicks++;
+}
+
+// The profiler's own bookkeeping uses plain malloc: it runs between instructions, where a
+// collection triggered by `reallocate` would be unexpected.
+static void* growBuffer(void* buffer, int* capacity, size_t elementSize) {
+  *capacity = *capacity < 8 ? 8 : *capacity * 2;
+  void* result = realloc(buffer, elementSize * (size_t)*capacity);
+  if (result == NULL) {
+    fprintf(stderr, "Not enough memory for the profiler.\n");
+    exit(1);
+  }
+  return result;
+}
+
+static uint32_t hashPointer(const void* pointer) {
+  uint64_t bits = (uint64_t)(uintptr_t)pointer;
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// Rebuilds an open-addressing map of index + 1 values at twice its capacity. Only the indices
+// already in the map are carried over.
+static int* growSlots(int* slots, int* capacity, uint32_t (*hashOf)(int index)) {
+  int oldCapacity = *capacity;
+  *capacity = oldCapacity < 16 ? 16 : oldCapacity * 2;
+  int* grown = calloc((size_t)*capacity, sizeof(int));
+  if (grown == NULL) {
+    fprintf(stderr, "Not enough memory for the profiler.\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < oldCapacity; i++) {
+    if (slots[i] == 0) continue;
+    uint32_t slot = hashOf(slots[i] - 1) & (*capacity - 1);
+    while (grown[slot] != 0) slot = (slot + 1) & (*capacity - 1);
+    grown[slot] = slots[i];
+  }
+  free(slots);
+  return grown;
+}
+
+static uint32_t functionHash(int index) {
+  return hashPointer(vm->profiler.functions[index].function);
+}
+
+static uint32_t stackHash(int index) { return vm->profiler.stacks[index].hash; }
+
+// Returns the index of the function's profile, creating it on first sight.
+static int functionIndex(ObjFunction* function) {
+  Profiler* profiler = &vm->profiler;
+  uint32_t hash = hashPointer(function);
+
+  if (profiler->functionSlotCapacity > 0) {
+    uint32_t mask = profiler->functionSlotCapacity - 1;
+    int* slots = profiler->functionSlots;
+    for (uint32_t slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask) {
+      int index = slots[slot] - 1;
+      if (profiler->functions[index].function == function) return index;
+    }
+  }
+
+  if (profiler->functionCapacity < profiler->functionCount + 1) {
+    profiler->functions = growBuffer(profiler->functions, &profiler->functionCapacity,
+                                     sizeof(FunctionProfile));
+  }
+  int index = profiler->functionCount++;
+  FunctionProfile* profile = &profiler->functions[index];
+  profile->function = function;
+  profile->calls = 0;
+  profile->selfMicros = 0;
+  profile->totalMicros = 0;
+  profile->lastSample = 0;
+  size_t length = (size_t)function->chunk.count + 1;
+  profile->instructionCounts = calloc(length, sizeof(uint64_t));
+  profile->sampleMicros = calloc(length, sizeof(uint64_t));
+  if (profile->instructionCounts == NULL || profile->sampleMicros == NULL) {
+    fprintf(stderr, "Not enough memory for the profiler.\n");
+    exit(1);
+  }
+
+  // Kept at most half full.
+  if (profiler->functionSlotCapacity < profiler->functionCount * 2) {
+    profiler->functionSlots =
+        growSlots(profiler->functionSlots, &profiler->functionSlotCapacity, functionHash);
+  }
+  uint32_t mask = profiler->functionSlotCapacity - 1;
+  uint32_t slot = hash & mask;
+  while (profiler->functionSlots[slot] != 0) slot = (slot + 1) & mask;
+  profiler->functionSlots[slot] = index + 1;
+  return index;
+}
+
+// Adds `micros` to the stack made of `frames`, outermost first.
+static void countStack(const int* frames, int depth, uint64_t micros) {
+  Profiler* profiler = &vm->profiler;
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < depth; i++) {
+    hash ^= (uint32_t)frames[i];
+    hash *= 16777619;
+  }
+
+  if (profiler->stackSlotCapacity > 0) {
+    uint32_t mask = profiler->stackSlotCapacity - 1;
+    int* slots = profiler->stackSlots;
+    for (uint32_t slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask) {
+      ProfileStack* stack = &profiler->stacks[slots[slot] - 1];
+      if (stack->hash == hash && stack->depth == depth &&
+          memcmp(&profiler->stackFrames[stack->start], frames, sizeof(int) * depth) == 0) {
+        stack->micros += micros;
+        return;
+      }
+    }
+  }
+
+  while (profiler->stackFrameCapacity < profiler->stackFrameCount + depth) {
+    profiler->stackFrames =
+        growBuffer(profiler->stackFrames, &profiler->stackFrameCapacity, sizeof(int));
+  }
+  if (profiler->stackCapacity < profiler->stackCount + 1) {
+    profiler->stacks = growBuffer(profiler->stacks, &profiler->stackCapacity, sizeof(ProfileStack));
+  }
+
+  int index = profiler->stackCount++;
+  ProfileStack* stack = &profiler->stacks[index];
+  stack->hash = hash;
+  stack->start = profiler->stackFrameCount;
+  stack->depth = depth;
+  stack->micros = micros;
+  memcpy(&profiler->stackFrames[stack->start], frames, sizeof(int) * depth);
+  profiler->stackFrameCount += depth;
+
+  if (profiler->stackSlotCapacity < profiler->stackCount * 2) {
+    profiler->stackSlots = growSlots(profiler->stackSlots, &profiler->stackSlotCapacity, stackHash);
+  }
+  uint32_t mask = profiler->stackSlotCapacity - 1;
+  uint32_t slot = hash & mask;
+  while (profiler->stackSlots[slot] != 0) slot = (slot + 1) & mask;
+  profiler->stackSlots[slot] = index + 1;
+}
+
+// Charges `micros` to the running instruction and to everything on the call stack.
+static void recordSample(int index, int offset, uint64_t micros) {
+  Profiler* profiler = &vm->profiler;
+  profiler->samples++;
+
+  FunctionProfile* running = &profiler->functions[index];
+  running->selfMicros += micros;
+  running->sampleMicros[offset] += micros;
+
+  int* frames = malloc(sizeof(int) * vm->frameCount);
+  if (frames == NULL) return;
+
+  for (int i = 0; i < vm->frameCount; i++) {
+    bool top = i == vm->frameCount - 1;
+    int frameIndex = top ? index : functionIndex(vm->frames[i].closure->function);
+    frames[i] = frameIndex;
+
+    // A recursive function is on the stack several times but only spent this time once.
+    FunctionProfile* profile = &profiler->functions[frameIndex];
+    if (profile->lastSample != profiler->samples) {
+      profile->lastSample = profiler->samples;
+      profile->totalMicros += micros;
+    }
+  }
+
+  countStack(frames, vm->frameCount, micros);
+  free(frames);
+}
+
+void initProfiler() {
+  memset(&vm->profiler, 0, sizeof(Profiler));
+  vm->profiler.intervalMicros = PROFILE_INTERVAL_US;
+  vm->profiler.lastIndex = -1;
+}
+
+void freeProfiler() {
+  if (vm->profiler.running) stopProfiler();
+
+  for (int i = 0; i < vm->profiler.functionCount; i++) {
+    free(vm->profiler.functions[i].instructionCounts);
+    free(vm->profiler.functions[i].sampleMicros);
+  }
+  free(vm->profiler.functions);
+  free(vm->profiler.functionSlots);
+  free(vm->profiler.stacks);
+  free(vm->profiler.stackSlots);
+  free(vm->profiler.stackFrames);
+  initProfiler();
+}
+
+void startProfiler(int intervalMicros) {
+  Profiler* profiler = &vm->profiler;
+  profiler->intervalMicros = intervalMicros;
+  profiler->lastFunction = NULL;
+  profiler->lastFrameCount = vm->frameCount;
+  profiler->lastSampleTime = cpuMicros();
+  pendingTicks = 0;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onProfileTick;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &action, NULL);
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = intervalMicros / 1000000;
+  timer.it_interval.tv_usec = intervalMicros % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  profiler->running = true;
+}
+
+void stopProfiler() {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  vm->profiler.running = false;
+}
+
+void profileInstruction(ObjFunction* function, uint8_t* ip) {
+  Profiler* profiler = &vm->profiler;
+  if (function != profiler->lastFunction) {
+    profiler->lastIndex = functionIndex(function);
+    profiler->lastFunction = function;
+  }
+
+  FunctionProfile* profile = &profiler->functions[profiler->lastIndex];
+  // Only a call pushes a frame, and the callee's first instruction runs right after it.
+  if (vm->frameCount > profiler->lastFrameCount) profile->calls++;
+  profiler->lastFrameCount = vm->frameCount;
+
+  int offset = (int)(ip - function->chunk.code);
+  profile->instructionCounts[offset]++;
+  profiler->opcodeCounts[*ip]++;
+  profiler->instructions++;
+
+  if (pendingTicks > 0) {
+    pendingTicks = 0;
+    // Ticks are only as fine as the kernel's timer, so the time is measured rather than assumed.
+    uint64_t now = cpuMicros();
+    recordSample(profiler->lastIndex, offset, now - profiler->lastSampleTime);
+    profiler->lastSampleTime = now;
+  }
+}
+
+void markProfiler() {
+  for (int i = 0; i < vm->profiler.functionCount; i++) {
+    markObject((Obj*)vm->profiler.functions[i].function);
+  }
+}
+
+static const char* functionName(ObjFunction* function) {
+  return function->name == NULL ? "script" : function->name->chars;
+}
+
+// Names a function together with the line its body starts on, so that methods sharing a name
+// stay apart.
+static const char* functionLabel(ObjFunction* function, char* buffer, size_t size) {
+  if (function->name == NULL || function->chunk.count == 0) return functionName(function);
+  snprintf(buffer, size, "%s:%d", function->name->chars, getLine(&function->chunk, 0));
+  return buffer;
+}
+
+static double millis(uint64_t micros) { return (double)micros / 1000.0; }
+
+static double share(uint64_t part, uint64_t whole) {
+  return whole == 0 ? 0 : 100.0 * (double)part / (double)whole;
+}
+
+typedef struct {
+  int function;
+  int line;
+  uint64_t instructions;
+  uint64_t micros;
+} LineProfile;
+
+typedef struct {
+  int index;
+  uint64_t primary;
+  uint64_t secondary;
+} Ranked;
+
+static int compareRanked(const void* a, const void* b) {
+  const Ranked* left = a;
+  const Ranked* right = b;
+  if (left->primary != right->primary) return left->primary < right->primary ? 1 : -1;
+  if (left->secondary != right->secondary) return left->secondary < right->secondary ? 1 : -1;
+  return left->index - right->index;
+}
+
+// Folds the per-offset counters of every function into one entry per source line.
+static LineProfile* collectLines(int* count) {
+  LineProfile* lines = NULL;
+  int capacity = 0;
+  *count = 0;
+
+  for (int i = 0; i < vm->profiler.functionCount; i++) {
+    FunctionProfile* profile = &vm->profiler.functions[i];
+    Chunk* chunk = &profile->function->chunk;
+    int first = *count;
+
+    // Resolve the lines of every sampled offset at once; the offsets are ascending.
+    int* offsets = malloc(sizeof(int) * chunk->count * 2);
+    int* offsetLines = offsets + chunk->count;
+    int sampled = 0;
+    for (int offset = 0; offset < chunk->count; offset++) {
+      if (profile->instructionCounts[offset] != 0 || profile->sampleMicros[offset] != 0) {
+        offsets[sampled++] = offset;
+      }
+    }
+    getLines(chunk, offsets, offsetLines, sampled);
+
+    for (int k = 0; k < sampled; k++) {
+      int line = offsetLines[k];
+      LineProfile* entry = NULL;
+      for (int j = first; j < *count; j++) {
+        if (lines[j].line == line) {
+          entry = &lines[j];
+          break;
+        }
+      }
+
+      if (entry == NULL) {
+        if (capacity < *count + 1) lines = growBuffer(lines, &capacity, sizeof(LineProfile));
+        entry = &lines[(*count)++];
+        entry->function = i;
+        entry->line = line;
+        entry->instructions = 0;
+        entry->micros = 0;
+      }
+      entry->instructions += profile->instructionCounts[offsets[k]];
+      entry->micros += profile->sampleMicros[offsets[k]];
+    }
+    free(offsets);
+  }
+  return lines;
+}
+
+static void printFunctions(uint64_t totalMicros) {
+  int count = vm->profiler.functionCount;
+  Ranked* ranked = malloc(sizeof(Ranked) * (count > 0 ? count : 1));
+  if (ranked == NULL) return;
+
+  for (int i = 0; i < count; i++) {
+    FunctionProfile* profile = &vm->profiler.functions[i];
+    uint64_t instructions = 0;
+    for (int offset = 0; offset < profile->function->chunk.count; offset++) {
+      instructions += profile->instructionCounts[offset];
+    }
+    ranked[i] = (Ranked){i, profile->selfMicros, instructions};
+  }
+  qsort(ranked, count, sizeof(Ranked), compareRanked);
+
+  fprintf(stderr, "%-24s %12s %10s %8s %10s %8s %14s\n", "function", "calls", "self ms", "self %",
+          "total ms", "total %", "instructions");
+  char label[64];
+  for (int i = 0; i < count && i < PROFILE_TOP; i++) {
+    FunctionProfile* profile = &vm->profiler.functions[ranked[i].index];
+    fprintf(stderr, "%-24s %12llu %10.1f %7.1f%% %10.1f %7.1f%% %14llu\n",
+            functionLabel(profile->function, label, sizeof(label)),
+            (unsigned long long)profile->calls, millis(profile->selfMicros),
+            share(profile->selfMicros, totalMicros), millis(profile->totalMicros),
+            share(profile->totalMicros, totalMicros),
+            (unsigned long long)ranked[i].secondary);
+  }
+  free(ranked);
+}
+
+static void printLines(uint64_t totalMicros) {
+  int count;
+  LineProfile* lines = collectLines(&count);
+  Ranked* ranked = malloc(sizeof(Ranked) * (count > 0 ? count : 1));
+  if (ranked == NULL) {
+    free(lines);
+    return;
+  }
+
+  for (int i = 0; i < count; i++) ranked[i] = (Ranked){i, lines[i].micros, lines[i].instructions};
+  qsort(ranked, count, sizeof(Ranked), compareRanked);
+
+  fprintf(stderr, "%-24s %8s %10s %8s %14s\n", "line", "", "self ms", "self %", "instructions");
+  for (int i = 0; i < count && i < PROFILE_TOP; i++) {
+    LineProfile* line = &lines[ranked[i].index];
+    fprintf(stderr, "%-24s %8d %10.1f %7.1f%% %14llu\n",
+            functionName(vm->profiler.functions[line->function].function), line->line,
+            millis(line->micros), share(line->micros, totalMicros),
+            (unsigned long long)line->instructions);
+  }
+  free(ranked);
+  free(lines);
+}
+
+static void printOpcodes() {
+  Ranked ranked[OPCODE_COUNT];
+  for (int i = 0; i < OPCODE_COUNT; i++) {
+    ranked[i] = (Ranked){i, vm->profiler.opcodeCounts[i], 0};
+  }
+  qsort(ranked, OPCODE_COUNT, sizeof(Ranked), compareRanked);
+
+  fprintf(stderr, "%-24s %14s %8s\n", "opcode", "executed", "share");
+  for (int i = 0; i < OPCODE_COUNT && i < PROFILE_TOP && ranked[i].primary > 0; i++) {
+    fprintf(stderr, "%-24s %14llu %7.1f%%\n", opcodeName((uint8_t)ranked[i].index),
+            (unsigned long long)ranked[i].primary,
+            share(ranked[i].primary, vm->profiler.instructions));
+  }
+}
+
+void printProfile() {
+  uint64_t totalMicros = 0;
+  for (int i = 0; i < vm->profiler.functionCount; i++) {
+    totalMicros += vm->profiler.functions[i].selfMicros;
+  }
+
+  fprintf(stderr, "== profile ==\n");
+  fprintf(stderr, "samples: %llu (%.1f ms sampled), instructions: %llu\n",
+          (unsigned long long)vm->profiler.samples, millis(totalMicros),
+          (unsigned long long)vm->profiler.instructions);
+  printFunctions(totalMicros);
+  fprintf(stderr, "\n");
+  printLines(totalMicros);
+  fprintf(stderr, "\n");
+  printOpcodes();
+}
+
+bool writeProfileStacks(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) return false;
+
+  char label[64];
+  for (int i = 0; i < vm->profiler.stackCount; i++) {
+    ProfileStack* stack = &vm->profiler.stacks[i];
+    for (int j = 0; j < stack->depth; j++) {
+      int index = vm->profiler.stackFrames[stack->start + j];
+      ObjFunction* function = vm->profiler.functions[index].function;
+      fprintf(file, "%s%s", j > 0 ? ";" : "", functionLabel(function, label, sizeof(label)));
+    }
+    fprintf(file, " %llu\n", (unsigned long long)stack->micros);
+  }
+
+  return fclose(file) == 0;
+}
@@ -0,0 +1,209 @@
+#include "registers.h"
+
+#include <stdlib.h>
+
+#include "vm.h"
+
+// Marks old instructions that are kept as they are, and the condition pops that are dropped.
+#define KEPT 0xff
+#define DROPPED 0xfe
+
+// A local (`GET_LOCAL`) or constant (`CONSTANT`) operand of a sequence.
+typedef struct {
+  bool constant;
+  uint8_t index;
+} Operand;
+
+// What the instruction at an old offset becomes.
+typedef struct {
+  uint8_t instruction;  // The register instruction, KEPT or DROPPED.
+  uint8_t operands[3];
+  int length;  // Old bytes the register instruction replaces.
+  int target;  // Old offset a compare-and-branch lands on.
+} Rewrite;
+
+// Register forms of each arithmetic instruction, `_RR` and then `_RK`.
+static uint8_t arithmetic(uint8_t instruction, bool constant) {
+  switch (instruction) {
+    case OP_ADD:
+      return constant ? OP_ADD_RK : OP_ADD_RR;
+    case OP_SUBTRACT:
+      return constant ? OP_SUBTRACT_RK : OP_SUBTRACT_RR;
+    case OP_MULTIPLY:
+      return constant ? OP_MULTIPLY_RK : OP_MULTIPLY_RR;
+    case OP_DIVIDE:
+      return constant ? OP_DIVIDE_RK : OP_DIVIDE_RR;
+    default:
+      return KEPT;
+  }
+}
+
+// Compare-and-branch forms. The compiler writes `a <= b` as `!(a > b)` and `a >= b` as
+// `!(a < b)`, so a negated comparison becomes the opposite inclusive one.
+static uint8_t branch(uint8_t comparison, bool negated, bool constant) {
+  if (comparison == OP_LESS && !negated) return constant ? OP_LESS_RK_JUMP : OP_LESS_RR_JUMP;
+  if (comparison == OP_LESS) return constant ? OP_GREATER_EQUAL_RK_JUMP : OP_GREATER_EQUAL_RR_JUMP;
+  if (!negated) return constant ? OP_GREATER_RK_JUMP : OP_GREATER_RR_JUMP;
+  return constant ? OP_LESS_EQUAL_RK_JUMP : OP_LESS_EQUAL_RR_JUMP;
+}
+
+static bool isBranch(uint8_t instruction) {
+  return instruction >= OP_LESS_RR_JUMP && instruction <= OP_GREATER_EQUAL_RK_JUMP;
+}
+
+// Bytes of each register instruction.
+static int rewrittenLength(uint8_t instruction) {
+  if (instruction == OP_MOVE || instruction == OP_LOAD_CONSTANT) return 3;
+  return isBranch(instruction) ? 5 : 4;
+}
+
+// True if an instruction `instruction` starts at `offset` and is only reached from the one before.
+static bool follows(Chunk* chunk, const int* entries, int offset, uint8_t instruction) {
+  return offset < chunk->count && chunk->code[offset] == instruction && entries[offset] == 1;
+}
+
+static bool readOperand(Chunk* chunk, int offset, Operand* operand) {
+  if (offset >= chunk->count) return false;
+  if (chunk->code[offset] != OP_GET_LOCAL && chunk->code[offset] != OP_CONSTANT) return false;
+  operand->constant = chunk->code[offset] == OP_CONSTANT;
+  operand->index = chunk->code[offset + 1];
+  return true;
+}
+
+// Fills in `rewrite` if the code at `offset` starts a sequence with a register form.
+static bool matchSequence(Chunk* chunk, const int* entries, int offset, Rewrite* rewrite) {
+  uint8_t* code = chunk->code;
+  Operand left, right;
+  if (!readOperand(chunk, offset, &left)) return false;
+
+  int next = offset + 2;
+  if (follows(chunk, entries, next, OP_SET_LOCAL) && follows(chunk, entries, next + 2, OP_POP)) {
+    rewrite->instruction = left.constant ? OP_LOAD_CONSTANT : OP_MOVE;
+    rewrite->operands[0] = code[next + 1];
+    rewrite->operands[1] = left.index;
+    rewrite->length = 5;
+    return true;
+  }
+
+  // The first operand is always a local, as constant folding leaves few constants there.
+  if (left.constant || entries[next] != 1 || !readOperand(chunk, next, &right)) return false;
+  next += 2;
+  if (next >= chunk->count || entries[next] != 1) return false;
+  uint8_t operation = code[next];
+
+  uint8_t instruction = arithmetic(operation, right.constant);
+  if (instruction != KEPT) {
+    if (!follows(chunk, entries, next + 1, OP_SET_LOCAL) ||
+        !follows(chunk, entries, next + 3, OP_POP)) {
+      return false;
+    }
+
+    // Left to the peephole pass, whose OP_INC_LOCAL is shorter and has a machine code template.
+    uint8_t destination = code[next + 2];
+    if (vm->peephole && operation == OP_ADD && right.constant && destination == left.index &&
+        IS_NUMBER(chunk->constants.values[right.index])) {
+      return false;
+    }
+
+    rewrite->instruction = instruction;
+    rewrite->operands[0] = destination;
+    rewrite->operands[1] = left.index;
+    rewrite->operands[2] = right.index;
+    rewrite->length = next + 4 - offset;
+    return true;
+  }
+
+  if (operation != OP_LESS && operation != OP_GREATER) return false;
+  bool negated = follows(chunk, entries, next + 1, OP_NOT);
+  int jump = next + (negated ? 2 : 1);
+  if (!follows(chunk, entries, jump, OP_JUMP_IF_FALSE) ||
+      !follows(chunk, entries, jump + 3, OP_POP)) {
+    return false;
+  }
+
+  // The condition is popped on both paths. Dropping the pop at the target is only safe when
+  // nothing else arrives there, since it would still leave a value behind.
+  int target = jumpTarget(chunk, jump);
+  if (chunk->code[target] != OP_POP || entries[target] != 1) return false;
+
+  rewrite->instruction = branch(operation, negated, right.constant);
+  rewrite->operands[0] = left.index;
+  rewrite->operands[1] = right.index;
+  rewrite->length = jump + 4 - offset;
+  rewrite->target = target;
+  return true;
+}
+
+// Writes the register instruction planned for `offset`, or drops a condition pop.
+static int writeRegisters(Chunk* chunk, int offset, int* write, const int* newOffset,
+                          void* context) {
+  const Rewrite* rewrite = &((const Rewrite*)context)[offset];
+  if (rewrite->instruction == KEPT) return 0;
+  if (rewrite->instruction == DROPPED) return 1;
+
+  uint8_t* code = chunk->code;
+  int start = *write;
+  bool branches = isBranch(rewrite->instruction);
+  int operandCount = branches ? 2 : rewrittenLength(rewrite->instruction) - 1;
+  code[(*write)++] = rewrite->instruction;
+  for (int i = 0; i < operandCount; i++) code[(*write)++] = rewrite->operands[i];
+  if (branches) {
+    writeJumpOperand(code, *write, newOffset[rewrite->target + 1] - (start + 5));
+    *write += 2;
+  }
+  return rewrite->length;
+}
+
+void translateToRegisters(Chunk* chunk) {
+  int count = chunk->count;
+  int* entries = calloc(count + 1, sizeof(int));
+  Rewrite* rewrites = malloc(count * sizeof(Rewrite));
+  int* newOffset = malloc((count + 1) * sizeof(int));
+  if (entries == NULL || rewrites == NULL || newOffset == NULL) {
+    free(entries);
+    free(rewrites);
+    free(newOffset);
+    return;
+  }
+
+  // Count the ways into each instruction: every jump landing on it, plus the instruction before
+  // it unless that one never falls through.
+  bool fallsThrough = true;
+  for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+    if (fallsThrough) entries[offset]++;
+    int target = jumpTarget(chunk, offset);
+    if (target >= 0) entries[target]++;
+
+    uint8_t instruction = chunk->code[offset];
+    fallsThrough = instruction != OP_JUMP && instruction != OP_LOOP && instruction != OP_RETURN;
+  }
+
+  // Decide what each instruction becomes and where it will live. Condition pops are only ever
+  // dropped ahead of the scan, since conditions always jump forwards.
+  for (int offset = 0; offset < count; offset++) rewrites[offset].instruction = KEPT;
+  int size = 0;
+  for (int offset = 0; offset < count;) {
+    Rewrite* rewrite = &rewrites[offset];
+    newOffset[offset] = size;
+    if (rewrite->instruction == DROPPED) {
+      offset++;
+      continue;
+    }
+
+    if (matchSequence(chunk, entries, offset, rewrite)) {
+      if (isBranch(rewrite->instruction)) rewrites[rewrite->target].instruction = DROPPED;
+      size += rewrittenLength(rewrite->instruction);
+      offset += rewrite->length;
+    } else {
+      size += instructionLength(chunk, offset);
+      offset += instructionLength(chunk, offset);
+    }
+  }
+  newOffset[count] = size;
+
+  relocateChunk(chunk, newOffset, writeRegisters, rewrites);
+
+  free(entries);
+  free(rewrites);
+  free(newOffset);
+}
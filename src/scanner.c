@@ -1,35 +1,220 @@
 #include "scanner.h"
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 
-Scanner scanner;
+THREAD_LOCAL Scanner scanner;
 
-void initScanner(const char* source) {
+// Streamed source is read this many bytes at a time, or more for a token longer than that.
+#define STREAM_CHUNK (64 * 1024)
+
+struct SourceBuffer {
+  SourceBuffer* previous;  // An older buffer that tokens may still point into.
+  size_t capacity;
+  char chars[];
+};
+
+void initScanner(const char* source, size_t length) {
   scanner.start = source;
   scanner.current = source;
+  scanner.end = source + length;
   scanner.line = 1;
+  scanner.stream = NULL;
+  scanner.buffer = NULL;
+}
+
+static SourceBuffer* newSourceBuffer(size_t capacity, SourceBuffer* previous) {
+  SourceBuffer* buffer = (SourceBuffer*)malloc(sizeof(SourceBuffer) + capacity);
+  if (buffer == NULL) {
+    fprintf(stderr, "Not enough memory to read the source.\n");
+    exit(74);
+  }
+  buffer->previous = previous;
+  buffer->capacity = capacity;
+  return buffer;
+}
+
+void initStreamScanner(FILE* file) {
+  SourceBuffer* buffer = newSourceBuffer(STREAM_CHUNK, NULL);
+  initScanner(buffer->chars, 0);
+  scanner.buffer = buffer;
+  scanner.stream = file;
+}
+
+static void freeSourceBuffers(SourceBuffer* buffer) {
+  while (buffer != NULL) {
+    SourceBuffer* previous = buffer->previous;
+    free(buffer);
+    buffer = previous;
+  }
+}
+
+void freeScanner() {
+  freeSourceBuffers(scanner.buffer);
+  scanner.buffer = NULL;
+  scanner.stream = NULL;
 }
 
-static bool isAlpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+// Reads more of a streamed source until `count` characters are available at `current`. Returns
+// false if the stream ends first, or if the source is not streamed at all.
+static bool refill(ptrdiff_t count) {
+  while (scanner.stream != NULL) {
+    SourceBuffer* buffer = scanner.buffer;
+    size_t used = (size_t)(scanner.end - buffer->chars);
+    if (used == buffer->capacity) {
+      // The token being scanned moves on to a new buffer, but the old one stays alive for the
+      // tokens already handed out.
+      size_t kept = (size_t)(scanner.end - scanner.start);
+      buffer = newSourceBuffer(kept * 2 > STREAM_CHUNK ? kept * 2 : STREAM_CHUNK, buffer);
+      memcpy(buffer->chars, scanner.start, kept);
+      scanner.current = buffer->chars + (scanner.current - scanner.start);
+      scanner.start = buffer->chars;
+      scanner.end = buffer->chars + kept;
+      scanner.buffer = buffer;
+      used = kept;
+    }
+
+    size_t read = fread(buffer->chars + used, 1, buffer->capacity - used, scanner.stream);
+    scanner.end += read;
+    if (read == 0) scanner.stream = NULL;
+    if (scanner.end - scanner.current >= count) return true;
+  }
+  return false;
+}
 
-static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+const char* discardSource(const char* keep) {
+  SourceBuffer* buffer = scanner.buffer;
+  if (buffer == NULL) return keep;
+  // Error tokens point at their message rather than into the source.
+  uintptr_t address = (uintptr_t)keep;
+  if (address < (uintptr_t)buffer->chars || address > (uintptr_t)scanner.end) return keep;
+
+  freeSourceBuffers(buffer->previous);
+  buffer->previous = NULL;
+
+  // Moving the rest of the source to the front is only worth it once most of the buffer is spent.
+  size_t dropped = (size_t)(keep - buffer->chars);
+  if (dropped < buffer->capacity / 2) return keep;
+  memmove(buffer->chars, keep, (size_t)(scanner.end - keep));
+  scanner.start -= dropped;
+  scanner.current -= dropped;
+  scanner.end -= dropped;
+  return buffer->chars;
+}
+
+// Character classes, looked up by `characterClass` instead of comparing against ranges.
+#define CHAR_ALPHA 0x1  // Letters and '_', which can start an identifier.
+#define CHAR_DIGIT 0x2
+#define CHAR_BLANK 0x4  // Whitespace other than '\n', which also ends a line.
+
+#define A CHAR_ALPHA
+#define D CHAR_DIGIT
+#define B CHAR_BLANK
+// Characters from 0x80 on are left out, and so belong to no class.
+static const uint8_t characterClass[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, B, 0, 0, 0, B, 0, 0,  // 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0x10
+    B, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0x20
+    D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0,  // 0x30
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,  // 0x40
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, A,  // 0x50
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,  // 0x60
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0,  // 0x70
+};
+#undef A
+#undef D
+#undef B
+
+static bool isAlpha(char c) { return characterClass[(uint8_t)c] & CHAR_ALPHA; }
+
+static bool isDigit(char c) { return characterClass[(uint8_t)c] & CHAR_DIGIT; }
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+// Bitmask with bit i set when character i of the 16 at `chars` lies in [low, high]. Both bounds
+// are ASCII, so the signed comparisons leave out every character from 0x80 on.
+static inline uint32_t matchRange(__m128i chars, char low, char high) {
+  __m128i above = _mm_cmpgt_epi8(chars, _mm_set1_epi8((char)(low - 1)));
+  __m128i below = _mm_cmplt_epi8(chars, _mm_set1_epi8((char)(high + 1)));
+  return (uint32_t)_mm_movemask_epi8(_mm_and_si128(above, below));
+}
+
+static inline uint32_t matchChar(__m128i chars, char c) {
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_set1_epi8(c)));
+}
+#endif
+
+// Most identifiers and blank runs are short enough that loading 16 characters at once only pays
+// off after this many of them turned out to be part of the run.
+#define SHORT_RUN 8
+
+// The first character from `p` on that cannot continue an identifier, or `end`.
+static const char* skipIdentifierChars(const char* p, const char* end) {
+  const char* shortEnd = end - p > SHORT_RUN ? p + SHORT_RUN : end;
+  while (p < shortEnd && (characterClass[(uint8_t)*p] & (CHAR_ALPHA | CHAR_DIGIT))) p++;
+  if (p < shortEnd || p == end) return p;
+#if defined(__SSE2__)
+  while (end - p >= 16) {
+    __m128i chars = _mm_loadu_si128((const __m128i*)p);
+    // Setting bit 5 maps upper case letters onto lower case ones and nothing else onto a letter.
+    uint32_t letters = matchRange(_mm_or_si128(chars, _mm_set1_epi8(0x20)), 'a', 'z');
+    uint32_t rest = ~(letters | matchRange(chars, '0', '9') | matchChar(chars, '_')) & 0xFFFF;
+    if (rest != 0) return p + __builtin_ctz(rest);
+    p += 16;
+  }
+#endif
+  while (p < end && (characterClass[(uint8_t)*p] & (CHAR_ALPHA | CHAR_DIGIT))) p++;
+  return p;
+}
+
+// The first character from `p` on that is not a blank, or `end`.
+static const char* skipBlanks(const char* p, const char* end) {
+  const char* shortEnd = end - p > SHORT_RUN ? p + SHORT_RUN : end;
+  while (p < shortEnd && (characterClass[(uint8_t)*p] & CHAR_BLANK)) p++;
+  if (p < shortEnd || p == end) return p;
+#if defined(__SSE2__)
+  while (end - p >= 16) {
+    __m128i chars = _mm_loadu_si128((const __m128i*)p);
+    uint32_t blanks = matchChar(chars, ' ') | matchChar(chars, '\t') | matchChar(chars, '\r');
+    uint32_t rest = ~blanks & 0xFFFF;
+    if (rest != 0) return p + __builtin_ctz(rest);
+    p += 16;
+  }
+#endif
+  while (p < end && (characterClass[(uint8_t)*p] & CHAR_BLANK)) p++;
+  return p;
+}
+
+// The number of line breaks in [p, end).
+static int countLines(const char* p, const char* end) {
+  int lines = 0;
+  while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+    lines++;
+    p++;
+  }
+  return lines;
+}
+
+// Whether `count` more characters are there to scan, reading them from the stream if need be.
+static bool available(ptrdiff_t count) {
+  return scanner.end - scanner.current >= count || refill(count);
+}
 
-static bool isAtEnd() { return *scanner.current == '\0'; }
+static bool isAtEnd() { return !available(1); }
 
 static char advance() {
   scanner.current++;
   return scanner.current[-1];
 }
 
-static char peek() { return *scanner.current; }
+static char peek() { return available(1) ? *scanner.current : '\0'; }
 
-static char peekNext() {
-  if (isAtEnd()) return '\0';
-  return scanner.current[1];
-}
+static char peekNext() { return available(2) ? scanner.current[1] : '\0'; }
 
 static bool match(char expected) {
   if (isAtEnd()) return false;
@@ -56,167 +241,133 @@ static Token errorToken(const char* message) {
   return token;
 }
 
+// Moves past a line comment up to the line break that ends it.
+static void skipLineComment() {
+  for (;;) {
+    const char* lineEnd = memchr(scanner.current, '\n', (size_t)(scanner.end - scanner.current));
+    if (lineEnd != NULL) {
+      scanner.current = lineEnd;
+      return;
+    }
+    scanner.current = scanner.end;
+    if (isAtEnd()) return;
+  }
+}
+
+// Moves past a block comment, from just after its "/*" to just after its "*/".
+static void skipBlockComment() {
+  for (;;) {
+    const char* star = memchr(scanner.current, '*', (size_t)(scanner.end - scanner.current));
+    const char* stop = star != NULL ? star : scanner.end;
+    scanner.line += countLines(scanner.current, stop);
+    scanner.current = stop;
+    if (isAtEnd()) return;
+    if (star != NULL) {
+      advance();
+      if (match('/')) return;
+    }
+  }
+}
+
 static void skipWhitespace() {
   for (;;) {
-    char c = peek();
-    switch (c) {
+    scanner.current = skipBlanks(scanner.current, scanner.end);
+    switch (peek()) {
       case ' ':
       case '\r':
       case '\t':
+        // More blanks were read from the stream after the ones just skipped.
+        break;
+      case '\n':
+        scanner.line++;
         advance();
         break;
       case '/':
         if (peekNext() == '/') {
-          // A comment goes until the end of the line.
-          while (peek() != '\n' && !isAtEnd()) advance();
+          skipLineComment();
         } else if (peekNext() == '*') {
-          // A block comment goes until the end of the block.
-          advance();  // Consume the '*'
-          advance();  // Consume the '/'
-          while (!(peek() == '*' && peekNext() == '/') && !isAtEnd()) {
-            if (peek() == '\n') scanner.line++;
-            advance();
-          }
-
-          if (isAtEnd()) {
-            return;
-          }
-
-          advance();
-          advance();
+          scanner.current += 2;
+          skipBlockComment();
         } else {
           return;
         }
         break;
-      case '\n':
-        scanner.line++;
-        advance();
-        break;
       default:
         return;
     }
   }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
-    return type;
+// Keywords are found with a perfect hash of an identifier's length and its first and last
+// characters, chosen so that no two keywords share a slot. A keyword added later that collides
+// with another one trips -Woverride-init (part of -Wextra) on the table below.
+#define KEYWORD_SLOTS 64
+#define KEYWORD_MAX_LENGTH 8
+#define KEYWORD_HASH(first, last, length)                                                \
+  (((uint8_t)(first) * 6u + (uint8_t)(last) * 18u + (unsigned)(length)) % KEYWORD_SLOTS)
+
+typedef struct {
+  const char* name;
+  int length;  // 0 in the slots that hold no keyword.
+  TokenType type;
+} Keyword;
+
+#define KEYWORD(name, first, last, type)                                         \
+  [KEYWORD_HASH(first, last, sizeof(name) - 1)] = {name, sizeof(name) - 1, type}
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    KEYWORD("and", 'a', 'd', TOKEN_AND),
+    KEYWORD("break", 'b', 'k', TOKEN_BREAK),
+    KEYWORD("case", 'c', 'e', TOKEN_CASE),
+    KEYWORD("continue", 'c', 'e', TOKEN_CONTINUE),
+    KEYWORD("class", 'c', 's', TOKEN_CLASS),
+    KEYWORD("default", 'd', 't', TOKEN_DEFAULT),
+    KEYWORD("else", 'e', 'e', TOKEN_ELSE),
+    KEYWORD("elif", 'e', 'f', TOKEN_ELIF),
+    KEYWORD("fall", 'f', 'l', TOKEN_FALLTHROUGH),
+    KEYWORD("false", 'f', 'e', TOKEN_FALSE),
+    KEYWORD("for", 'f', 'r', TOKEN_FOR),
+    KEYWORD("fun", 'f', 'n', TOKEN_FUN),
+    KEYWORD("if", 'i', 'f', TOKEN_IF),
+    KEYWORD("nil", 'n', 'l', TOKEN_NIL),
+    KEYWORD("or", 'o', 'r', TOKEN_OR),
+    KEYWORD("print", 'p', 't', TOKEN_PRINT),
+    KEYWORD("return", 'r', 'n', TOKEN_RETURN),
+    KEYWORD("super", 's', 'r', TOKEN_SUPER),
+    KEYWORD("switch", 's', 'h', TOKEN_SWITCH),
+    KEYWORD("then", 't', 'n', TOKEN_THEN),
+    KEYWORD("this", 't', 's', TOKEN_THIS),
+    KEYWORD("true", 't', 'e', TOKEN_TRUE),
+    KEYWORD("var", 'v', 'r', TOKEN_VAR),
+    KEYWORD("while", 'w', 'e', TOKEN_WHILE),
+};
+#undef KEYWORD
+
+// Compares the identifier with a keyword of the same length. Keywords are short enough that a
+// loop beats calling memcmp, whose length is not known here.
+static bool matchesKeyword(const char* name, int length) {
+  for (int i = 0; i < length; i++) {
+    if (scanner.start[i] != name[i]) return false;
   }
-
-  return TOKEN_IDENTIFIER;
+  return true;
 }
 
 static TokenType identifierType() {
-  switch (scanner.start[0]) {
-    case 'a':
-      return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'b':
-      return checkKeyword(1, 4, "reak", TOKEN_BREAK);
-    case 'c':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'a':
-            return checkKeyword(2, 2, "se", TOKEN_CASE);
-          case 'o':
-            return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
-          case 'l':
-            return checkKeyword(2, 3, "ass", TOKEN_CLASS);
-        }
-      }
-      break;
-    case 'd':
-      return checkKeyword(1, 6, "efault", TOKEN_DEFAULT);
-    case 'e':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'l':
-            if (scanner.current - scanner.start > 2) {
-              switch (scanner.start[2]) {
-                case 's':
-                  return checkKeyword(3, 1, "e", TOKEN_ELSE);
-                case 'i':
-                  return checkKeyword(3, 1, "f", TOKEN_ELIF);
-              }
-            }
-        }
-      }
-      break;
-    case 'f':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'a':
-            if (scanner.current - scanner.start > 2) {
-              switch (scanner.start[2]) {
-                case 'l':
-                  if (scanner.current - scanner.start > 3) {
-                    printf("%c", scanner.start[4]);
-                    switch (scanner.start[3]) {
-                      case 's':
-                        return checkKeyword(4, 1, "e", TOKEN_FALSE);
-                      case 'l':
-                        return checkKeyword(4, 0, "", TOKEN_FALLTHROUGH);
-                    }
-                  }
-                  break;
-              }
-            }
-            break;
-          case 'o':
-            return checkKeyword(2, 1, "r", TOKEN_FOR);
-          case 'u':
-            return checkKeyword(2, 1, "n", TOKEN_FUN);
-        }
-      }
-      break;
-    case 'i':
-      return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n':
-      return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o':
-      return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p':
-      return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r':
-      return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'u':
-            return checkKeyword(2, 3, "per", TOKEN_SUPER);
-          case 'w':
-            return checkKeyword(2, 4, "itch", TOKEN_SWITCH);
-        }
-      }
-      break;
-    case 't':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'r':
-            return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-          case 'h':
-            if (scanner.current - scanner.start > 2) {
-              switch (scanner.start[2]) {
-                case 'e':
-                  return checkKeyword(3, 1, "n", TOKEN_THEN);
-                case 'i':
-                  return checkKeyword(3, 1, "s", TOKEN_THIS);
-              }
-            }
-        }
-      }
-      break;
-    case 'v':
-      return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w':
-      return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-  }
+  int length = (int)(scanner.current - scanner.start);
+  if (length > KEYWORD_MAX_LENGTH) return TOKEN_IDENTIFIER;
 
+  const Keyword* keyword = &keywords[KEYWORD_HASH(scanner.start[0], scanner.current[-1], length)];
+  if (keyword->length == length && matchesKeyword(keyword->name, length)) {
+    return keyword->type;
+  }
   return TOKEN_IDENTIFIER;
 }
 
 static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek())) advance();
+  for (;;) {
+    scanner.current = skipIdentifierChars(scanner.current, scanner.end);
+    // Stopping short of the end means a character that is not part of the identifier.
+    if (scanner.current < scanner.end || isAtEnd()) break;
+  }
   return makeToken(identifierType());
 }
 
@@ -266,6 +417,10 @@ Token scanToken() {
       return makeToken(TOKEN_LEFT_BRACE);
     case '}':
       return makeToken(TOKEN_RIGHT_BRACE);
+    case '[':
+      return makeToken(TOKEN_LEFT_BRACKET);
+    case ']':
+      return makeToken(TOKEN_RIGHT_BRACKET);
     case ';':
       return makeToken(TOKEN_SEMICOLON);
     case ',':
@@ -6,145 +6,292 @@
 #include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #define TABLE_MAX_LOAD 0.75
+// Deletes shrink a table below this load; well under half of TABLE_MAX_LOAD so that a table
+// hovering around one size does not resize back and forth.
+#define TABLE_MIN_LOAD 0.2
+// Tuned separately: a sparser intern table measured slower, its larger footprint costing more
+// cache misses on insertion than the shorter probes saved.
+#define STRING_TABLE_MAX_LOAD 0.75
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Bitmask with bit i set when control byte i of the group at `control` equals `byte`.
+static inline uint32_t matchByte(const uint8_t* control, uint8_t byte) {
+#if defined(__SSE2__)
+  __m128i group = _mm_loadu_si128((const __m128i*)control);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+    if (control[i] == byte) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+static inline uint8_t hashFragment(uint32_t hash) { return (uint8_t)(hash >> 25); }
+
+static size_t tableBytes(int capacity) {
+  if (capacity == 0) return 0;
+  return (sizeof(Value) + sizeof(ObjString*) + 1) * (size_t)capacity + TABLE_GROUP_WIDTH;
+}
+
+// Values come first in the block so that every array stays naturally aligned.
+static void layoutTable(Table* table, void* block, int capacity) {
+  table->capacity = capacity;
+  table->values = block;
+  table->keys = (ObjString**)(table->values + capacity);
+  table->control = (uint8_t*)(table->keys + capacity);
+}
 
 void initTable(Table* table) {
   table->count = 0;
   table->capacity = 0;
-  table->entries = NULL;
+  table->control = NULL;
+  table->keys = NULL;
+  table->values = NULL;
 }
 
 void freeTable(Table* table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  reallocate(table->values, tableBytes(table->capacity), 0);
   initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-  uint32_t index = key->hash & (capacity - 1);
-  Entry* tombstone = NULL;
-
-  for (;;) {
-    Entry* entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone.
-        if (tombstone == NULL) tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // We found the key.
-      return entry;
-    }
-
-    index = (index + 1) & (capacity - 1);
+// Writes a control byte and its copies in the mirror after the last slot. Tables smaller than a
+// group repeat their slots several times in the mirror.
+static void setControl(Table* table, int index, uint8_t byte) {
+  table->control[index] = byte;
+  for (int i = index; i < TABLE_GROUP_WIDTH; i += table->capacity) {
+    table->control[table->capacity + i] = byte;
   }
 }
 
-bool tableGet(Table* table, ObjString* key, Value* value) {
-  if (table->count == 0) return false;
-
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+static int findSlot(Table* table, ObjString* key) {
+  if (table->count == 0) return -1;
+  VMStats* stats = &vm->stats;
+  stats->tableLookups++;
 
-  *value = entry->value;
-  return true;
-}
-
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
-  if (table->count == 0) return NULL;
+  uint32_t mask = table->capacity - 1;
+  uint32_t home = key->hash & mask;
+  uint8_t fragment = hashFragment(key->hash);
+  // Most keys sit in their home slot. Checking its control byte first keeps misses off the keys.
+  if (table->control[home] == fragment && table->keys[home] == key) return (int)home;
 
-  uint32_t index = hash & (table->capacity - 1);
-  for (;;) {
-    Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry.
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length && entry->key->hash == hash &&
-               memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it.
-      return entry->key;
+  for (uint32_t group = home;; group = (group + TABLE_GROUP_WIDTH) & mask) {
+    stats->tableProbes++;
+    const uint8_t* control = &table->control[group];
+    for (uint32_t match = matchByte(control, fragment); match != 0; match &= match - 1) {
+      uint32_t index = (group + __builtin_ctz(match)) & mask;
+      if (table->keys[index] == key) return (int)index;
     }
+    // Keys never sit past the end of their probe run.
+    if (matchByte(control, TABLE_EMPTY) != 0) return -1;
+  }
+}
 
-    index = (index + 1) & (table->capacity - 1);
+static int findEmptySlot(Table* table, uint32_t hash) {
+  uint32_t mask = table->capacity - 1;
+  for (uint32_t group = hash & mask;; group = (group + TABLE_GROUP_WIDTH) & mask) {
+    uint32_t empty = matchByte(&table->control[group], TABLE_EMPTY);
+    if (empty != 0) return (int)((group + __builtin_ctz(empty)) & mask);
   }
 }
 
+static void insertSlot(Table* table, ObjString* key, Value value) {
+  int index = findEmptySlot(table, key->hash);
+  setControl(table, index, hashFragment(key->hash));
+  table->keys[index] = key;
+  table->values[index] = value;
+  table->count++;
+}
+
 static void adjustCapacity(Table* table, int capacity) {
-  Entry* entries = ALLOCATE(Entry, capacity);
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
-  }
+  vm->stats.tableResizes++;
+  // Allocating can collect, and the collector may still walk the old arrays.
+  void* block = reallocate(NULL, 0, tableBytes(capacity));
 
-  table->count = 0;
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key == NULL) continue;
+  Table resized;
+  resized.count = 0;
+  layoutTable(&resized, block, capacity);
+  memset(resized.control, TABLE_EMPTY, capacity + TABLE_GROUP_WIDTH);
 
-    Entry* dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
+  for (int i = 0; i < table->capacity; i++) {
+    if (table->control[i] != TABLE_EMPTY) insertSlot(&resized, table->keys[i], table->values[i]);
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-  table->entries = entries;
-  table->capacity = capacity;
+  freeTable(table);
+  *table = resized;
+}
+
+bool tableGet(Table* table, ObjString* key, Value* value) {
+  int index = findSlot(table, key);
+  if (index < 0) return false;
+
+  *value = table->values[index];
+  return true;
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+  int index = findSlot(table, key);
+  bool isNewKey = index < 0;
+  if (isNewKey) {
+    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+      adjustCapacity(table, GROW_CAPACITY(table->capacity));
+    }
+    insertSlot(table, key, value);
+  } else {
+    table->values[index] = value;
   }
 
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
-
-  entry->key = key;
-  entry->value = value;
+  WRITE_BARRIER_OBJ(key);
+  WRITE_BARRIER(value);
   return isNewKey;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
-  if (table->count == 0) return false;
+  int index = findSlot(table, key);
+  if (index < 0) return false;
 
-  // Find the entry.
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  // Backward shift: pull later entries of the probe run into the hole while that moves them
+  // no earlier than their home slot.
+  uint32_t mask = table->capacity - 1;
+  uint32_t hole = (uint32_t)index;
+  for (uint32_t next = (hole + 1) & mask; table->control[next] != TABLE_EMPTY;
+       next = (next + 1) & mask) {
+    uint32_t home = table->keys[next]->hash & mask;
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      setControl(table, hole, table->control[next]);
+      table->keys[hole] = table->keys[next];
+      table->values[hole] = table->values[next];
+      hole = next;
+    }
+  }
+  setControl(table, hole, TABLE_EMPTY);
+  table->keys[hole] = NULL;
+  table->values[hole] = NIL_VAL;
+  table->count--;
 
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  if (table->capacity > 8 && table->count < table->capacity * TABLE_MIN_LOAD) {
+    adjustCapacity(table, table->capacity / 2);
+  }
   return true;
 }
 
 void tableAddAll(Table* from, Table* to) {
   for (int i = 0; i < from->capacity; i++) {
-    Entry* entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
-    }
+    if (from->control[i] != TABLE_EMPTY) tableSet(to, from->keys[i], from->values[i]);
   }
 }
 
-void tableRemoveWhite(Table* table) {
+void markTable(Table* table) {
   for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);
+    if (table->control[i] == TABLE_EMPTY) continue;
+    markObject((Obj*)table->keys[i]);
+    markValue(table->values[i]);
+  }
+}
+
+void initStringTable(StringTable* table) {
+  table->count = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+}
+
+void freeStringTable(StringTable* table) {
+  FREE_ARRAY(StringEntry, table->entries, table->capacity);
+  initStringTable(table);
+}
+
+// Packs the bytes of a short string into one word, so a match is a single compare.
+static inline uint64_t shortStringWord(const char* chars, int length) {
+  uint64_t word = 0;
+  for (int i = 0; i < length; i++) word |= (uint64_t)(uint8_t)chars[i] << (8 * i);
+  return word;
+}
+
+ObjString* stringTableFind(StringTable* table, const char* chars, int length, uint32_t hash) {
+  if (table->count == 0) return NULL;
+  VMStats* stats = &vm->stats;
+  stats->tableLookups++;
+
+  uint32_t mask = table->capacity - 1;
+  for (uint32_t index = hash & mask;; index = (index + 1) & mask, stats->tableProbes++) {
+    StringEntry* entry = &table->entries[index];
+    if (entry->key == NULL) return NULL;
+    if (entry->hash != hash || entry->length != length) continue;
+
+    // Only a long string that agrees on hash and length is compared through its pointer.
+    if (length <= STRING_ENTRY_PREFIX) {
+      if (entry->prefix == shortStringWord(chars, length)) return entry->key;
+    } else if (memcmp(entry->key->chars, chars, length) == 0) {
+      return entry->key;
     }
   }
 }
 
-void markTable(Table* table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    markObject((Obj*)entry->key);
-    markValue(entry->value);
+static void insertStringEntry(StringEntry* entries, int capacity, StringEntry* entry) {
+  uint32_t mask = capacity - 1;
+  uint32_t index = entry->hash & mask;
+  while (entries[index].key != NULL) index = (index + 1) & mask;
+  entries[index] = *entry;
+}
+
+void stringTableAdd(StringTable* table, ObjString* string) {
+  if (table->count + 1 > table->capacity * STRING_TABLE_MAX_LOAD) {
+    int capacity = GROW_CAPACITY(table->capacity);
+    vm->stats.tableResizes++;
+    // Allocating can collect and prune the table, so read the old slots only afterwards.
+    StringEntry* entries = ALLOCATE(StringEntry, capacity);
+    for (int i = 0; i < capacity; i++) entries[i].key = NULL;
+
+    for (int i = 0; i < table->capacity; i++) {
+      if (table->entries[i].key != NULL) insertStringEntry(entries, capacity, &table->entries[i]);
+    }
+    FREE_ARRAY(StringEntry, table->entries, table->capacity);
+    table->entries = entries;
+    table->capacity = capacity;
+  }
+
+  StringEntry entry;
+  entry.key = string;
+  entry.hash = string->hash;
+  entry.length = string->length;
+  entry.prefix =
+      string->length <= STRING_ENTRY_PREFIX ? shortStringWord(string->chars, string->length) : 0;
+  insertStringEntry(table->entries, table->capacity, &entry);
+  table->count++;
+}
+
+// Backward-shift deletion: later entries of the same probe run move into the hole so that
+// lookups never need tombstones to keep probing.
+static void removeStringEntry(StringTable* table, uint32_t hole) {
+  uint32_t mask = table->capacity - 1;
+  for (uint32_t index = (hole + 1) & mask; table->entries[index].key != NULL;
+       index = (index + 1) & mask) {
+    uint32_t home = table->entries[index].hash & mask;
+    // The entry may fill the hole only if its home slot is not inside (hole, index].
+    if (((index - home) & mask) >= ((index - hole) & mask)) {
+      table->entries[hole] = table->entries[index];
+      hole = index;
+    }
   }
-}
\ No newline at end of file
+  table->entries[hole].key = NULL;
+  table->count--;
+}
+
+void stringTableRemoveWhite(StringTable* table) {
+  for (int i = 0; i < table->capacity;) {
+    ObjString* key = table->entries[i].key;
+    if (key != NULL && !key->obj.isMarked) {
+      // An entry shifted into slot i still needs to be examined.
+      removeStringEntry(table, i);
+    } else {
+      i++;
+    }
+  }
+}
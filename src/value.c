@@ -76,6 +76,9 @@ void printValue(Value value) {
     case VAL_OBJ:
       printObject(value);
       break;
+    case VAL_UNDEFINED:
+      printf("undefined");
+      break;
   }
 #endif
 }
\ No newline at end of file
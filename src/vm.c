@@ -9,20 +9,131 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
+#include "natives.h"
 #include "object.h"
 
-VM vm;  ///< Global static instance of the virtual machine.
+THREAD_LOCAL VM* vm = NULL;  ///< The calling thread's current virtual machine.
 
 static Value clockNative(int argCount __attribute__((unused)),
                          Value* args __attribute__((unused))) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+static Value lenNative(int argCount __attribute__((unused)), Value* args) {
+  if (IS_LIST(args[0])) return INT_VAL(AS_LIST(args[0])->items.count);
+  if (IS_STRING(args[0])) return INT_VAL(AS_STRING(args[0])->length);
+  if (IS_ROPE(args[0])) return INT_VAL(AS_ROPE(args[0])->length);
+  if (IS_STRING_BUILDER(args[0])) return INT_VAL(AS_STRING_BUILDER(args[0])->length);
+  return nativeError("len() expects a list, string or string builder.");
+}
+
+static Value pushNative(int argCount __attribute__((unused)), Value* args) {
+  Value item = args[1];
+  if (!IS_LIST(args[0])) return nativeError("push() expects a list.");
+
+  ObjList* list = AS_LIST(args[0]);
+  writeValueArray(&list->items, item);
+  WRITE_BARRIER(item);
+  return INT_VAL(list->items.count);
+}
+
+static Value popNative(int argCount __attribute__((unused)), Value* args) {
+  if (!IS_LIST(args[0])) return nativeError("pop() expects a list.");
+  if (AS_LIST(args[0])->items.count == 0) return NIL_VAL;
+
+  ObjList* list = AS_LIST(args[0]);
+  return list->items.values[--list->items.count];
+}
+
+static Value stringBuilderNative(int argCount __attribute__((unused)),
+                                 Value* args __attribute__((unused))) {
+  return OBJ_VAL(newStringBuilder());
+}
+
+static Value appendNative(int argCount __attribute__((unused)), Value* args) {
+  Value builder = args[0];
+  Value text = args[1];
+  if (!IS_STRING_BUILDER(builder) || !IS_ANY_STRING(text)) {
+    return nativeError("append() expects a string builder and a string.");
+  }
+
+  builderAppend(AS_STRING_BUILDER(builder), text);
+  return builder;
+}
+
+static Value buildNative(int argCount __attribute__((unused)), Value* args) {
+  if (!IS_STRING_BUILDER(args[0])) return nativeError("build() expects a string builder.");
+
+  ObjStringBuilder* builder = AS_STRING_BUILDER(args[0]);
+  return OBJ_VAL(copyString(builder->length > 0 ? builder->chars : "", builder->length));
+}
+
+// Sets a field of an instance that is on the stack, naming it with a C string.
+static void setStatField(ObjInstance* instance, const char* name, Value value) {
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  instanceSetField(instance, AS_STRING(vm->stackTop[-1]), value);
+  pop();
+}
+
+// A fresh instance of an empty class, left on the stack so that it survives collections.
+static ObjInstance* pushStatsInstance(const char* className) {
+  push(OBJ_VAL(copyString(className, (int)strlen(className))));
+  vm->stackTop[-1] = OBJ_VAL(newClass(AS_STRING(vm->stackTop[-1])));
+  ObjInstance* instance = newInstance(AS_CLASS(vm->stackTop[-1]));
+  vm->stackTop[-1] = OBJ_VAL(instance);
+  return instance;
+}
+
+// Per-type and per-opcode counters become the fields of a nested instance, one per entry.
+static void setStatCounts(ObjInstance* stats, const char* field, const uint64_t* counts, int count,
+                          const char* (*name)(int)) {
+  ObjInstance* instance = pushStatsInstance("Counts");
+  for (int i = 0; i < count; i++) setStatField(instance, name(i), NUMBER_VAL((double)counts[i]));
+  setStatField(stats, field, OBJ_VAL(instance));
+  pop();
+}
+
+static const char* typeLabel(int type) { return objTypeName((ObjType)type); }
+
+static const char* opcodeLabel(int opcode) { return opcodeName((uint8_t)opcode); }
+
+// The VM's counters as an instance of "Stats", one field per counter. Building it allocates, so
+// the counters are read before that starts.
+static Value statsNative(int argCount __attribute__((unused)),
+                         Value* args __attribute__((unused))) {
+  VMStats counters = vm->stats;
+  size_t live = vm->bytesAllocated;
+
+  ObjInstance* stats = pushStatsInstance("Stats");
+  setStatCounts(stats, "objects", counters.objectsAllocated, OBJ_TYPE_COUNT, typeLabel);
+  setStatCounts(stats, "bytes", counters.bytesAllocated, OBJ_TYPE_COUNT, typeLabel);
+  setStatField(stats, "liveBytes", NUMBER_VAL((double)live));
+  setStatField(stats, "gcCycles", NUMBER_VAL((double)counters.gcCycles));
+  setStatField(stats, "gcPauses", NUMBER_VAL((double)counters.gcPauses));
+  setStatField(stats, "gcPauseMs", NUMBER_VAL(counters.gcPauseSeconds * 1e3));
+  setStatField(stats, "gcMaxPauseMs", NUMBER_VAL(counters.gcMaxPauseSeconds * 1e3));
+  setStatField(stats, "gcBytesFreed", NUMBER_VAL((double)counters.gcBytesFreed));
+  setStatField(stats, "tableLookups", NUMBER_VAL((double)counters.tableLookups));
+  setStatField(stats, "tableProbes", NUMBER_VAL((double)counters.tableProbes));
+  setStatField(stats, "tableResizes", NUMBER_VAL((double)counters.tableResizes));
+  setStatCounts(stats, "instructions", counters.instructions, OPCODE_COUNT, opcodeLabel);
+  setStatField(stats, "framesPushed", NUMBER_VAL((double)counters.framesPushed));
+  return pop();
+}
+
+// Frames printed at each end of a runtime error's stack trace.
+#define TRACE_EDGE_FRAMES 10
+
 void resetStack() {
-  vm.stackTop = vm.stack;
-  vm.frameCount = 0;
-  vm.openUpvalues = NULL;
+  for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    vm->stackUpvalues[upvalue->location - vm->stack] = NULL;
+  }
+
+  vm->stackTop = vm->stack;
+  vm->frameCount = 0;
+  vm->openUpvalues = NULL;
 }
 
 static void runtimeError(const char* format, ...) {
@@ -32,8 +143,15 @@ static void runtimeError(const char* format, ...) {
   va_end(args);
   fputs("\n", stderr);
 
-  for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame* frame = &vm.frames[i];
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    // Deep recursion would print thousands of identical lines; keep both ends of the stack.
+    if (i == vm->frameCount - 1 - TRACE_EDGE_FRAMES && i > TRACE_EDGE_FRAMES) {
+      fprintf(stderr, "... %d more frames\n", i - TRACE_EDGE_FRAMES + 1);
+      i = TRACE_EDGE_FRAMES;
+      continue;
+    }
+
+    CallFrame* frame = &vm->frames[i];
     ObjFunction* function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
     fprintf(stderr, "[line %d] in ", getLine(&frame->closure->function->chunk, instruction));
@@ -47,67 +165,193 @@ static void runtimeError(const char* format, ...) {
   resetStack();
 }
 
-static void defineNative(const char* name, NativeFn function, int arity) {
+void defineNative(const char* name, NativeFn function, int arity) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function, arity)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = globalSlot(AS_STRING(vm->stack[0]));
+  vm->globalValues.values[slot] = vm->stack[1];
+  pop();
   pop();
+}
+
+Value nativeError(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(vm->nativeErrorMessage, NATIVE_ERROR_MAX, format, args);
+  va_end(args);
+  return UNDEFINED_VAL;
+}
+
+int globalSlot(ObjString* name) {
+  Value slot;
+  if (tableGet(&vm->globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+  push(OBJ_VAL(name));
+  int index = vm->globalValues.count;
+  writeValueArray(&vm->globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm->globalNames, OBJ_VAL(name));
+  tableSet(&vm->globalSlots, name, NUMBER_VAL(index));
   pop();
+
+  return index;
 }
 
 void initVM() {
-  vm.stackCapacity = STACK_MAX;
-  vm.stack = GROW_ARRAY(Value, NULL, 0, vm.stackCapacity);
-  resetStack();
+  // Zeroed so that every pointer the collector may look at is NULL until it is set up.
+  vm = calloc(1, sizeof(VM));
+  if (vm == NULL) {
+    fprintf(stderr, "Failed to allocate the virtual machine.\n");
+    exit(1);
+  }
 
-  vm.bytesAllocated = 0;
-  vm.nextGC = 1024 * 1024;
-  vm.grayCount = 0;
-  vm.grayCapacity = 0;
-  vm.grayStack = NULL;
+  vm->bytesAllocated = 0;
+  vm->nextGC = 1024 * 1024;
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->grayStack = NULL;
+  vm->gcMode = GC_MODE_INCREMENTAL;
+  vm->gcThreads = 1;
+  vm->gcPhase = GC_PHASE_IDLE;
+  vm->sweepLink = NULL;
+  vm->gcObjectsAllocated = 0;
+  vm->gcPauses = NULL;
+  vm->gcPauseCount = 0;
+  vm->gcPauseCapacity = 0;
+  vm->peephole = true;
+  vm->registers = false;
+  vm->jit = false;
+  vm->countInstructions = false;
+  vm->countAllocations = false;
+  vm->currentOpcode = OPCODE_COUNT;
+  memset(vm->allocCounts, 0, sizeof(vm->allocCounts));
+  memset(&vm->stats, 0, sizeof(vm->stats));
+  initProfiler();
+#ifdef POOL_ALLOCATOR
+  initPool(&vm->pool);
+#endif
 
-  initTable(&vm.globals);
-  initTable(&vm.strings);
-  vm.objects = NULL;
+  initTable(&vm->globalSlots);
+  initValueArray(&vm->globalValues);
+  initValueArray(&vm->globalNames);
+  initStringTable(&vm->strings);
+  vm->objects = NULL;
+  vm->openUpvalues = NULL;
+
+  // Allocated once the collector state above is valid, since this can already trigger a GC.
+  vm->stackCapacity = STACK_INITIAL;
+  vm->stack = GROW_ARRAY(Value, NULL, 0, vm->stackCapacity);
+  vm->stackUpvalues = GROW_ARRAY(ObjUpvalue*, NULL, 0, vm->stackCapacity);
+  memset(vm->stackUpvalues, 0, sizeof(ObjUpvalue*) * vm->stackCapacity);
+  vm->frameCapacity = FRAMES_INITIAL;
+  vm->frames = GROW_ARRAY(CallFrame, NULL, 0, vm->frameCapacity);
+  vm->maxFrames = FRAMES_MAX;
+  resetStack();
 
   // Nulled out for GC
-  vm.initString = NULL;
-  vm.initString = copyString("init", 4);
+  vm->initString = NULL;
+  vm->initString = copyString("init", 4);
 
   // Native functions definitions
   defineNative("clock", clockNative, 0);
+  defineNative("len", lenNative, 1);
+  defineNative("push", pushNative, 2);
+  defineNative("pop", popNative, 1);
+  defineNative("stringBuilder", stringBuilderNative, 0);
+  defineNative("append", appendNative, 2);
+  defineNative("build", buildNative, 1);
+  defineNative("stats", statsNative, 0);
+  defineStandardLibrary();
 }
 
 void freeVM() {
-  FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
-  free(vm.grayStack);
-  freeTable(&vm.globals);
-  freeTable(&vm.strings);
-  vm.initString = NULL;
+  FREE_ARRAY(Value, vm->stack, vm->stackCapacity);
+  FREE_ARRAY(ObjUpvalue*, vm->stackUpvalues, vm->stackCapacity);
+  FREE_ARRAY(CallFrame, vm->frames, vm->frameCapacity);
+  free(vm->grayStack);
+  free(vm->gcPauses);
+  freeTable(&vm->globalSlots);
+  freeValueArray(&vm->globalValues);
+  freeValueArray(&vm->globalNames);
+  freeStringTable(&vm->strings);
+  freeProfiler();
+  vm->initString = NULL;
   freeObjects();
+  free(vm);
+  vm = NULL;
 }
 
-void push(Value value) {
-  if (vm.stackTop - vm.stack >= vm.stackCapacity) {
-    int oldCapacity = vm.stackCapacity;
-    vm.stackCapacity = GROW_CAPACITY(oldCapacity);
-    vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
-    if (vm.stack == NULL) {
-      fprintf(stderr, "Failed to reallocate memory for the stack.\n");
-      exit(1);
-    }
-    vm.stackTop = vm.stack + oldCapacity;
+VM* useVM(VM* instance) {
+  VM* previous = vm;
+  vm = instance;
+  return previous;
+}
+
+VM* createVM() {
+  VM* previous = vm;
+  initVM();
+  return useVM(previous);
+}
+
+InterpretResult interpretVM(VM* instance, const char* source) {
+  VM* previous = useVM(instance);
+  InterpretResult result = interpret(source);
+  useVM(previous);
+  return result;
+}
+
+const VMStats* getStatsVM(VM* instance) { return &instance->stats; }
+
+void destroyVM(VM* instance) {
+  VM* previous = useVM(instance);
+  freeVM();
+  if (previous != instance) useVM(previous);
+}
+
+// Moves the value stack to a buffer of at least `needed` slots. Frame slots and open upvalues point
+// into the stack, so they are rebased before the old buffer is released.
+static void growStack(int needed) {
+  int oldCapacity = vm->stackCapacity;
+  int newCapacity = GROW_CAPACITY(oldCapacity);
+  while (newCapacity < needed) newCapacity = GROW_CAPACITY(newCapacity);
+
+  Value* stack = GROW_ARRAY(Value, NULL, 0, newCapacity);
+  if (stack == NULL) {
+    fprintf(stderr, "Failed to reallocate memory for the stack.\n");
+    exit(1);
   }
-  *vm.stackTop = value;
-  vm.stackTop++;
+  memcpy(stack, vm->stack, sizeof(Value) * oldCapacity);
+
+  for (int i = 0; i < vm->frameCount; i++) {
+    vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+  }
+  for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm->stack);
+  }
+  vm->stackTop = stack + (vm->stackTop - vm->stack);
+
+  FREE_ARRAY(Value, vm->stack, oldCapacity);
+  vm->stack = stack;
+
+  // The upvalue index is keyed by slot number, so it only needs the new slots cleared.
+  vm->stackUpvalues = GROW_ARRAY(ObjUpvalue*, vm->stackUpvalues, oldCapacity, newCapacity);
+  memset(vm->stackUpvalues + oldCapacity, 0, sizeof(ObjUpvalue*) * (newCapacity - oldCapacity));
+  vm->stackCapacity = newCapacity;
+}
+
+// Growing allocates and so may collect, which would free a value that is not on the stack yet. The
+// stack therefore always keeps a free slot: the value goes there first, and a full stack grows after.
+void push(Value value) {
+  *vm->stackTop = value;
+  vm->stackTop++;
+  if (vm->stackTop - vm->stack == vm->stackCapacity) growStack(vm->stackCapacity + 1);
 }
 
 Value pop() {
-  vm.stackTop--;
-  return *vm.stackTop;
+  vm->stackTop--;
+  return *vm->stackTop;
 }
 
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+static Value peek(int distance) { return vm->stackTop[-1 - distance]; }
 
 static bool call(ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {
@@ -115,15 +359,33 @@ static bool call(ObjClosure* closure, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  if (vm->frameCount == vm->maxFrames) {
     runtimeError("Stack overflow.");
     return false;
   }
 
-  CallFrame* frame = &vm.frames[vm.frameCount++];
+  // The interpreter loop reloads its frame pointer after every call, so the array may move.
+  if (vm->frameCount == vm->frameCapacity) {
+    int oldCapacity = vm->frameCapacity;
+    vm->frameCapacity = GROW_CAPACITY(oldCapacity);
+    if (vm->frameCapacity > vm->maxFrames) vm->frameCapacity = vm->maxFrames;
+    vm->frames = GROW_ARRAY(CallFrame, vm->frames, oldCapacity, vm->frameCapacity);
+  }
+
+  // Reserving the callee's whole stack depth up front is what lets the interpreter loop push
+  // without checking the capacity. The slot past it is the free one push() relies on.
+  int needed = (int)(vm->stackTop - argCount - 1 - vm->stack) + closure->function->maxSlots + 1;
+  if (needed > vm->stackCapacity) growStack(needed);
+
+#ifdef JIT
+  if (vm->jit) jitCount(closure->function);
+#endif
+
+  vm->stats.framesPushed++;
+  CallFrame* frame = &vm->frames[vm->frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  frame->slots = vm->stackTop - argCount - 1;
   return true;
 }
 
@@ -133,8 +395,13 @@ static bool callNative(ObjNative* native, int argCount) {
     return false;
   }
 
-  Value result = native->function(argCount, vm.stackTop - argCount);
-  vm.stackTop -= argCount + 1;
+  Value result = native->function(argCount, vm->stackTop - argCount);
+  if (IS_UNDEFINED(result)) {
+    runtimeError("%s", vm->nativeErrorMessage);
+    return false;
+  }
+
+  vm->stackTop -= argCount + 1;
   push(result);
   return true;
 }
@@ -148,14 +415,14 @@ static bool callValue(Value callee, int argCount) {
         return call(AS_CLOSURE(callee), argCount);
       case OBJ_CLASS: {
         ObjClass* klass = AS_CLASS(callee);
-        vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+        vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
 
         if (klass->cachedInit != NULL) {
           return call(klass->cachedInit, argCount);
         }
 
         Value initializer;
-        if (tableGet(&klass->methods, vm.initString, &initializer)) {
+        if (tableGet(&klass->methods, vm->initString, &initializer)) {
           klass->cachedInit = AS_CLOSURE(initializer);
           return call(AS_CLOSURE(initializer), argCount);
         } else if (argCount != 0) {
@@ -167,7 +434,7 @@ static bool callValue(Value callee, int argCount) {
       }
       case OBJ_BOUND_METHOD: {
         ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-        vm.stackTop[-argCount - 1] = bound->receiver;
+        vm->stackTop[-argCount - 1] = bound->receiver;
         return call(bound->method, argCount);
       }
       default:
@@ -200,42 +467,120 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
   return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
-  Value receiver = peek(argCount);
+/**
+ * @brief Outcome of resolving a property name against an instance.
+ */
+typedef enum {
+  PROPERTY_UNDEFINED,  ///< Neither a field nor a method has that name.
+  PROPERTY_FIELD,      ///< The name resolved to a field of the instance.
+  PROPERTY_METHOD,     ///< The name resolved to a method of the instance's class.
+} PropertyKind;
+
+static PropertyKind lookupProperty(InlineCache* cache, ObjInstance* instance, ObjString* name,
+                                   Value* result) {
+  ObjShape* shape = instance->shape;
+
+  for (int i = 0; i < cache->count; i++) {
+    InlineCacheEntry* entry = &cache->entries[i];
+    if (entry->shape != shape) continue;
+
+    if (entry->method == NULL) {
+      cache->hits++;
+      *result = instance->slots[entry->slot];
+      return PROPERTY_FIELD;
+    }
 
-  if (!IS_INSTANCE(receiver)) {
-    runtimeError("Only instances have methods.");
-    return false;
+    if (entry->version != instance->klass->version) break;
+    cache->hits++;
+    *result = OBJ_VAL(entry->method);
+    return PROPERTY_METHOD;
   }
 
-  ObjInstance* instance = AS_INSTANCE(receiver);
+  cache->misses++;
 
-  Value value;
-  if (tableGet(&instance->fields, name, &value)) {
-    vm.stackTop[-argCount - 1] = value;
-    return callValue(value, argCount);
+  // Dictionary-mode instances have no shape and are never cached.
+  if (shape == NULL) {
+    if (tableGet(&instance->fields, name, result)) return PROPERTY_FIELD;
+    if (!tableGet(&instance->klass->methods, name, result)) return PROPERTY_UNDEFINED;
+    return PROPERTY_METHOD;
   }
 
-  return invokeFromClass(instance->klass, name, argCount);
+  int slot = shapeFindSlot(shape, name);
+  if (slot != -1) {
+    *result = instance->slots[slot];
+    recordInlineCache(cache, shape, NULL, NULL, slot);
+    return PROPERTY_FIELD;
+  }
+
+  if (!tableGet(&instance->klass->methods, name, result)) return PROPERTY_UNDEFINED;
+
+  // The shape has no field by this name, so the method stays valid until the class changes.
+  recordInlineCache(cache, shape, AS_CLOSURE(*result), NULL, 0);
+  return PROPERTY_METHOD;
+}
+
+static void setProperty(InlineCache* cache, ObjInstance* instance, ObjString* name, Value value) {
+  ObjShape* shape = instance->shape;
+
+  for (int i = 0; i < cache->count; i++) {
+    InlineCacheEntry* entry = &cache->entries[i];
+    if (entry->shape != shape) continue;
+
+    cache->hits++;
+    if (entry->transition == NULL) {
+      instance->slots[entry->slot] = value;
+      WRITE_BARRIER(value);
+    } else {
+      instanceAddField(instance, entry->transition, value);
+    }
+    return;
+  }
+
+  cache->misses++;
+
+  if (shape == NULL) {
+    tableSet(&instance->fields, name, value);
+    return;
+  }
+
+  int slot = shapeFindSlot(shape, name);
+  if (slot != -1) {
+    instance->slots[slot] = value;
+    WRITE_BARRIER(value);
+    recordInlineCache(cache, shape, NULL, NULL, slot);
+    return;
+  }
+
+  ObjShape* next = shapeTransition(shape, name);
+  if (next == NULL) {
+    instanceSetField(instance, name, value);
+    return;
+  }
+
+  instanceAddField(instance, next, value);
+  recordInlineCache(cache, shape, NULL, next, next->fieldCount - 1);
 }
 
 static ObjUpvalue* captureUpvalue(Value* local) {
+  // A slot has at most one open upvalue, which the index finds without walking the list.
+  int slot = (int)(local - vm->stack);
+  if (vm->stackUpvalues[slot] != NULL) return vm->stackUpvalues[slot];
+
+  ObjUpvalue* createdUpvalue = newUpvalue(local);
+  vm->stackUpvalues[slot] = createdUpvalue;
+
+  // The list stays sorted from the top of the stack down so that closing pops it from the head.
+  // New upvalues belong to the running frame, so the walk stops within its own captures.
   ObjUpvalue* prevUpvalue = NULL;
-  ObjUpvalue* upvalue = vm.openUpvalues;
+  ObjUpvalue* upvalue = vm->openUpvalues;
   while (upvalue != NULL && upvalue->location > local) {
     prevUpvalue = upvalue;
     upvalue = upvalue->next;
   }
-
-  if (upvalue != NULL && upvalue->location == local) {
-    return upvalue;
-  }
-
-  ObjUpvalue* createdUpvalue = newUpvalue(local);
   createdUpvalue->next = upvalue;
 
   if (prevUpvalue == NULL) {
-    vm.openUpvalues = createdUpvalue;
+    vm->openUpvalues = createdUpvalue;
   } else {
     prevUpvalue->next = createdUpvalue;
   }
@@ -244,11 +589,13 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 }
 
 static void closeUpvalues(Value* last) {
-  while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-    ObjUpvalue* upvalue = vm.openUpvalues;
+  while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+    ObjUpvalue* upvalue = vm->openUpvalues;
+    vm->stackUpvalues[upvalue->location - vm->stack] = NULL;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
+    WRITE_BARRIER(upvalue->closed);
+    vm->openUpvalues = upvalue->next;
   }
 }
 
@@ -256,9 +603,44 @@ static void defineMethod(ObjString* name) {
   Value method = peek(0);
   ObjClass* klass = AS_CLASS(peek(1));
   tableSet(&klass->methods, name, method);
+  klass->version++;
   pop();
 }
 
+static bool listIndex(Value receiver, Value index, ObjList** list, int* slot) {
+  if (!IS_LIST(receiver)) {
+    runtimeError("Only lists can be indexed.");
+    return false;
+  }
+  if (!IS_NUMBER(index)) {
+    runtimeError("List index must be a number.");
+    return false;
+  }
+
+  *list = AS_LIST(receiver);
+  if (IS_INT(index)) {
+    *slot = AS_INT(index);
+    if (*slot < 0 || *slot >= (*list)->items.count) {
+      runtimeError("List index out of bounds.");
+      return false;
+    }
+    return true;
+  }
+
+  double number = AS_NUMBER(index);
+  // Range-check as a double first so huge values and NaN never reach the int conversion.
+  if (!(number >= 0 && number < (*list)->items.count)) {
+    runtimeError("List index out of bounds.");
+    return false;
+  }
+  *slot = (int)number;
+  if (*slot != number) {
+    runtimeError("List index must be an integer.");
+    return false;
+  }
+  return true;
+}
+
 static bool isFalsey(Value value) { return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)); }
 
 static int falsey(Value value) {
@@ -271,356 +653,1070 @@ static int truthy(Value value) {
 
 static int roundDouble(double value) { return (int)(value + 0.5); }
 
-static void concatenate() {
-  ObjString* b = AS_STRING(peek(0));
-  ObjString* a = AS_STRING(peek(1));
+// Gives `roundDouble` of an integral value without the conversion: truncating `value + 0.5`
+// towards zero moves negative values one up.
+static int32_t roundInt(int32_t value) { return value < 0 ? value + 1 : value; }
+
+// `a % b` for a divisor already known not to be 0. C leaves INT_MIN % -1 undefined, and x86 traps
+// on it, though the remainder is plainly 0.
+static inline int32_t intRemainder(int32_t a, int32_t b) { return b == -1 ? 0 : a % b; }
 
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+// Boxes the sum or difference of two small integers, as a double once it leaves the 32-bit range.
+// The conversion rounds the exact result once, as the double operation would have.
+static inline Value intResult(int64_t result) {
+  return result == (int32_t)result ? INT_VAL(result) : NUMBER_VAL((double)result);
+}
 
-  ObjString* result = takeString(chars, length);
+// Boxes the product of two small integers. A zero product with a negative factor is negative zero
+// in double arithmetic, which no small integer can hold.
+static inline Value intProduct(int64_t a, int64_t b) {
+  int64_t product = a * b;
+  if (product == 0 && (a < 0 || b < 0)) return NUMBER_VAL(-0.0);
+  return intResult(product);
+}
+
+static void concatenate() {
+  if (IS_STRING(peek(0)) && IS_STRING(peek(1)) &&
+      AS_STRING(peek(0))->length + AS_STRING(peek(1))->length < ROPE_MIN_LENGTH) {
+    ObjString* b = AS_STRING(peek(0));
+    ObjString* a = AS_STRING(peek(1));
+
+    int length = a->length + b->length;
+    char* chars = ALLOCATE(char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+
+    ObjString* result = takeString(chars, length);
+    pop();
+    pop();
+    push(OBJ_VAL(result));
+    return;
+  }
+
+  // Long results are deferred, so building a string piece by piece stays linear.
+  ObjRope* result = newRope(AS_OBJ(peek(1)), AS_OBJ(peek(0)));
   pop();
   pop();
-
   push(OBJ_VAL(result));
 }
 
+// Replaces a rope on the stack with its flattened string, for operations that need the chars.
+static void flattenOperand(int distance) {
+  Value value = peek(distance);
+  if (IS_ROPE(value)) vm->stackTop[-1 - distance] = OBJ_VAL(flattenRope(AS_ROPE(value)));
+}
+
+#ifdef JIT
+// The instruction bodies the machine code calls. Each one either completes its instruction and
+// returns the new stack top or returns NULL having changed nothing, so the interpreter can redo
+// the instruction. That is also how every runtime error ends up reported by the interpreter.
+#define JIT_HELPER(name) static Value* name(Value* stackTop, Value* local, uint64_t operand)
+#define JIT_UNUSED() ((void)local, (void)operand)
+#define JIT_BINARY_HELPER(name, intBox, valueType, op)               \
+  JIT_HELPER(name) {                                                 \
+    JIT_UNUSED();                                                    \
+    Value b = stackTop[-1];                                          \
+    Value a = stackTop[-2];                                          \
+    if (ARE_INTS(a, b)) {                                            \
+      stackTop[-2] = intBox((int64_t)AS_INT(a), (int64_t)AS_INT(b)); \
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {                       \
+      stackTop[-2] = valueType(AS_NUMBER(a) op AS_NUMBER(b));        \
+    } else {                                                         \
+      return NULL;                                                   \
+    }                                                                \
+    return stackTop - 1;                                             \
+  }
+#define JIT_SUM(a, b) intResult((a) + (b))
+#define JIT_DIFFERENCE(a, b) intResult((a) - (b))
+#define JIT_LESS(a, b) BOOL_VAL((a) < (b))
+#define JIT_GREATER(a, b) BOOL_VAL((a) > (b))
+
+JIT_BINARY_HELPER(jitAdd, JIT_SUM, NUMBER_VAL, +)
+JIT_BINARY_HELPER(jitSubtract, JIT_DIFFERENCE, NUMBER_VAL, -)
+JIT_BINARY_HELPER(jitMultiply, intProduct, NUMBER_VAL, *)
+JIT_BINARY_HELPER(jitLess, JIT_LESS, BOOL_VAL, <)
+JIT_BINARY_HELPER(jitGreater, JIT_GREATER, BOOL_VAL, >)
+
+JIT_HELPER(jitDivide) {
+  JIT_UNUSED();
+  if (!IS_NUMBER(stackTop[-1]) || !IS_NUMBER(stackTop[-2])) return NULL;
+  stackTop[-2] = NUMBER_VAL(AS_NUMBER(stackTop[-2]) / AS_NUMBER(stackTop[-1]));
+  return stackTop - 1;
+}
+
+JIT_HELPER(jitModulo) {
+  JIT_UNUSED();
+  Value b = stackTop[-1];
+  Value a = stackTop[-2];
+  // A divisor that rounds to 0 is left to the interpreter, which reports it.
+  if (ARE_INTS(a, b)) {
+    int32_t divisor = roundInt(AS_INT(b));
+    if (divisor == 0) return NULL;
+    stackTop[-2] = INT_VAL(intRemainder(roundInt(AS_INT(a)), divisor));
+  } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    int divisor = roundDouble(AS_NUMBER(b));
+    if (divisor == 0) return NULL;
+    stackTop[-2] = INT_VAL(intRemainder(roundDouble(AS_NUMBER(a)), divisor));
+  } else {
+    return NULL;
+  }
+  return stackTop - 1;
+}
+
+// Ropes would have to be flattened, which allocates.
+JIT_HELPER(jitEqual) {
+  JIT_UNUSED();
+  if (IS_ROPE(stackTop[-1]) || IS_ROPE(stackTop[-2])) return NULL;
+  stackTop[-2] = BOOL_VAL(valuesEqual(stackTop[-2], stackTop[-1]));
+  return stackTop - 1;
+}
+
+JIT_HELPER(jitNegate) {
+  JIT_UNUSED();
+  if (!IS_NUMBER(stackTop[-1])) return NULL;
+  stackTop[-1] = NUMBER_VAL(-AS_NUMBER(stackTop[-1]));
+  return stackTop;
+}
+
+JIT_HELPER(jitNot) {
+  JIT_UNUSED();
+  stackTop[-1] = BOOL_VAL(isFalsey(stackTop[-1]));
+  return stackTop;
+}
+
+JIT_HELPER(jitIncLocal) {
+  Value constant = (Value)operand;
+  if (ARE_INTS(*local, constant)) {
+    *local = intResult((int64_t)AS_INT(*local) + AS_INT(constant));
+  } else if (IS_NUMBER(*local)) {
+    *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(constant));
+  } else {
+    return NULL;
+  }
+  return stackTop;
+}
+
+JIT_HELPER(jitAddConst) {
+  (void)local;
+  Value constant = (Value)operand;
+  if (ARE_INTS(constant, stackTop[-1])) {
+    stackTop[-1] = intResult((int64_t)AS_INT(stackTop[-1]) + AS_INT(constant));
+  } else if (IS_NUMBER(constant) && IS_NUMBER(stackTop[-1])) {
+    stackTop[-1] = NUMBER_VAL(AS_NUMBER(stackTop[-1]) + AS_NUMBER(constant));
+  } else {
+    return NULL;
+  }
+  return stackTop;
+}
+
+JIT_HELPER(jitGetGlobal) {
+  (void)local;
+  Value value = vm->globalValues.values[operand];
+  if (IS_UNDEFINED(value)) return NULL;
+  *stackTop = value;
+  return stackTop + 1;
+}
+
+JIT_HELPER(jitSetGlobal) {
+  (void)local;
+  if (IS_UNDEFINED(vm->globalValues.values[operand])) return NULL;
+  vm->globalValues.values[operand] = stackTop[-1];
+  return stackTop;
+}
+
+// Only small-integer indexes inside the list; the interpreter handles the rest.
+static ObjList* jitList(Value receiver, Value index) {
+  if (!IS_LIST(receiver) || !IS_INT(index)) return NULL;
+  ObjList* list = AS_LIST(receiver);
+  if (AS_INT(index) < 0 || AS_INT(index) >= list->items.count) return NULL;
+  return list;
+}
+
+JIT_HELPER(jitIndexGet) {
+  JIT_UNUSED();
+  ObjList* list = jitList(stackTop[-2], stackTop[-1]);
+  if (list == NULL) return NULL;
+  stackTop[-2] = list->items.values[AS_INT(stackTop[-1])];
+  return stackTop - 1;
+}
+
+JIT_HELPER(jitIndexSet) {
+  JIT_UNUSED();
+  ObjList* list = jitList(stackTop[-3], stackTop[-2]);
+  if (list == NULL) return NULL;
+  Value value = stackTop[-1];
+  list->items.values[AS_INT(stackTop[-2])] = value;
+  WRITE_BARRIER(value);
+  stackTop[-3] = value;
+  return stackTop - 2;
+}
+
+JIT_HELPER(jitPrint) {
+  JIT_UNUSED();
+  if (IS_ROPE(stackTop[-1])) return NULL;
+  printValue(stackTop[-1]);
+  printf("\n");
+  return stackTop - 1;
+}
+
+const JitHelper jitHelpers[OPCODE_COUNT] = {
+    [OP_ADD] = jitAdd,
+    [OP_SUBTRACT] = jitSubtract,
+    [OP_MULTIPLY] = jitMultiply,
+    [OP_DIVIDE] = jitDivide,
+    [OP_MODULO] = jitModulo,
+    [OP_LESS] = jitLess,
+    [OP_GREATER] = jitGreater,
+    [OP_EQUAL] = jitEqual,
+    [OP_NEGATE] = jitNegate,
+    [OP_NOT] = jitNot,
+    [OP_INC_LOCAL] = jitIncLocal,
+    [OP_ADD_CONST] = jitAddConst,
+    [OP_GET_GLOBAL] = jitGetGlobal,
+    [OP_SET_GLOBAL] = jitSetGlobal,
+    [OP_INDEX_GET] = jitIndexGet,
+    [OP_INDEX_SET] = jitIndexSet,
+    [OP_PRINT] = jitPrint,
+};
+
+#undef JIT_HELPER
+#undef JIT_UNUSED
+#undef JIT_BINARY_HELPER
+#undef JIT_SUM
+#undef JIT_DIFFERENCE
+#undef JIT_LESS
+#undef JIT_GREATER
+#endif
+
 static InterpretResult run() {
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  // Reading the thread-local `vm` costs a load of its own, so the loop reads it once.
+  VM* const self = vm;
+  CallFrame* frame;
+  register uint8_t* ip;
+  register Value* constants;
+  // The stack top is cached here and only written back to `vm->stackTop` before code outside the
+  // loop looks at the stack. Anything that allocates counts, since a collection marks the stack.
+  register Value* stackTop;
+
+#define STORE_STACK() (self->stackTop = stackTop)
+#define LOAD_STACK() (stackTop = self->stackTop)
+#define STORE_FRAME() (frame->ip = ip, STORE_STACK())
+// Calls can move the stack as well as change the frame, so every LOAD_FRAME() after one is paired
+// with a LOAD_STACK().
+#define LOAD_FRAME()                                              \
+  do {                                                            \
+    frame = &self->frames[self->frameCount - 1];                  \
+    ip = frame->ip;                                               \
+    constants = frame->closure->function->chunk.constants.values; \
+  } while (false)
+// call() reserves the frame's whole stack depth on entry, so pushing never checks the capacity.
+#define PUSH(value) (*stackTop = (value), stackTop++)
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define RUNTIME_ERROR(...)          \
+  do {                              \
+    STORE_FRAME();                  \
+    runtimeError(__VA_ARGS__);      \
+    return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_CONSTANT_LONG()                                                                \
-  ({                                                                                        \
-    uint8_t byte1 = READ_BYTE();                                                            \
-    uint8_t byte2 = READ_BYTE();                                                            \
-    uint8_t byte3 = READ_BYTE();                                                            \
-    frame->closure->function->chunk.constants.values[(byte1 << 16) | (byte2 << 8) | byte3]; \
+#define READ_CONSTANT_LONG()                         \
+  ({                                                 \
+    uint8_t byte1 = READ_BYTE();                     \
+    uint8_t byte2 = READ_BYTE();                     \
+    uint8_t byte3 = READ_BYTE();                     \
+    constants[(byte1 << 16) | (byte2 << 8) | byte3]; \
   })
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define BINARY_INT_OP(op)                             \
-  do {                                                \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtimeError("Operands must be numbers.");      \
-      return INTERPRET_RUNTIME_ERROR;                 \
-    }                                                 \
-    int b = roundDouble(AS_NUMBER(pop()));            \
-    int a = roundDouble(AS_NUMBER(pop()));            \
-    push(NUMBER_VAL(a op b));                         \
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CACHE() (&frame->closure->function->chunk.caches.caches[READ_SHORT()])
+// Small-integer operands skip the conversions. Like every int path below, this one gives exactly
+// what the double path would, so which one runs is never visible to the program.
+// Both operands are rounded to integers first, so a divisor between -1 and 1 counts as 0.
+#define MODULO_OP()                                        \
+  do {                                                     \
+    int32_t a, b;                                          \
+    if (ARE_INTS(PEEK(0), PEEK(1))) {                      \
+      b = roundInt(AS_INT(PEEK(0)));                       \
+      a = roundInt(AS_INT(PEEK(1)));                       \
+    } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) { \
+      b = roundDouble(AS_NUMBER(PEEK(0)));                 \
+      a = roundDouble(AS_NUMBER(PEEK(1)));                 \
+    } else {                                               \
+      RUNTIME_ERROR("Operands must be numbers.");          \
+    }                                                      \
+    if (b == 0) RUNTIME_ERROR("Modulo by zero.");          \
+    stackTop -= 2;                                         \
+    PUSH(INT_VAL(intRemainder(a, b)));                     \
   } while (false)
-#define BINARY_OP(valueType, op)                      \
-  do {                                                \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtimeError("Operands must be numbers.");      \
-      return INTERPRET_RUNTIME_ERROR;                 \
-    }                                                 \
-    double b = AS_NUMBER(pop());                      \
-    double a = AS_NUMBER(pop());                      \
-    push(valueType(a op b));                          \
+// Each operand is tested for a double first, and that test also tells the two number encodings
+// apart, so a double costs one check and a small integer two.
+#define NUMBER_OPERAND(value) (IS_DOUBLE(value) ? AS_DOUBLE(value) : (double)AS_INT(value))
+#define BINARY_OP(valueType, op)                                             \
+  do {                                                                       \
+    Value right = PEEK(0);                                                   \
+    Value left = PEEK(1);                                                    \
+    if (!IS_NUMBER(right) || !IS_NUMBER(left)) {                             \
+      RUNTIME_ERROR("Operands must be numbers.");                            \
+    }                                                                        \
+    stackTop--;                                                              \
+    stackTop[-1] = valueType(NUMBER_OPERAND(left) op NUMBER_OPERAND(right)); \
+  } while (false)
+// Finishes the instruction early when both operands are small integers, with `box(a, b)` as the
+// result.
+#define INT_FAST_PATH(box)                    \
+  do {                                        \
+    if (ARE_INTS(PEEK(0), PEEK(1))) {         \
+      int64_t b = AS_INT(POP());              \
+      stackTop[-1] = box(AS_INT(PEEK(0)), b); \
+      DISPATCH();                             \
+    }                                         \
+  } while (false)
+#define INT_SUM(a, b) intResult((a) + (b))
+#define INT_DIFFERENCE(a, b) intResult((a) - (b))
+#define INT_LESS(a, b) BOOL_VAL((a) < (b))
+#define INT_GREATER(a, b) BOOL_VAL((a) > (b))
+#define INT_QUOTIENT(a, b) NUMBER_VAL((double)(a) / (double)(b))
+// Register instructions name their destination and first operand by local slot. The second
+// operand is a slot for the _RR forms and a constant for the _RK forms.
+#define READ_LOCAL() (frame->slots[READ_BYTE()])
+// Stores `left op right` into the destination slot, running `otherwise` when the operands are not
+// both numbers.
+#define REGISTER_OP(readRight, intBox, op, otherwise)                                        \
+  do {                                                                                       \
+    uint8_t destination = READ_BYTE();                                                       \
+    Value left = READ_LOCAL();                                                               \
+    Value right = readRight();                                                               \
+    if (ARE_INTS(left, right)) {                                                             \
+      frame->slots[destination] = intBox((int64_t)AS_INT(left), (int64_t)AS_INT(right));     \
+    } else if (IS_NUMBER(left) && IS_NUMBER(right)) {                                        \
+      frame->slots[destination] = NUMBER_VAL(NUMBER_OPERAND(left) op NUMBER_OPERAND(right)); \
+    } else {                                                                                 \
+      otherwise;                                                                             \
+    }                                                                                        \
+  } while (false)
+#define NUMBERS_ONLY RUNTIME_ERROR("Operands must be numbers.")
+// Concatenation goes through the stack, where the collector can see the operands.
+#define CONCATENATE_INTO_DESTINATION                                 \
+  do {                                                               \
+    if (!IS_ANY_STRING(left) || !IS_ANY_STRING(right)) {             \
+      RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+    }                                                                \
+    PUSH(left);                                                      \
+    PUSH(right);                                                     \
+    STORE_STACK();                                                   \
+    concatenate();                                                   \
+    LOAD_STACK();                                                    \
+    frame->slots[destination] = POP();                               \
+  } while (false)
+// Jumps when `left op right` is `jumpWhen`. The condition never reaches the stack.
+#define REGISTER_BRANCH(readRight, op, jumpWhen)              \
+  do {                                                        \
+    Value left = READ_LOCAL();                                \
+    Value right = readRight();                                \
+    uint16_t offset = READ_SHORT();                           \
+    bool result;                                              \
+    if (ARE_INTS(left, right)) {                              \
+      result = AS_INT(left) op AS_INT(right);                 \
+    } else if (IS_NUMBER(left) && IS_NUMBER(right)) {         \
+      result = NUMBER_OPERAND(left) op NUMBER_OPERAND(right); \
+    } else {                                                  \
+      RUNTIME_ERROR("Operands must be numbers.");             \
+    }                                                         \
+    ip += (result == (jumpWhen)) * offset;                    \
   } while (false)
 
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(&frame->closure->function->chunk,
-                           (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION()                                                   \
+  do {                                                                        \
+    printf("          ");                                                     \
+    for (Value* slot = self->stack; slot < stackTop; slot++) {                \
+      printf("[ ");                                                           \
+      printValue(*slot);                                                      \
+      printf(" ]");                                                           \
+    }                                                                         \
+    printf("\n");                                                             \
+    disassembleInstruction(&frame->closure->function->chunk,                  \
+                           (int)(ip - frame->closure->function->chunk.code)); \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() \
+  do {                      \
+  } while (false)
 #endif
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT_LONG: {
-        Value constant = READ_CONSTANT_LONG();
-        push(constant);
-        break;
-      }
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
-        push(constant);
-        break;
-      }
-      case OP_DUP: {
-        push(peek(0));
-        break;
-      }
-      case OP_NIL:
-        push(NIL_VAL);
-        break;
-      case OP_TRUE:
-        push(BOOL_VAL(true));
-        break;
-      case OP_FALSE:
-        push(BOOL_VAL(false));
-        break;
-      case OP_POP:
-        pop();
-        break;
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
-      }
-      case OP_GET_PROPERTY: {
-        if (!IS_INSTANCE(peek(0))) {
-          runtimeError("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-
-        ObjInstance* instance = AS_INSTANCE(peek(0));
-        ObjString* name = READ_STRING();
+#ifdef COMPUTED_GOTO
+  // One label per opcode, indexed by the opcode value itself.
+  static void* const handlerTable[] = {
+#define DISPATCH_ENTRY(name) [name] = &&label_##name
+      DISPATCH_ENTRY(OP_CONSTANT),            DISPATCH_ENTRY(OP_CONSTANT_LONG),
+      DISPATCH_ENTRY(OP_CLOSURE),             DISPATCH_ENTRY(OP_CLOSE_UPVALUE),
+      DISPATCH_ENTRY(OP_CLASS),               DISPATCH_ENTRY(OP_METHOD),
+      DISPATCH_ENTRY(OP_INVOKE),              DISPATCH_ENTRY(OP_SUPER_INVOKE),
+      DISPATCH_ENTRY(OP_INHERIT),             DISPATCH_ENTRY(OP_DUP),
+      DISPATCH_ENTRY(OP_NIL),                 DISPATCH_ENTRY(OP_TRUE),
+      DISPATCH_ENTRY(OP_FALSE),               DISPATCH_ENTRY(OP_POP),
+      DISPATCH_ENTRY(OP_GET_LOCAL),           DISPATCH_ENTRY(OP_SET_LOCAL),
+      DISPATCH_ENTRY(OP_GET_PROPERTY),        DISPATCH_ENTRY(OP_SET_PROPERTY),
+      DISPATCH_ENTRY(OP_GET_UPVALUE),         DISPATCH_ENTRY(OP_SET_UPVALUE),
+      DISPATCH_ENTRY(OP_GET_SUPER),           DISPATCH_ENTRY(OP_GET_GLOBAL),
+      DISPATCH_ENTRY(OP_SET_GLOBAL),          DISPATCH_ENTRY(OP_DEFINE_GLOBAL),
+      DISPATCH_ENTRY(OP_LIST),                DISPATCH_ENTRY(OP_LIST_APPEND),
+      DISPATCH_ENTRY(OP_INDEX_GET),           DISPATCH_ENTRY(OP_INDEX_SET),
+      DISPATCH_ENTRY(OP_EQUAL),               DISPATCH_ENTRY(OP_GREATER),
+      DISPATCH_ENTRY(OP_LESS),                DISPATCH_ENTRY(OP_ADD),
+      DISPATCH_ENTRY(OP_SUBTRACT),            DISPATCH_ENTRY(OP_MULTIPLY),
+      DISPATCH_ENTRY(OP_DIVIDE),              DISPATCH_ENTRY(OP_MODULO),
+      DISPATCH_ENTRY(OP_NOT),                 DISPATCH_ENTRY(OP_NEGATE),
+      DISPATCH_ENTRY(OP_PRINT),               DISPATCH_ENTRY(OP_JUMP),
+      DISPATCH_ENTRY(OP_JUMP_IF_FALSE),       DISPATCH_ENTRY(OP_JUMP_IF_TRUE),
+      DISPATCH_ENTRY(OP_LOOP),                DISPATCH_ENTRY(OP_CALL),
+      DISPATCH_ENTRY(OP_RETURN),              DISPATCH_ENTRY(OP_GET_LOCAL_GET_LOCAL),
+      DISPATCH_ENTRY(OP_INC_LOCAL),           DISPATCH_ENTRY(OP_ADD_CONST),
+      DISPATCH_ENTRY(OP_LESS_JUMP_IF_FALSE),  DISPATCH_ENTRY(OP_NOT_JUMP_IF_FALSE),
+      DISPATCH_ENTRY(OP_MOVE),                DISPATCH_ENTRY(OP_LOAD_CONSTANT),
+      DISPATCH_ENTRY(OP_ADD_RR),              DISPATCH_ENTRY(OP_ADD_RK),
+      DISPATCH_ENTRY(OP_SUBTRACT_RR),         DISPATCH_ENTRY(OP_SUBTRACT_RK),
+      DISPATCH_ENTRY(OP_MULTIPLY_RR),         DISPATCH_ENTRY(OP_MULTIPLY_RK),
+      DISPATCH_ENTRY(OP_DIVIDE_RR),           DISPATCH_ENTRY(OP_DIVIDE_RK),
+      DISPATCH_ENTRY(OP_LESS_RR_JUMP),        DISPATCH_ENTRY(OP_LESS_RK_JUMP),
+      DISPATCH_ENTRY(OP_LESS_EQUAL_RR_JUMP),  DISPATCH_ENTRY(OP_LESS_EQUAL_RK_JUMP),
+      DISPATCH_ENTRY(OP_GREATER_RR_JUMP),     DISPATCH_ENTRY(OP_GREATER_RK_JUMP),
+      DISPATCH_ENTRY(OP_GREATER_EQUAL_RR_JUMP), DISPATCH_ENTRY(OP_GREATER_EQUAL_RK_JUMP),
+#undef DISPATCH_ENTRY
+  };
+
+  // While profiling, every opcode first goes through the profiler hook, which then jumps to the
+  // real handler; counting instructions, and recording the opcode that allocations are attributed
+  // to, work the same way. Otherwise the table holds the handlers themselves and none of them costs
+  // anything. Each thread has its own table, since only some of the VMs may be profiling.
+  static THREAD_LOCAL void* dispatchTable[OPCODE_COUNT];
+  void* hook = NULL;
+  if (self->profiler.running) {
+    hook = &&label_profile;
+  } else if (self->countInstructions) {
+    hook = &&label_count;
+  } else if (self->countAllocations) {
+    hook = &&label_opcode;
+  }
+  for (int i = 0; i < OPCODE_COUNT; i++) {
+    dispatchTable[i] = hook != NULL ? hook : handlerTable[i];
+  }
 
-        Value value;
-        if (tableGet(&instance->fields, name, &value)) {
-          pop();  // Instance.
-          push(value);
-        } else if (!bindMethod(instance->klass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
+#define INTERPRET_LOOP                                  \
+  DISPATCH();                                           \
+  label_profile:                                        \
+  profileInstruction(frame->closure->function, ip - 1); \
+  if (!self->countInstructions) goto label_opcode;      \
+  label_count:                                          \
+  self->stats.instructions[ip[-1]]++;                   \
+  label_opcode:                                         \
+  self->currentOpcode = ip[-1];                         \
+  goto *handlerTable[ip[-1]];
+#define CASE(name) label_##name:
+#define DISPATCH()                    \
+  do {                                \
+    TRACE_INSTRUCTION();              \
+    goto *dispatchTable[READ_BYTE()]; \
+  } while (false)
+#else
+  uint8_t instruction;
+#define INTERPRET_LOOP                                                              \
+  loop:                                                                             \
+  TRACE_INSTRUCTION();                                                              \
+  instruction = READ_BYTE();                                                        \
+  if (self->countInstructions) self->stats.instructions[instruction]++;             \
+  if (self->profiler.running) profileInstruction(frame->closure->function, ip - 1); \
+  if (self->countAllocations) self->currentOpcode = instruction;                    \
+  switch (instruction)
+#define CASE(name) case name:
+#define DISPATCH() goto loop
+#endif
 
-        break;
-      }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(1))) {
-          runtimeError("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+  LOAD_FRAME();
+  LOAD_STACK();
 
-        ObjInstance* instance = AS_INSTANCE(peek(1));
-        tableSet(&instance->fields, READ_STRING(), peek(0));
-        Value value = pop();
-        pop();
-        push(value);
-        break;
+  INTERPRET_LOOP {
+    CASE(OP_CONSTANT_LONG) {
+      Value constant = READ_CONSTANT_LONG();
+      PUSH(constant);
+      DISPATCH();
+    }
+    CASE(OP_CONSTANT) {
+      Value constant = READ_CONSTANT();
+      PUSH(constant);
+      DISPATCH();
+    }
+    CASE(OP_DUP) {
+      PUSH(PEEK(0));
+      DISPATCH();
+    }
+    CASE(OP_NIL) {
+      PUSH(NIL_VAL);
+      DISPATCH();
+    }
+    CASE(OP_TRUE) {
+      PUSH(BOOL_VAL(true));
+      DISPATCH();
+    }
+    CASE(OP_FALSE) {
+      PUSH(BOOL_VAL(false));
+      DISPATCH();
+    }
+    CASE(OP_POP) {
+      stackTop--;
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL) {
+      uint8_t slot = READ_BYTE();
+      PUSH(frame->slots[slot]);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL) {
+      uint8_t slot = READ_BYTE();
+      frame->slots[slot] = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_GET_LOCAL) {
+      uint8_t first = READ_BYTE();
+      uint8_t second = READ_BYTE();
+      PUSH(frame->slots[first]);
+      PUSH(frame->slots[second]);
+      DISPATCH();
+    }
+    CASE(OP_INC_LOCAL) {
+      uint8_t slot = READ_BYTE();
+      Value constant = READ_CONSTANT();
+      Value local = frame->slots[slot];
+      if (ARE_INTS(local, constant)) {
+        frame->slots[slot] = intResult((int64_t)AS_INT(local) + AS_INT(constant));
+        DISPATCH();
       }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
+      if (!IS_NUMBER(local)) {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
+      frame->slots[slot] = NUMBER_VAL(AS_NUMBER(local) + AS_NUMBER(constant));
+      DISPATCH();
+    }
+    CASE(OP_GET_PROPERTY) {
+      if (!IS_INSTANCE(PEEK(0))) {
+        RUNTIME_ERROR("Only instances have properties.");
       }
-      case OP_GET_SUPER: {
-        ObjString* name = READ_STRING();
-        ObjClass* superclass = AS_CLASS(pop());
 
-        if (!bindMethod(superclass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
+      ObjInstance* instance = AS_INSTANCE(PEEK(0));
+      ObjString* name = READ_STRING();
+      InlineCache* cache = READ_CACHE();
+
+      Value value;
+      switch (lookupProperty(cache, instance, name, &value)) {
+        case PROPERTY_FIELD:
+          stackTop[-1] = value;  // Replaces the instance.
+          break;
+        case PROPERTY_METHOD: {
+          STORE_STACK();
+          ObjBoundMethod* bound = newBoundMethod(PEEK(0), AS_CLOSURE(value));
+          LOAD_STACK();
+          stackTop[-1] = OBJ_VAL(bound);  // Replaces the instance.
+          break;
         }
-        break;
+        case PROPERTY_UNDEFINED:
+          RUNTIME_ERROR("Undefined property '%s'.", name->chars);
       }
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
-      }
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        if (tableSet(&vm.globals, name, peek(0))) {
-          tableDelete(&vm.globals, name);
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      DISPATCH();
+    }
+    CASE(OP_SET_PROPERTY) {
+      if (!IS_INSTANCE(PEEK(1))) {
+        RUNTIME_ERROR("Only instances have fields.");
       }
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
-        break;
+
+      ObjInstance* instance = AS_INSTANCE(PEEK(1));
+      ObjString* name = READ_STRING();
+      STORE_STACK();
+      setProperty(READ_CACHE(), instance, name, PEEK(0));
+      LOAD_STACK();
+      Value value = POP();
+      stackTop[-1] = value;  // Replaces the instance.
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE) {
+      uint8_t slot = READ_BYTE();
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE) {
+      uint8_t slot = READ_BYTE();
+      *frame->closure->upvalues[slot]->location = PEEK(0);
+      WRITE_BARRIER(PEEK(0));
+      DISPATCH();
+    }
+    CASE(OP_GET_SUPER) {
+      ObjString* name = READ_STRING();
+      ObjClass* superclass = AS_CLASS(POP());
+
+      STORE_FRAME();
+      if (!bindMethod(superclass, name)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
-        break;
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      Value value = self->globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(self->globalNames.values[slot]));
       }
-      case OP_GREATER:
-        BINARY_OP(BOOL_VAL, >);
-        break;
-      case OP_LESS:
-        BINARY_OP(BOOL_VAL, <);
-        break;
-      case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
-        } else {
-          runtimeError("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      PUSH(value);
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(self->globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(self->globalNames.values[slot]));
       }
-      case OP_SUBTRACT:
-        BINARY_OP(NUMBER_VAL, -);
-        break;
-      case OP_MULTIPLY:
-        BINARY_OP(NUMBER_VAL, *);
-        break;
-      case OP_DIVIDE:
-        BINARY_OP(NUMBER_VAL, /);
-        break;
-      case OP_MODULO:
-        BINARY_INT_OP(%);
-        break;
-      case OP_NOT:
-        push(BOOL_VAL(isFalsey(pop())));
-        break;
-      case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OP_PRINT: {
-        printValue(pop());
-        printf("\n");
-        break;
+      self->globalValues.values[slot] = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_DEFINE_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      self->globalValues.values[slot] = PEEK(0);
+      stackTop--;
+      DISPATCH();
+    }
+    CASE(OP_LIST) {
+      STORE_STACK();
+      Value list = OBJ_VAL(newList());
+      LOAD_STACK();
+      PUSH(list);
+      DISPATCH();
+    }
+    CASE(OP_LIST_APPEND) {
+      ObjList* list = AS_LIST(PEEK(1));
+      STORE_STACK();
+      writeValueArray(&list->items, PEEK(0));
+      LOAD_STACK();
+      WRITE_BARRIER(PEEK(0));
+      stackTop--;
+      DISPATCH();
+    }
+    CASE(OP_INDEX_GET) {
+      ObjList* list;
+      int index;
+      STORE_FRAME();
+      if (!listIndex(PEEK(1), PEEK(0), &list, &index)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+      Value item = list->items.values[index];
+      stackTop -= 2;
+      PUSH(item);
+      DISPATCH();
+    }
+    CASE(OP_INDEX_SET) {
+      ObjList* list;
+      int index;
+      STORE_FRAME();
+      if (!listIndex(PEEK(2), PEEK(1), &list, &index)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += falsey(peek(0)) * offset;
-        break;
+      Value value = POP();
+      list->items.values[index] = value;
+      WRITE_BARRIER(value);
+      stackTop -= 2;
+      PUSH(value);
+      DISPATCH();
+    }
+    CASE(OP_EQUAL) {
+      STORE_STACK();
+      flattenOperand(0);
+      flattenOperand(1);
+      LOAD_STACK();
+      Value b = POP();
+      Value a = POP();
+      PUSH(BOOL_VAL(valuesEqual(a, b)));
+      DISPATCH();
+    }
+    CASE(OP_GREATER) {
+      INT_FAST_PATH(INT_GREATER);
+      BINARY_OP(BOOL_VAL, >);
+      DISPATCH();
+    }
+    CASE(OP_LESS) {
+      INT_FAST_PATH(INT_LESS);
+      BINARY_OP(BOOL_VAL, <);
+      DISPATCH();
+    }
+    CASE(OP_ADD) {
+      INT_FAST_PATH(INT_SUM);
+      if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        Value right = POP();
+        stackTop[-1] = NUMBER_VAL(NUMBER_OPERAND(PEEK(0)) + NUMBER_OPERAND(right));
+      } else if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1))) {
+        STORE_STACK();
+        concatenate();
+        LOAD_STACK();
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-      case OP_JUMP_IF_TRUE: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += truthy(peek(0)) * offset;
-        break;
+      DISPATCH();
+    }
+    CASE(OP_ADD_CONST) {
+      Value constant = READ_CONSTANT();
+      if (ARE_INTS(constant, PEEK(0))) {
+        stackTop[-1] = intResult((int64_t)AS_INT(PEEK(0)) + AS_INT(constant));
+      } else if (IS_NUMBER(constant) && IS_NUMBER(PEEK(0))) {
+        stackTop[-1] = NUMBER_VAL(AS_NUMBER(PEEK(0)) + AS_NUMBER(constant));
+      } else if (IS_STRING(constant) && IS_ANY_STRING(PEEK(0))) {
+        PUSH(constant);
+        STORE_STACK();
+        concatenate();
+        LOAD_STACK();
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT) {
+      INT_FAST_PATH(INT_DIFFERENCE);
+      BINARY_OP(NUMBER_VAL, -);
+      DISPATCH();
+    }
+    CASE(OP_MULTIPLY) {
+      INT_FAST_PATH(intProduct);
+      BINARY_OP(NUMBER_VAL, *);
+      DISPATCH();
+    }
+    CASE(OP_DIVIDE) {
+      BINARY_OP(NUMBER_VAL, /);
+      DISPATCH();
+    }
+    CASE(OP_MODULO) {
+      MODULO_OP();
+      DISPATCH();
+    }
+    CASE(OP_NOT) {
+      stackTop[-1] = BOOL_VAL(isFalsey(PEEK(0)));
+      DISPATCH();
+    }
+    CASE(OP_NEGATE) {
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      case OP_CALL: {
-        int argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+      stackTop[-1] = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+      DISPATCH();
+    }
+    CASE(OP_PRINT) {
+      STORE_STACK();
+      flattenOperand(0);
+      LOAD_STACK();
+      printValue(POP());
+      printf("\n");
+      DISPATCH();
+    }
+    CASE(OP_JUMP) {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE) {
+      uint16_t offset = READ_SHORT();
+      ip += falsey(PEEK(0)) * offset;
+      DISPATCH();
+    }
+    CASE(OP_LESS_JUMP_IF_FALSE) {
+      uint16_t offset = READ_SHORT();
+      bool less;
+      if (ARE_INTS(PEEK(0), PEEK(1))) {
+        int32_t b = AS_INT(POP());
+        less = AS_INT(PEEK(0)) < b;
+      } else {
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+          RUNTIME_ERROR("Operands must be numbers.");
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        double b = AS_NUMBER(POP());
+        less = AS_NUMBER(PEEK(0)) < b;
       }
-      case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
+      stackTop[-1] = BOOL_VAL(less);
+      ip += !less * offset;
+      DISPATCH();
+    }
+    CASE(OP_NOT_JUMP_IF_FALSE) {
+      uint16_t offset = READ_SHORT();
+      int jump = truthy(PEEK(0));
+      stackTop[-1] = BOOL_VAL(!jump);
+      ip += jump * offset;
+      DISPATCH();
+    }
+    CASE(OP_MOVE) {
+      uint8_t destination = READ_BYTE();
+      frame->slots[destination] = READ_LOCAL();
+      DISPATCH();
+    }
+    CASE(OP_LOAD_CONSTANT) {
+      uint8_t destination = READ_BYTE();
+      frame->slots[destination] = READ_CONSTANT();
+      DISPATCH();
+    }
+    CASE(OP_ADD_RR) {
+      REGISTER_OP(READ_LOCAL, INT_SUM, +, CONCATENATE_INTO_DESTINATION);
+      DISPATCH();
+    }
+    CASE(OP_ADD_RK) {
+      REGISTER_OP(READ_CONSTANT, INT_SUM, +, CONCATENATE_INTO_DESTINATION);
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT_RR) {
+      REGISTER_OP(READ_LOCAL, INT_DIFFERENCE, -, NUMBERS_ONLY);
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT_RK) {
+      REGISTER_OP(READ_CONSTANT, INT_DIFFERENCE, -, NUMBERS_ONLY);
+      DISPATCH();
+    }
+    CASE(OP_MULTIPLY_RR) {
+      REGISTER_OP(READ_LOCAL, intProduct, *, NUMBERS_ONLY);
+      DISPATCH();
+    }
+    CASE(OP_MULTIPLY_RK) {
+      REGISTER_OP(READ_CONSTANT, intProduct, *, NUMBERS_ONLY);
+      DISPATCH();
+    }
+    CASE(OP_DIVIDE_RR) {
+      REGISTER_OP(READ_LOCAL, INT_QUOTIENT, /, NUMBERS_ONLY);
+      DISPATCH();
+    }
+    CASE(OP_DIVIDE_RK) {
+      REGISTER_OP(READ_CONSTANT, INT_QUOTIENT, /, NUMBERS_ONLY);
+      DISPATCH();
+    }
+    // The compiler writes `a <= b` as `!(a > b)`, so that is what the inclusive forms test; the
+    // two only differ for NaN.
+    CASE(OP_LESS_RR_JUMP) {
+      REGISTER_BRANCH(READ_LOCAL, <, false);
+      DISPATCH();
+    }
+    CASE(OP_LESS_RK_JUMP) {
+      REGISTER_BRANCH(READ_CONSTANT, <, false);
+      DISPATCH();
+    }
+    CASE(OP_LESS_EQUAL_RR_JUMP) {
+      REGISTER_BRANCH(READ_LOCAL, >, true);
+      DISPATCH();
+    }
+    CASE(OP_LESS_EQUAL_RK_JUMP) {
+      REGISTER_BRANCH(READ_CONSTANT, >, true);
+      DISPATCH();
+    }
+    CASE(OP_GREATER_RR_JUMP) {
+      REGISTER_BRANCH(READ_LOCAL, >, false);
+      DISPATCH();
+    }
+    CASE(OP_GREATER_RK_JUMP) {
+      REGISTER_BRANCH(READ_CONSTANT, >, false);
+      DISPATCH();
+    }
+    CASE(OP_GREATER_EQUAL_RR_JUMP) {
+      REGISTER_BRANCH(READ_LOCAL, <, true);
+      DISPATCH();
+    }
+    CASE(OP_GREATER_EQUAL_RK_JUMP) {
+      REGISTER_BRANCH(READ_CONSTANT, <, true);
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_TRUE) {
+      uint16_t offset = READ_SHORT();
+      ip += truthy(PEEK(0)) * offset;
+      DISPATCH();
+    }
+    CASE(OP_LOOP) {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+#ifdef JIT
+      if (self->jit) {
+        ObjFunction* function = frame->closure->function;
+        jitCount(function);
+        if (function->jitCode != NULL) {
+          STORE_STACK();
+          ip = jitRun(function, ip, frame->slots);
+          LOAD_STACK();
         }
-        break;
       }
-      case OP_CLASS:
-        push(OBJ_VAL(newClass(READ_STRING())));
-        break;
-      case OP_METHOD:
-        defineMethod(READ_STRING());
-        break;
-      case OP_INHERIT: {
-        Value superclass = peek(1);
-        if (!IS_CLASS(superclass)) {
-          runtimeError("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-
-        ObjClass* subclass = AS_CLASS(peek(0));
-        tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-        pop();  // Subclass.
-        break;
+#endif
+      DISPATCH();
+    }
+    CASE(OP_CALL) {
+      int argCount = READ_BYTE();
+      STORE_FRAME();
+      if (!callValue(PEEK(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_INVOKE: {
-        ObjString* method = READ_STRING();
-        int argCount = READ_BYTE();
-        if (!invoke(method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+      LOAD_FRAME();
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_CLOSURE) {
+      ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+      STORE_STACK();
+      ObjClosure* closure = newClosure(function);
+      push(OBJ_VAL(closure));
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        if (isLocal) {
+          closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else {
+          closure->upvalues[i] = frame->closure->upvalues[index];
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        WRITE_BARRIER_OBJ(closure->upvalues[i]);
       }
-      case OP_SUPER_INVOKE: {
-        ObjString* method = READ_STRING();
-        int argCount = READ_BYTE();
-        ObjClass* superclass = AS_CLASS(pop());
-        if (!invokeFromClass(superclass, method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_CLASS) {
+      STORE_STACK();
+      Value klass = OBJ_VAL(newClass(READ_STRING()));
+      LOAD_STACK();
+      PUSH(klass);
+      DISPATCH();
+    }
+    CASE(OP_METHOD) {
+      STORE_STACK();
+      defineMethod(READ_STRING());
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_INHERIT) {
+      Value superclass = PEEK(1);
+      if (!IS_CLASS(superclass)) {
+        RUNTIME_ERROR("Superclass must be a class.");
       }
-      case OP_CLOSE_UPVALUE:
-        closeUpvalues(vm.stackTop - 1);
-        pop();
-        break;
-      case OP_RETURN: {
-        Value result = pop();
-        closeUpvalues(frame->slots);
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          pop();
-          return INTERPRET_OK;
-        }
 
-        vm.stackTop = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      ObjClass* subclass = AS_CLASS(PEEK(0));
+      STORE_STACK();
+      tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+      LOAD_STACK();
+      subclass->version++;
+      stackTop--;  // Subclass.
+      DISPATCH();
+    }
+    CASE(OP_INVOKE) {
+      ObjString* name = READ_STRING();
+      int argCount = READ_BYTE();
+      InlineCache* cache = READ_CACHE();
+
+      Value receiver = PEEK(argCount);
+      if (!IS_INSTANCE(receiver)) {
+        RUNTIME_ERROR("Only instances have methods.");
       }
+
+      Value value;
+      STORE_FRAME();
+      switch (lookupProperty(cache, AS_INSTANCE(receiver), name, &value)) {
+        case PROPERTY_FIELD:
+          self->stackTop[-argCount - 1] = value;
+          if (!callValue(value, argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          break;
+        case PROPERTY_METHOD:
+          if (!call(AS_CLOSURE(value), argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          break;
+        case PROPERTY_UNDEFINED:
+          RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+      }
+      LOAD_FRAME();
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_SUPER_INVOKE) {
+      ObjString* method = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjClass* superclass = AS_CLASS(POP());
+      STORE_FRAME();
+      if (!invokeFromClass(superclass, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_CLOSE_UPVALUE) {
+      closeUpvalues(stackTop - 1);
+      stackTop--;
+      DISPATCH();
+    }
+    CASE(OP_RETURN) {
+      Value result = POP();
+      if (frame->closure->function->capturesLocals) closeUpvalues(frame->slots);
+      self->frameCount--;
+      if (self->frameCount == 0) {
+        stackTop--;
+        STORE_STACK();
+        return INTERPRET_OK;
+      }
+
+      stackTop = frame->slots;
+      PUSH(result);
+      LOAD_FRAME();
+      DISPATCH();
     }
   }
 
+  return INTERPRET_RUNTIME_ERROR;  // Unreachable.
+
+#undef STORE_STACK
+#undef LOAD_STACK
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef READ_CONSTANT_LONG
 #undef READ_SHORT
-#undef BINARY_INT_OP
+#undef READ_CACHE
+#undef MODULO_OP
 #undef BINARY_OP
+#undef NUMBER_OPERAND
+#undef INT_FAST_PATH
+#undef INT_SUM
+#undef INT_DIFFERENCE
+#undef INT_LESS
+#undef INT_GREATER
+#undef INT_QUOTIENT
+#undef READ_LOCAL
+#undef REGISTER_OP
+#undef NUMBERS_ONLY
+#undef CONCATENATE_INTO_DESTINATION
+#undef REGISTER_BRANCH
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
 InterpretResult interpret(const char* source) {
   ObjFunction* function = compile(source);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+  return interpretFunction(function);
+}
+
+InterpretResult interpretFunction(ObjFunction* function) {
   push(OBJ_VAL(function));
   ObjClosure* closure = newClosure(function);
   pop();
   push(OBJ_VAL(closure));
   call(closure, 0);
 
-  return run();
+  InterpretResult result = run();
+  vm->currentOpcode = OPCODE_COUNT;
+  return result;
 }
\ No newline at end of file